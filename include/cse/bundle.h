@@ -2,12 +2,14 @@
 #define WAYKCSE_BUNDLE_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef enum
 {
 	WAYK_CSE_BUNDLE_OK,
 	WAYK_CSE_BUNDLE_MISSING_PACKAGE,
 	WAYK_CSE_BUNDLE_FS_ERROR,
+	WAYK_CSE_BUNDLE_INTEGRITY_ERROR,
 } WaykCseBundleStatus;
 
 typedef enum
@@ -20,9 +22,24 @@ typedef enum
 struct waykcse_bundle;
 typedef struct waykcse_bundle WaykCseBundle;
 
+typedef struct
+{
+	const char* fileName;
+	WaykCseBundleStatus status;
+} WaykCseBundleExtractItem;
+
 WaykCseBundle* WaykCseBundle_Open();
 void WaykCseBundle_Close(WaykCseBundle* ctx);
 
+// Caps working memory used to decode a bundle entry (in bytes, 0 - no limit).
+// Entries are streamed from the resource to the target file through fixed-size
+// buffers; with a limit set, extraction is never parallel
+void WaykCseBundle_SetMemoryLimit(WaykCseBundle* ctx, size_t memoryLimit);
+
+// False only if the bundle is known not to hold fileName; without an entry
+// index that is only found out by extracting it
+bool WaykCseBundle_HasEntry(WaykCseBundle* ctx, const char* fileName);
+
 WaykCseBundleStatus WaykCseBundle_ExtractWaykNowInstaller(
 	WaykCseBundle* ctx,
 	WaykBinariesBitness bitness,
@@ -37,6 +54,36 @@ WaykCseBundleStatus WaykCseBundle_ExtractOptionsJson(
 	WaykCseBundle* ctx,
 	const char* targetFolder);
 
+// Extracts all requested entries in a single pass over the bundle. Status of
+// each entry is reported in items[i].status; WAYK_CSE_BUNDLE_MISSING_PACKAGE
+// there is not an error for optional entries
+WaykCseBundleStatus WaykCseBundle_ExtractMany(
+	WaykCseBundle* ctx,
+	const char* targetFolder,
+	WaykCseBundleExtractItem* items,
+	int itemCount);
+
+// Same as WaykCseBundle_ExtractMany, but entries are decoded and written
+// concurrently by up to workerCount threads (0 - one per CPU). Returns when all
+// entries are extracted
+WaykCseBundleStatus WaykCseBundle_ExtractManyParallel(
+	WaykCseBundle* ctx,
+	const char* targetFolder,
+	WaykCseBundleExtractItem* items,
+	int itemCount,
+	int workerCount);
+
+// Decodes entry into a newly allocated buffer owned by the caller (release with
+// free). Buffer is always null-terminated, the terminator is not counted in size.
+// Entries only decodable to a file go through a uniquely named file in
+// tempFolder, removed before returning
+WaykCseBundleStatus WaykCseBundle_ExtractToBuffer(
+	WaykCseBundle* ctx,
+	const char* fileName,
+	const char* tempFolder,
+	char** pBuffer,
+	size_t* pSize);
+
 const char* GetBrandingFileName();
 const char* GetPowerShellInitScriptFileName();
 const char* GetJsonOptionsFileName();
@@ -0,0 +1,36 @@
+#ifndef WAYKCSE_BUNDLE_CHUNKS_H
+#define WAYKCSE_BUNDLE_CHUNKS_H
+
+#include <cse/bundle_codec.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Entries which share most of their data (installers for both architectures)
+// are split by the patcher into content-defined chunks; every unique chunk is
+// stored once in the chunk pool entry. Stream of a chunked entry is its recipe:
+// u32 chunk count, then u64 pool offset and u32 size of every chunk
+#define WAYK_CSE_BUNDLE_CHUNK_POOL_NAME "chunks.bin"
+
+// Checks that the recipe describes exactly entrySize bytes within the pool;
+// recipes are trusted by the functions below, so this is done on open
+bool WaykCseBundleChunks_Validate(
+	const uint8_t* recipe,
+	size_t recipeSize,
+	uint64_t entrySize,
+	uint64_t poolSize);
+
+// Pool is stored in the bundle, chunks are written straight from it
+bool WaykCseBundleChunks_AssembleFromMemory(
+	const uint8_t* recipe,
+	const uint8_t* pool,
+	WaykCseBundleOutput* output);
+
+// Pool is compressed and was decoded to poolPath first
+bool WaykCseBundleChunks_AssembleFromFile(
+	const uint8_t* recipe,
+	const char* poolPath,
+	WaykCseBundleOutput* output);
+
+#endif //WAYKCSE_BUNDLE_CHUNKS_H
@@ -0,0 +1,62 @@
+#ifndef WAYKCSE_BUNDLE_CODEC_H
+#define WAYKCSE_BUNDLE_CODEC_H
+
+#include <cse/bundle_index.h>
+#include <cse/sha256.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define WAYK_CSE_BUNDLE_CODEC_COUNT 3
+
+// Extracted entry file; written data is fed to hash (if not 0)
+struct waykcse_bundle_output;
+typedef struct waykcse_bundle_output WaykCseBundleOutput;
+
+// Creates the output file with size bytes allocated up front, so it is written
+// without growing and fragmenting; size 0 means the size is not known
+WaykCseBundleOutput* WaykCseBundleOutput_Open(const char* path, uint64_t size, CseSha256* hash);
+bool WaykCseBundleOutput_Write(WaykCseBundleOutput* ctx, const uint8_t* data, size_t size);
+// Writes at the given offset and does not feed the hash; may be called from
+// several threads at once for distinct ranges
+bool WaykCseBundleOutput_WriteAt(WaykCseBundleOutput* ctx, uint64_t offset, const uint8_t* data, size_t size);
+uint64_t WaykCseBundleOutput_GetWritten(WaykCseBundleOutput* ctx);
+// File is deleted unless keep is set; returns false if it can't be completed
+bool WaykCseBundleOutput_Close(WaykCseBundleOutput* ctx, bool keep);
+
+// Decoder instance holds codec state and must not be shared between threads;
+// every thread which extracts entries creates its own one
+typedef struct
+{
+	WaykCseBundleCodecId id;
+	const char* name;
+
+	// memoryLimit caps working memory of the decoder in bytes, 0 means no limit
+	void* (*NewDecoder)(size_t memoryLimit);
+	void (*FreeDecoder)(void* decoder);
+
+	// stream is the encoded entry data; entry is 0 when the bundle has no index
+	// and the entry is looked up by name. Decoded data is fed to hash (if not 0)
+	bool (*DecodeToFile)(
+		void* decoder,
+		const uint8_t* stream,
+		size_t streamSize,
+		const char* fileName,
+		const WaykCseBundleIndexEntry* entry,
+		const char* outputPath,
+		CseSha256* hash);
+
+	// Optional; buffer has room for entry->size bytes
+	bool (*DecodeToBuffer)(
+		void* decoder,
+		const uint8_t* stream,
+		size_t streamSize,
+		const WaykCseBundleIndexEntry* entry,
+		uint8_t* buffer);
+} WaykCseBundleCodec;
+
+// Returns 0 for unknown codec id
+const WaykCseBundleCodec* WaykCseBundleCodec_Get(uint16_t id);
+
+#endif //WAYKCSE_BUNDLE_CODEC_H
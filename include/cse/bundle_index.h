@@ -0,0 +1,50 @@
+#ifndef WAYKCSE_BUNDLE_INDEX_H
+#define WAYKCSE_BUNDLE_INDEX_H
+
+#include <cse/sha256.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum
+{
+	WAYK_CSE_BUNDLE_CODEC_7Z = 0,
+	WAYK_CSE_BUNDLE_CODEC_ZSTD = 1,
+	WAYK_CSE_BUNDLE_CODEC_ZSTD_BLOCKS = 2,  // independent zstd frames with a block table
+	WAYK_CSE_BUNDLE_CODEC_CHUNKED = 3,      // rebuilt from the shared chunk pool entry
+} WaykCseBundleCodecId;
+
+typedef struct
+{
+	char* name;
+	int archiveIndex;  // file index inside the 7z archive
+	int folderIndex;   // solid block which holds the entry data (-1 for empty files)
+	uint64_t size;
+	uint32_t crc;
+	bool hasCrc;
+	uint16_t codec;
+	bool isStored;        // entry data is stored in the payload without compression
+	uint64_t dataOffset;  // offset of entry stream from the bundle payload start
+	uint64_t packedSize;  // size of entry stream in the payload
+	uint8_t sha256[CSE_SHA256_DIGEST_SIZE];
+	bool hasSha256;
+} WaykCseBundleIndexEntry;
+
+struct waykcse_bundle_index;
+typedef struct waykcse_bundle_index WaykCseBundleIndex;
+
+// Builds entry index from the 7z archive headers. Returns 0 if the archive
+// headers can't be read directly (e.g. they are compressed). Stream of every
+// compressed entry is the whole archive
+WaykCseBundleIndex* WaykCseBundleIndex_Parse(const uint8_t* data, size_t size);
+// Builds entry index from the bundle table of contents; every entry is a
+// separate stream of the payload, payloadSize is used for bounds checks
+WaykCseBundleIndex* WaykCseBundleIndex_ParseToc(const uint8_t* toc, size_t tocSize, size_t payloadSize);
+void WaykCseBundleIndex_Free(WaykCseBundleIndex* ctx);
+
+int WaykCseBundleIndex_GetCount(WaykCseBundleIndex* ctx);
+const WaykCseBundleIndexEntry* WaykCseBundleIndex_GetEntry(WaykCseBundleIndex* ctx, int index);
+const WaykCseBundleIndexEntry* WaykCseBundleIndex_Find(WaykCseBundleIndex* ctx, const char* name);
+
+#endif //WAYKCSE_BUNDLE_INDEX_H
@@ -0,0 +1,29 @@
+#ifndef WAYKCSE_BUNDLE_MANIFEST_H
+#define WAYKCSE_BUNDLE_MANIFEST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Records which bundle entries were already extracted to a folder, so repeated
+// CSE runs can reuse them instead of decoding the bundle again
+struct waykcse_bundle_manifest;
+typedef struct waykcse_bundle_manifest WaykCseBundleManifest;
+
+// Loads manifest stored in the extraction folder; missing or corrupted
+// manifest results in an empty one
+WaykCseBundleManifest* WaykCseBundleManifest_Load(const char* folder);
+void WaykCseBundleManifest_Free(WaykCseBundleManifest* ctx);
+
+// Checks that the file was extracted from an entry with the same size and CRC
+// and that its size and write time haven't changed since then; contents are
+// not read, callers verify them before reusing the file
+bool WaykCseBundleManifest_IsUpToDate(
+	WaykCseBundleManifest* ctx,
+	const char* fileName,
+	uint64_t size,
+	uint32_t crc);
+bool WaykCseBundleManifest_Update(WaykCseBundleManifest* ctx, const char* fileName, uint32_t crc);
+void WaykCseBundleManifest_Remove(WaykCseBundleManifest* ctx, const char* fileName);
+bool WaykCseBundleManifest_Save(WaykCseBundleManifest* ctx);
+
+#endif //WAYKCSE_BUNDLE_MANIFEST_H
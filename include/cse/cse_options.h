@@ -2,6 +2,8 @@
 #define _WAYKCSE_CSE_OPTIONS_H_
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 typedef struct cse_options CseOptions;
 
@@ -31,6 +33,22 @@ bool CseOptions_WaykNowPsModuleImportRequired(CseOptions* ctx);
 // Enrollment
 const char* CseOptions_GetEnrollmentUrl(CseOptions* ctx);
 const char* CseOptions_GetEnrollmentToken(CseOptions* ctx);
+// Extraction; memory limit is in bytes, 0 if not set
+size_t CseOptions_GetExtractionMemoryLimit(CseOptions* ctx);
+// Download; connections is 0 if not set, segment size is in bytes, 0 if not set
+int CseOptions_GetDownloadConnections(CseOptions* ctx);
+size_t CseOptions_GetDownloadSegmentSize(CseOptions* ctx);
+// NULL if downloads are not cached
+const char* CseOptions_GetDownloadCacheDirectory(CseOptions* ctx);
+// Mirror base URLs in the configured order, count is 0 if there are none
+const char* const* CseOptions_GetDownloadMirrors(CseOptions* ctx, int* count);
+// Rate limit is in bytes per second and burst size in bytes, 0 if not set
+uint64_t CseOptions_GetDownloadMaxRate(CseOptions* ctx);
+size_t CseOptions_GetDownloadBurstSize(CseOptions* ctx);
+bool CseOptions_DownloadLowPriority(CseOptions* ctx);
+// Stall threshold is in milliseconds, 0 if not set
+uint32_t CseOptions_GetDownloadStallThreshold(CseOptions* ctx);
+const char* CseOptions_GetDownloadSummaryFile(CseOptions* ctx);
 
 WaykNowConfigOption* CseOptions_GetFirstMsiWaykNowConfigOption(CseOptions* ctx);
 
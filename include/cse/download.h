@@ -3,14 +3,115 @@
 
 #include <cse/bundle.h>
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 typedef enum
 {
 	CSE_DOWNLOAD_OK,
 	CSE_DOWNLOAD_FAILURE,
 	CSE_DOWNLOAD_PARAM,
 	CSE_DOWNLOAD_NOMEM,
+	CSE_DOWNLOAD_INTEGRITY,
+	CSE_DOWNLOAD_CANCELLED,
 } CseDownloadResult;
 
-CseDownloadResult CseDownload_DownloadMsi(WaykBinariesBitness bitness, const char* msiPath);
+typedef struct
+{
+	// Both count the compressed stream while it comes from a compressed
+	// mirror; the last report has the file size
+	uint64_t received;        // bytes of the file downloaded so far, resumed data included
+	uint64_t total;           // file size, CSE_DOWNLOAD_SIZE_UNKNOWN until the server has sent it
+	uint64_t bytesPerSecond;  // throughput over the last second
+} CseDownloadProgress;
+
+#define CSE_DOWNLOAD_SIZE_UNKNOWN UINT64_MAX
+
+// Called from the download threads, one call at a time, about twice a second
+// and once more when the download is complete
+typedef void (*CseDownloadProgressFn)(void* param, const CseDownloadProgress* progress);
+
+struct cse_download_session;
+typedef struct cse_download_session CseDownloadSession;
+
+// Time source of the rate limiter; tests replace it with a simulated clock
+typedef struct
+{
+	uint64_t (*Now)(void* param);  // milliseconds
+	void (*Sleep)(void* param, uint32_t milliseconds);
+	void* param;
+} CseDownloadClock;
+
+typedef struct
+{
+	int connections;     // parallel range requests, 1 or less downloads over a single connection
+	size_t segmentSize;  // bytes per range request when connections > 1, 0 selects the default
+	const char* cacheDirectory;  // keeps downloaded files between runs, NULL to disable
+	const char* const* mirrors;  // base URLs which serve the file under the same name
+	int mirrorCount;
+	uint64_t maxRate;    // bytes per second over all connections, 0 for no limit
+	size_t burstSize;    // bytes which may be received at once above maxRate, 0 for one second worth
+	bool lowPriority;    // lowers the rate while data keeps arriving later than it used to
+	CseDownloadProgressFn progress;  // can be NULL
+	void* progressParam;
+	const CseDownloadClock* clock;   // NULL for the system clock
+	CseDownloadSession* session;     // connections opened ahead of time, NULL to open them on demand
+	uint32_t stallThreshold;         // milliseconds without data logged as a stall, 0 selects the default
+	const char* summaryPath;         // receives the JSON summary of each download, NULL to only log it
+	const char* productInfoUrl;      // where the MSI URL is looked up, NULL for the published productinfo.htm
+	volatile long* cancel;           // download stops once it is set to non-zero, can be NULL
+} CseDownloadOptions;
+
+// Opens the HTTP session of a download and starts connecting to urls in the
+// background (NULL for the productinfo.htm and CDN hosts), so name
+// resolution and the TCP and TLS handshakes are done by the time the MSI
+// transfer starts. Returns NULL on failure, downloads then open their own
+// session
+CseDownloadSession* CseDownloadSession_New(const char* const* urls, int urlCount);
+// Starts connecting to more hosts in the background, such as mirrors only
+// known once the options are loaded
+void CseDownloadSession_Connect(CseDownloadSession* ctx, const char* const* urls, int urlCount);
+// Connection attempts still running finish in the background
+void CseDownloadSession_Free(CseDownloadSession* ctx);
+
+// Downloads url to path. The transfer is retried with range requests when the
+// connection drops; if it still fails, the partial file and a resume sidecar
+// are kept next to path and the next call for the same url continues them.
+// sha256 is the expected digest of the file, NULL to skip verification.
+// options can be NULL for a single connection download. With a cache
+// directory, a cached copy of url matching sha256 (or, without a digest,
+// confirmed by the server with a 304) is copied to path instead. Mirrors are
+// tried from the fastest to answer, url last; the download moves on to the
+// next one when a source fails
+CseDownloadResult CseDownload_File(
+	const char* url,
+	const char* path,
+	const uint8_t* sha256,
+	const CseDownloadOptions* options);
+
+// Looks up the MSI URL and digest in productinfo.htm, then downloads the MSI
+// to msiPath. The summary covers both, whatever the outcome
+CseDownloadResult CseDownload_DownloadMsi(
+	WaykBinariesBitness bitness,
+	const char* msiPath,
+	const CseDownloadOptions* options);
+
+struct cse_msi_download;
+typedef struct cse_msi_download CseMsiDownload;
+
+// Runs CseDownload_DownloadMsi on a background thread. options are copied,
+// the cache directory, mirror strings and session must stay valid until the
+// download is finished.
+// Returns NULL if the thread can't be started
+CseMsiDownload* CseDownload_StartMsi(
+	WaykBinariesBitness bitness,
+	const char* msiPath,
+	const CseDownloadOptions* options);
+// Makes the download stop at its next read; the partial file is kept to be
+// resumed. CseDownload_FinishMsi still has to be called
+void CseDownload_CancelMsi(CseMsiDownload* ctx);
+// Waits for the download started by CseDownload_StartMsi and frees ctx
+CseDownloadResult CseDownload_FinishMsi(CseMsiDownload* ctx);
 
 #endif //WAYKCSE_DOWNLOAD_H
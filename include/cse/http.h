@@ -0,0 +1,65 @@
+#ifndef WAYKCSE_HTTP_H
+#define WAYKCSE_HTTP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CSE_HTTP_ETAG_SIZE 128
+#define CSE_HTTP_DATE_SIZE 64
+#define CSE_HTTP_SIZE_UNKNOWN UINT64_MAX
+#define CSE_HTTP_TIME_NONE UINT32_MAX
+
+typedef struct
+{
+	uint32_t status;
+	uint64_t contentLength;  // CSE_HTTP_SIZE_UNKNOWN if the server didn't send it
+	uint64_t rangeStart;     // first byte of a partial (206) response body
+	uint64_t totalSize;      // whole resource size from Content-Range, CSE_HTTP_SIZE_UNKNOWN if not sent
+	char etag[CSE_HTTP_ETAG_SIZE];  // empty if the server didn't send it
+	char lastModified[CSE_HTTP_DATE_SIZE];  // Last-Modified value, empty if not sent
+} CseHttpResponse;
+
+// Milliseconds spent in each phase of a request, CSE_HTTP_TIME_NONE for the
+// phases which didn't happen (e.g. the connection was reused)
+typedef struct
+{
+	uint32_t resolve;
+	uint32_t connect;
+	uint32_t tls;        // from the connection to the request being sent
+	uint32_t firstByte;  // from the request being sent to the response headers
+} CseHttpTimings;
+
+struct cse_http;
+typedef struct cse_http CseHttp;
+
+struct cse_http_request;
+typedef struct cse_http_request CseHttpRequest;
+
+CseHttp* CseHttp_New(const char* userAgent);
+void CseHttp_Free(CseHttp* ctx);
+
+void CseHttp_SetRecvTimeout(CseHttp* ctx, int timeout);
+// Applies to name resolution too, which has no limit by default
+void CseHttp_SetConnectTimeout(CseHttp* ctx, int timeout);
+
+// Sends GET request and waits for the response headers. headers are extra
+// "Name: value\r\n" lines, can be NULL. Returns NULL on failure, error is
+// set to the WinHTTP error code then
+CseHttpRequest* CseHttp_Get(CseHttp* ctx, const char* url, const char* headers, uint32_t* error);
+// Same as CseHttp_Get with every timeout of this request, name resolution
+// included, set to timeout milliseconds instead of the session ones
+CseHttpRequest* CseHttp_GetWithTimeout(CseHttp* ctx, const char* url, const char* headers, int timeout, uint32_t* error);
+// Same as CseHttp_Get without the response body; the connection can be
+// reused by the next request of the session as soon as the request is freed
+CseHttpRequest* CseHttp_Head(CseHttp* ctx, const char* url, const char* headers, uint32_t* error);
+
+const CseHttpResponse* CseHttpRequest_GetResponse(CseHttpRequest* ctx);
+const CseHttpTimings* CseHttpRequest_GetTimings(CseHttpRequest* ctx);
+// Replaces the session receive timeout for the rest of the response body
+void CseHttpRequest_SetRecvTimeout(CseHttpRequest* ctx, int timeout);
+// Reads next part of the response body; read is set to 0 at the end of body
+bool CseHttpRequest_Read(CseHttpRequest* ctx, uint8_t* buffer, size_t size, size_t* read, uint32_t* error);
+void CseHttpRequest_Free(CseHttpRequest* ctx);
+
+#endif //WAYKCSE_HTTP_H
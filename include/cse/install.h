@@ -16,6 +16,9 @@ typedef enum
 
 typedef struct cse_install CseInstall;
 
+// Strings given to CseInstall are referenced, not copied: they have to stay
+// valid until CseInstall_Run. Setters fail with CSE_INSTALL_TOO_BIG_CLI when
+// the command line would exceed the CreateProcess limit
 CseInstall* CseInstall_WithLocalMsi(const char* msiPath);
 void CseInstall_Free(CseInstall* ctx);
 
@@ -0,0 +1,31 @@
+#ifndef WAYKCSE_SHA256_H
+#define WAYKCSE_SHA256_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+#define CSE_SHA256_DIGEST_SIZE 32
+#define CSE_SHA256_HEX_SIZE (CSE_SHA256_DIGEST_SIZE * 2 + 1)
+
+struct cse_sha256;
+typedef struct cse_sha256 CseSha256;
+
+CseSha256* CseSha256_New();
+void CseSha256_Free(CseSha256* ctx);
+
+bool CseSha256_Update(CseSha256* ctx, const uint8_t* data, size_t size);
+// Writes CSE_SHA256_DIGEST_SIZE bytes to digest; ctx can't be updated afterwards
+bool CseSha256_Finish(CseSha256* ctx, uint8_t* digest);
+
+bool CseSha256_Compute(const uint8_t* data, size_t size, uint8_t* digest);
+// Hashes the first size bytes of the file; fails if the file is shorter
+bool CseSha256_ComputeFile(const wchar_t* path, uint64_t size, uint8_t* digest);
+
+// hex is a null-terminated string of CSE_SHA256_HEX_SIZE - 1 characters, in
+// any case; returns false if it is not a valid digest
+bool CseSha256_FromHex(const char* hex, uint8_t* digest);
+void CseSha256_ToHex(const uint8_t* digest, char* hex);
+
+#endif //WAYKCSE_SHA256_H
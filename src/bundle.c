@@ -1,4 +1,8 @@
 #include <cse/bundle.h>
+#include <cse/bundle_chunks.h>
+#include <cse/bundle_codec.h>
+#include <cse/bundle_index.h>
+#include <cse/bundle_manifest.h>
 #include <cse/log.h>
 
 #include <lizard/lizard.h>
@@ -15,18 +19,187 @@
 
 #define JSON_OPTIONS_FILE_NAME "options.json"
 
+#define BUNDLE_MAX_EXTRACT_WORKERS 8
+
+// Bundle resource starts with a fixed header: magic, format version and
+// payload offset. Entries of the payload are described by the table of contents
+// resource. Resources without the magic are plain 7z archives
+#define BUNDLE_HEADER_MAGIC "WCSEBNDL"
+#define BUNDLE_HEADER_MAGIC_SIZE 8
+#define BUNDLE_HEADER_SIZE 16
+#define BUNDLE_FORMAT_VERSION 3
+
+// Decoders are created on first use, one per codec
+typedef struct
+{
+	void* decoders[WAYK_CSE_BUNDLE_CODEC_COUNT];
+	size_t memoryLimit;  // per decoder, 0 - no limit
+} WaykCseBundleDecoders;
+
 struct waykcse_bundle
 {
-	LzArchive* archiveHandle;
+	WaykCseBundleDecoders decoders;  // used by the thread which opened the bundle
+	WaykCseBundleIndex* index;
+	const uint8_t* data;  // payload
+	size_t dataSize;
+	bool isArchive;       // payload is a single 7z archive, bundles without header
 };
 
+static void* WaykCseBundleDecoders_Get(WaykCseBundleDecoders* ctx, const WaykCseBundleCodec* codec)
+{
+	if (!ctx->decoders[codec->id])
+		ctx->decoders[codec->id] = codec->NewDecoder(ctx->memoryLimit);
+
+	return ctx->decoders[codec->id];
+}
+
+static void WaykCseBundleDecoders_Free(WaykCseBundleDecoders* ctx)
+{
+	for (int i = 0; i < WAYK_CSE_BUNDLE_CODEC_COUNT; ++i)
+	{
+		if (ctx->decoders[i])
+			WaykCseBundleCodec_Get((uint16_t) i)->FreeDecoder(ctx->decoders[i]);
+		ctx->decoders[i] = 0;
+	}
+}
+
+// Installers are expected to be in their own solid blocks; otherwise extracting
+// the installer for one architecture decodes the other one as well
+static void WaykCseBundle_CheckInstallersLayout(WaykCseBundle* ctx)
+{
+	const WaykBinariesBitness bitnesses[] = { WAYK_BINARIES_BITNESS_X86, WAYK_BINARIES_BITNESS_X64 };
+
+	for (int i = 0; i < (int)(sizeof(bitnesses) / sizeof(bitnesses[0])); ++i)
+	{
+		const char* installerName = GetInstallerFileName(bitnesses[i]);
+		const WaykCseBundleIndexEntry* installer = WaykCseBundleIndex_Find(ctx->index, installerName);
+		if (!installer || (installer->folderIndex < 0))
+			continue;
+
+		for (int j = 0; j < WaykCseBundleIndex_GetCount(ctx->index); ++j)
+		{
+			const WaykCseBundleIndexEntry* entry = WaykCseBundleIndex_GetEntry(ctx->index, j);
+			if ((entry != installer) && (entry->folderIndex == installer->folderIndex))
+			{
+				CSE_LOG_WARN(
+					"%s shares a solid block with %s, both will be decoded on extraction",
+					installerName,
+					entry->name);
+			}
+		}
+	}
+}
+
+static uint32_t ReadUInt32(const uint8_t* data)
+{
+	return (uint32_t) data[0]
+		| ((uint32_t) data[1] << 8)
+		| ((uint32_t) data[2] << 16)
+		| ((uint32_t) data[3] << 24);
+}
+
+static const uint8_t* LoadRcData(int resourceId, DWORD* pSize)
+{
+	HRSRC resourceInfo = FindResourceW(NULL, MAKEINTRESOURCEW(resourceId), (LPCWSTR) RT_RCDATA);
+	if (!resourceInfo)
+		return 0;
+
+	HGLOBAL resource = LoadResource(0, resourceInfo);
+	if (!resource)
+		return 0;
+
+	// Actually on Windows version > XP LockResource just calculated and returns
+	// pointer; unlock and FreeResource is not required anymore on modern Windows
+	*pSize = SizeofResource(NULL, resourceInfo);
+	return (const uint8_t*) LockResource(resource);
+}
+
+static bool WaykCseBundle_ReadHeader(WaykCseBundle* ctx, const uint8_t* data, size_t size)
+{
+	const uint8_t* toc = 0;
+	DWORD tocSize = 0;
+
+	if ((size < BUNDLE_HEADER_MAGIC_SIZE) || (memcmp(data, BUNDLE_HEADER_MAGIC, BUNDLE_HEADER_MAGIC_SIZE) != 0))
+	{
+		CSE_LOG_DEBUG("Bundle has no header, reading it as 7z archive");
+		ctx->data = data;
+		ctx->dataSize = size;
+		ctx->isArchive = true;
+		ctx->index = WaykCseBundleIndex_Parse(ctx->data, ctx->dataSize);
+		return true;
+	}
+
+	if (size < BUNDLE_HEADER_SIZE)
+	{
+		CSE_LOG_ERROR("Bundle header is truncated");
+		return false;
+	}
+
+	uint16_t version = (uint16_t)(data[8] | (data[9] << 8));
+	uint32_t payloadOffset = ReadUInt32(data + 12);
+
+	if (version != BUNDLE_FORMAT_VERSION)
+	{
+		CSE_LOG_ERROR("Bundle format version %d is not supported", (int) version);
+		return false;
+	}
+
+	if ((payloadOffset < BUNDLE_HEADER_SIZE) || (payloadOffset > size))
+	{
+		CSE_LOG_ERROR("Bundle payload is out of bounds");
+		return false;
+	}
+
+	ctx->data = data + payloadOffset;
+	ctx->dataSize = size - payloadOffset;
+
+	toc = LoadRcData(IDR_WAYK_BUNDLE_TOC, &tocSize);
+	if (!toc)
+	{
+		CSE_LOG_ERROR("Can't load Wayk Now bundle table of contents");
+		return false;
+	}
+
+	ctx->index = WaykCseBundleIndex_ParseToc(toc, tocSize, ctx->dataSize);
+	if (!ctx->index)
+		return false;
+
+	const WaykCseBundleIndexEntry* pool = WaykCseBundleIndex_Find(ctx->index, WAYK_CSE_BUNDLE_CHUNK_POOL_NAME);
+
+	for (int i = 0; i < WaykCseBundleIndex_GetCount(ctx->index); ++i)
+	{
+		const WaykCseBundleIndexEntry* entry = WaykCseBundleIndex_GetEntry(ctx->index, i);
+
+		if (entry->isStored)
+			continue;
+
+		if (entry->codec == WAYK_CSE_BUNDLE_CODEC_CHUNKED)
+		{
+			if (!pool || !WaykCseBundleChunks_Validate(
+				ctx->data + entry->dataOffset,
+				(size_t) entry->packedSize,
+				entry->size,
+				pool->size))
+			{
+				CSE_LOG_ERROR("Bundle entry %s has invalid chunk recipe", entry->name);
+				return false;
+			}
+		}
+		else if (!WaykCseBundleCodec_Get(entry->codec))
+		{
+			CSE_LOG_ERROR("Bundle entry %s uses unsupported codec %d", entry->name, (int) entry->codec);
+			return false;
+		}
+	}
+
+	return true;
+}
+
 WaykCseBundle* WaykCseBundle_Open()
 {
 	WaykCseBundle* result = 0;
 	WaykCseBundle* bundle = 0;
-	HRSRC resourceInfo = 0;
-	HGLOBAL resource = 0;
-	BYTE* resourceData = 0;
+	const uint8_t* resourceData = 0;
 	DWORD resourceSize = 0;
 
 	bundle = calloc(1, sizeof(WaykCseBundle));
@@ -36,36 +209,26 @@ WaykCseBundle* WaykCseBundle_Open()
 		goto cleanup;
 	}
 
-	resourceInfo = FindResourceW(NULL, MAKEINTRESOURCEW(IDR_WAYK_BUNDLE), (LPCWSTR) RT_RCDATA);
-	if (!resourceInfo)
+	resourceData = LoadRcData(IDR_WAYK_BUNDLE, &resourceSize);
+	if (!resourceData)
 	{
-		CSE_LOG_ERROR("Can't find Wayk Now bundle resource");
+		CSE_LOG_ERROR("Can't load Wayk Now bundle resource");
 		goto cleanup;
 	}
 
-	resource = LoadResource(0, resourceInfo);
-	if (!resource)
+	if (!WaykCseBundle_ReadHeader(bundle, resourceData, resourceSize))
 	{
-		CSE_LOG_ERROR("Can't load Wayk Now bundle resource");
+		CSE_LOG_ERROR("Embedded bundle has invalid format");
 		goto cleanup;
 	}
 
-	// Actually on Windows version > XP LockResource just calculated and returns
-	// pointer; unlock and FreeResource is not required anymore on modern Windows
-	resourceData = (BYTE*) LockResource(resource);
-	resourceSize = SizeofResource(NULL, resourceInfo);
-
-	bundle->archiveHandle = LzArchive_New();
-	if (!bundle->archiveHandle)
+	if (!bundle->index)
 	{
-		CSE_LOG_ERROR("Can't create LzArchive");
-		goto cleanup;
+		CSE_LOG_WARN("Bundle entry index is not available, falling back to lookup by name");
 	}
-
-	if (LzArchive_OpenData(bundle->archiveHandle, resourceData, resourceSize) != LZ_OK)
+	else
 	{
-		CSE_LOG_ERROR("Embedded bundle has invalid format");
-		goto cleanup;
+		WaykCseBundle_CheckInstallersLayout(bundle);
 	}
 
 	result = bundle;
@@ -78,36 +241,607 @@ cleanup:
 	return result;
 }
 
+void WaykCseBundle_SetMemoryLimit(WaykCseBundle* ctx, size_t memoryLimit)
+{
+	// Decoders are sized when they are created
+	WaykCseBundleDecoders_Free(&ctx->decoders);
+	ctx->decoders.memoryLimit = memoryLimit;
+}
+
+bool WaykCseBundle_HasEntry(WaykCseBundle* ctx, const char* fileName)
+{
+	if (!ctx->index)
+		return true;
+
+	return WaykCseBundleIndex_Find(ctx->index, fileName) != 0;
+}
+
 void WaykCseBundle_Close(WaykCseBundle* ctx)
 {
-	if (ctx->archiveHandle)
+	WaykCseBundleDecoders_Free(&ctx->decoders);
+
+	if (ctx->index)
+		WaykCseBundleIndex_Free(ctx->index);
+
+	free(ctx);
+}
+
+static bool WaykCseBundle_CheckDigest(const WaykCseBundleIndexEntry* entry, const uint8_t* digest)
+{
+	char expected[CSE_SHA256_HEX_SIZE];
+	char actual[CSE_SHA256_HEX_SIZE];
+
+	if (memcmp(entry->sha256, digest, CSE_SHA256_DIGEST_SIZE) == 0)
+		return true;
+
+	CseSha256_ToHex(entry->sha256, expected);
+	CseSha256_ToHex(digest, actual);
+	CSE_LOG_ERROR("Bundle entry %s is corrupted: SHA-256 is %s, expected %s", entry->name, actual, expected);
+
+	return false;
+}
+
+// Files left by a previous run are in a user-writable folder and msiexec runs
+// them, so the manifest alone (size and time) doesn't prove they are intact
+static bool WaykCseBundle_IsExtractedFileIntact(
+	const char* targetFolder,
+	const char* fileName,
+	const WaykCseBundleIndexEntry* entry)
+{
+	char path[LZ_MAX_PATH];
+	uint8_t digest[CSE_SHA256_DIGEST_SIZE];
+	bool intact;
+
+	if (!entry->hasSha256)
+		return false;
+
+	path[0] = '\0';
+	LzPathCchAppend(path, sizeof(path), targetFolder);
+	LzPathCchAppend(path, sizeof(path), fileName);
+
+	WCHAR* pathW = LzUnicode_UTF8toUTF16_dup(path);
+	if (!pathW)
+		return false;
+
+	intact = CseSha256_ComputeFile(pathW, entry->size, digest)
+		&& (memcmp(digest, entry->sha256, CSE_SHA256_DIGEST_SIZE) == 0);
+	free(pathW);
+
+	if (!intact)
+		CSE_LOG_WARN("%s was modified since it was extracted, extracting it again", fileName);
+
+	return intact;
+}
+
+static void WaykCseBundle_DeleteFile(const char* path)
+{
+	WCHAR* pathW = LzUnicode_UTF8toUTF16_dup(path);
+	if (pathW)
 	{
-		LzArchive_Close(ctx->archiveHandle);
-		LzArchive_Free(ctx->archiveHandle);
+		DeleteFileW(pathW);
+		free(pathW);
 	}
+}
 
-	free(ctx);
+// Without index, the entry is looked up by name in the whole 7z archive
+static const WaykCseBundleCodec* WaykCseBundle_GetEntryStream(
+	WaykCseBundle* ctx,
+	const WaykCseBundleIndexEntry* entry,
+	const uint8_t** pStream,
+	size_t* pStreamSize)
+{
+	if (!entry)
+	{
+		*pStream = ctx->data;
+		*pStreamSize = ctx->dataSize;
+		return WaykCseBundleCodec_Get(WAYK_CSE_BUNDLE_CODEC_7Z);
+	}
+
+	*pStream = ctx->data + entry->dataOffset;
+	*pStreamSize = (size_t) entry->packedSize;
+	return WaykCseBundleCodec_Get(entry->codec);
 }
 
-static WaykCseBundleStatus WaykCseBundle_ExtractSingleFile(
+static bool WaykCseBundle_WriteStoredEntry(
+	WaykCseBundle* ctx,
+	const WaykCseBundleIndexEntry* entry,
+	const char* outputPath,
+	CseSha256* hash)
+{
+	WaykCseBundleOutput* output = WaykCseBundleOutput_Open(outputPath, entry->size, hash);
+	if (!output)
+		return false;
+
+	bool written = WaykCseBundleOutput_Write(output, ctx->data + entry->dataOffset, (size_t) entry->size);
+	return WaykCseBundleOutput_Close(output, written);
+}
+
+static bool WaykCseBundle_DecodeEntry(
+	WaykCseBundle* ctx,
+	WaykCseBundleDecoders* decoders,
+	const char* fileName,
+	const WaykCseBundleIndexEntry* entry,
+	const char* outputPath,
+	CseSha256* hash);
+
+static WaykCseBundleStatus WaykCseBundle_DecodeVerified(
+	WaykCseBundle* ctx,
+	WaykCseBundleDecoders* decoders,
+	const char* fileName,
+	const WaykCseBundleIndexEntry* entry,
+	const char* outputPath)
+{
+	WaykCseBundleStatus status = WAYK_CSE_BUNDLE_OK;
+	CseSha256* hash = 0;
+	uint8_t digest[CSE_SHA256_DIGEST_SIZE];
+
+	if (entry && entry->hasSha256)
+	{
+		hash = CseSha256_New();
+		if (!hash)
+			return WAYK_CSE_BUNDLE_FS_ERROR;
+	}
+
+	if (!WaykCseBundle_DecodeEntry(ctx, decoders, fileName, entry, outputPath, hash))
+	{
+		status = WAYK_CSE_BUNDLE_MISSING_PACKAGE;
+		goto cleanup;
+	}
+
+	if (hash && (!CseSha256_Finish(hash, digest) || !WaykCseBundle_CheckDigest(entry, digest)))
+	{
+		WaykCseBundle_DeleteFile(outputPath);
+		status = WAYK_CSE_BUNDLE_INTEGRITY_ERROR;
+		goto cleanup;
+	}
+
+cleanup:
+	if (hash)
+		CseSha256_Free(hash);
+
+	return status;
+}
+
+// Only chunks of the requested entry are read from the pool. Compressed pool is
+// decoded next to the output first and removed afterwards
+static bool WaykCseBundle_WriteChunkedEntry(
+	WaykCseBundle* ctx,
+	WaykCseBundleDecoders* decoders,
+	const WaykCseBundleIndexEntry* entry,
+	const char* outputPath,
+	CseSha256* hash)
+{
+	bool result = false;
+	const uint8_t* recipe = ctx->data + entry->dataOffset;
+	const WaykCseBundleIndexEntry* pool = WaykCseBundleIndex_Find(ctx->index, WAYK_CSE_BUNDLE_CHUNK_POOL_NAME);
+	WaykCseBundleOutput* output = 0;
+	char poolPath[LZ_MAX_PATH];
+
+	poolPath[0] = '\0';
+
+	if (!pool->isStored)
+	{
+		sprintf_s(poolPath, sizeof(poolPath), "%s.chunks", outputPath);
+
+		if (WaykCseBundle_DecodeVerified(ctx, decoders, pool->name, pool, poolPath) != WAYK_CSE_BUNDLE_OK)
+		{
+			CSE_LOG_ERROR("Failed to decode chunk pool for %s", entry->name);
+			poolPath[0] = '\0';
+			goto cleanup;
+		}
+	}
+
+	output = WaykCseBundleOutput_Open(outputPath, entry->size, hash);
+	if (!output)
+		goto cleanup;
+
+	if (pool->isStored)
+		result = WaykCseBundleChunks_AssembleFromMemory(recipe, ctx->data + pool->dataOffset, output);
+	else
+		result = WaykCseBundleChunks_AssembleFromFile(recipe, poolPath, output);
+
+cleanup:
+	if (output)
+		result = WaykCseBundleOutput_Close(output, result);
+	if (poolPath[0])
+		WaykCseBundle_DeleteFile(poolPath);
+
+	return result;
+}
+
+// Writes entry data to outputPath feeding it to hash (if not 0)
+static bool WaykCseBundle_DecodeEntry(
 	WaykCseBundle* ctx,
+	WaykCseBundleDecoders* decoders,
+	const char* fileName,
+	const WaykCseBundleIndexEntry* entry,
+	const char* outputPath,
+	CseSha256* hash)
+{
+	const uint8_t* stream = 0;
+	size_t streamSize = 0;
+
+	if (entry && entry->isStored)
+		return WaykCseBundle_WriteStoredEntry(ctx, entry, outputPath, hash);
+
+	if (entry && (entry->codec == WAYK_CSE_BUNDLE_CODEC_CHUNKED))
+		return WaykCseBundle_WriteChunkedEntry(ctx, decoders, entry, outputPath, hash);
+
+	const WaykCseBundleCodec* codec = WaykCseBundle_GetEntryStream(ctx, entry, &stream, &streamSize);
+	void* decoder = WaykCseBundleDecoders_Get(decoders, codec);
+
+	return decoder && codec->DecodeToFile(decoder, stream, streamSize, fileName, entry, outputPath, hash);
+}
+
+static WaykCseBundleStatus WaykCseBundle_ExtractEntryWith(
+	WaykCseBundle* ctx,
+	WaykCseBundleDecoders* decoders,
 	const char* targetFolder,
-	const char* fileName)
+	const char* fileName,
+	const WaykCseBundleIndexEntry* entry)
 {
 	char outputPath[LZ_MAX_PATH];
+
 	outputPath[0] = '\0';
 	LzPathCchAppend(outputPath, sizeof(outputPath), targetFolder);
 	LzPathCchAppend(outputPath, sizeof(outputPath), fileName);
 
-	int rv = LzArchive_ExtractFile(ctx->archiveHandle, -1, fileName, outputPath);
-	
-	if (rv != LZ_OK)
+	return WaykCseBundle_DecodeVerified(ctx, decoders, fileName, entry, outputPath);
+}
+
+static WaykCseBundleStatus WaykCseBundle_ExtractEntry(
+	WaykCseBundle* ctx,
+	const char* targetFolder,
+	const char* fileName,
+	const WaykCseBundleIndexEntry* entry)
+{
+	return WaykCseBundle_ExtractEntryWith(ctx, &ctx->decoders, targetFolder, fileName, entry);
+}
+
+static WaykCseBundleStatus WaykCseBundle_ExtractSingleFile(
+	WaykCseBundle* ctx,
+	const char* targetFolder,
+	const char* fileName)
+{
+	if (!ctx->index)
+		return WaykCseBundle_ExtractEntry(ctx, targetFolder, fileName, 0);
+
+	const WaykCseBundleIndexEntry* entry = WaykCseBundleIndex_Find(ctx->index, fileName);
+	if (!entry)
 	{
-		CSE_LOG_ERROR("Failed to extract %s from the bundle: %d %s\n", fileName, rv, outputPath);
+		CSE_LOG_DEBUG("%s is not present in the bundle", fileName);
 		return WAYK_CSE_BUNDLE_MISSING_PACKAGE;
 	}
 
-	return WAYK_CSE_BUNDLE_OK;
+	return WaykCseBundle_ExtractEntry(ctx, targetFolder, fileName, entry);
+}
+
+typedef struct
+{
+	WaykCseBundle* bundle;
+	const char* targetFolder;
+	WaykCseBundleExtractItem* items;
+	const WaykCseBundleIndexEntry** entries;
+	int* pending;        // indices of items which have to be decoded, in extraction order
+	int pendingCount;
+	volatile LONG next;  // next pending item to be taken by a worker
+} WaykCseBundleExtractJob;
+
+static int WaykCseBundle_GetEntryArchiveIndex(const WaykCseBundleIndexEntry* entry)
+{
+	return entry ? entry->archiveIndex : -1;
+}
+
+static uint64_t WaykCseBundle_GetEntrySize(const WaykCseBundleIndexEntry* entry)
+{
+	return entry ? entry->size : 0;
+}
+
+static void WaykCseBundleExtractJob_Run(WaykCseBundleExtractJob* job, WaykCseBundleDecoders* decoders)
+{
+	while (true)
+	{
+		LONG next = InterlockedIncrement(&job->next) - 1;
+		if (next >= job->pendingCount)
+			break;
+
+		int item = job->pending[next];
+		job->items[item].status = WaykCseBundle_ExtractEntryWith(
+			job->bundle,
+			decoders,
+			job->targetFolder,
+			job->items[item].fileName,
+			job->entries[item]);
+	}
+}
+
+// Worker decodes with its own decoder instances over the shared resource data,
+// so the decoder state is never shared between threads
+static DWORD WINAPI WaykCseBundle_ExtractWorker(LPVOID param)
+{
+	WaykCseBundleExtractJob* job = (WaykCseBundleExtractJob*) param;
+	WaykCseBundleDecoders decoders;
+
+	ZeroMemory(&decoders, sizeof(WaykCseBundleDecoders));
+	decoders.memoryLimit = job->bundle->decoders.memoryLimit;
+
+	WaykCseBundleExtractJob_Run(job, &decoders);
+
+	WaykCseBundleDecoders_Free(&decoders);
+	return 0;
+}
+
+static int WaykCseBundle_GetWorkerCount(int requestedWorkers, int pendingCount)
+{
+	int workers = requestedWorkers;
+
+	if (workers <= 0)
+	{
+		SYSTEM_INFO systemInfo;
+		GetSystemInfo(&systemInfo);
+		workers = (int) systemInfo.dwNumberOfProcessors;
+	}
+
+	if (workers > BUNDLE_MAX_EXTRACT_WORKERS)
+		workers = BUNDLE_MAX_EXTRACT_WORKERS;
+	if (workers > pendingCount)
+		workers = pendingCount;
+
+	return (workers > 0) ? workers : 1;
+}
+
+static void WaykCseBundleExtractJob_RunParallel(WaykCseBundleExtractJob* job, int workers)
+{
+	HANDLE threads[BUNDLE_MAX_EXTRACT_WORKERS];
+	int threadCount = 0;
+
+	// Calling thread is a worker as well, using the bundle's own decoder
+	for (int i = 1; i < workers; ++i)
+	{
+		threads[threadCount] = CreateThread(NULL, 0, WaykCseBundle_ExtractWorker, job, 0, NULL);
+		if (!threads[threadCount])
+		{
+			CSE_LOG_WARN("Failed to start extraction worker (%d)", (int) GetLastError());
+			break;
+		}
+		threadCount++;
+	}
+
+	CSE_LOG_DEBUG("Extracting %d bundle entries with %d workers", job->pendingCount, threadCount + 1);
+
+	WaykCseBundleExtractJob_Run(job, &job->bundle->decoders);
+
+	if (threadCount > 0)
+		WaitForMultipleObjects((DWORD) threadCount, threads, TRUE, INFINITE);
+
+	for (int i = 0; i < threadCount; ++i)
+		CloseHandle(threads[i]);
+}
+
+static bool WaykCseBundle_CheckFreeSpace(const char* targetFolder, uint64_t requiredSize)
+{
+	ULARGE_INTEGER freeBytes;
+	BOOL queried;
+
+	WCHAR* targetFolderW = LzUnicode_UTF8toUTF16_dup(targetFolder);
+	if (!targetFolderW)
+		return true;
+
+	queried = GetDiskFreeSpaceExW(targetFolderW, &freeBytes, NULL, NULL);
+	free(targetFolderW);
+
+	if (!queried)
+	{
+		CSE_LOG_WARN("Failed to query free disk space (%d)", (int) GetLastError());
+		return true;
+	}
+
+	if (freeBytes.QuadPart < requiredSize)
+	{
+		CSE_LOG_ERROR(
+			"Not enough disk space in %s: %llu bytes required, %llu available",
+			targetFolder,
+			(unsigned long long) requiredSize,
+			(unsigned long long) freeBytes.QuadPart);
+		return false;
+	}
+
+	return true;
+}
+
+static WaykCseBundleStatus WaykCseBundle_ExtractItems(
+	WaykCseBundle* ctx,
+	const char* targetFolder,
+	WaykCseBundleExtractItem* items,
+	int itemCount,
+	int workers)
+{
+	WaykCseBundleStatus result = WAYK_CSE_BUNDLE_OK;
+	WaykCseBundleExtractJob job;
+	const WaykCseBundleIndexEntry** entries = 0;
+	WaykCseBundleManifest* manifest = 0;
+	int* pending = 0;
+	int pendingCount = 0;
+
+	if (!ctx || !items || (itemCount <= 0))
+		return WAYK_CSE_BUNDLE_MISSING_PACKAGE;
+
+	// Every worker has its own decoders, so the limit would be exceeded
+	if (ctx->decoders.memoryLimit && (workers != 1))
+	{
+		CSE_LOG_DEBUG("Memory limit is set, extracting bundle entries sequentially");
+		workers = 1;
+	}
+
+	// Workers would each decode the solid blocks of the whole archive; a
+	// single decoder keeps it open and goes through it once, in archive order
+	if (ctx->isArchive && (workers != 1))
+	{
+		CSE_LOG_DEBUG("Bundle is a single 7z archive, extracting bundle entries sequentially");
+		workers = 1;
+	}
+
+	// Files left by a previous run are only reusable when their CRC and
+	// SHA-256 are known
+	if (ctx->index)
+		manifest = WaykCseBundleManifest_Load(targetFolder);
+
+	entries = calloc(itemCount, sizeof(WaykCseBundleIndexEntry*));
+	pending = calloc(itemCount, sizeof(int));
+	if (!entries || !pending)
+	{
+		CSE_LOG_ERROR("Allocation failed");
+		result = WAYK_CSE_BUNDLE_FS_ERROR;
+		goto cleanup;
+	}
+
+	for (int i = 0; i < itemCount; ++i)
+	{
+		WaykCseBundleExtractItem* item = &items[i];
+		const WaykCseBundleIndexEntry* entry = ctx->index
+			? WaykCseBundleIndex_Find(ctx->index, item->fileName)
+			: 0;
+
+		entries[i] = entry;
+
+		if (ctx->index && !entry)
+		{
+			CSE_LOG_DEBUG("%s is not present in the bundle", item->fileName);
+			item->status = WAYK_CSE_BUNDLE_MISSING_PACKAGE;
+			continue;
+		}
+
+		if (manifest && entry->hasCrc && entry->hasSha256
+			&& WaykCseBundleManifest_IsUpToDate(manifest, item->fileName, entry->size, entry->crc)
+			&& WaykCseBundle_IsExtractedFileIntact(targetFolder, item->fileName, entry))
+		{
+			CSE_LOG_INFO("%s is already extracted, skipping it", item->fileName);
+			item->status = WAYK_CSE_BUNDLE_OK;
+			continue;
+		}
+
+		pending[pendingCount++] = i;
+	}
+
+	// Sequential extraction goes in archive order, which is the order the
+	// entries are laid out in solid blocks; each block is then decoded front to
+	// back a single time. Parallel extraction starts with the largest entries
+	// so that small ones are decoded while the installer is still in progress
+	for (int i = 1; i < pendingCount; ++i)
+	{
+		int current = pending[i];
+		int j = i - 1;
+
+		while (j >= 0)
+		{
+			bool after = (workers == 1)
+				? (WaykCseBundle_GetEntryArchiveIndex(entries[pending[j]])
+					> WaykCseBundle_GetEntryArchiveIndex(entries[current]))
+				: (WaykCseBundle_GetEntrySize(entries[pending[j]])
+					< WaykCseBundle_GetEntrySize(entries[current]));
+
+			if (!after)
+				break;
+
+			pending[j + 1] = pending[j];
+			--j;
+		}
+
+		pending[j + 1] = current;
+	}
+
+	uint64_t requiredSize = 0;
+	for (int i = 0; i < pendingCount; ++i)
+	{
+		const WaykCseBundleIndexEntry* entry = entries[pending[i]];
+		requiredSize += WaykCseBundle_GetEntrySize(entry);
+
+		// Compressed chunk pool is decoded next to the entry for a while
+		if (entry && (entry->codec == WAYK_CSE_BUNDLE_CODEC_CHUNKED))
+		{
+			const WaykCseBundleIndexEntry* pool = WaykCseBundleIndex_Find(ctx->index, WAYK_CSE_BUNDLE_CHUNK_POOL_NAME);
+			if (!pool->isStored)
+				requiredSize += pool->size;
+		}
+	}
+
+	// Fail before writing anything rather than leave half-extracted files
+	if (!WaykCseBundle_CheckFreeSpace(targetFolder, requiredSize))
+	{
+		for (int i = 0; i < pendingCount; ++i)
+			items[pending[i]].status = WAYK_CSE_BUNDLE_FS_ERROR;
+
+		result = WAYK_CSE_BUNDLE_FS_ERROR;
+		goto cleanup;
+	}
+
+	ZeroMemory(&job, sizeof(WaykCseBundleExtractJob));
+	job.bundle = ctx;
+	job.targetFolder = targetFolder;
+	job.items = items;
+	job.entries = entries;
+	job.pending = pending;
+	job.pendingCount = pendingCount;
+
+	workers = WaykCseBundle_GetWorkerCount(workers, pendingCount);
+	if (workers > 1)
+		WaykCseBundleExtractJob_RunParallel(&job, workers);
+	else
+		WaykCseBundleExtractJob_Run(&job, &ctx->decoders);
+
+	for (int i = 0; i < pendingCount; ++i)
+	{
+		WaykCseBundleExtractItem* item = &items[pending[i]];
+		const WaykCseBundleIndexEntry* entry = entries[pending[i]];
+
+		// Entry is listed in the index, so failing to write it is an actual error
+		if (entry && (item->status != WAYK_CSE_BUNDLE_OK))
+		{
+			if (item->status != WAYK_CSE_BUNDLE_INTEGRITY_ERROR)
+				item->status = WAYK_CSE_BUNDLE_FS_ERROR;
+			result = item->status;
+		}
+
+		if (manifest)
+		{
+			if ((item->status == WAYK_CSE_BUNDLE_OK) && entry->hasCrc)
+				WaykCseBundleManifest_Update(manifest, item->fileName, entry->crc);
+			else
+				WaykCseBundleManifest_Remove(manifest, item->fileName);
+		}
+	}
+
+	if (manifest)
+		WaykCseBundleManifest_Save(manifest);
+
+cleanup:
+	if (manifest)
+		WaykCseBundleManifest_Free(manifest);
+	if (entries)
+		free(entries);
+	if (pending)
+		free(pending);
+
+	return result;
+}
+
+WaykCseBundleStatus WaykCseBundle_ExtractMany(
+	WaykCseBundle* ctx,
+	const char* targetFolder,
+	WaykCseBundleExtractItem* items,
+	int itemCount)
+{
+	return WaykCseBundle_ExtractItems(ctx, targetFolder, items, itemCount, 1);
+}
+
+WaykCseBundleStatus WaykCseBundle_ExtractManyParallel(
+	WaykCseBundle* ctx,
+	const char* targetFolder,
+	WaykCseBundleExtractItem* items,
+	int itemCount,
+	int workerCount)
+{
+	return WaykCseBundle_ExtractItems(ctx, targetFolder, items, itemCount, (workerCount > 0) ? workerCount : 0);
 }
 
 WaykCseBundleStatus WaykCseBundle_ExtractBrandingZip(
@@ -139,6 +873,195 @@ WaykCseBundleStatus WaykCseBundle_ExtractOptionsJson(
 	return WaykCseBundle_ExtractSingleFile(ctx, targetFolder, GetJsonOptionsFileName());
 }
 
+static char* ReadFileToBuffer(const char* path, size_t* pSize)
+{
+	char* result = 0;
+	char* buffer = 0;
+	WCHAR* pathW = 0;
+	FILE* fp = 0;
+	long size = 0;
+
+	pathW = LzUnicode_UTF8toUTF16_dup(path);
+	if (!pathW)
+		goto cleanup;
+
+	fp = _wfopen(pathW, L"rb");
+	if (!fp)
+		goto cleanup;
+
+	if ((fseek(fp, 0, SEEK_END) != 0) || ((size = ftell(fp)) < 0) || (fseek(fp, 0, SEEK_SET) != 0))
+		goto cleanup;
+
+	buffer = malloc((size_t) size + 1);
+	if (!buffer)
+	{
+		CSE_LOG_ERROR("Allocation failed");
+		goto cleanup;
+	}
+
+	if (fread(buffer, 1, (size_t) size, fp) != (size_t) size)
+		goto cleanup;
+
+	buffer[size] = '\0';
+	*pSize = (size_t) size;
+	result = buffer;
+	buffer = 0;
+
+cleanup:
+	if (fp)
+		fclose(fp);
+	if (pathW)
+		free(pathW);
+	if (buffer)
+		free(buffer);
+
+	return result;
+}
+
+// Creates an empty file with a unique name in folder, so decoding into it
+// never overwrites another file
+static bool WaykCseBundle_CreateTempFile(const char* folder, char* path, size_t pathSize)
+{
+	bool result = false;
+	WCHAR pathW[MAX_PATH];
+	WCHAR* folderW = LzUnicode_UTF8toUTF16_dup(folder);
+
+	if (!folderW)
+		return false;
+
+	if (GetTempFileNameW(folderW, L"cse", 0, pathW) != 0)
+	{
+		result = LzUnicode_UTF16toUTF8(pathW, -1, (uint8_t*) path, (int) pathSize) >= 0;
+		if (!result)
+			DeleteFileW(pathW);
+	}
+
+	free(folderW);
+
+	return result;
+}
+
+// Fallback for compressed entries: lizard only decodes 7z entries to a file,
+// which is created in tempFolder under a name of its own
+static WaykCseBundleStatus WaykCseBundle_ExtractToBufferViaTempFile(
+	WaykCseBundle* ctx,
+	const char* fileName,
+	const WaykCseBundleIndexEntry* entry,
+	const char* tempFolder,
+	char** pBuffer,
+	size_t* pSize)
+{
+	WaykCseBundleStatus status;
+	char tempPath[LZ_MAX_PATH];
+
+	if (!WaykCseBundle_CreateTempFile(tempFolder, tempPath, sizeof(tempPath)))
+	{
+		CSE_LOG_ERROR("Failed to create temporary file in %s", tempFolder);
+		return WAYK_CSE_BUNDLE_FS_ERROR;
+	}
+
+	status = WaykCseBundle_DecodeVerified(ctx, &ctx->decoders, fileName, entry, tempPath);
+	if (status == WAYK_CSE_BUNDLE_OK)
+	{
+		*pBuffer = ReadFileToBuffer(tempPath, pSize);
+		if (!*pBuffer)
+		{
+			CSE_LOG_ERROR("Failed to read extracted %s", fileName);
+			status = WAYK_CSE_BUNDLE_FS_ERROR;
+		}
+	}
+
+	WaykCseBundle_DeleteFile(tempPath);
+
+	return status;
+}
+
+WaykCseBundleStatus WaykCseBundle_ExtractToBuffer(
+	WaykCseBundle* ctx,
+	const char* fileName,
+	const char* tempFolder,
+	char** pBuffer,
+	size_t* pSize)
+{
+	const WaykCseBundleIndexEntry* entry = 0;
+	size_t size = 0;
+
+	if (!ctx || !fileName || !tempFolder || !pBuffer)
+		return WAYK_CSE_BUNDLE_MISSING_PACKAGE;
+
+	*pBuffer = 0;
+	if (!pSize)
+		pSize = &size;
+	*pSize = 0;
+
+	if (!ctx->index)
+		return WaykCseBundle_ExtractToBufferViaTempFile(ctx, fileName, 0, tempFolder, pBuffer, pSize);
+
+	entry = WaykCseBundleIndex_Find(ctx->index, fileName);
+	if (!entry)
+	{
+		CSE_LOG_DEBUG("%s is not present in the bundle", fileName);
+		return WAYK_CSE_BUNDLE_MISSING_PACKAGE;
+	}
+
+	const uint8_t* stream = 0;
+	size_t streamSize = 0;
+	const WaykCseBundleCodec* codec = WaykCseBundle_GetEntryStream(ctx, entry, &stream, &streamSize);
+
+	if (!entry->isStored && (!codec || !codec->DecodeToBuffer))
+	{
+		CSE_LOG_DEBUG("%s is compressed, extracting through a temporary file", fileName);
+		return WaykCseBundle_ExtractToBufferViaTempFile(
+			ctx,
+			fileName,
+			entry,
+			tempFolder,
+			pBuffer,
+			pSize);
+	}
+
+	char* buffer = malloc((size_t) entry->size + 1);
+	if (!buffer)
+	{
+		CSE_LOG_ERROR("Allocation failed");
+		return WAYK_CSE_BUNDLE_FS_ERROR;
+	}
+
+	if (entry->isStored)
+	{
+		memcpy(buffer, stream, (size_t) entry->size);
+	}
+	else
+	{
+		void* decoder = WaykCseBundleDecoders_Get(&ctx->decoders, codec);
+
+		if (!decoder || !codec->DecodeToBuffer(decoder, stream, streamSize, entry, (uint8_t*) buffer))
+		{
+			free(buffer);
+			return WAYK_CSE_BUNDLE_FS_ERROR;
+		}
+	}
+
+	if (entry->hasSha256)
+	{
+		uint8_t digest[CSE_SHA256_DIGEST_SIZE];
+
+		if (!CseSha256_Compute((uint8_t*) buffer, (size_t) entry->size, digest)
+			|| !WaykCseBundle_CheckDigest(entry, digest))
+		{
+			free(buffer);
+			return WAYK_CSE_BUNDLE_INTEGRITY_ERROR;
+		}
+	}
+
+	buffer[entry->size] = '\0';
+
+	*pBuffer = buffer;
+	*pSize = (size_t) entry->size;
+
+	return WAYK_CSE_BUNDLE_OK;
+}
+
 const char* GetBrandingFileName()
 {
 	return BRANDING_FILE_NAME;
@@ -0,0 +1,176 @@
+#include <cse/bundle_chunks.h>
+#include <cse/log.h>
+
+#include <lizard/lizard.h>
+
+#define CSE_LOG_TAG "WaykCseBundleChunks"
+
+#define CHUNK_RECIPE_HEADER_SIZE 4
+#define CHUNK_RECIPE_RECORD_SIZE 12
+
+// Patcher chunks are at most 256 KB; anything bigger is a corrupted recipe
+#define CHUNK_MAX_SIZE (4 * 1024 * 1024)
+
+typedef struct
+{
+	uint64_t offset;
+	uint32_t size;
+} ChunkRecord;
+
+static uint32_t ReadUInt32(const uint8_t* data)
+{
+	return (uint32_t) data[0]
+		| ((uint32_t) data[1] << 8)
+		| ((uint32_t) data[2] << 16)
+		| ((uint32_t) data[3] << 24);
+}
+
+static uint64_t ReadUInt64(const uint8_t* data)
+{
+	return (uint64_t) ReadUInt32(data) | ((uint64_t) ReadUInt32(data + 4) << 32);
+}
+
+static uint32_t GetChunkCount(const uint8_t* recipe)
+{
+	return ReadUInt32(recipe);
+}
+
+static ChunkRecord GetChunk(const uint8_t* recipe, uint32_t index)
+{
+	const uint8_t* record = recipe + CHUNK_RECIPE_HEADER_SIZE + (size_t) index * CHUNK_RECIPE_RECORD_SIZE;
+	ChunkRecord chunk;
+
+	chunk.offset = ReadUInt64(record);
+	chunk.size = ReadUInt32(record + 8);
+
+	return chunk;
+}
+
+bool WaykCseBundleChunks_Validate(
+	const uint8_t* recipe,
+	size_t recipeSize,
+	uint64_t entrySize,
+	uint64_t poolSize)
+{
+	uint64_t totalSize = 0;
+
+	if (recipeSize < CHUNK_RECIPE_HEADER_SIZE)
+		return false;
+
+	// Records fill the rest of the recipe exactly, trailing bytes are corruption
+	uint32_t chunkCount = GetChunkCount(recipe);
+	if ((uint64_t) (recipeSize - CHUNK_RECIPE_HEADER_SIZE) != (uint64_t) chunkCount * CHUNK_RECIPE_RECORD_SIZE)
+		return false;
+
+	for (uint32_t i = 0; i < chunkCount; ++i)
+	{
+		ChunkRecord chunk = GetChunk(recipe, i);
+
+		if ((chunk.size == 0) || (chunk.size > CHUNK_MAX_SIZE)
+			|| (chunk.offset > poolSize) || (chunk.size > poolSize - chunk.offset))
+		{
+			return false;
+		}
+
+		totalSize += chunk.size;
+	}
+
+	return totalSize == entrySize;
+}
+
+bool WaykCseBundleChunks_AssembleFromMemory(
+	const uint8_t* recipe,
+	const uint8_t* pool,
+	WaykCseBundleOutput* output)
+{
+	uint32_t chunkCount = GetChunkCount(recipe);
+
+	for (uint32_t i = 0; i < chunkCount; ++i)
+	{
+		ChunkRecord chunk = GetChunk(recipe, i);
+
+		if (!WaykCseBundleOutput_Write(output, pool + chunk.offset, chunk.size))
+			return false;
+	}
+
+	return true;
+}
+
+bool WaykCseBundleChunks_AssembleFromFile(
+	const uint8_t* recipe,
+	const char* poolPath,
+	WaykCseBundleOutput* output)
+{
+	bool result = false;
+	WCHAR* poolPathW = 0;
+	HANDLE pool = INVALID_HANDLE_VALUE;
+	uint8_t* buffer = 0;
+	uint32_t chunkCount = GetChunkCount(recipe);
+	uint32_t maxChunkSize = 0;
+
+	poolPathW = LzUnicode_UTF8toUTF16_dup(poolPath);
+	if (!poolPathW)
+		goto cleanup;
+
+	// Recipe of a single installer touches most of the pool, mostly in order
+	pool = CreateFileW(
+		poolPathW,
+		GENERIC_READ,
+		FILE_SHARE_READ,
+		NULL,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+		NULL);
+
+	if (pool == INVALID_HANDLE_VALUE)
+	{
+		CSE_LOG_ERROR("Failed to open %s (%d)", poolPath, (int) GetLastError());
+		goto cleanup;
+	}
+
+	for (uint32_t i = 0; i < chunkCount; ++i)
+	{
+		ChunkRecord chunk = GetChunk(recipe, i);
+		if (chunk.size > maxChunkSize)
+			maxChunkSize = chunk.size;
+	}
+
+	buffer = malloc(maxChunkSize ? maxChunkSize : 1);
+	if (!buffer)
+	{
+		CSE_LOG_ERROR("Allocation failed");
+		goto cleanup;
+	}
+
+	for (uint32_t i = 0; i < chunkCount; ++i)
+	{
+		ChunkRecord chunk = GetChunk(recipe, i);
+		DWORD readSize = 0;
+		OVERLAPPED overlapped;
+
+		ZeroMemory(&overlapped, sizeof(OVERLAPPED));
+		overlapped.Offset = (DWORD) chunk.offset;
+		overlapped.OffsetHigh = (DWORD) (chunk.offset >> 32);
+
+		if (!ReadFile(pool, buffer, chunk.size, &readSize, &overlapped) || (readSize != chunk.size))
+		{
+			CSE_LOG_ERROR("Failed to read chunk %u from %s (%d)", (unsigned) i, poolPath, (int) GetLastError());
+			goto cleanup;
+		}
+
+		if (!WaykCseBundleOutput_Write(output, buffer, chunk.size))
+			goto cleanup;
+	}
+
+	result = true;
+
+cleanup:
+	if (buffer)
+		free(buffer);
+	if (pool != INVALID_HANDLE_VALUE)
+		CloseHandle(pool);
+	if (poolPathW)
+		free(poolPathW);
+
+	return result;
+}
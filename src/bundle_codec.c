@@ -0,0 +1,1019 @@
+#include <cse/bundle_codec.h>
+#include <cse/log.h>
+
+#include <lizard/lizard.h>
+
+#include <zstd.h>
+#include <zstd_errors.h>
+
+#define CSE_LOG_TAG "WaykCseBundleCodec"
+
+// WriteFile takes 32-bit sizes
+#define BUNDLE_OUTPUT_MAX_WRITE (64 * 1024 * 1024)
+
+// Decoded data goes to the output file through a ring of fixed-size slots
+// drained by a writer thread, so decoding overlaps disk writes while memory
+// use stays constant regardless of the entry size
+#define BUNDLE_RING_SLOT_COUNT 4
+#define BUNDLE_RING_MAX_SIZE (4 * 1024 * 1024)
+#define BUNDLE_RING_MIN_SLOT_SIZE (64 * 1024)
+
+// zstd decoder state besides the window: block buffers and the context itself
+#define BUNDLE_ZSTD_DECODER_OVERHEAD (512 * 1024)
+
+#define BUNDLE_MAX_BLOCK_WORKERS 16
+
+struct waykcse_bundle_output
+{
+	HANDLE file;
+	WCHAR* path;
+	CseSha256* hash;
+	uint64_t written;
+	bool failed;
+};
+
+WaykCseBundleOutput* WaykCseBundleOutput_Open(const char* path, uint64_t size, CseSha256* hash)
+{
+	WaykCseBundleOutput* ctx = calloc(1, sizeof(WaykCseBundleOutput));
+	if (!ctx)
+	{
+		CSE_LOG_ERROR("Allocation failed");
+		return 0;
+	}
+
+	ctx->file = INVALID_HANDLE_VALUE;
+	ctx->hash = hash;
+
+	ctx->path = LzUnicode_UTF8toUTF16_dup(path);
+	if (!ctx->path)
+	{
+		free(ctx);
+		return 0;
+	}
+
+	ctx->file = CreateFileW(
+		ctx->path,
+		GENERIC_WRITE,
+		FILE_SHARE_READ,
+		NULL,
+		CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+		NULL);
+
+	if (ctx->file == INVALID_HANDLE_VALUE)
+	{
+		CSE_LOG_ERROR("Failed to create %s (%d)", path, (int) GetLastError());
+		free(ctx->path);
+		free(ctx);
+		return 0;
+	}
+
+	// Allocation only reserves disk space, file size still grows with writes
+	if (size > 0)
+	{
+		FILE_ALLOCATION_INFO allocationInfo;
+		allocationInfo.AllocationSize.QuadPart = (LONGLONG) size;
+
+		if (!SetFileInformationByHandle(ctx->file, FileAllocationInfo, &allocationInfo, sizeof(allocationInfo)))
+			CSE_LOG_WARN("Failed to preallocate %s (%d)", path, (int) GetLastError());
+	}
+
+	return ctx;
+}
+
+bool WaykCseBundleOutput_Write(WaykCseBundleOutput* ctx, const uint8_t* data, size_t size)
+{
+	if (ctx->failed)
+		return false;
+
+	if (ctx->hash && !CseSha256_Update(ctx->hash, data, size))
+	{
+		ctx->failed = true;
+		return false;
+	}
+
+	while (size > 0)
+	{
+		DWORD chunkSize = (size > BUNDLE_OUTPUT_MAX_WRITE) ? BUNDLE_OUTPUT_MAX_WRITE : (DWORD) size;
+		DWORD written = 0;
+
+		if (!WriteFile(ctx->file, data, chunkSize, &written, NULL) || (written != chunkSize))
+		{
+			CSE_LOG_ERROR("Failed to write extracted file (%d)", (int) GetLastError());
+			ctx->failed = true;
+			return false;
+		}
+
+		data += chunkSize;
+		size -= chunkSize;
+		ctx->written += chunkSize;
+	}
+
+	return true;
+}
+
+bool WaykCseBundleOutput_WriteAt(WaykCseBundleOutput* ctx, uint64_t offset, const uint8_t* data, size_t size)
+{
+	while (size > 0)
+	{
+		DWORD chunkSize = (size > BUNDLE_OUTPUT_MAX_WRITE) ? BUNDLE_OUTPUT_MAX_WRITE : (DWORD) size;
+		DWORD written = 0;
+		OVERLAPPED overlapped;
+
+		ZeroMemory(&overlapped, sizeof(OVERLAPPED));
+		overlapped.Offset = (DWORD) offset;
+		overlapped.OffsetHigh = (DWORD) (offset >> 32);
+
+		if (!WriteFile(ctx->file, data, chunkSize, &written, &overlapped) || (written != chunkSize))
+		{
+			CSE_LOG_ERROR("Failed to write extracted file (%d)", (int) GetLastError());
+			return false;
+		}
+
+		data += chunkSize;
+		size -= chunkSize;
+		offset += chunkSize;
+		InterlockedExchangeAdd64((volatile LONG64*) &ctx->written, (LONG64) chunkSize);
+	}
+
+	return true;
+}
+
+uint64_t WaykCseBundleOutput_GetWritten(WaykCseBundleOutput* ctx)
+{
+	return ctx->written;
+}
+
+bool WaykCseBundleOutput_Close(WaykCseBundleOutput* ctx, bool keep)
+{
+	bool result = keep && !ctx->failed;
+
+	CloseHandle(ctx->file);
+
+	if (!result)
+		DeleteFileW(ctx->path);
+
+	free(ctx->path);
+	free(ctx);
+
+	return result;
+}
+
+typedef struct
+{
+	uint8_t* memory;
+	size_t slotSize;
+	size_t sizes[BUNDLE_RING_SLOT_COUNT];
+	HANDLE freeSlots;
+	HANDLE filledSlots;
+	int readIndex;
+	int writeIndex;
+	WaykCseBundleOutput* output;
+	volatile LONG failed;
+} WaykCseBundleRing;
+
+static bool WaykCseBundleRing_Init(WaykCseBundleRing* ctx, size_t size)
+{
+	ZeroMemory(ctx, sizeof(WaykCseBundleRing));
+
+	ctx->slotSize = size / BUNDLE_RING_SLOT_COUNT;
+	if (ctx->slotSize < BUNDLE_RING_MIN_SLOT_SIZE)
+		ctx->slotSize = BUNDLE_RING_MIN_SLOT_SIZE;
+
+	ctx->memory = malloc(ctx->slotSize * BUNDLE_RING_SLOT_COUNT);
+	ctx->freeSlots = CreateSemaphoreW(NULL, BUNDLE_RING_SLOT_COUNT, BUNDLE_RING_SLOT_COUNT, NULL);
+	ctx->filledSlots = CreateSemaphoreW(NULL, 0, BUNDLE_RING_SLOT_COUNT, NULL);
+
+	return ctx->memory && ctx->freeSlots && ctx->filledSlots;
+}
+
+static void WaykCseBundleRing_Uninit(WaykCseBundleRing* ctx)
+{
+	if (ctx->freeSlots)
+		CloseHandle(ctx->freeSlots);
+	if (ctx->filledSlots)
+		CloseHandle(ctx->filledSlots);
+	if (ctx->memory)
+		free(ctx->memory);
+
+	ZeroMemory(ctx, sizeof(WaykCseBundleRing));
+}
+
+// Empty slot marks the end of the data; after a write failure the remaining
+// slots are still released so the producer never blocks
+static DWORD WINAPI WaykCseBundleRing_Writer(LPVOID param)
+{
+	WaykCseBundleRing* ctx = (WaykCseBundleRing*) param;
+
+	while (true)
+	{
+		WaitForSingleObject(ctx->filledSlots, INFINITE);
+
+		size_t size = ctx->sizes[ctx->readIndex];
+		uint8_t* slot = ctx->memory + ctx->slotSize * ctx->readIndex;
+
+		if ((size > 0) && !ctx->failed && !WaykCseBundleOutput_Write(ctx->output, slot, size))
+			InterlockedExchange(&ctx->failed, 1);
+
+		ctx->readIndex = (ctx->readIndex + 1) % BUNDLE_RING_SLOT_COUNT;
+		ReleaseSemaphore(ctx->freeSlots, 1, NULL);
+
+		if (size == 0)
+			break;
+	}
+
+	return 0;
+}
+
+static HANDLE WaykCseBundleRing_Start(WaykCseBundleRing* ctx, WaykCseBundleOutput* output)
+{
+	ctx->output = output;
+	ctx->failed = 0;
+	ctx->readIndex = 0;
+	ctx->writeIndex = 0;
+
+	HANDLE writer = CreateThread(NULL, 0, WaykCseBundleRing_Writer, ctx, 0, NULL);
+	if (!writer)
+		CSE_LOG_ERROR("Failed to start bundle writer (%d)", (int) GetLastError());
+
+	return writer;
+}
+
+// Blocks until the writer releases a slot
+static uint8_t* WaykCseBundleRing_Acquire(WaykCseBundleRing* ctx)
+{
+	WaitForSingleObject(ctx->freeSlots, INFINITE);
+	return ctx->memory + ctx->slotSize * ctx->writeIndex;
+}
+
+// Returns an acquired slot without writing anything
+static void WaykCseBundleRing_Discard(WaykCseBundleRing* ctx)
+{
+	ReleaseSemaphore(ctx->freeSlots, 1, NULL);
+}
+
+static void WaykCseBundleRing_Submit(WaykCseBundleRing* ctx, size_t size)
+{
+	ctx->sizes[ctx->writeIndex] = size;
+	ctx->writeIndex = (ctx->writeIndex + 1) % BUNDLE_RING_SLOT_COUNT;
+	ReleaseSemaphore(ctx->filledSlots, 1, NULL);
+}
+
+// Waits until all submitted data is written; returns false if any write failed
+static bool WaykCseBundleRing_Finish(WaykCseBundleRing* ctx, HANDLE writer)
+{
+	WaykCseBundleRing_Acquire(ctx);
+	WaykCseBundleRing_Submit(ctx, 0);
+
+	WaitForSingleObject(writer, INFINITE);
+	CloseHandle(writer);
+
+	return !ctx->failed;
+}
+
+// Archive stays open after an entry is extracted, for as long as the next
+// entries come from the same stream. Bundles without table of contents are a
+// single 7z archive; LzArchive keeps the last solid block it decoded, so
+// entries taken from it in archive order decode each block only once
+typedef struct
+{
+	LzArchive* archive;
+	const uint8_t* stream;  // open stream, 0 if none
+	size_t streamSize;
+} SevenZipDecoder;
+
+static void SevenZipCodec_FreeDecoder(void* decoder)
+{
+	SevenZipDecoder* ctx = (SevenZipDecoder*) decoder;
+
+	if (ctx->stream)
+		LzArchive_Close(ctx->archive);
+	if (ctx->archive)
+		LzArchive_Free(ctx->archive);
+
+	free(ctx);
+}
+
+static void* SevenZipCodec_NewDecoder(size_t memoryLimit)
+{
+	SevenZipDecoder* ctx = calloc(1, sizeof(SevenZipDecoder));
+	if (!ctx)
+	{
+		CSE_LOG_ERROR("Allocation failed");
+		return 0;
+	}
+
+	ctx->archive = LzArchive_New();
+	if (!ctx->archive)
+	{
+		CSE_LOG_ERROR("Can't create LzArchive");
+		SevenZipCodec_FreeDecoder(ctx);
+		return 0;
+	}
+
+	// LzArchive allocates its own working memory
+	if (memoryLimit > 0)
+		CSE_LOG_WARN("Memory limit is not enforced for 7z bundle entries");
+
+	return ctx;
+}
+
+static bool SevenZipCodec_Open(SevenZipDecoder* ctx, const uint8_t* stream, size_t streamSize)
+{
+	if ((ctx->stream == stream) && (ctx->streamSize == streamSize))
+		return true;
+
+	if (ctx->stream)
+		LzArchive_Close(ctx->archive);
+	ctx->stream = 0;
+
+	if (LzArchive_OpenData(ctx->archive, stream, streamSize) != LZ_OK)
+		return false;
+
+	ctx->stream = stream;
+	ctx->streamSize = streamSize;
+
+	return true;
+}
+
+// LzArchive writes the output file itself and has no hook for the decoded
+// data, so the file is hashed right after it is written, while it is still in
+// the file cache. This second pass over every 7z entry remains; the patcher
+// writes zstd bundles by default, which are hashed as they are decoded
+static bool SevenZipCodec_HashFile(const char* path, CseSha256* hash)
+{
+	bool result = false;
+	WCHAR* pathW = 0;
+	FILE* fp = 0;
+	uint8_t* buffer = 0;
+	size_t bufferSize = 1024 * 1024;
+	size_t readSize;
+
+	pathW = LzUnicode_UTF8toUTF16_dup(path);
+	if (!pathW)
+		goto cleanup;
+
+	fp = _wfopen(pathW, L"rb");
+	buffer = malloc(bufferSize);
+	if (!fp || !buffer)
+		goto cleanup;
+
+	while ((readSize = fread(buffer, 1, bufferSize, fp)) > 0)
+	{
+		if (!CseSha256_Update(hash, buffer, readSize))
+			goto cleanup;
+	}
+
+	result = !ferror(fp);
+
+cleanup:
+	if (buffer)
+		free(buffer);
+	if (fp)
+		fclose(fp);
+	if (pathW)
+		free(pathW);
+
+	return result;
+}
+
+// Stream is either a whole 7z archive (bundles without table of contents) or a
+// single-entry archive, in both cases entry index in it is known from the index
+static bool SevenZipCodec_DecodeToFile(
+	void* decoder,
+	const uint8_t* stream,
+	size_t streamSize,
+	const char* fileName,
+	const WaykCseBundleIndexEntry* entry,
+	const char* outputPath,
+	CseSha256* hash)
+{
+	SevenZipDecoder* ctx = (SevenZipDecoder*) decoder;
+	int archiveIndex = entry ? entry->archiveIndex : -1;
+	int rv;
+
+	if (!SevenZipCodec_Open(ctx, stream, streamSize))
+	{
+		CSE_LOG_ERROR("Bundle entry %s has invalid format", fileName);
+		return false;
+	}
+
+	rv = LzArchive_ExtractFile(ctx->archive, archiveIndex, fileName, outputPath);
+
+	if (rv != LZ_OK)
+	{
+		LzArchive_Close(ctx->archive);
+		ctx->stream = 0;
+
+		CSE_LOG_ERROR("Failed to extract %s from the bundle: %d %s\n", fileName, rv, outputPath);
+		return false;
+	}
+
+	if (hash && !SevenZipCodec_HashFile(outputPath, hash))
+	{
+		CSE_LOG_ERROR("Failed to hash %s", outputPath);
+		return false;
+	}
+
+	return true;
+}
+
+typedef struct
+{
+	ZSTD_DCtx* stream;
+	WaykCseBundleRing ring;
+} ZstdDecoder;
+
+static void ZstdCodec_FreeDecoder(void* decoder)
+{
+	ZstdDecoder* ctx = (ZstdDecoder*) decoder;
+
+	if (ctx->stream)
+		ZSTD_freeDCtx(ctx->stream);
+
+	WaykCseBundleRing_Uninit(&ctx->ring);
+
+	free(ctx);
+}
+
+// Splits the memory limit between the output ring and the decoding window;
+// window log is rounded down, so the decoder never exceeds the limit
+static int ZstdCodec_GetWindowLogMax(size_t memoryLimit, size_t ringSize)
+{
+	ZSTD_bounds bounds = ZSTD_dParam_getBounds(ZSTD_d_windowLogMax);
+	size_t reserved = ringSize + BUNDLE_ZSTD_DECODER_OVERHEAD;
+	int windowLog = bounds.lowerBound;
+
+	while ((windowLog < bounds.upperBound) && (windowLog < 30)
+		&& (reserved + ((size_t) 1 << (windowLog + 1)) <= memoryLimit))
+	{
+		windowLog++;
+	}
+
+	return windowLog;
+}
+
+static void* ZstdCodec_NewDecoder(size_t memoryLimit)
+{
+	size_t ringSize = BUNDLE_RING_MAX_SIZE;
+
+	ZstdDecoder* ctx = calloc(1, sizeof(ZstdDecoder));
+	if (!ctx)
+	{
+		CSE_LOG_ERROR("Allocation failed");
+		return 0;
+	}
+
+	if ((memoryLimit > 0) && (memoryLimit / 4 < ringSize))
+		ringSize = memoryLimit / 4;
+
+	ctx->stream = ZSTD_createDCtx();
+
+	if (!WaykCseBundleRing_Init(&ctx->ring, ringSize) || !ctx->stream)
+	{
+		CSE_LOG_ERROR("Can't create zstd decoder");
+		ZstdCodec_FreeDecoder(ctx);
+		return 0;
+	}
+
+	if (memoryLimit > 0)
+	{
+		int windowLog = ZstdCodec_GetWindowLogMax(memoryLimit, ringSize);
+
+		CSE_LOG_DEBUG("zstd decoding window is limited to %u KB", (unsigned) ((1u << windowLog) / 1024));
+
+		// Parameter is sticky, session resets between entries keep it
+		ZSTD_DCtx_setParameter(ctx->stream, ZSTD_d_windowLogMax, windowLog);
+	}
+
+	return ctx;
+}
+
+static bool ZstdCodec_DecodeToFile(
+	void* decoder,
+	const uint8_t* stream,
+	size_t streamSize,
+	const char* fileName,
+	const WaykCseBundleIndexEntry* entry,
+	const char* outputPath,
+	CseSha256* hash)
+{
+	ZstdDecoder* ctx = (ZstdDecoder*) decoder;
+	bool result = false;
+	WaykCseBundleOutput* output = 0;
+	HANDLE writer;
+	ZSTD_inBuffer input = { stream, streamSize, 0 };
+	size_t rv = 0;
+
+	if (!entry)
+	{
+		CSE_LOG_ERROR("%s is not present in the bundle", fileName);
+		goto cleanup;
+	}
+
+	output = WaykCseBundleOutput_Open(outputPath, entry->size, hash);
+	if (!output)
+		goto cleanup;
+
+	ZSTD_DCtx_reset(ctx->stream, ZSTD_reset_session_only);
+
+	writer = WaykCseBundleRing_Start(&ctx->ring, output);
+	if (!writer)
+		goto cleanup;
+
+	do
+	{
+		ZSTD_outBuffer outBuffer = { WaykCseBundleRing_Acquire(&ctx->ring), ctx->ring.slotSize, 0 };
+
+		rv = ZSTD_decompressStream(ctx->stream, &outBuffer, &input);
+		if (ZSTD_isError(rv))
+		{
+			WaykCseBundleRing_Discard(&ctx->ring);
+
+			if (ZSTD_getErrorCode(rv) == ZSTD_error_frameParameter_windowTooLarge)
+				CSE_LOG_ERROR("%s needs more memory to decode than the memory limit allows", fileName);
+			else
+				CSE_LOG_ERROR("Failed to decode %s: %s", fileName, ZSTD_getErrorName(rv));
+			break;
+		}
+
+		if (outBuffer.pos > 0)
+			WaykCseBundleRing_Submit(&ctx->ring, outBuffer.pos);
+		else
+			WaykCseBundleRing_Discard(&ctx->ring);
+
+		if (ctx->ring.failed)
+			break;
+
+		// Input is consumed, but the decoder may still hold buffered output
+		if ((input.pos == input.size) && (outBuffer.pos < outBuffer.size))
+			break;
+	}
+	while (true);
+
+	if (!WaykCseBundleRing_Finish(&ctx->ring, writer) || ZSTD_isError(rv))
+		goto cleanup;
+
+	if ((rv != 0) || (WaykCseBundleOutput_GetWritten(output) != entry->size))
+	{
+		CSE_LOG_ERROR("Bundle entry %s is truncated", fileName);
+		goto cleanup;
+	}
+
+	result = true;
+
+cleanup:
+	if (output)
+		result = WaykCseBundleOutput_Close(output, result);
+
+	return result;
+}
+
+static bool ZstdCodec_DecodeToBuffer(
+	void* decoder,
+	const uint8_t* stream,
+	size_t streamSize,
+	const WaykCseBundleIndexEntry* entry,
+	uint8_t* buffer)
+{
+	ZstdDecoder* ctx = (ZstdDecoder*) decoder;
+
+	size_t rv = ZSTD_decompressDCtx(ctx->stream, buffer, (size_t) entry->size, stream, streamSize);
+	if (ZSTD_isError(rv))
+	{
+		CSE_LOG_ERROR("Failed to decode %s: %s", entry->name, ZSTD_getErrorName(rv));
+		return false;
+	}
+
+	if (rv != entry->size)
+	{
+		CSE_LOG_ERROR("Bundle entry %s is truncated", entry->name);
+		return false;
+	}
+
+	return true;
+}
+
+// Stream of a block-encoded entry: u32 block size, u32 block count, u32 packed
+// size of every block, then the blocks as independent zstd frames. Every block
+// but the last one decodes to exactly block size bytes
+#define ZSTD_BLOCK_TABLE_HEADER_SIZE 8
+
+typedef struct
+{
+	uint32_t blockSize;
+	uint32_t blockCount;
+	const uint8_t* frames;
+	size_t framesSize;
+	uint64_t* frameOffsets;  // blockCount + 1 offsets from frames
+} ZstdBlockTable;
+
+static uint32_t ReadUInt32(const uint8_t* data)
+{
+	return (uint32_t) data[0]
+		| ((uint32_t) data[1] << 8)
+		| ((uint32_t) data[2] << 16)
+		| ((uint32_t) data[3] << 24);
+}
+
+static bool ZstdBlockTable_Parse(ZstdBlockTable* ctx, const uint8_t* stream, size_t streamSize, uint64_t size)
+{
+	size_t headerSize;
+
+	ZeroMemory(ctx, sizeof(ZstdBlockTable));
+
+	if (streamSize < ZSTD_BLOCK_TABLE_HEADER_SIZE)
+		return false;
+
+	ctx->blockSize = ReadUInt32(stream);
+	ctx->blockCount = ReadUInt32(stream + 4);
+
+	if ((ctx->blockSize == 0)
+		|| (ctx->blockCount != (size + ctx->blockSize - 1) / ctx->blockSize)
+		|| (ctx->blockCount > (streamSize - ZSTD_BLOCK_TABLE_HEADER_SIZE) / 4))
+	{
+		return false;
+	}
+
+	headerSize = ZSTD_BLOCK_TABLE_HEADER_SIZE + (size_t) ctx->blockCount * 4;
+	ctx->frames = stream + headerSize;
+	ctx->framesSize = streamSize - headerSize;
+
+	ctx->frameOffsets = calloc((size_t) ctx->blockCount + 1, sizeof(uint64_t));
+	if (!ctx->frameOffsets)
+		return false;
+
+	for (uint32_t i = 0; i < ctx->blockCount; ++i)
+	{
+		uint32_t packedSize = ReadUInt32(stream + ZSTD_BLOCK_TABLE_HEADER_SIZE + i * 4);
+		ctx->frameOffsets[i + 1] = ctx->frameOffsets[i] + packedSize;
+	}
+
+	return ctx->frameOffsets[ctx->blockCount] == ctx->framesSize;
+}
+
+static void ZstdBlockTable_Uninit(ZstdBlockTable* ctx)
+{
+	if (ctx->frameOffsets)
+		free(ctx->frameOffsets);
+
+	ZeroMemory(ctx, sizeof(ZstdBlockTable));
+}
+
+typedef struct
+{
+	const ZstdBlockTable* table;
+	const char* fileName;
+	uint64_t size;
+	WaykCseBundleOutput* output;
+	CseSha256* hash;
+	volatile LONG next;  // next block to be taken by a worker
+	SRWLOCK lock;
+	CONDITION_VARIABLE hashedChanged;
+	uint32_t hashed;  // blocks fed to the hash, guarded by lock
+	bool failed;      // guarded by lock
+} ZstdBlockJob;
+
+static void ZstdBlockJob_Fail(ZstdBlockJob* job)
+{
+	AcquireSRWLockExclusive(&job->lock);
+	job->failed = true;
+	ReleaseSRWLockExclusive(&job->lock);
+
+	WakeAllConditionVariable(&job->hashedChanged);
+}
+
+static bool ZstdBlockJob_HasFailed(ZstdBlockJob* job)
+{
+	AcquireSRWLockExclusive(&job->lock);
+	bool failed = job->failed;
+	ReleaseSRWLockExclusive(&job->lock);
+
+	return failed;
+}
+
+// Hash is sequential, so blocks are fed to it in order: a worker waits until
+// all preceding blocks are hashed. Workers take blocks in order, so the block
+// waited for is always being decoded by another worker
+static bool ZstdBlockJob_Hash(ZstdBlockJob* job, uint32_t block, const uint8_t* data, size_t size)
+{
+	bool result;
+
+	AcquireSRWLockExclusive(&job->lock);
+
+	while ((job->hashed != block) && !job->failed)
+		SleepConditionVariableSRW(&job->hashedChanged, &job->lock, INFINITE, 0);
+
+	result = !job->failed && CseSha256_Update(job->hash, data, size);
+	if (result)
+		job->hashed++;
+
+	ReleaseSRWLockExclusive(&job->lock);
+
+	WakeAllConditionVariable(&job->hashedChanged);
+	return result;
+}
+
+static bool ZstdBlockJob_DecodeBlock(ZstdBlockJob* job, ZSTD_DCtx* stream, uint8_t* buffer, uint32_t block)
+{
+	const ZstdBlockTable* table = job->table;
+	uint64_t offset = (uint64_t) block * table->blockSize;
+	uint64_t remaining = job->size - offset;
+	size_t blockSize = (remaining < table->blockSize) ? (size_t) remaining : table->blockSize;
+	const uint8_t* frame = table->frames + table->frameOffsets[block];
+	size_t frameSize = (size_t) (table->frameOffsets[block + 1] - table->frameOffsets[block]);
+
+	size_t rv = ZSTD_decompressDCtx(stream, buffer, blockSize, frame, frameSize);
+	if (ZSTD_isError(rv) || (rv != blockSize))
+	{
+		CSE_LOG_ERROR(
+			"Failed to decode block %u of %s: %s",
+			(unsigned) block,
+			job->fileName,
+			ZSTD_isError(rv) ? ZSTD_getErrorName(rv) : "size mismatch");
+		return false;
+	}
+
+	// Blocks are written as soon as they are decoded; since workers take them in
+	// order, writes stay close to the end of the data written so far
+	if (!WaykCseBundleOutput_WriteAt(job->output, offset, buffer, blockSize))
+		return false;
+
+	return !job->hash || ZstdBlockJob_Hash(job, block, buffer, blockSize);
+}
+
+// Worker owns its decoding context and block buffer
+static DWORD WINAPI ZstdBlockJob_Worker(LPVOID param)
+{
+	ZstdBlockJob* job = (ZstdBlockJob*) param;
+	ZSTD_DCtx* stream = ZSTD_createDCtx();
+	uint8_t* buffer = malloc(job->table->blockSize);
+
+	if (!stream || !buffer)
+	{
+		CSE_LOG_ERROR("Can't create zstd block decoder");
+		ZstdBlockJob_Fail(job);
+		goto cleanup;
+	}
+
+	while (!ZstdBlockJob_HasFailed(job))
+	{
+		LONG block = InterlockedIncrement(&job->next) - 1;
+		if (block >= (LONG) job->table->blockCount)
+			break;
+
+		if (!ZstdBlockJob_DecodeBlock(job, stream, buffer, (uint32_t) block))
+		{
+			ZstdBlockJob_Fail(job);
+			break;
+		}
+	}
+
+cleanup:
+	if (buffer)
+		free(buffer);
+	if (stream)
+		ZSTD_freeDCtx(stream);
+
+	return 0;
+}
+
+typedef struct
+{
+	ZstdDecoder* sequential;  // streams the entry when it is decoded on a single thread
+	size_t memoryLimit;
+} ZstdBlocksDecoder;
+
+static void ZstdBlocksCodec_FreeDecoder(void* decoder)
+{
+	ZstdBlocksDecoder* ctx = (ZstdBlocksDecoder*) decoder;
+
+	if (ctx->sequential)
+		ZstdCodec_FreeDecoder(ctx->sequential);
+
+	free(ctx);
+}
+
+static void* ZstdBlocksCodec_NewDecoder(size_t memoryLimit)
+{
+	ZstdBlocksDecoder* ctx = calloc(1, sizeof(ZstdBlocksDecoder));
+	if (!ctx)
+	{
+		CSE_LOG_ERROR("Allocation failed");
+		return 0;
+	}
+
+	ctx->memoryLimit = memoryLimit;
+	ctx->sequential = ZstdCodec_NewDecoder(memoryLimit);
+
+	if (!ctx->sequential)
+	{
+		ZstdBlocksCodec_FreeDecoder(ctx);
+		return 0;
+	}
+
+	return ctx;
+}
+
+// One worker per CPU, each of them holds a whole decoded block in memory
+static int ZstdBlocksCodec_GetWorkerCount(ZstdBlocksDecoder* ctx, const ZstdBlockTable* table)
+{
+	SYSTEM_INFO systemInfo;
+	GetSystemInfo(&systemInfo);
+
+	size_t workers = (size_t) systemInfo.dwNumberOfProcessors;
+
+	if (ctx->memoryLimit > 0)
+	{
+		size_t workerMemory = (size_t) table->blockSize + BUNDLE_ZSTD_DECODER_OVERHEAD;
+		if (workers > ctx->memoryLimit / workerMemory)
+			workers = ctx->memoryLimit / workerMemory;
+	}
+
+	if (workers > BUNDLE_MAX_BLOCK_WORKERS)
+		workers = BUNDLE_MAX_BLOCK_WORKERS;
+	if (workers > table->blockCount)
+		workers = table->blockCount;
+
+	return (int) workers;
+}
+
+static bool ZstdBlocksCodec_DecodeParallel(
+	ZstdBlockJob* job,
+	int workers)
+{
+	HANDLE threads[BUNDLE_MAX_BLOCK_WORKERS];
+	int threadCount = 0;
+
+	// Calling thread is a worker as well
+	for (int i = 1; i < workers; ++i)
+	{
+		threads[threadCount] = CreateThread(NULL, 0, ZstdBlockJob_Worker, job, 0, NULL);
+		if (!threads[threadCount])
+		{
+			CSE_LOG_WARN("Failed to start block decoding worker (%d)", (int) GetLastError());
+			break;
+		}
+		threadCount++;
+	}
+
+	CSE_LOG_DEBUG(
+		"Decoding %u blocks of %s with %d workers",
+		(unsigned) job->table->blockCount,
+		job->fileName,
+		threadCount + 1);
+
+	ZstdBlockJob_Worker(job);
+
+	if (threadCount > 0)
+		WaitForMultipleObjects((DWORD) threadCount, threads, TRUE, INFINITE);
+
+	for (int i = 0; i < threadCount; ++i)
+		CloseHandle(threads[i]);
+
+	return !job->failed && (!job->hash || (job->hashed == job->table->blockCount));
+}
+
+static bool ZstdBlocksCodec_DecodeToFile(
+	void* decoder,
+	const uint8_t* stream,
+	size_t streamSize,
+	const char* fileName,
+	const WaykCseBundleIndexEntry* entry,
+	const char* outputPath,
+	CseSha256* hash)
+{
+	ZstdBlocksDecoder* ctx = (ZstdBlocksDecoder*) decoder;
+	bool result = false;
+	ZstdBlockTable table;
+	ZstdBlockJob job;
+	WaykCseBundleOutput* output = 0;
+	int workers;
+
+	ZeroMemory(&table, sizeof(ZstdBlockTable));
+
+	if (!entry)
+	{
+		CSE_LOG_ERROR("%s is not present in the bundle", fileName);
+		goto cleanup;
+	}
+
+	if (!ZstdBlockTable_Parse(&table, stream, streamSize, entry->size))
+	{
+		CSE_LOG_ERROR("Bundle entry %s has invalid block table", fileName);
+		goto cleanup;
+	}
+
+	// Frames follow each other, so together they are a regular zstd stream
+	workers = ZstdBlocksCodec_GetWorkerCount(ctx, &table);
+	if (workers <= 1)
+	{
+		result = ZstdCodec_DecodeToFile(
+			ctx->sequential,
+			table.frames,
+			table.framesSize,
+			fileName,
+			entry,
+			outputPath,
+			hash);
+		goto cleanup;
+	}
+
+	output = WaykCseBundleOutput_Open(outputPath, entry->size, 0);
+	if (!output)
+		goto cleanup;
+
+	ZeroMemory(&job, sizeof(ZstdBlockJob));
+	job.table = &table;
+	job.fileName = fileName;
+	job.size = entry->size;
+	job.output = output;
+	job.hash = hash;
+	InitializeSRWLock(&job.lock);
+	InitializeConditionVariable(&job.hashedChanged);
+
+	if (!ZstdBlocksCodec_DecodeParallel(&job, workers))
+		goto cleanup;
+
+	if (WaykCseBundleOutput_GetWritten(output) != entry->size)
+	{
+		CSE_LOG_ERROR("Bundle entry %s is truncated", fileName);
+		goto cleanup;
+	}
+
+	result = true;
+
+cleanup:
+	if (output)
+		result = WaykCseBundleOutput_Close(output, result);
+
+	ZstdBlockTable_Uninit(&table);
+
+	return result;
+}
+
+static bool ZstdBlocksCodec_DecodeToBuffer(
+	void* decoder,
+	const uint8_t* stream,
+	size_t streamSize,
+	const WaykCseBundleIndexEntry* entry,
+	uint8_t* buffer)
+{
+	ZstdBlocksDecoder* ctx = (ZstdBlocksDecoder*) decoder;
+	ZstdBlockTable table;
+	bool result = false;
+
+	if (!ZstdBlockTable_Parse(&table, stream, streamSize, entry->size))
+		CSE_LOG_ERROR("Bundle entry %s has invalid block table", entry->name);
+	else
+		result = ZstdCodec_DecodeToBuffer(ctx->sequential, table.frames, table.framesSize, entry, buffer);
+
+	ZstdBlockTable_Uninit(&table);
+
+	return result;
+}
+
+static const WaykCseBundleCodec SEVEN_ZIP_CODEC =
+{
+	.id = WAYK_CSE_BUNDLE_CODEC_7Z,
+	.name = "7z",
+	.NewDecoder = SevenZipCodec_NewDecoder,
+	.FreeDecoder = SevenZipCodec_FreeDecoder,
+	.DecodeToFile = SevenZipCodec_DecodeToFile,
+	.DecodeToBuffer = 0,
+};
+
+static const WaykCseBundleCodec ZSTD_CODEC =
+{
+	.id = WAYK_CSE_BUNDLE_CODEC_ZSTD,
+	.name = "zstd",
+	.NewDecoder = ZstdCodec_NewDecoder,
+	.FreeDecoder = ZstdCodec_FreeDecoder,
+	.DecodeToFile = ZstdCodec_DecodeToFile,
+	.DecodeToBuffer = ZstdCodec_DecodeToBuffer,
+};
+
+static const WaykCseBundleCodec ZSTD_BLOCKS_CODEC =
+{
+	.id = WAYK_CSE_BUNDLE_CODEC_ZSTD_BLOCKS,
+	.name = "zstd-blocks",
+	.NewDecoder = ZstdBlocksCodec_NewDecoder,
+	.FreeDecoder = ZstdBlocksCodec_FreeDecoder,
+	.DecodeToFile = ZstdBlocksCodec_DecodeToFile,
+	.DecodeToBuffer = ZstdBlocksCodec_DecodeToBuffer,
+};
+
+const WaykCseBundleCodec* WaykCseBundleCodec_Get(uint16_t id)
+{
+	switch (id)
+	{
+		case WAYK_CSE_BUNDLE_CODEC_7Z:
+			return &SEVEN_ZIP_CODEC;
+		case WAYK_CSE_BUNDLE_CODEC_ZSTD:
+			return &ZSTD_CODEC;
+		case WAYK_CSE_BUNDLE_CODEC_ZSTD_BLOCKS:
+			return &ZSTD_BLOCKS_CODEC;
+		default:
+			return 0;
+	}
+}
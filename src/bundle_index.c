@@ -0,0 +1,1089 @@
+#include <cse/bundle_index.h>
+#include <cse/log.h>
+
+#include <lizard/lizard.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CSE_LOG_TAG "WaykCseBundleIndex"
+
+// See DOC/7zFormat.txt from the LZMA SDK for the header layout
+#define SEVEN_ZIP_SIGNATURE_HEADER_SIZE 32
+#define SEVEN_ZIP_MAX_FOLDER_STREAMS 64
+#define SEVEN_ZIP_MAX_SUBSTREAMS 0x10000
+
+#define SEVEN_ZIP_ID_END 0x00
+#define SEVEN_ZIP_ID_HEADER 0x01
+#define SEVEN_ZIP_ID_ARCHIVE_PROPERTIES 0x02
+#define SEVEN_ZIP_ID_ADDITIONAL_STREAMS_INFO 0x03
+#define SEVEN_ZIP_ID_MAIN_STREAMS_INFO 0x04
+#define SEVEN_ZIP_ID_FILES_INFO 0x05
+#define SEVEN_ZIP_ID_PACK_INFO 0x06
+#define SEVEN_ZIP_ID_UNPACK_INFO 0x07
+#define SEVEN_ZIP_ID_SUBSTREAMS_INFO 0x08
+#define SEVEN_ZIP_ID_SIZE 0x09
+#define SEVEN_ZIP_ID_CRC 0x0A
+#define SEVEN_ZIP_ID_FOLDER 0x0B
+#define SEVEN_ZIP_ID_CODERS_UNPACK_SIZE 0x0C
+#define SEVEN_ZIP_ID_NUM_UNPACK_STREAM 0x0D
+#define SEVEN_ZIP_ID_EMPTY_STREAM 0x0E
+#define SEVEN_ZIP_ID_NAME 0x11
+#define SEVEN_ZIP_ID_ENCODED_HEADER 0x17
+
+// Table of contents: header (magic, version, record size, entry count) and
+// fixed-size records: null-padded name, stream offset in the payload, stream
+// size, raw size, CRC32, codec id, flags and SHA-256 of the raw data
+#define BUNDLE_TOC_MAGIC "WCSE_TOC"
+#define BUNDLE_TOC_MAGIC_SIZE 8
+#define BUNDLE_TOC_HEADER_SIZE 16
+#define BUNDLE_TOC_VERSION 1
+#define BUNDLE_TOC_RECORD_SIZE 128
+#define BUNDLE_TOC_NAME_SIZE 64
+#define BUNDLE_TOC_FLAG_STORED 0x0001
+
+static const uint8_t SEVEN_ZIP_SIGNATURE[6] = { '7', 'z', 0xBC, 0xAF, 0x27, 0x1C };
+
+struct waykcse_bundle_index
+{
+	WaykCseBundleIndexEntry* entries;
+	int entryCount;
+};
+
+typedef struct
+{
+	const uint8_t* data;
+	size_t size;
+	size_t pos;
+	bool failed;
+} HeaderReader;
+
+typedef struct
+{
+	uint64_t numOutStreams;
+	uint64_t numPackedStreams;
+	uint64_t firstPackedStream;
+	bool isCopy;
+	int mainOutStream;
+	uint64_t unpackSize;
+	uint32_t crc;
+	bool hasCrc;
+	uint64_t numSubStreams;
+} SevenZipFolder;
+
+typedef struct
+{
+	uint64_t packPos;
+	uint64_t numPackStreams;
+	uint64_t* packSizes;
+	uint64_t numFolders;
+	SevenZipFolder* folders;
+	uint64_t numSubStreams;
+	uint64_t* subStreamSizes;
+	uint32_t* subStreamCrcs;
+	bool* subStreamHasCrc;
+} SevenZipStreamsInfo;
+
+typedef struct
+{
+	uint64_t numFiles;
+	bool* emptyStream;
+	char** names;
+} SevenZipFilesInfo;
+
+static uint8_t HeaderReader_ReadByte(HeaderReader* r)
+{
+	if (r->pos >= r->size)
+	{
+		r->failed = true;
+		return 0;
+	}
+
+	return r->data[r->pos++];
+}
+
+static uint16_t HeaderReader_ReadUInt16(HeaderReader* r)
+{
+	uint16_t value = HeaderReader_ReadByte(r);
+	value |= (uint16_t)(HeaderReader_ReadByte(r) << 8);
+	return value;
+}
+
+static uint32_t HeaderReader_ReadUInt32(HeaderReader* r)
+{
+	uint32_t value = 0;
+	for (int i = 0; i < 4; ++i)
+		value |= ((uint32_t) HeaderReader_ReadByte(r)) << (8 * i);
+	return value;
+}
+
+static uint64_t HeaderReader_ReadUInt64(HeaderReader* r)
+{
+	uint64_t value = HeaderReader_ReadUInt32(r);
+	value |= ((uint64_t) HeaderReader_ReadUInt32(r)) << 32;
+	return value;
+}
+
+// 7z variable length number: leading one bits of the first byte tell how many
+// bytes follow, remaining bits of the first byte are the high part
+static uint64_t HeaderReader_ReadNumber(HeaderReader* r)
+{
+	uint8_t firstByte = HeaderReader_ReadByte(r);
+	uint8_t mask = 0x80;
+	uint64_t value = 0;
+
+	for (int i = 0; i < 8; ++i)
+	{
+		if ((firstByte & mask) == 0)
+		{
+			uint64_t highPart = firstByte & (mask - 1);
+			value |= (highPart << (8 * i));
+			return value;
+		}
+
+		value |= ((uint64_t) HeaderReader_ReadByte(r)) << (8 * i);
+		mask >>= 1;
+	}
+
+	return value;
+}
+
+static void HeaderReader_Skip(HeaderReader* r, uint64_t count)
+{
+	if (count > (r->size - r->pos))
+	{
+		r->failed = true;
+		return;
+	}
+
+	r->pos += (size_t) count;
+}
+
+static void HeaderReader_SkipData(HeaderReader* r)
+{
+	HeaderReader_Skip(r, HeaderReader_ReadNumber(r));
+}
+
+// Item count sanity check: every item takes at least a bit of header data
+static bool HeaderReader_IsValidCount(HeaderReader* r, uint64_t count)
+{
+	return !r->failed && (count <= (uint64_t)(r->size - r->pos) * 8);
+}
+
+static void HeaderReader_ReadBitVector(HeaderReader* r, uint64_t count, bool* bits)
+{
+	uint8_t byte = 0;
+	uint8_t mask = 0;
+
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		if (mask == 0)
+		{
+			byte = HeaderReader_ReadByte(r);
+			mask = 0x80;
+		}
+
+		bits[i] = (byte & mask) != 0;
+		mask >>= 1;
+	}
+}
+
+static bool HeaderReader_ReadDigests(HeaderReader* r, uint64_t count, bool* defined, uint32_t* crcs)
+{
+	bool allDefined = HeaderReader_ReadByte(r) != 0;
+
+	if (allDefined)
+	{
+		for (uint64_t i = 0; i < count; ++i)
+			defined[i] = true;
+	}
+	else
+	{
+		HeaderReader_ReadBitVector(r, count, defined);
+	}
+
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		if (defined[i])
+			crcs[i] = HeaderReader_ReadUInt32(r);
+	}
+
+	return !r->failed;
+}
+
+static void SevenZipStreamsInfo_Free(SevenZipStreamsInfo* info)
+{
+	free(info->packSizes);
+	free(info->folders);
+	free(info->subStreamSizes);
+	free(info->subStreamCrcs);
+	free(info->subStreamHasCrc);
+	memset(info, 0, sizeof(SevenZipStreamsInfo));
+}
+
+static void SevenZipFilesInfo_Free(SevenZipFilesInfo* info)
+{
+	if (info->names)
+	{
+		for (uint64_t i = 0; i < info->numFiles; ++i)
+			free(info->names[i]);
+		free(info->names);
+	}
+
+	free(info->emptyStream);
+	memset(info, 0, sizeof(SevenZipFilesInfo));
+}
+
+static bool SevenZip_ReadPackInfo(HeaderReader* r, SevenZipStreamsInfo* info)
+{
+	info->packPos = HeaderReader_ReadNumber(r);
+	info->numPackStreams = HeaderReader_ReadNumber(r);
+	uint64_t numPackStreams = info->numPackStreams;
+	if (!HeaderReader_IsValidCount(r, numPackStreams))
+		return false;
+
+	info->packSizes = calloc((size_t) numPackStreams + 1, sizeof(uint64_t));
+	if (!info->packSizes)
+	{
+		CSE_LOG_ERROR("Allocation failed");
+		return false;
+	}
+
+	uint64_t id = HeaderReader_ReadNumber(r);
+	while (!r->failed && (id != SEVEN_ZIP_ID_END))
+	{
+		if (id == SEVEN_ZIP_ID_SIZE)
+		{
+			for (uint64_t i = 0; i < numPackStreams; ++i)
+				info->packSizes[i] = HeaderReader_ReadNumber(r);
+		}
+		else if (id == SEVEN_ZIP_ID_CRC)
+		{
+			bool* defined = calloc((size_t) numPackStreams + 1, sizeof(bool));
+			uint32_t* crcs = calloc((size_t) numPackStreams + 1, sizeof(uint32_t));
+			if (defined && crcs)
+				HeaderReader_ReadDigests(r, numPackStreams, defined, crcs);
+			else
+				r->failed = true;
+			free(defined);
+			free(crcs);
+		}
+		else
+		{
+			HeaderReader_SkipData(r);
+		}
+
+		id = HeaderReader_ReadNumber(r);
+	}
+
+	return !r->failed;
+}
+
+static bool SevenZip_ReadFolder(HeaderReader* r, SevenZipFolder* folder)
+{
+	uint64_t numCoders = HeaderReader_ReadNumber(r);
+	uint64_t numInStreams = 0;
+	uint64_t numOutStreams = 0;
+	bool boundOutStreams[SEVEN_ZIP_MAX_FOLDER_STREAMS];
+
+	if ((numCoders == 0) || (numCoders > SEVEN_ZIP_MAX_FOLDER_STREAMS))
+		return false;
+
+	for (uint64_t i = 0; i < numCoders; ++i)
+	{
+		uint8_t flags = HeaderReader_ReadByte(r);
+
+		// Alternative coder methods are not used by any 7z writer
+		if (flags & 0x80)
+			return false;
+
+		// Copy method has a single zero byte codec id
+		uint8_t codecIdSize = flags & 0x0F;
+		folder->isCopy = (numCoders == 1) && (codecIdSize == 1) && !(flags & 0x30);
+		for (uint8_t j = 0; j < codecIdSize; ++j)
+		{
+			if (HeaderReader_ReadByte(r) != 0)
+				folder->isCopy = false;
+		}
+
+		if (flags & 0x10)
+		{
+			numInStreams += HeaderReader_ReadNumber(r);
+			numOutStreams += HeaderReader_ReadNumber(r);
+		}
+		else
+		{
+			numInStreams += 1;
+			numOutStreams += 1;
+		}
+
+		if (flags & 0x20)
+			HeaderReader_SkipData(r); // Coder properties
+
+		if (r->failed
+			|| (numInStreams > SEVEN_ZIP_MAX_FOLDER_STREAMS)
+			|| (numOutStreams > SEVEN_ZIP_MAX_FOLDER_STREAMS))
+		{
+			return false;
+		}
+	}
+
+	if (numOutStreams == 0)
+		return false;
+
+	uint64_t numBindPairs = numOutStreams - 1;
+	if (numInStreams < numBindPairs)
+		return false;
+
+	memset(boundOutStreams, 0, sizeof(boundOutStreams));
+	for (uint64_t i = 0; i < numBindPairs; ++i)
+	{
+		HeaderReader_ReadNumber(r); // InIndex
+		uint64_t outIndex = HeaderReader_ReadNumber(r);
+		if (outIndex >= numOutStreams)
+			return false;
+		boundOutStreams[outIndex] = true;
+	}
+
+	uint64_t numPackedStreams = numInStreams - numBindPairs;
+	folder->numPackedStreams = numPackedStreams;
+	if (numPackedStreams > 1)
+	{
+		for (uint64_t i = 0; i < numPackedStreams; ++i)
+			HeaderReader_ReadNumber(r);
+	}
+
+	folder->numOutStreams = numOutStreams;
+	folder->mainOutStream = -1;
+	for (uint64_t i = 0; i < numOutStreams; ++i)
+	{
+		if (!boundOutStreams[i])
+		{
+			folder->mainOutStream = (int) i;
+			break;
+		}
+	}
+
+	return !r->failed && (folder->mainOutStream >= 0);
+}
+
+static bool SevenZip_ReadUnpackInfo(HeaderReader* r, SevenZipStreamsInfo* info)
+{
+	if (HeaderReader_ReadNumber(r) != SEVEN_ZIP_ID_FOLDER)
+		return false;
+
+	info->numFolders = HeaderReader_ReadNumber(r);
+	if (!HeaderReader_IsValidCount(r, info->numFolders))
+		return false;
+
+	// External folders definition is never produced by 7z writers
+	if (HeaderReader_ReadByte(r) != 0)
+		return false;
+
+	info->folders = calloc((size_t) info->numFolders + 1, sizeof(SevenZipFolder));
+	if (!info->folders)
+	{
+		CSE_LOG_ERROR("Allocation failed");
+		return false;
+	}
+
+	uint64_t packedStream = 0;
+	for (uint64_t i = 0; i < info->numFolders; ++i)
+	{
+		if (!SevenZip_ReadFolder(r, &info->folders[i]))
+			return false;
+
+		info->folders[i].firstPackedStream = packedStream;
+		packedStream += info->folders[i].numPackedStreams;
+	}
+
+	if (HeaderReader_ReadNumber(r) != SEVEN_ZIP_ID_CODERS_UNPACK_SIZE)
+		return false;
+
+	for (uint64_t i = 0; i < info->numFolders; ++i)
+	{
+		SevenZipFolder* folder = &info->folders[i];
+		for (uint64_t j = 0; j < folder->numOutStreams; ++j)
+		{
+			uint64_t size = HeaderReader_ReadNumber(r);
+			if (j == (uint64_t) folder->mainOutStream)
+				folder->unpackSize = size;
+		}
+
+		folder->numSubStreams = 1;
+	}
+
+	uint64_t id = HeaderReader_ReadNumber(r);
+	while (!r->failed && (id != SEVEN_ZIP_ID_END))
+	{
+		if (id == SEVEN_ZIP_ID_CRC)
+		{
+			bool* defined = calloc((size_t) info->numFolders + 1, sizeof(bool));
+			uint32_t* crcs = calloc((size_t) info->numFolders + 1, sizeof(uint32_t));
+			if (defined && crcs && HeaderReader_ReadDigests(r, info->numFolders, defined, crcs))
+			{
+				for (uint64_t i = 0; i < info->numFolders; ++i)
+				{
+					info->folders[i].hasCrc = defined[i];
+					info->folders[i].crc = crcs[i];
+				}
+			}
+			else
+			{
+				r->failed = true;
+			}
+			free(defined);
+			free(crcs);
+		}
+		else
+		{
+			HeaderReader_SkipData(r);
+		}
+
+		id = HeaderReader_ReadNumber(r);
+	}
+
+	return !r->failed;
+}
+
+static bool SevenZip_AllocateSubStreams(SevenZipStreamsInfo* info)
+{
+	uint64_t total = 0;
+
+	for (uint64_t i = 0; i < info->numFolders; ++i)
+	{
+		total += info->folders[i].numSubStreams;
+		if (total > SEVEN_ZIP_MAX_SUBSTREAMS)
+			return false;
+	}
+
+	info->numSubStreams = total;
+	info->subStreamSizes = calloc((size_t) total + 1, sizeof(uint64_t));
+	info->subStreamCrcs = calloc((size_t) total + 1, sizeof(uint32_t));
+	info->subStreamHasCrc = calloc((size_t) total + 1, sizeof(bool));
+
+	if (!info->subStreamSizes || !info->subStreamCrcs || !info->subStreamHasCrc)
+	{
+		CSE_LOG_ERROR("Allocation failed");
+		return false;
+	}
+
+	// Defaults for folders holding a single stream
+	uint64_t k = 0;
+	for (uint64_t i = 0; i < info->numFolders; ++i)
+	{
+		SevenZipFolder* folder = &info->folders[i];
+		if (folder->numSubStreams == 1)
+		{
+			info->subStreamSizes[k] = folder->unpackSize;
+			info->subStreamCrcs[k] = folder->crc;
+			info->subStreamHasCrc[k] = folder->hasCrc;
+		}
+		k += folder->numSubStreams;
+	}
+
+	return true;
+}
+
+static bool SevenZip_ReadSubStreamsInfo(HeaderReader* r, SevenZipStreamsInfo* info)
+{
+	uint64_t id = HeaderReader_ReadNumber(r);
+
+	if (id == SEVEN_ZIP_ID_NUM_UNPACK_STREAM)
+	{
+		for (uint64_t i = 0; i < info->numFolders; ++i)
+			info->folders[i].numSubStreams = HeaderReader_ReadNumber(r);
+		id = HeaderReader_ReadNumber(r);
+	}
+
+	if (r->failed || !SevenZip_AllocateSubStreams(info))
+		return false;
+
+	uint64_t k = 0;
+	for (uint64_t i = 0; i < info->numFolders; ++i)
+	{
+		SevenZipFolder* folder = &info->folders[i];
+		if (folder->numSubStreams == 0)
+			continue;
+
+		uint64_t sum = 0;
+		if (id == SEVEN_ZIP_ID_SIZE)
+		{
+			for (uint64_t j = 1; j < folder->numSubStreams; ++j)
+			{
+				uint64_t size = HeaderReader_ReadNumber(r);
+				info->subStreamSizes[k++] = size;
+				sum += size;
+				if (sum > folder->unpackSize)
+					return false;
+			}
+		}
+		else if (folder->numSubStreams != 1)
+		{
+			return false;
+		}
+
+		info->subStreamSizes[k++] = folder->unpackSize - sum;
+	}
+
+	if (id == SEVEN_ZIP_ID_SIZE)
+		id = HeaderReader_ReadNumber(r);
+
+	while (!r->failed && (id != SEVEN_ZIP_ID_END))
+	{
+		if (id == SEVEN_ZIP_ID_CRC)
+		{
+			// Digests are only stored for streams not covered by folder CRC
+			uint64_t numUnknown = 0;
+			for (uint64_t i = 0; i < info->numFolders; ++i)
+			{
+				SevenZipFolder* folder = &info->folders[i];
+				if ((folder->numSubStreams != 1) || !folder->hasCrc)
+					numUnknown += folder->numSubStreams;
+			}
+
+			bool* defined = calloc((size_t) numUnknown + 1, sizeof(bool));
+			uint32_t* crcs = calloc((size_t) numUnknown + 1, sizeof(uint32_t));
+			if (defined && crcs && HeaderReader_ReadDigests(r, numUnknown, defined, crcs))
+			{
+				uint64_t stream = 0;
+				uint64_t digest = 0;
+				for (uint64_t i = 0; i < info->numFolders; ++i)
+				{
+					SevenZipFolder* folder = &info->folders[i];
+					if ((folder->numSubStreams == 1) && folder->hasCrc)
+					{
+						stream++;
+						continue;
+					}
+
+					for (uint64_t j = 0; j < folder->numSubStreams; ++j)
+					{
+						info->subStreamHasCrc[stream] = defined[digest];
+						info->subStreamCrcs[stream] = crcs[digest];
+						stream++;
+						digest++;
+					}
+				}
+			}
+			else
+			{
+				r->failed = true;
+			}
+			free(defined);
+			free(crcs);
+		}
+		else
+		{
+			HeaderReader_SkipData(r);
+		}
+
+		id = HeaderReader_ReadNumber(r);
+	}
+
+	return !r->failed;
+}
+
+static bool SevenZip_ReadStreamsInfo(HeaderReader* r, SevenZipStreamsInfo* info)
+{
+	bool hasSubStreamsInfo = false;
+	uint64_t id = HeaderReader_ReadNumber(r);
+
+	if (id == SEVEN_ZIP_ID_PACK_INFO)
+	{
+		if (!SevenZip_ReadPackInfo(r, info))
+			return false;
+		id = HeaderReader_ReadNumber(r);
+	}
+
+	if (id == SEVEN_ZIP_ID_UNPACK_INFO)
+	{
+		if (!SevenZip_ReadUnpackInfo(r, info))
+			return false;
+		id = HeaderReader_ReadNumber(r);
+	}
+
+	if (id == SEVEN_ZIP_ID_SUBSTREAMS_INFO)
+	{
+		if (!SevenZip_ReadSubStreamsInfo(r, info))
+			return false;
+		hasSubStreamsInfo = true;
+		id = HeaderReader_ReadNumber(r);
+	}
+
+	if (!hasSubStreamsInfo && !SevenZip_AllocateSubStreams(info))
+		return false;
+
+	return !r->failed && (id == SEVEN_ZIP_ID_END);
+}
+
+static bool SevenZip_ReadNames(HeaderReader* r, size_t end, SevenZipFilesInfo* info)
+{
+	for (uint64_t i = 0; i < info->numFiles; ++i)
+	{
+		size_t nameStart = r->pos;
+		size_t nameLength = 0;
+
+		while (true)
+		{
+			if ((r->pos + 2) > end)
+				return false;
+
+			uint16_t ch = (uint16_t)(r->data[r->pos] | (r->data[r->pos + 1] << 8));
+			r->pos += 2;
+
+			if (ch == 0)
+				break;
+
+			nameLength++;
+		}
+
+		uint16_t* nameW = calloc(nameLength + 1, sizeof(uint16_t));
+		if (!nameW)
+		{
+			CSE_LOG_ERROR("Allocation failed");
+			return false;
+		}
+
+		for (size_t j = 0; j < nameLength; ++j)
+		{
+			const uint8_t* ch = r->data + nameStart + j * 2;
+			nameW[j] = (uint16_t)(ch[0] | (ch[1] << 8));
+		}
+
+		info->names[i] = LzUnicode_UTF16toUTF8_dup(nameW);
+		free(nameW);
+
+		if (!info->names[i])
+			return false;
+	}
+
+	return true;
+}
+
+static bool SevenZip_ReadFilesInfo(HeaderReader* r, SevenZipFilesInfo* info)
+{
+	bool hasNames = false;
+
+	info->numFiles = HeaderReader_ReadNumber(r);
+	if (!HeaderReader_IsValidCount(r, info->numFiles))
+		return false;
+
+	info->emptyStream = calloc((size_t) info->numFiles + 1, sizeof(bool));
+	info->names = calloc((size_t) info->numFiles + 1, sizeof(char*));
+	if (!info->emptyStream || !info->names)
+	{
+		CSE_LOG_ERROR("Allocation failed");
+		return false;
+	}
+
+	while (true)
+	{
+		uint64_t type = HeaderReader_ReadNumber(r);
+		if (r->failed)
+			return false;
+		if (type == SEVEN_ZIP_ID_END)
+			break;
+
+		uint64_t size = HeaderReader_ReadNumber(r);
+		if (r->failed || (size > (r->size - r->pos)))
+			return false;
+
+		size_t propertyEnd = r->pos + (size_t) size;
+
+		if (type == SEVEN_ZIP_ID_EMPTY_STREAM)
+		{
+			HeaderReader_ReadBitVector(r, info->numFiles, info->emptyStream);
+		}
+		else if (type == SEVEN_ZIP_ID_NAME)
+		{
+			if (HeaderReader_ReadByte(r) != 0)
+				return false;
+			if (!SevenZip_ReadNames(r, propertyEnd, info))
+				return false;
+			hasNames = true;
+		}
+
+		if (r->failed || (r->pos > propertyEnd))
+			return false;
+
+		r->pos = propertyEnd;
+	}
+
+	return hasNames;
+}
+
+// Offset of the first packed stream of the folder from the archive start
+static bool SevenZip_GetFolderDataOffset(SevenZipStreamsInfo* streams, uint64_t folder, uint64_t* offset)
+{
+	uint64_t firstPackedStream = streams->folders[folder].firstPackedStream;
+
+	if (firstPackedStream >= streams->numPackStreams)
+		return false;
+
+	*offset = SEVEN_ZIP_SIGNATURE_HEADER_SIZE + streams->packPos;
+	for (uint64_t i = 0; i < firstPackedStream; ++i)
+		*offset += streams->packSizes[i];
+
+	return true;
+}
+
+static bool WaykCseBundleIndex_Build(
+	WaykCseBundleIndex* ctx,
+	SevenZipStreamsInfo* streams,
+	SevenZipFilesInfo* files)
+{
+	uint64_t folder = 0;
+	uint64_t streamInFolder = 0;
+	uint64_t stream = 0;
+	uint64_t folderDataOffset = 0;
+
+	ctx->entries = calloc((size_t) files->numFiles + 1, sizeof(WaykCseBundleIndexEntry));
+	if (!ctx->entries)
+	{
+		CSE_LOG_ERROR("Allocation failed");
+		return false;
+	}
+
+	for (uint64_t i = 0; i < files->numFiles; ++i)
+	{
+		WaykCseBundleIndexEntry* entry = &ctx->entries[ctx->entryCount++];
+
+		entry->name = files->names[i];
+		files->names[i] = 0;
+		entry->archiveIndex = (int) i;
+		entry->folderIndex = -1;
+
+		if (files->emptyStream[i])
+			continue;
+
+		while ((folder < streams->numFolders)
+			&& (streamInFolder >= streams->folders[folder].numSubStreams))
+		{
+			folder++;
+			streamInFolder = 0;
+		}
+
+		if ((folder >= streams->numFolders) || (stream >= streams->numSubStreams))
+			return false;
+
+		entry->folderIndex = (int) folder;
+		entry->size = streams->subStreamSizes[stream];
+		entry->crc = streams->subStreamCrcs[stream];
+		entry->hasCrc = streams->subStreamHasCrc[stream];
+
+		if (streams->folders[folder].isCopy)
+		{
+			if (streamInFolder == 0)
+			{
+				if (!SevenZip_GetFolderDataOffset(streams, folder, &folderDataOffset))
+					return false;
+			}
+
+			entry->isStored = true;
+			entry->dataOffset = folderDataOffset;
+			entry->packedSize = entry->size;
+			folderDataOffset += entry->size;
+		}
+
+		stream++;
+		streamInFolder++;
+	}
+
+	return true;
+}
+
+WaykCseBundleIndex* WaykCseBundleIndex_Parse(const uint8_t* data, size_t size)
+{
+	WaykCseBundleIndex* result = 0;
+	WaykCseBundleIndex* index = 0;
+	SevenZipStreamsInfo streams;
+	SevenZipFilesInfo files;
+	HeaderReader signatureReader;
+	HeaderReader r;
+
+	memset(&streams, 0, sizeof(SevenZipStreamsInfo));
+	memset(&files, 0, sizeof(SevenZipFilesInfo));
+
+	if (!data
+		|| (size < SEVEN_ZIP_SIGNATURE_HEADER_SIZE)
+		|| (memcmp(data, SEVEN_ZIP_SIGNATURE, sizeof(SEVEN_ZIP_SIGNATURE)) != 0))
+	{
+		CSE_LOG_ERROR("Bundle has invalid 7z signature");
+		goto cleanup;
+	}
+
+	memset(&signatureReader, 0, sizeof(HeaderReader));
+	signatureReader.data = data + 12;
+	signatureReader.size = 16;
+	uint64_t nextHeaderOffset = (uint64_t) HeaderReader_ReadUInt32(&signatureReader);
+	nextHeaderOffset |= ((uint64_t) HeaderReader_ReadUInt32(&signatureReader)) << 32;
+	uint64_t nextHeaderSize = (uint64_t) HeaderReader_ReadUInt32(&signatureReader);
+	nextHeaderSize |= ((uint64_t) HeaderReader_ReadUInt32(&signatureReader)) << 32;
+
+	size_t available = size - SEVEN_ZIP_SIGNATURE_HEADER_SIZE;
+	if ((nextHeaderOffset > available) || (nextHeaderSize > (available - nextHeaderOffset)))
+	{
+		CSE_LOG_ERROR("Bundle 7z header is out of bounds");
+		goto cleanup;
+	}
+
+	memset(&r, 0, sizeof(HeaderReader));
+	r.data = data + SEVEN_ZIP_SIGNATURE_HEADER_SIZE + nextHeaderOffset;
+	r.size = (size_t) nextHeaderSize;
+
+	uint64_t id = HeaderReader_ReadNumber(&r);
+	if (id == SEVEN_ZIP_ID_ENCODED_HEADER)
+	{
+		CSE_LOG_DEBUG("Bundle 7z header is compressed, entry index is not available");
+		goto cleanup;
+	}
+
+	if (id != SEVEN_ZIP_ID_HEADER)
+	{
+		CSE_LOG_ERROR("Bundle has invalid 7z header");
+		goto cleanup;
+	}
+
+	id = HeaderReader_ReadNumber(&r);
+	if (id == SEVEN_ZIP_ID_ARCHIVE_PROPERTIES)
+	{
+		while (!r.failed && (HeaderReader_ReadNumber(&r) != SEVEN_ZIP_ID_END))
+			HeaderReader_SkipData(&r);
+		id = HeaderReader_ReadNumber(&r);
+	}
+
+	if (id == SEVEN_ZIP_ID_ADDITIONAL_STREAMS_INFO)
+	{
+		CSE_LOG_DEBUG("Bundle 7z header uses additional streams, entry index is not available");
+		goto cleanup;
+	}
+
+	if (id == SEVEN_ZIP_ID_MAIN_STREAMS_INFO)
+	{
+		if (!SevenZip_ReadStreamsInfo(&r, &streams))
+		{
+			CSE_LOG_ERROR("Failed to read bundle 7z streams info");
+			goto cleanup;
+		}
+		id = HeaderReader_ReadNumber(&r);
+	}
+
+	if (id == SEVEN_ZIP_ID_FILES_INFO)
+	{
+		if (!SevenZip_ReadFilesInfo(&r, &files))
+		{
+			CSE_LOG_ERROR("Failed to read bundle 7z files info");
+			goto cleanup;
+		}
+		id = HeaderReader_ReadNumber(&r);
+	}
+
+	if (r.failed || (id != SEVEN_ZIP_ID_END))
+	{
+		CSE_LOG_ERROR("Bundle has invalid 7z header");
+		goto cleanup;
+	}
+
+	index = calloc(1, sizeof(WaykCseBundleIndex));
+	if (!index)
+	{
+		CSE_LOG_ERROR("Allocation failed");
+		goto cleanup;
+	}
+
+	if (!WaykCseBundleIndex_Build(index, &streams, &files))
+	{
+		CSE_LOG_ERROR("Bundle 7z files do not match its streams");
+		goto cleanup;
+	}
+
+	for (int i = 0; i < index->entryCount; ++i)
+	{
+		WaykCseBundleIndexEntry* entry = &index->entries[i];
+
+		entry->codec = WAYK_CSE_BUNDLE_CODEC_7Z;
+		if (!entry->isStored)
+		{
+			entry->dataOffset = 0;
+			entry->packedSize = size;
+		}
+		else if ((entry->dataOffset > size) || (entry->size > (size - entry->dataOffset)))
+		{
+			CSE_LOG_ERROR("Bundle entry %s is out of bounds", entry->name);
+			goto cleanup;
+		}
+
+		CSE_LOG_TRACE(
+			"Bundle entry #%d %s (block %d, %llu bytes%s)",
+			entry->archiveIndex,
+			entry->name,
+			entry->folderIndex,
+			(unsigned long long) entry->size,
+			entry->isStored ? ", stored" : "");
+	}
+
+	result = index;
+	index = 0;
+
+cleanup:
+	if (index)
+		WaykCseBundleIndex_Free(index);
+	SevenZipStreamsInfo_Free(&streams);
+	SevenZipFilesInfo_Free(&files);
+
+	return result;
+}
+
+WaykCseBundleIndex* WaykCseBundleIndex_ParseToc(const uint8_t* toc, size_t tocSize, size_t payloadSize)
+{
+	WaykCseBundleIndex* result = 0;
+	WaykCseBundleIndex* index = 0;
+	HeaderReader r;
+
+	if (!toc
+		|| (tocSize < BUNDLE_TOC_HEADER_SIZE)
+		|| (memcmp(toc, BUNDLE_TOC_MAGIC, BUNDLE_TOC_MAGIC_SIZE) != 0))
+	{
+		CSE_LOG_ERROR("Bundle table of contents has invalid signature");
+		goto cleanup;
+	}
+
+	memset(&r, 0, sizeof(HeaderReader));
+	r.data = toc;
+	r.size = tocSize;
+	r.pos = BUNDLE_TOC_MAGIC_SIZE;
+
+	uint16_t version = HeaderReader_ReadUInt16(&r);
+	uint16_t recordSize = HeaderReader_ReadUInt16(&r);
+	uint32_t entryCount = HeaderReader_ReadUInt32(&r);
+
+	if ((version != BUNDLE_TOC_VERSION) || (recordSize != BUNDLE_TOC_RECORD_SIZE))
+	{
+		CSE_LOG_ERROR("Bundle table of contents version %d is not supported", (int) version);
+		goto cleanup;
+	}
+
+	if ((uint64_t) entryCount * recordSize > (uint64_t)(tocSize - BUNDLE_TOC_HEADER_SIZE))
+	{
+		CSE_LOG_ERROR("Bundle table of contents is truncated");
+		goto cleanup;
+	}
+
+	index = calloc(1, sizeof(WaykCseBundleIndex));
+	if (!index)
+	{
+		CSE_LOG_ERROR("Allocation failed");
+		goto cleanup;
+	}
+
+	index->entries = calloc((size_t) entryCount + 1, sizeof(WaykCseBundleIndexEntry));
+	if (!index->entries)
+	{
+		CSE_LOG_ERROR("Allocation failed");
+		goto cleanup;
+	}
+
+	for (uint32_t i = 0; i < entryCount; ++i)
+	{
+		const uint8_t* record = toc + BUNDLE_TOC_HEADER_SIZE + (size_t) i * recordSize;
+
+		// Name is null-padded, the last byte of the field is always a terminator
+		if ((record[0] == '\0') || (record[BUNDLE_TOC_NAME_SIZE - 1] != '\0'))
+		{
+			CSE_LOG_ERROR("Bundle table of contents has invalid entry name");
+			goto cleanup;
+		}
+
+		WaykCseBundleIndexEntry* entry = &index->entries[index->entryCount++];
+
+		entry->name = _strdup((const char*) record);
+		if (!entry->name)
+		{
+			CSE_LOG_ERROR("Allocation failed");
+			goto cleanup;
+		}
+
+		memset(&r, 0, sizeof(HeaderReader));
+		r.data = record + BUNDLE_TOC_NAME_SIZE;
+		r.size = recordSize - BUNDLE_TOC_NAME_SIZE;
+
+		entry->archiveIndex = 0;
+		entry->folderIndex = (int) i;
+		entry->dataOffset = HeaderReader_ReadUInt64(&r);
+		entry->packedSize = HeaderReader_ReadUInt64(&r);
+		entry->size = HeaderReader_ReadUInt64(&r);
+		entry->crc = HeaderReader_ReadUInt32(&r);
+		entry->hasCrc = true;
+		entry->codec = HeaderReader_ReadUInt16(&r);
+		entry->isStored = (HeaderReader_ReadUInt16(&r) & BUNDLE_TOC_FLAG_STORED) != 0;
+		memcpy(entry->sha256, r.data + r.pos, CSE_SHA256_DIGEST_SIZE);
+		entry->hasSha256 = true;
+
+		if ((entry->dataOffset > payloadSize) || (entry->packedSize > (payloadSize - entry->dataOffset)))
+		{
+			CSE_LOG_ERROR("Bundle entry %s is out of bounds", entry->name);
+			goto cleanup;
+		}
+
+		if (entry->isStored && (entry->packedSize != entry->size))
+		{
+			CSE_LOG_ERROR("Bundle entry %s has invalid size", entry->name);
+			goto cleanup;
+		}
+
+		CSE_LOG_TRACE(
+			"Bundle entry #%d %s (%llu bytes, %llu packed, codec %d%s)",
+			(int) i,
+			entry->name,
+			(unsigned long long) entry->size,
+			(unsigned long long) entry->packedSize,
+			(int) entry->codec,
+			entry->isStored ? ", stored" : "");
+	}
+
+	result = index;
+	index = 0;
+
+cleanup:
+	if (index)
+		WaykCseBundleIndex_Free(index);
+
+	return result;
+}
+
+void WaykCseBundleIndex_Free(WaykCseBundleIndex* ctx)
+{
+	if (ctx->entries)
+	{
+		for (int i = 0; i < ctx->entryCount; ++i)
+			free(ctx->entries[i].name);
+		free(ctx->entries);
+	}
+
+	free(ctx);
+}
+
+int WaykCseBundleIndex_GetCount(WaykCseBundleIndex* ctx)
+{
+	return ctx->entryCount;
+}
+
+const WaykCseBundleIndexEntry* WaykCseBundleIndex_GetEntry(WaykCseBundleIndex* ctx, int index)
+{
+	if ((index < 0) || (index >= ctx->entryCount))
+		return 0;
+
+	return &ctx->entries[index];
+}
+
+const WaykCseBundleIndexEntry* WaykCseBundleIndex_Find(WaykCseBundleIndex* ctx, const char* name)
+{
+	for (int i = 0; i < ctx->entryCount; ++i)
+	{
+		if (strcmp(ctx->entries[i].name, name) == 0)
+			return &ctx->entries[i];
+	}
+
+	return 0;
+}
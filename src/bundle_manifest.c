@@ -0,0 +1,285 @@
+#include <cse/bundle_manifest.h>
+#include <cse/log.h>
+
+#include <lizard/lizard.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CSE_LOG_TAG "WaykCseBundleManifest"
+
+#define MANIFEST_FILE_NAME "bundle.manifest"
+#define MANIFEST_HEADER "WaykCseBundleManifest 1"
+
+typedef struct
+{
+	char* name;
+	uint64_t size;
+	uint32_t crc;
+	uint64_t writeTime;
+} ManifestRecord;
+
+struct waykcse_bundle_manifest
+{
+	char path[LZ_MAX_PATH];
+	char folder[LZ_MAX_PATH];
+	ManifestRecord* records;
+	int recordCount;
+	int recordCapacity;
+	bool modified;
+};
+
+static bool GetFileStamp(const char* path, uint64_t* size, uint64_t* writeTime)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	bool result = false;
+
+	WCHAR* pathW = LzUnicode_UTF8toUTF16_dup(path);
+	if (!pathW)
+		return false;
+
+	if (GetFileAttributesExW(pathW, GetFileExInfoStandard, &attributes))
+	{
+		*size = ((uint64_t) attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+		*writeTime = ((uint64_t) attributes.ftLastWriteTime.dwHighDateTime << 32)
+			| attributes.ftLastWriteTime.dwLowDateTime;
+		result = true;
+	}
+
+	free(pathW);
+	return result;
+}
+
+static ManifestRecord* WaykCseBundleManifest_Find(WaykCseBundleManifest* ctx, const char* fileName)
+{
+	for (int i = 0; i < ctx->recordCount; ++i)
+	{
+		if (strcmp(ctx->records[i].name, fileName) == 0)
+			return &ctx->records[i];
+	}
+
+	return 0;
+}
+
+static ManifestRecord* WaykCseBundleManifest_Add(WaykCseBundleManifest* ctx, const char* fileName)
+{
+	if (ctx->recordCount == ctx->recordCapacity)
+	{
+		int newCapacity = ctx->recordCapacity ? ctx->recordCapacity * 2 : 8;
+		ManifestRecord* newRecords = realloc(ctx->records, newCapacity * sizeof(ManifestRecord));
+		if (!newRecords)
+		{
+			CSE_LOG_ERROR("Allocation failed");
+			return 0;
+		}
+
+		ctx->records = newRecords;
+		ctx->recordCapacity = newCapacity;
+	}
+
+	ManifestRecord* record = &ctx->records[ctx->recordCount];
+	memset(record, 0, sizeof(ManifestRecord));
+	record->name = _strdup(fileName);
+	if (!record->name)
+	{
+		CSE_LOG_ERROR("Allocation failed");
+		return 0;
+	}
+
+	ctx->recordCount++;
+	return record;
+}
+
+static void WaykCseBundleManifest_Parse(WaykCseBundleManifest* ctx, FILE* fp)
+{
+	char line[LZ_MAX_PATH + 64];
+
+	if (!fgets(line, sizeof(line), fp) || (strncmp(line, MANIFEST_HEADER, strlen(MANIFEST_HEADER)) != 0))
+	{
+		CSE_LOG_DEBUG("Extraction manifest has unknown format, ignoring it");
+		return;
+	}
+
+	while (fgets(line, sizeof(line), fp))
+	{
+		unsigned int crc = 0;
+		unsigned long long size = 0;
+		unsigned long long writeTime = 0;
+		int nameOffset = 0;
+
+		line[strcspn(line, "\r\n")] = '\0';
+
+		if ((sscanf(line, "%8x %llu %llu %n", &crc, &size, &writeTime, &nameOffset) != 3)
+			|| (line[nameOffset] == '\0'))
+		{
+			CSE_LOG_DEBUG("Skipping invalid extraction manifest line");
+			continue;
+		}
+
+		ManifestRecord* record = WaykCseBundleManifest_Add(ctx, line + nameOffset);
+		if (!record)
+			return;
+
+		record->crc = crc;
+		record->size = size;
+		record->writeTime = writeTime;
+	}
+}
+
+WaykCseBundleManifest* WaykCseBundleManifest_Load(const char* folder)
+{
+	WaykCseBundleManifest* manifest = calloc(1, sizeof(WaykCseBundleManifest));
+	WCHAR* pathW = 0;
+	FILE* fp = 0;
+
+	if (!manifest)
+	{
+		CSE_LOG_ERROR("Allocation failed");
+		return 0;
+	}
+
+	strcpy_s(manifest->folder, sizeof(manifest->folder), folder);
+	LzPathCchAppend(manifest->path, sizeof(manifest->path), folder);
+	LzPathCchAppend(manifest->path, sizeof(manifest->path), MANIFEST_FILE_NAME);
+
+	pathW = LzUnicode_UTF8toUTF16_dup(manifest->path);
+	if (pathW)
+	{
+		fp = _wfopen(pathW, L"r");
+		free(pathW);
+	}
+
+	if (fp)
+	{
+		WaykCseBundleManifest_Parse(manifest, fp);
+		fclose(fp);
+	}
+
+	return manifest;
+}
+
+void WaykCseBundleManifest_Free(WaykCseBundleManifest* ctx)
+{
+	if (ctx->records)
+	{
+		for (int i = 0; i < ctx->recordCount; ++i)
+			free(ctx->records[i].name);
+		free(ctx->records);
+	}
+
+	free(ctx);
+}
+
+bool WaykCseBundleManifest_IsUpToDate(
+	WaykCseBundleManifest* ctx,
+	const char* fileName,
+	uint64_t size,
+	uint32_t crc)
+{
+	char path[LZ_MAX_PATH];
+	uint64_t fileSize = 0;
+	uint64_t fileWriteTime = 0;
+
+	ManifestRecord* record = WaykCseBundleManifest_Find(ctx, fileName);
+	if (!record || (record->crc != crc) || (record->size != size))
+		return false;
+
+	path[0] = '\0';
+	LzPathCchAppend(path, sizeof(path), ctx->folder);
+	LzPathCchAppend(path, sizeof(path), fileName);
+
+	if (!GetFileStamp(path, &fileSize, &fileWriteTime))
+		return false;
+
+	// Extracted file stamp is recorded right after it was written; any later
+	// change of the file content updates its last write time
+	return (fileSize == record->size) && (fileWriteTime == record->writeTime);
+}
+
+bool WaykCseBundleManifest_Update(WaykCseBundleManifest* ctx, const char* fileName, uint32_t crc)
+{
+	char path[LZ_MAX_PATH];
+	uint64_t fileSize = 0;
+	uint64_t fileWriteTime = 0;
+
+	path[0] = '\0';
+	LzPathCchAppend(path, sizeof(path), ctx->folder);
+	LzPathCchAppend(path, sizeof(path), fileName);
+
+	if (!GetFileStamp(path, &fileSize, &fileWriteTime))
+	{
+		WaykCseBundleManifest_Remove(ctx, fileName);
+		return false;
+	}
+
+	ManifestRecord* record = WaykCseBundleManifest_Find(ctx, fileName);
+	if (!record)
+		record = WaykCseBundleManifest_Add(ctx, fileName);
+	if (!record)
+		return false;
+
+	record->crc = crc;
+	record->size = fileSize;
+	record->writeTime = fileWriteTime;
+	ctx->modified = true;
+
+	return true;
+}
+
+void WaykCseBundleManifest_Remove(WaykCseBundleManifest* ctx, const char* fileName)
+{
+	ManifestRecord* record = WaykCseBundleManifest_Find(ctx, fileName);
+	if (!record)
+		return;
+
+	free(record->name);
+	*record = ctx->records[ctx->recordCount - 1];
+	ctx->recordCount--;
+	ctx->modified = true;
+}
+
+bool WaykCseBundleManifest_Save(WaykCseBundleManifest* ctx)
+{
+	FILE* fp = 0;
+	bool result = false;
+
+	if (!ctx->modified)
+		return true;
+
+	WCHAR* pathW = LzUnicode_UTF8toUTF16_dup(ctx->path);
+	if (!pathW)
+		return false;
+
+	fp = _wfopen(pathW, L"w");
+	free(pathW);
+
+	if (!fp)
+	{
+		CSE_LOG_WARN("Failed to write extraction manifest %s", ctx->path);
+		return false;
+	}
+
+	result = fprintf(fp, "%s\n", MANIFEST_HEADER) > 0;
+	for (int i = 0; result && (i < ctx->recordCount); ++i)
+	{
+		ManifestRecord* record = &ctx->records[i];
+		result = fprintf(
+			fp,
+			"%08x %llu %llu %s\n",
+			record->crc,
+			(unsigned long long) record->size,
+			(unsigned long long) record->writeTime,
+			record->name) > 0;
+	}
+
+	if (fclose(fp) != 0)
+		result = false;
+
+	if (result)
+		ctx->modified = false;
+	else
+		CSE_LOG_WARN("Failed to write extraction manifest %s", ctx->path);
+
+	return result;
+}
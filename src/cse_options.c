@@ -81,6 +81,17 @@ struct cse_options
 	char* installPath;
 	char* enrollmentUrl;
 	char* enrollmentToken;
+	size_t extractionMemoryLimit;
+	int downloadConnections;
+	size_t downloadSegmentSize;
+	char* downloadCacheDirectory;
+	char** downloadMirrors;
+	int downloadMirrorCount;
+	uint64_t downloadMaxRate;
+	size_t downloadBurstSize;
+	bool downloadLowPriority;
+	uint32_t downloadStallThreshold;
+	char* downloadSummaryFile;
 	WaykNowConfigOption* waykOptions;
 };
 
@@ -144,6 +155,20 @@ void CseOptions_Free(CseOptions* ctx)
 	{
 		free(ctx->enrollmentUrl);
 	}
+	if (ctx->downloadCacheDirectory)
+	{
+		free(ctx->downloadCacheDirectory);
+	}
+	if (ctx->downloadMirrors)
+	{
+		for (int i = 0; i < ctx->downloadMirrorCount; ++i)
+			free(ctx->downloadMirrors[i]);
+		free(ctx->downloadMirrors);
+	}
+	if (ctx->downloadSummaryFile)
+	{
+		free(ctx->downloadSummaryFile);
+	}
 	if (ctx->waykOptions)
 	{
 		WaykNowConfigOption_FreeRecursive(ctx->waykOptions);
@@ -242,6 +267,113 @@ static CseOptionsResult CseOptions_ParseCseKnownCseOptions(CseOptions* ctx, JSON
 		}
 		CSE_LOG_TRACE("Found option -> enrollment.token: %s", enrollmentToken);
 	}
+
+	// Megabytes; missing or non-positive value means no limit
+	double memoryLimit = lz_json_object_dotget_number(root, "extraction.memoryLimit");
+	if (memoryLimit >= 1)
+	{
+		CSE_LOG_TRACE("Found option -> extraction.memoryLimit: %d", (int) memoryLimit);
+		ctx->extractionMemoryLimit = (size_t) memoryLimit * 1024 * 1024;
+	}
+
+	double connections = lz_json_object_dotget_number(root, "download.connections");
+	if (connections >= 1)
+	{
+		CSE_LOG_TRACE("Found option -> download.connections: %d", (int) connections);
+		ctx->downloadConnections = (int) connections;
+	}
+
+	// Megabytes
+	double segmentSize = lz_json_object_dotget_number(root, "download.segmentSize");
+	if (segmentSize >= 1)
+	{
+		CSE_LOG_TRACE("Found option -> download.segmentSize: %d", (int) segmentSize);
+		ctx->downloadSegmentSize = (size_t) segmentSize * 1024 * 1024;
+	}
+
+	const char* cacheDirectory = lz_json_object_dotget_string(root, "download.cacheDirectory");
+	if (cacheDirectory)
+	{
+		ctx->downloadCacheDirectory = _strdup(cacheDirectory);
+		if (!ctx->downloadCacheDirectory)
+		{
+			CSE_LOG_ERROR("Allocation failed");
+			return CSE_OPTIONS_NOMEM;
+		}
+		CSE_LOG_TRACE("Found option -> download.cacheDirectory: %s", cacheDirectory);
+	}
+
+	JSON_Array* mirrors = lz_json_object_dotget_array(root, "download.mirrors");
+	if (mirrors && lz_json_array_get_count(mirrors))
+	{
+		int mirrorCount = (int) lz_json_array_get_count(mirrors);
+
+		ctx->downloadMirrors = calloc(mirrorCount, sizeof(char*));
+		if (!ctx->downloadMirrors)
+		{
+			CSE_LOG_ERROR("Allocation failed");
+			return CSE_OPTIONS_NOMEM;
+		}
+
+		for (int i = 0; i < mirrorCount; ++i)
+		{
+			const char* mirror = lz_json_array_get_string(mirrors, i);
+			if (!mirror)
+				continue;
+
+			ctx->downloadMirrors[ctx->downloadMirrorCount] = _strdup(mirror);
+			if (!ctx->downloadMirrors[ctx->downloadMirrorCount])
+			{
+				CSE_LOG_ERROR("Allocation failed");
+				return CSE_OPTIONS_NOMEM;
+			}
+			ctx->downloadMirrorCount++;
+			CSE_LOG_TRACE("Found option -> download.mirrors: %s", mirror);
+		}
+	}
+
+	// Kilobytes per second
+	double maxRate = lz_json_object_dotget_number(root, "download.maxRate");
+	if (maxRate >= 1)
+	{
+		CSE_LOG_TRACE("Found option -> download.maxRate: %d", (int) maxRate);
+		ctx->downloadMaxRate = (uint64_t) maxRate * 1024;
+	}
+
+	// Kilobytes
+	double burstSize = lz_json_object_dotget_number(root, "download.burstSize");
+	if (burstSize >= 1)
+	{
+		CSE_LOG_TRACE("Found option -> download.burstSize: %d", (int) burstSize);
+		ctx->downloadBurstSize = (size_t) burstSize * 1024;
+	}
+
+	int lowPriority = lz_json_object_dotget_boolean(root, "download.lowPriority");
+	if (lowPriority >= 0)
+	{
+		CSE_LOG_TRACE("Found option -> download.lowPriority: %d", lowPriority);
+		ctx->downloadLowPriority = lowPriority;
+	}
+
+	// Seconds
+	double stallThreshold = lz_json_object_dotget_number(root, "download.stallThreshold");
+	if (stallThreshold >= 1)
+	{
+		CSE_LOG_TRACE("Found option -> download.stallThreshold: %d", (int) stallThreshold);
+		ctx->downloadStallThreshold = (uint32_t) stallThreshold * 1000;
+	}
+
+	const char* summaryFile = lz_json_object_dotget_string(root, "download.summaryFile");
+	if (summaryFile)
+	{
+		ctx->downloadSummaryFile = _strdup(summaryFile);
+		if (!ctx->downloadSummaryFile)
+		{
+			CSE_LOG_ERROR("Allocation failed");
+			return CSE_OPTIONS_NOMEM;
+		}
+		CSE_LOG_TRACE("Found option -> download.summaryFile: %s", summaryFile);
+	}
 	return CSE_OPTIONS_OK;
 }
 
@@ -447,6 +579,57 @@ const char* CseOptions_GetEnrollmentToken(CseOptions* ctx)
 	return ctx->enrollmentToken;
 }
 
+size_t CseOptions_GetExtractionMemoryLimit(CseOptions* ctx)
+{
+	return ctx->extractionMemoryLimit;
+}
+
+int CseOptions_GetDownloadConnections(CseOptions* ctx)
+{
+	return ctx->downloadConnections;
+}
+
+size_t CseOptions_GetDownloadSegmentSize(CseOptions* ctx)
+{
+	return ctx->downloadSegmentSize;
+}
+
+const char* CseOptions_GetDownloadCacheDirectory(CseOptions* ctx)
+{
+	return ctx->downloadCacheDirectory;
+}
+
+const char* const* CseOptions_GetDownloadMirrors(CseOptions* ctx, int* count)
+{
+	*count = ctx->downloadMirrorCount;
+	return (const char* const*) ctx->downloadMirrors;
+}
+
+uint64_t CseOptions_GetDownloadMaxRate(CseOptions* ctx)
+{
+	return ctx->downloadMaxRate;
+}
+
+size_t CseOptions_GetDownloadBurstSize(CseOptions* ctx)
+{
+	return ctx->downloadBurstSize;
+}
+
+bool CseOptions_DownloadLowPriority(CseOptions* ctx)
+{
+	return ctx->downloadLowPriority;
+}
+
+uint32_t CseOptions_GetDownloadStallThreshold(CseOptions* ctx)
+{
+	return ctx->downloadStallThreshold;
+}
+
+const char* CseOptions_GetDownloadSummaryFile(CseOptions* ctx)
+{
+	return ctx->downloadSummaryFile;
+}
+
 WaykNowConfigOption* CseOptions_GetFirstMsiWaykNowConfigOption(CseOptions* ctx)
 {
 	return ctx->waykOptions;
@@ -1,155 +1,3110 @@
 #include <cse/download.h>
+#include <cse/http.h>
 #include <cse/log.h>
+#include <cse/sha256.h>
 
 #include <lizard/lizard.h>
+#include <lizard/LzJson.h>
+
+#include <windows.h>
+
+#include <zstd.h>
+
+#include <stdio.h>
+#include <string.h>
 
 #define CSE_LOG_TAG "CseDownload"
 
-#define CSE_USER_AGENT "WaykCse"
+#define CSE_USER_AGENT "WaykCse"
+#define CSE_PRODUCT_INFO_URL "https://www.devolutions.net/productinfo.htm"
+#define CSE_PRODUCT_INFO_BUFFER_SIZE (16 * 1024)
+// Host of the MSI URLs published in productinfo.htm
+#define CSE_DOWNLOAD_CDN_URL "https://cdn.devolutions.net/"
+
+#define CSE_DOWNLOAD_URL_SIZE 2048
+#define CSE_DOWNLOAD_BUFFER_SIZE (64 * 1024)
+#define CSE_DOWNLOAD_MAX_ATTEMPTS 5
+#define CSE_DOWNLOAD_RETRY_DELAY 1000
+// A stalled transfer is retried from where it stopped rather than waited for
+#define CSE_DOWNLOAD_RECV_TIMEOUT (60 * 1000)
+// Source which sends nothing for this long is left for the next one, when
+// there is another one to go to (milliseconds)
+#define CSE_DOWNLOAD_FAILOVER_TIMEOUT (10 * 1000)
+// Resume state is saved at least this often, so a killed process loses little
+#define CSE_DOWNLOAD_CHECKPOINT_SIZE (4 * 1024 * 1024)
+
+// Disk writes are done in large buffers on a separate thread
+#define CSE_DOWNLOAD_SINK_BUFFER_COUNT 2
+#define CSE_DOWNLOAD_SINK_BUFFER_SIZE (1024 * 1024)
+
+// Progress is reported at most this often (milliseconds)
+#define CSE_DOWNLOAD_PROGRESS_INTERVAL 500
+// Low priority mode adjusts the rate at most this often (milliseconds)
+#define CSE_DOWNLOAD_ADJUST_INTERVAL 1000
+#define CSE_DOWNLOAD_MIN_RATE (16 * 1024)
+// Reads may wait this much longer than the shortest wait seen before the
+// low priority mode backs off (milliseconds)
+#define CSE_DOWNLOAD_LATENCY_MARGIN 50
+
+// Reads waiting longer than this for data count as stalls (milliseconds)
+#define CSE_DOWNLOAD_STALL_THRESHOLD (2 * 1000)
+// Bytes received are sampled every second, for at most this many seconds
+#define CSE_DOWNLOAD_MAX_SAMPLES 3600
+
+// Mirrors which don't answer within this time are left out (milliseconds)
+#define CSE_DOWNLOAD_PROBE_TIMEOUT (5 * 1000)
+
+#define CSE_DOWNLOAD_MAX_CONNECTIONS 16
+#define CSE_DOWNLOAD_SEGMENT_SIZE (8 * 1024 * 1024)
+
+#define CSE_DOWNLOAD_PARTIAL_SUFFIX ".partial"
+#define CSE_DOWNLOAD_RESUME_SUFFIX ".resume"
+#define CSE_DOWNLOAD_CACHE_SUFFIX ".cache"
+// Mirrors may also serve the file compressed, under its name with this suffix
+#define CSE_DOWNLOAD_COMPRESSED_SUFFIX ".zst"
+// Largest zstd window accepted from a compressed source; the decoder never
+// allocates more than the file size
+#define CSE_DOWNLOAD_ZSTD_WINDOW_LOG_MAX 30
+
+struct cse_download_session
+{
+	CseHttp* http;
+	volatile LONG refCount;  // owner and the running connect threads
+};
+
+// Hosts one connect thread goes through
+typedef struct
+{
+	CseDownloadSession* session;
+	char** urls;
+	int urlCount;
+} CseDownloadConnect;
+
+struct cse_msi_download
+{
+	WaykBinariesBitness bitness;
+	char msiPath[LZ_MAX_PATH];
+	CseDownloadOptions options;
+	CseDownloadResult result;
+	HANDLE thread;
+	volatile LONG cancel;
+};
+
+// Kept in the sidecar file next to the partial download. Cache entries use
+// the same format, received is the size of the cached file then
+typedef struct
+{
+	char url[CSE_DOWNLOAD_URL_SIZE];
+	char etag[CSE_HTTP_ETAG_SIZE];
+	char lastModified[CSE_HTTP_DATE_SIZE];
+	uint64_t received;
+} CseDownloadResumeState;
+
+typedef enum
+{
+	CSE_TRANSFER_COMPLETE,
+	CSE_TRANSFER_INTERRUPTED,  // can be continued with a range request
+	CSE_TRANSFER_FAILED,
+} CseTransferStatus;
+
+// Telemetry of a download, logged and summarized once it is over. Times are
+// in milliseconds
+typedef struct
+{
+	uint64_t start;
+	uint64_t bytes;           // received by this run, resumed data excluded
+	uint64_t* samples;        // bytes received in each second since start, NULL if not recorded
+	uint32_t sampleCount;
+	uint32_t requests;
+	uint32_t connections;     // requests which had to open a new connection
+	CseHttpTimings first;     // the first request pays for name resolution and handshakes
+	uint64_t firstByteTotal;
+	uint32_t stallThreshold;
+	uint32_t stalls;
+	uint64_t stallTime;
+	uint64_t longestStall;
+	volatile LONG64 writeBlockedTime;  // network data waiting for the disk, added by the sinks
+	char source[CSE_DOWNLOAD_URL_SIZE];  // where the file came from, empty if it didn't come from anywhere
+} CseDownloadStats;
+
+// Token bucket shared by all connections of a download. Received data is
+// paid for after it is read, a connection in debt sleeps until the bucket
+// has refilled. Also measures throughput for progress reports and telemetry
+typedef struct
+{
+	CseDownloadClock clock;
+	uint64_t maxRate;
+	uint64_t rate;        // current limit in bytes per second, 0 if not limited
+	uint64_t ceiling;     // without maxRate, throughput before the first back-off
+	int64_t burst;        // bucket size in thousandths of a byte
+	int64_t tokens;       // in thousandths of a byte, negative when in debt
+	uint64_t lastRefill;
+	bool lowPriority;
+	uint32_t minLatency;  // shortest read wait seen, UINT32_MAX before the first one
+	uint32_t latency;     // smoothed read wait
+	uint64_t lastAdjust;
+	uint64_t received;
+	uint64_t total;
+	uint64_t windowStart;
+	uint64_t windowBytes;
+	uint64_t throughput;
+	uint64_t lastProgress;
+	CseDownloadProgressFn progress;
+	void* progressParam;
+	volatile long* cancel;
+	CseDownloadStats stats;
+	SRWLOCK lock;
+} CseDownloadThrottle;
+
+static uint64_t CseDownloadThrottle_SystemNow(void* param)
+{
+	return GetTickCount64();
+}
+
+static void CseDownloadThrottle_SystemSleep(void* param, uint32_t milliseconds)
+{
+	Sleep(milliseconds);
+}
+
+static void CseDownloadThrottle_Init(CseDownloadThrottle* ctx, const CseDownloadOptions* options)
+{
+	ZeroMemory(ctx, sizeof(CseDownloadThrottle));
+
+	ctx->clock.Now = CseDownloadThrottle_SystemNow;
+	ctx->clock.Sleep = CseDownloadThrottle_SystemSleep;
+	ctx->minLatency = UINT32_MAX;
+	ctx->total = CSE_DOWNLOAD_SIZE_UNKNOWN;
+	ctx->stats.stallThreshold = CSE_DOWNLOAD_STALL_THRESHOLD;
+
+	if (options)
+	{
+		if (options->clock)
+			ctx->clock = *options->clock;
+
+		ctx->maxRate = options->maxRate;
+		ctx->rate = options->maxRate;
+		ctx->burst = (int64_t) (options->burstSize ? options->burstSize : options->maxRate) * 1000;
+		ctx->lowPriority = options->lowPriority;
+		ctx->progress = options->progress;
+		ctx->progressParam = options->progressParam;
+		ctx->cancel = options->cancel;
+
+		if (options->stallThreshold)
+			ctx->stats.stallThreshold = options->stallThreshold;
+	}
+
+	// Bucket starts full
+	ctx->tokens = ctx->burst;
+	ctx->lastRefill = ctx->clock.Now(ctx->clock.param);
+	ctx->windowStart = ctx->lastRefill;
+	ctx->lastAdjust = ctx->lastRefill;
+	ctx->stats.start = ctx->lastRefill;
+
+	// Download goes on without the samples if they can't be kept
+	ctx->stats.samples = calloc(CSE_DOWNLOAD_MAX_SAMPLES, sizeof(uint64_t));
+
+	ctx->stats.first.resolve = CSE_HTTP_TIME_NONE;
+	ctx->stats.first.connect = CSE_HTTP_TIME_NONE;
+	ctx->stats.first.tls = CSE_HTTP_TIME_NONE;
+	ctx->stats.first.firstByte = CSE_HTTP_TIME_NONE;
+
+	InitializeSRWLock(&ctx->lock);
+}
+
+static void CseDownloadThrottle_Free(CseDownloadThrottle* ctx)
+{
+	free(ctx->stats.samples);
+	ctx->stats.samples = NULL;
+}
+
+static void CseDownloadThrottle_Report(CseDownloadThrottle* ctx, uint64_t now)
+{
+	CseDownloadProgress progress;
+
+	if (!ctx->progress)
+		return;
+
+	progress.received = ctx->received;
+	progress.total = ctx->total;
+	progress.bytesPerSecond = ctx->throughput;
+
+	// Within the first second there is only the current window
+	if (!progress.bytesPerSecond && (now > ctx->windowStart))
+		progress.bytesPerSecond = ctx->windowBytes * 1000 / (now - ctx->windowStart);
+
+	ctx->progress(ctx->progressParam, &progress);
+}
+
+// Sets the file position progress continues from, after a resume or restart
+static void CseDownloadThrottle_SetPosition(CseDownloadThrottle* ctx, uint64_t received, uint64_t total)
+{
+	AcquireSRWLockExclusive(&ctx->lock);
+	ctx->received = received;
+	ctx->total = total;
+	ReleaseSRWLockExclusive(&ctx->lock);
+}
+
+// Last report of a complete download, whatever the interval
+static void CseDownloadThrottle_Complete(CseDownloadThrottle* ctx)
+{
+	AcquireSRWLockExclusive(&ctx->lock);
+	CseDownloadThrottle_Report(ctx, ctx->clock.Now(ctx->clock.param));
+	ReleaseSRWLockExclusive(&ctx->lock);
+}
+
+// Low priority mode: reads waiting longer for data than they used to mean
+// the link is busy with other traffic, the rate is lowered then. Otherwise it
+// slowly goes back up to the configured limit, or without one to the
+// throughput seen before the first back-off, where it is lifted again
+static void CseDownloadThrottle_Adjust(CseDownloadThrottle* ctx, uint64_t now)
+{
+	uint64_t rate = ctx->rate;
+
+	ctx->lastAdjust = now;
+
+	if (ctx->minLatency == UINT32_MAX)
+		return;
+
+	if (ctx->latency > ctx->minLatency + ctx->minLatency / 2 + CSE_DOWNLOAD_LATENCY_MARGIN)
+	{
+		// Unlimited download is slowed down from what it gets now
+		if (!rate && (ctx->throughput > ctx->ceiling))
+			ctx->ceiling = ctx->throughput;
+
+		rate = (rate ? rate : ctx->throughput) / 4 * 3;
+		if (rate < CSE_DOWNLOAD_MIN_RATE)
+			rate = CSE_DOWNLOAD_MIN_RATE;
+
+		if (!ctx->rate)
+		{
+			ctx->burst = (int64_t) rate * 1000;
+			ctx->tokens = 0;
+			ctx->lastRefill = now;
+		}
+	}
+	else if (rate && (!ctx->maxRate || (rate < ctx->maxRate)))
+	{
+		rate += rate / 8;
+		if (ctx->maxRate && (rate > ctx->maxRate))
+			rate = ctx->maxRate;
+		else if (!ctx->maxRate && (rate >= ctx->ceiling))
+			rate = 0;
+	}
+
+	if (rate != ctx->rate)
+	{
+		if (rate)
+			CSE_LOG_DEBUG("Download rate limit set to %llu bytes/s", (unsigned long long) rate);
+		else
+			CSE_LOG_DEBUG("Download rate limit lifted");
+
+		ctx->rate = rate;
+	}
+}
+
+static void CseDownloadThrottle_Consume(CseDownloadThrottle* ctx, size_t size)
+{
+	uint64_t now;
+	uint64_t wait = 0;
+
+	AcquireSRWLockExclusive(&ctx->lock);
+
+	now = ctx->clock.Now(ctx->clock.param);
+
+	ctx->received += size;
+	ctx->windowBytes += size;
+	ctx->stats.bytes += size;
+
+	if (ctx->stats.samples && (now - ctx->stats.start < CSE_DOWNLOAD_MAX_SAMPLES * 1000ULL))
+	{
+		uint32_t sample = (uint32_t) ((now - ctx->stats.start) / 1000);
+
+		ctx->stats.samples[sample] += size;
+		if (sample >= ctx->stats.sampleCount)
+			ctx->stats.sampleCount = sample + 1;
+	}
+
+	if (now - ctx->windowStart >= 1000)
+	{
+		ctx->throughput = ctx->windowBytes * 1000 / (now - ctx->windowStart);
+		ctx->windowStart = now;
+		ctx->windowBytes = 0;
+	}
+
+	if (ctx->lowPriority && (now - ctx->lastAdjust >= CSE_DOWNLOAD_ADJUST_INTERVAL))
+		CseDownloadThrottle_Adjust(ctx, now);
+
+	if (ctx->rate)
+	{
+		// Milliseconds times bytes per second are thousandths of a byte
+		ctx->tokens += (int64_t) ((now - ctx->lastRefill) * ctx->rate);
+		ctx->lastRefill = now;
+
+		if (ctx->tokens > ctx->burst)
+			ctx->tokens = ctx->burst;
+
+		ctx->tokens -= (int64_t) size * 1000;
+
+		if (ctx->tokens < 0)
+			wait = ((uint64_t) -ctx->tokens + ctx->rate - 1) / ctx->rate;
+	}
+
+	if (now - ctx->lastProgress >= CSE_DOWNLOAD_PROGRESS_INTERVAL)
+	{
+		ctx->lastProgress = now;
+		CseDownloadThrottle_Report(ctx, now);
+	}
+
+	ReleaseSRWLockExclusive(&ctx->lock);
+
+	if (wait)
+		ctx->clock.Sleep(ctx->clock.param, (uint32_t) wait);
+}
+
+static void CseDownloadThrottle_AddLatency(CseDownloadThrottle* ctx, uint32_t latency)
+{
+	AcquireSRWLockExclusive(&ctx->lock);
+
+	if (ctx->minLatency == UINT32_MAX)
+		ctx->latency = latency;
+	else
+		ctx->latency = (ctx->latency * 7 + latency) / 8;
+
+	if (latency < ctx->minLatency)
+		ctx->minLatency = latency;
+
+	ReleaseSRWLockExclusive(&ctx->lock);
+}
+
+static void CseDownloadThrottle_AddRequest(CseDownloadThrottle* ctx, CseHttpRequest* request)
+{
+	const CseHttpTimings* timings = CseHttpRequest_GetTimings(request);
+
+	CSE_LOG_DEBUG("Request timings: resolve %d ms, connect %d ms, TLS %d ms, first byte %d ms",
+		(timings->resolve != CSE_HTTP_TIME_NONE) ? (int) timings->resolve : -1,
+		(timings->connect != CSE_HTTP_TIME_NONE) ? (int) timings->connect : -1,
+		(timings->tls != CSE_HTTP_TIME_NONE) ? (int) timings->tls : -1,
+		(timings->firstByte != CSE_HTTP_TIME_NONE) ? (int) timings->firstByte : -1);
+
+	AcquireSRWLockExclusive(&ctx->lock);
+
+	if (!ctx->stats.requests)
+		ctx->stats.first = *timings;
+
+	ctx->stats.requests++;
+
+	if (timings->connect != CSE_HTTP_TIME_NONE)
+		ctx->stats.connections++;
+
+	if (timings->firstByte != CSE_HTTP_TIME_NONE)
+		ctx->stats.firstByteTotal += timings->firstByte;
+
+	ReleaseSRWLockExclusive(&ctx->lock);
+}
+
+static void CseDownloadThrottle_AddStall(CseDownloadThrottle* ctx, uint64_t duration)
+{
+	AcquireSRWLockExclusive(&ctx->lock);
+
+	CSE_LOG_WARN("Download stalled for %llu ms at %llu bytes",
+		(unsigned long long) duration, (unsigned long long) ctx->received);
+
+	ctx->stats.stalls++;
+	ctx->stats.stallTime += duration;
+
+	if (duration > ctx->stats.longestStall)
+		ctx->stats.longestStall = duration;
+
+	ReleaseSRWLockExclusive(&ctx->lock);
+}
+
+static bool CseDownloadThrottle_IsCancelled(CseDownloadThrottle* ctx)
+{
+	return ctx->cancel && (InterlockedCompareExchange(ctx->cancel, 0, 0) != 0);
+}
+
+// Reads next part of the response body, then waits as long as the rate limit
+// requires
+static bool CseDownloadThrottle_Read(
+	CseDownloadThrottle* ctx,
+	CseHttpRequest* request,
+	uint8_t* buffer,
+	size_t size,
+	size_t* read,
+	uint32_t* error)
+{
+	uint64_t start;
+	uint64_t wait;
+	bool result;
+
+	// Cancelled download is kept to be resumed, like an interrupted one
+	if (CseDownloadThrottle_IsCancelled(ctx))
+	{
+		*read = 0;
+		*error = ERROR_CANCELLED;
+		return false;
+	}
+
+	start = ctx->clock.Now(ctx->clock.param);
+	result = CseHttpRequest_Read(request, buffer, size, read, error);
+	wait = ctx->clock.Now(ctx->clock.param) - start;
+
+	// Reads which time out are stalls too
+	if (wait >= ctx->stats.stallThreshold)
+		CseDownloadThrottle_AddStall(ctx, wait);
+
+	if (!result)
+		return false;
+
+	if (*read)
+	{
+		if (ctx->lowPriority)
+			CseDownloadThrottle_AddLatency(ctx, (uint32_t) wait);
+
+		CseDownloadThrottle_Consume(ctx, *read);
+	}
+
+	return true;
+}
+
+typedef struct
+{
+	HANDLE file;
+	CseSha256* hash;
+	const uint8_t* expectedDigest;
+	CseDownloadResumeState state;
+	const WCHAR* statePath;
+	uint8_t* buffer;
+	CseDownloadThrottle* throttle;
+	const char* url;  // source requests go to, state has the URL the file is known by
+	bool compressed;  // url sends a zstd stream of the file
+	bool mirror;      // url is a mirror, its errors only mean going to another source
+	bool failover;    // there are other sources to go to when url stalls
+} CseDownloadTransfer;
+
+static bool CseDownload_CopyValue(char* value, size_t valueSize, const char* source)
+{
+	size_t length = strlen(source);
+
+	if (length >= valueSize)
+		return false;
+
+	memcpy(value, source, length + 1);
+	return true;
+}
+
+static bool CseDownload_LoadResumeState(const WCHAR* statePath, CseDownloadResumeState* state)
+{
+	FILE* fp;
+	char line[CSE_DOWNLOAD_URL_SIZE + 16];
+	bool hasUrl = false;
+	bool hasReceived = false;
+
+	ZeroMemory(state, sizeof(CseDownloadResumeState));
+
+	fp = _wfopen(statePath, L"rb");
+	if (!fp)
+		return false;
+
+	while (fgets(line, sizeof(line), fp))
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+
+		if (strncmp(line, "url=", 4) == 0)
+		{
+			hasUrl = CseDownload_CopyValue(state->url, sizeof(state->url), line + 4);
+		}
+		else if (strncmp(line, "etag=", 5) == 0)
+		{
+			if (!CseDownload_CopyValue(state->etag, sizeof(state->etag), line + 5))
+				state->etag[0] = '\0';
+		}
+		else if (strncmp(line, "lastModified=", 13) == 0)
+		{
+			if (!CseDownload_CopyValue(state->lastModified, sizeof(state->lastModified), line + 13))
+				state->lastModified[0] = '\0';
+		}
+		else if (strncmp(line, "received=", 9) == 0)
+		{
+			state->received = strtoull(line + 9, NULL, 10);
+			hasReceived = true;
+		}
+	}
+
+	fclose(fp);
+
+	return hasUrl && hasReceived;
+}
+
+static bool CseDownload_SaveState(const WCHAR* statePath, const CseDownloadResumeState* state)
+{
+	bool saved = false;
+
+	FILE* fp = _wfopen(statePath, L"wb");
+	if (fp)
+	{
+		saved = fprintf(fp, "url=%s\netag=%s\nlastModified=%s\nreceived=%llu\n",
+			state->url, state->etag, state->lastModified, (unsigned long long) state->received) > 0;
+		saved = (fclose(fp) == 0) && saved;
+	}
+
+	return saved;
+}
+
+static void CseDownload_SaveResumeState(CseDownloadTransfer* transfer)
+{
+	// Download goes on, it just can't be resumed by another run
+	if (!CseDownload_SaveState(transfer->statePath, &transfer->state))
+		CSE_LOG_WARN("Failed to save download resume state");
+}
+
+// Drops file data past offset, writing continues from there
+static bool CseDownload_Truncate(CseDownloadTransfer* transfer, uint64_t offset)
+{
+	LARGE_INTEGER position;
+	position.QuadPart = (LONGLONG) offset;
+
+	return SetFilePointerEx(transfer->file, position, NULL, FILE_BEGIN) && SetEndOfFile(transfer->file);
+}
+
+static bool CseDownload_Restart(CseDownloadTransfer* transfer)
+{
+	transfer->state.received = 0;
+	transfer->state.etag[0] = '\0';
+	transfer->state.lastModified[0] = '\0';
+
+	if (transfer->hash)
+	{
+		CseSha256_Free(transfer->hash);
+		transfer->hash = CseSha256_New();
+		if (!transfer->hash)
+			return false;
+	}
+
+	return CseDownload_Truncate(transfer, 0);
+}
+
+// Data received by a previous attempt is part of the digest too
+static bool CseDownload_HashPartial(CseDownloadTransfer* transfer)
+{
+	uint64_t remaining = transfer->state.received;
+	LARGE_INTEGER start;
+	DWORD bytesRead;
+
+	if (!transfer->hash || !remaining)
+		return true;
+
+	start.QuadPart = 0;
+	if (!SetFilePointerEx(transfer->file, start, NULL, FILE_BEGIN))
+		return false;
+
+	while (remaining > 0)
+	{
+		DWORD toRead = (remaining > CSE_DOWNLOAD_BUFFER_SIZE) ? CSE_DOWNLOAD_BUFFER_SIZE : (DWORD) remaining;
+
+		if (!ReadFile(transfer->file, transfer->buffer, toRead, &bytesRead, NULL) || (bytesRead != toRead))
+			return false;
+
+		if (!CseSha256_Update(transfer->hash, transfer->buffer, bytesRead))
+			return false;
+
+		remaining -= bytesRead;
+	}
+
+	return true;
+}
+
+// Continues the partial file left by a previous attempt for the same URL, or
+// starts a new one
+static bool CseDownload_OpenPartial(CseDownloadTransfer* transfer, const WCHAR* partialPath, const char* url)
+{
+	LARGE_INTEGER size;
+
+	if (!CseDownload_LoadResumeState(transfer->statePath, &transfer->state) ||
+		(strcmp(transfer->state.url, url) != 0))
+	{
+		ZeroMemory(&transfer->state, sizeof(CseDownloadResumeState));
+		CseDownload_CopyValue(transfer->state.url, sizeof(transfer->state.url), url);
+	}
+
+	transfer->file = CreateFileW(
+		partialPath,
+		GENERIC_READ | GENERIC_WRITE,
+		0,
+		NULL,
+		OPEN_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL);
+
+	if (transfer->file == INVALID_HANDLE_VALUE)
+	{
+		transfer->file = NULL;
+		return false;
+	}
+
+	if (!GetFileSizeEx(transfer->file, &size))
+		return false;
+
+	// Resume state may be ahead of the data if the system went down
+	if ((uint64_t) size.QuadPart < transfer->state.received)
+		transfer->state.received = (uint64_t) size.QuadPart;
+
+	if (!transfer->state.received)
+		return CseDownload_Restart(transfer);
+
+	if (!CseDownload_HashPartial(transfer))
+	{
+		CSE_LOG_WARN("Failed to read partial download, restarting");
+		return CseDownload_Restart(transfer);
+	}
+
+	CSE_LOG_INFO("Found partial download of %llu bytes", (unsigned long long) transfer->state.received);
+
+	return CseDownload_Truncate(transfer, transfer->state.received);
+}
+
+// Range request header from first to last byte (open-ended when last is
+// CSE_HTTP_SIZE_UNKNOWN). With If-Range the server sends the whole file
+// instead if it has changed since the etag was received
+static void CseDownload_FormatRange(char* headers, size_t size, uint64_t first, uint64_t last, const char* etag)
+{
+	int length;
+
+	if (last != CSE_HTTP_SIZE_UNKNOWN)
+		length = snprintf(headers, size, "Range: bytes=%llu-%llu\r\n", (unsigned long long) first, (unsigned long long) last);
+	else
+		length = snprintf(headers, size, "Range: bytes=%llu-\r\n", (unsigned long long) first);
+
+	if (etag[0] && (length > 0) && ((size_t) length < size))
+		snprintf(headers + length, size - length, "If-Range: %s\r\n", etag);
+}
+
+static bool CseDownload_WriteAt(HANDLE file, uint64_t offset, const uint8_t* data, size_t size)
+{
+	DWORD written = 0;
+	OVERLAPPED overlapped;
+
+	ZeroMemory(&overlapped, sizeof(OVERLAPPED));
+	overlapped.Offset = (DWORD) offset;
+	overlapped.OffsetHigh = (DWORD) (offset >> 32);
+
+	if (!WriteFile(file, data, (DWORD) size, &written, &overlapped) || (written != size))
+	{
+		CSE_LOG_ERROR("Failed to write downloaded data (%lu)", GetLastError());
+		return false;
+	}
+
+	return true;
+}
+
+static bool CseDownload_ReadAt(HANDLE file, uint64_t offset, uint8_t* data, size_t size)
+{
+	DWORD bytesRead = 0;
+	OVERLAPPED overlapped;
+
+	ZeroMemory(&overlapped, sizeof(OVERLAPPED));
+	overlapped.Offset = (DWORD) offset;
+	overlapped.OffsetHigh = (DWORD) (offset >> 32);
+
+	return ReadFile(file, data, (DWORD) size, &bytesRead, &overlapped) && (bytesRead == size);
+}
+
+// Received data is collected in large buffers which a separate thread writes
+// out, so the receive loop doesn't wait for the disk. While one buffer is
+// written the next one is filled
+typedef struct
+{
+	HANDLE file;
+	CseSha256* hash;  // updated by the writer in file order, can be NULL
+	uint8_t* memory;
+	size_t sizes[CSE_DOWNLOAD_SINK_BUFFER_COUNT];
+	uint64_t offsets[CSE_DOWNLOAD_SINK_BUFFER_COUNT];
+	uint8_t* current;  // buffer being filled, NULL until one is free
+	size_t fill;
+	uint64_t offset;   // file offset of the current buffer
+	int readIndex;
+	int writeIndex;
+	HANDLE freeBuffers;
+	HANDLE filledBuffers;
+	HANDLE writer;
+	volatile LONG failed;
+	volatile LONG64* blockedTime;  // milliseconds spent waiting for the writer are added to it, can be NULL
+} CseDownloadSink;
+
+static DWORD WINAPI CseDownloadSink_Writer(LPVOID param)
+{
+	CseDownloadSink* ctx = (CseDownloadSink*) param;
+
+	while (true)
+	{
+		size_t size;
+		uint8_t* buffer;
+
+		WaitForSingleObject(ctx->filledBuffers, INFINITE);
+
+		size = ctx->sizes[ctx->readIndex];
+		buffer = ctx->memory + (size_t) ctx->readIndex * CSE_DOWNLOAD_SINK_BUFFER_SIZE;
+
+		// After a failure buffers are only given back, Write reports the error
+		if ((size > 0) && !ctx->failed)
+		{
+			if (!CseDownload_WriteAt(ctx->file, ctx->offsets[ctx->readIndex], buffer, size) ||
+				(ctx->hash && !CseSha256_Update(ctx->hash, buffer, size)))
+			{
+				InterlockedExchange(&ctx->failed, 1);
+			}
+		}
+
+		ctx->readIndex = (ctx->readIndex + 1) % CSE_DOWNLOAD_SINK_BUFFER_COUNT;
+		ReleaseSemaphore(ctx->freeBuffers, 1, NULL);
+
+		// Empty buffer is submitted by Close
+		if (!size)
+			break;
+	}
+
+	return 0;
+}
+
+static void CseDownloadSink_Submit(CseDownloadSink* ctx, size_t size)
+{
+	ctx->sizes[ctx->writeIndex] = size;
+	ctx->offsets[ctx->writeIndex] = ctx->offset;
+	ctx->writeIndex = (ctx->writeIndex + 1) % CSE_DOWNLOAD_SINK_BUFFER_COUNT;
+	ctx->offset += size;
+	ctx->current = NULL;
+	ctx->fill = 0;
+
+	ReleaseSemaphore(ctx->filledBuffers, 1, NULL);
+}
+
+// Takes a free buffer, counting the time the network waits for the disk
+static void CseDownloadSink_WaitFree(CseDownloadSink* ctx)
+{
+	ULONGLONG start;
+
+	if (WaitForSingleObject(ctx->freeBuffers, 0) == WAIT_OBJECT_0)
+		return;
+
+	start = GetTickCount64();
+	WaitForSingleObject(ctx->freeBuffers, INFINITE);
+
+	if (ctx->blockedTime)
+		InterlockedExchangeAdd64(ctx->blockedTime, (LONG64) (GetTickCount64() - start));
+}
+
+static bool CseDownloadSink_Close(CseDownloadSink* ctx);
+
+// Data is written from offset on; hash is updated with it once written.
+// blockedTime can be NULL
+static bool CseDownloadSink_Open(
+	CseDownloadSink* ctx,
+	HANDLE file,
+	uint64_t offset,
+	CseSha256* hash,
+	volatile LONG64* blockedTime)
+{
+	ZeroMemory(ctx, sizeof(CseDownloadSink));
+
+	ctx->file = file;
+	ctx->offset = offset;
+	ctx->hash = hash;
+	ctx->blockedTime = blockedTime;
+
+	// Page aligned, so the system copies whole pages to the cache
+	ctx->memory = VirtualAlloc(NULL,
+		CSE_DOWNLOAD_SINK_BUFFER_COUNT * CSE_DOWNLOAD_SINK_BUFFER_SIZE,
+		MEM_COMMIT | MEM_RESERVE,
+		PAGE_READWRITE);
+
+	ctx->freeBuffers = CreateSemaphoreW(NULL,
+		CSE_DOWNLOAD_SINK_BUFFER_COUNT, CSE_DOWNLOAD_SINK_BUFFER_COUNT, NULL);
+	ctx->filledBuffers = CreateSemaphoreW(NULL, 0, CSE_DOWNLOAD_SINK_BUFFER_COUNT, NULL);
+
+	if (!ctx->memory || !ctx->freeBuffers || !ctx->filledBuffers)
+		goto error;
+
+	ctx->writer = CreateThread(NULL, 0, CseDownloadSink_Writer, ctx, 0, NULL);
+	if (!ctx->writer)
+		goto error;
+
+	return true;
+
+error:
+	CSE_LOG_ERROR("Failed to start download writer (%lu)", GetLastError());
+	CseDownloadSink_Close(ctx);
+	return false;
+}
+
+// Returns false once writing of earlier data has failed
+static bool CseDownloadSink_Write(CseDownloadSink* ctx, const uint8_t* data, size_t size)
+{
+	while (size > 0)
+	{
+		size_t chunk;
+
+		if (ctx->failed)
+			return false;
+
+		if (!ctx->current)
+		{
+			CseDownloadSink_WaitFree(ctx);
+			ctx->current = ctx->memory + (size_t) ctx->writeIndex * CSE_DOWNLOAD_SINK_BUFFER_SIZE;
+		}
+
+		chunk = CSE_DOWNLOAD_SINK_BUFFER_SIZE - ctx->fill;
+		if (chunk > size)
+			chunk = size;
+
+		memcpy(ctx->current + ctx->fill, data, chunk);
+		ctx->fill += chunk;
+		data += chunk;
+		size -= chunk;
+
+		if (ctx->fill == CSE_DOWNLOAD_SINK_BUFFER_SIZE)
+			CseDownloadSink_Submit(ctx, ctx->fill);
+	}
+
+	return !ctx->failed;
+}
+
+// Waits until all data given so far is in the file
+static bool CseDownloadSink_Flush(CseDownloadSink* ctx)
+{
+	int index;
+
+	if (ctx->fill)
+	{
+		CseDownloadSink_Submit(ctx, ctx->fill);
+	}
+	else if (ctx->current)
+	{
+		ctx->current = NULL;
+		ReleaseSemaphore(ctx->freeBuffers, 1, NULL);
+	}
+
+	// Writer is idle once every buffer has been given back
+	for (index = 0; index < CSE_DOWNLOAD_SINK_BUFFER_COUNT; index++)
+		CseDownloadSink_WaitFree(ctx);
+
+	ReleaseSemaphore(ctx->freeBuffers, CSE_DOWNLOAD_SINK_BUFFER_COUNT, NULL);
+
+	return !ctx->failed;
+}
+
+// Following data is written from offset on
+static bool CseDownloadSink_Seek(CseDownloadSink* ctx, uint64_t offset)
+{
+	bool result = CseDownloadSink_Flush(ctx);
+
+	ctx->offset = offset;
+	return result;
+}
+
+// Writes the remaining data and stops the writer. Returns false if any of
+// the data couldn't be written
+static bool CseDownloadSink_Close(CseDownloadSink* ctx)
+{
+	bool result = false;
+
+	if (ctx->writer)
+	{
+		result = CseDownloadSink_Flush(ctx);
+
+		WaitForSingleObject(ctx->freeBuffers, INFINITE);
+		CseDownloadSink_Submit(ctx, 0);
+
+		WaitForSingleObject(ctx->writer, INFINITE);
+		CloseHandle(ctx->writer);
+	}
+
+	if (ctx->freeBuffers)
+		CloseHandle(ctx->freeBuffers);
+	if (ctx->filledBuffers)
+		CloseHandle(ctx->filledBuffers);
+	if (ctx->memory)
+		VirtualFree(ctx->memory, 0, MEM_RELEASE);
+
+	ZeroMemory(ctx, sizeof(CseDownloadSink));
+
+	return result;
+}
+
+// Writes response body at the end of the partial file
+// Decodes a compressed source as it is received, so only the decoded file
+// is written
+typedef struct
+{
+	ZSTD_DCtx* stream;
+	uint8_t* buffer;
+	size_t pending;  // 0 once the last frame is complete
+} CseDownloadDecoder;
+
+static bool CseDownloadDecoder_Init(CseDownloadDecoder* ctx)
+{
+	ctx->stream = ZSTD_createDCtx();
+	ctx->buffer = malloc(CSE_DOWNLOAD_BUFFER_SIZE);
+	ctx->pending = 1;
+
+	if (!ctx->stream || !ctx->buffer)
+		return false;
+
+	ZSTD_DCtx_setParameter(ctx->stream, ZSTD_d_windowLogMax, CSE_DOWNLOAD_ZSTD_WINDOW_LOG_MAX);
+
+	return true;
+}
+
+static void CseDownloadDecoder_Free(CseDownloadDecoder* ctx)
+{
+	if (ctx->stream)
+		ZSTD_freeDCtx(ctx->stream);
+
+	free(ctx->buffer);
+}
+
+// Decoded size is added to received; false if the data is not a valid
+// stream or can't be written, corrupt tells which
+static bool CseDownloadDecoder_Write(
+	CseDownloadDecoder* ctx,
+	CseDownloadSink* sink,
+	const uint8_t* data,
+	size_t size,
+	uint64_t* received,
+	bool* corrupt)
+{
+	ZSTD_inBuffer input = { data, size, 0 };
+	ZSTD_outBuffer output;
+
+	*corrupt = false;
+
+	// Output may be left in the decoder when the buffer fills up
+	do
+	{
+		output.dst = ctx->buffer;
+		output.size = CSE_DOWNLOAD_BUFFER_SIZE;
+		output.pos = 0;
+
+		ctx->pending = ZSTD_decompressStream(ctx->stream, &output, &input);
+
+		if (ZSTD_isError(ctx->pending))
+		{
+			CSE_LOG_ERROR("Failed to decode compressed download: %s", ZSTD_getErrorName(ctx->pending));
+			*corrupt = true;
+			return false;
+		}
+
+		if (output.pos && !CseDownloadSink_Write(sink, ctx->buffer, output.pos))
+			return false;
+
+		*received += output.pos;
+	} while ((input.pos < input.size) || (output.pos == output.size));
+
+	return true;
+}
+
+static void CseDownload_AddRequest(CseDownloadTransfer* transfer, CseHttpRequest* request)
+{
+	CseDownloadThrottle_AddRequest(transfer->throttle, request);
+
+	// Stalled source isn't waited for when another one can take over
+	if (transfer->failover)
+		CseHttpRequest_SetRecvTimeout(request, CSE_DOWNLOAD_FAILOVER_TIMEOUT);
+}
+
+static CseTransferStatus CseDownload_Receive(CseDownloadTransfer* transfer, CseHttpRequest* request)
+{
+	CseTransferStatus status = CSE_TRANSFER_INTERRUPTED;
+	CseDownloadResumeState* state = &transfer->state;
+	const CseHttpResponse* response;
+	uint64_t bodyReceived = 0;
+	uint64_t checkpoint;
+	uint32_t error = 0;
+	size_t read;
+	bool corrupt;
+	CseDownloadSink sink;
+	CseDownloadDecoder decoder;
+
+	ZeroMemory(&sink, sizeof(CseDownloadSink));
+	ZeroMemory(&decoder, sizeof(CseDownloadDecoder));
+
+	response = CseHttpRequest_GetResponse(request);
+
+	if ((response->status == 206) && state->received && (response->rangeStart == state->received))
+	{
+		CSE_LOG_INFO("Resuming download at %llu bytes", (unsigned long long) state->received);
+	}
+	else if (response->status == 200)
+	{
+		if (state->received)
+		{
+			CSE_LOG_INFO("Server sent the whole file, restarting download");
+
+			if (!CseDownload_Restart(transfer))
+			{
+				status = CSE_TRANSFER_FAILED;
+				goto exit;
+			}
+		}
+	}
+	else if ((response->status == 206) || (response->status == 416))
+	{
+		// Partial file doesn't match the resource anymore
+		CSE_LOG_WARN("Range request rejected (%u), restarting download", (unsigned) response->status);
+		status = CseDownload_Restart(transfer) ? CSE_TRANSFER_INTERRUPTED : CSE_TRANSFER_FAILED;
+		goto exit;
+	}
+	else
+	{
+		CSE_LOG_ERROR("Unexpected HTTP status %u", (unsigned) response->status);
+
+		// Server errors may go away on retry, anything else won't unless
+		// another source serves the file
+		if ((response->status < 500) && !transfer->mirror)
+			status = CSE_TRANSFER_FAILED;
+
+		goto exit;
+	}
+
+	memcpy(state->etag, response->etag, sizeof(state->etag));
+	memcpy(state->lastModified, response->lastModified, sizeof(state->lastModified));
+
+	if (transfer->compressed && !CseDownloadDecoder_Init(&decoder))
+	{
+		status = CSE_TRANSFER_FAILED;
+		goto exit;
+	}
+
+	// Progress of a compressed source counts the compressed bytes, received
+	// and total alike; the stream always starts from its beginning
+	CseDownloadThrottle_SetPosition(transfer->throttle, transfer->compressed ? 0 : state->received, response->totalSize);
+
+	CseDownload_SaveResumeState(transfer);
+	checkpoint = state->received;
+
+	// Data is hashed as it is written, so the file is never read back for checking
+	if (!CseDownloadSink_Open(&sink, transfer->file, state->received, transfer->hash,
+		&transfer->throttle->stats.writeBlockedTime))
+	{
+		status = CSE_TRANSFER_FAILED;
+		goto exit;
+	}
+
+	while (true)
+	{
+		if (!CseDownloadThrottle_Read(transfer->throttle, request, transfer->buffer, CSE_DOWNLOAD_BUFFER_SIZE, &read, &error))
+		{
+			CSE_LOG_WARN("Download interrupted at %llu bytes (%lu)",
+				(unsigned long long) state->received, (unsigned long) error);
+			goto exit;
+		}
+
+		if (!read)
+			break;
+
+		bodyReceived += read;
+
+		if (decoder.stream)
+		{
+			if (!CseDownloadDecoder_Write(&decoder, &sink, transfer->buffer, read, &state->received, &corrupt))
+			{
+				// Another source may serve a good copy
+				if (corrupt && CseDownloadSink_Close(&sink) && CseDownload_Restart(transfer))
+					status = CSE_TRANSFER_INTERRUPTED;
+				else
+					status = CSE_TRANSFER_FAILED;
+
+				goto exit;
+			}
+		}
+		else
+		{
+			if (!CseDownloadSink_Write(&sink, transfer->buffer, read))
+			{
+				status = CSE_TRANSFER_FAILED;
+				goto exit;
+			}
+
+			state->received += read;
+		}
+
+		if (state->received - checkpoint >= CSE_DOWNLOAD_CHECKPOINT_SIZE)
+		{
+			// Saved state must never be ahead of the data in the file
+			if (!CseDownloadSink_Flush(&sink))
+			{
+				status = CSE_TRANSFER_FAILED;
+				goto exit;
+			}
+
+			CseDownload_SaveResumeState(transfer);
+			checkpoint = state->received;
+		}
+	}
+
+	if ((response->contentLength != CSE_HTTP_SIZE_UNKNOWN) && (bodyReceived < response->contentLength))
+	{
+		CSE_LOG_WARN("Connection closed at %llu of %llu bytes",
+			(unsigned long long) bodyReceived, (unsigned long long) response->contentLength);
+		goto exit;
+	}
+
+	if (decoder.stream && decoder.pending)
+	{
+		CSE_LOG_WARN("Compressed download ended in the middle of a frame");
+		goto exit;
+	}
+
+	status = CSE_TRANSFER_COMPLETE;
+
+exit:
+	if (sink.writer && !CseDownloadSink_Close(&sink))
+		status = CSE_TRANSFER_FAILED;
+
+	CseDownloadDecoder_Free(&decoder);
+
+	if (status == CSE_TRANSFER_INTERRUPTED)
+		CseDownload_SaveResumeState(transfer);
+
+	return status;
+}
+
+static CseTransferStatus CseDownload_Transfer(CseDownloadTransfer* transfer, CseHttp* http)
+{
+	CseTransferStatus status;
+	CseDownloadResumeState* state = &transfer->state;
+	CseHttpRequest* request;
+	char headers[CSE_HTTP_ETAG_SIZE + 96];
+	uint32_t error = 0;
+
+	headers[0] = '\0';
+
+	if (state->received)
+		CseDownload_FormatRange(headers, sizeof(headers), state->received, CSE_HTTP_SIZE_UNKNOWN, state->etag);
+
+	request = CseHttp_Get(http, transfer->url, headers[0] ? headers : NULL, &error);
+
+	if (!request)
+	{
+		CSE_LOG_ERROR("HTTP request failed (%lu)", (unsigned long) error);
+		return CSE_TRANSFER_INTERRUPTED;
+	}
+
+	CseDownload_AddRequest(transfer, request);
+
+	status = CseDownload_Receive(transfer, request);
+	CseHttpRequest_Free(request);
+
+	return status;
+}
+
+// Segmented mode: the file is split in ranges fetched over parallel
+// connections and written in place. Data received at the hash cursor is
+// hashed straight from the receive buffer; segments which arrive ahead of it
+// are read back once the cursor gets to them. Only the contiguous prefix is
+// saved as received
+typedef struct
+{
+	CseDownloadTransfer* transfer;
+	CseHttp* http;
+	int connections;
+	uint64_t segmentSize;
+	uint64_t base;          // file data before the first segment was already there
+	uint64_t totalSize;
+	uint32_t segmentCount;  // 0 until the server has confirmed range support
+	uint64_t* segmentReceived;
+	uint32_t nextSegment;
+	uint32_t hashedSegments;
+	uint64_t hashOffset;    // file data up to here has been hashed
+	SRWLOCK hashLock;       // protects hashOffset and the transfer hash
+	int activeWorkers;
+	CseHttpRequest* probe;  // response for the first segment, taken by the first worker
+	bool unsupported;       // server doesn't serve ranges, file is streamed instead
+	bool failed;            // failed and changed are only accessed under lock
+	bool changed;           // file has changed on the server, download restarts
+	SRWLOCK lock;
+	CONDITION_VARIABLE progress;
+} CseSegmentedDownload;
+
+static void CseSegmentedDownload_Init(
+	CseSegmentedDownload* ctx,
+	CseDownloadTransfer* transfer,
+	CseHttp* http,
+	const CseDownloadOptions* options)
+{
+	ZeroMemory(ctx, sizeof(CseSegmentedDownload));
+
+	ctx->transfer = transfer;
+	ctx->http = http;
+	ctx->connections = options->connections;
+	ctx->segmentSize = options->segmentSize ? options->segmentSize : CSE_DOWNLOAD_SEGMENT_SIZE;
+
+	if (ctx->connections > CSE_DOWNLOAD_MAX_CONNECTIONS)
+		ctx->connections = CSE_DOWNLOAD_MAX_CONNECTIONS;
+
+	InitializeSRWLock(&ctx->lock);
+	InitializeSRWLock(&ctx->hashLock);
+	InitializeConditionVariable(&ctx->progress);
+}
+
+// Forgets the segment layout, next round probes the server again
+static void CseSegmentedDownload_Reset(CseSegmentedDownload* ctx)
+{
+	free(ctx->segmentReceived);
+	ctx->segmentReceived = NULL;
+	ctx->segmentCount = 0;
+	ctx->hashedSegments = 0;
+	ctx->changed = false;
+}
+
+static uint64_t CseSegmentedDownload_GetStart(CseSegmentedDownload* ctx, uint32_t index)
+{
+	return ctx->base + (uint64_t) index * ctx->segmentSize;
+}
+
+static uint64_t CseSegmentedDownload_GetLength(CseSegmentedDownload* ctx, uint32_t index)
+{
+	uint64_t start = CseSegmentedDownload_GetStart(ctx, index);
+	uint64_t remaining = ctx->totalSize - start;
+
+	return (remaining < ctx->segmentSize) ? remaining : ctx->segmentSize;
+}
+
+static bool CseSegmentedDownload_IsComplete(CseSegmentedDownload* ctx, uint32_t index)
+{
+	return ctx->segmentReceived[index] == CseSegmentedDownload_GetLength(ctx, index);
+}
+
+// Asks for the first missing segment. Returns true if the server has answered
+// with a partial response and the file size; otherwise the response has been
+// handled as a regular transfer and status is set
+static bool CseSegmentedDownload_Probe(CseSegmentedDownload* ctx, CseTransferStatus* status)
+{
+	CseDownloadTransfer* transfer = ctx->transfer;
+	CseDownloadResumeState* state = &transfer->state;
+	CseHttpRequest* request;
+	const CseHttpResponse* response;
+	char headers[CSE_HTTP_ETAG_SIZE + 96];
+	uint32_t error = 0;
+
+	CseDownload_FormatRange(headers, sizeof(headers), state->received, state->received + ctx->segmentSize - 1, state->etag);
+
+	request = CseHttp_Get(ctx->http, transfer->url, headers, &error);
+
+	if (!request)
+	{
+		CSE_LOG_ERROR("HTTP request failed (%lu)", (unsigned long) error);
+		*status = CSE_TRANSFER_INTERRUPTED;
+		return false;
+	}
+
+	CseDownload_AddRequest(transfer, request);
+
+	response = CseHttpRequest_GetResponse(request);
+
+	if ((response->status != 206) ||
+		(response->rangeStart != state->received) ||
+		(response->totalSize == CSE_HTTP_SIZE_UNKNOWN))
+	{
+		if (response->status == 206)
+		{
+			// Can't tell where the file ends, ask for the rest at once
+			CseHttpRequest_Free(request);
+			ctx->unsupported = true;
+			*status = CseDownload_Transfer(transfer, ctx->http);
+			return false;
+		}
+
+		if (response->status == 200)
+		{
+			CSE_LOG_INFO("Server doesn't support range requests, downloading over a single connection");
+			ctx->unsupported = true;
+		}
+
+		*status = CseDownload_Receive(transfer, request);
+		CseHttpRequest_Free(request);
+		return false;
+	}
+
+	// Hash already covers the data received before
+	ctx->base = state->received;
+	ctx->hashOffset = state->received;
+	ctx->totalSize = response->totalSize;
+	ctx->segmentCount = (uint32_t) ((ctx->totalSize - ctx->base + ctx->segmentSize - 1) / ctx->segmentSize);
+	ctx->segmentReceived = calloc(ctx->segmentCount, sizeof(uint64_t));
+
+	// Whole file is allocated up front, segments are written in place
+	if (!ctx->segmentReceived || !CseDownload_Truncate(transfer, ctx->totalSize))
+	{
+		CseHttpRequest_Free(request);
+		CseSegmentedDownload_Reset(ctx);
+		*status = CSE_TRANSFER_FAILED;
+		return false;
+	}
+
+	memcpy(state->etag, response->etag, sizeof(state->etag));
+	memcpy(state->lastModified, response->lastModified, sizeof(state->lastModified));
+	CseDownload_SaveResumeState(transfer);
+
+	ctx->probe = request;
+	return true;
+}
+
+// Hashes data written at offset if it is next in file order; otherwise it is
+// read back once the segments before it are complete
+static void CseSegmentedDownload_HashReceived(
+	CseSegmentedDownload* ctx,
+	uint64_t offset,
+	const uint8_t* data,
+	size_t size)
+{
+	if (!ctx->transfer->hash)
+		return;
+
+	AcquireSRWLockExclusive(&ctx->hashLock);
+
+	if ((offset == ctx->hashOffset) && CseSha256_Update(ctx->transfer->hash, data, size))
+		ctx->hashOffset += size;
+
+	ReleaseSRWLockExclusive(&ctx->hashLock);
+}
+
+static CseTransferStatus CseSegmentedDownload_Fetch(
+	CseSegmentedDownload* ctx,
+	uint32_t index,
+	CseHttpRequest* request,
+	CseDownloadSink* sink,
+	uint8_t* buffer,
+	uint64_t* pReceived)
+{
+	CseTransferStatus status = CSE_TRANSFER_INTERRUPTED;
+	const CseDownloadResumeState* state = &ctx->transfer->state;
+	const CseHttpResponse* response;
+	uint64_t start = CseSegmentedDownload_GetStart(ctx, index);
+	uint64_t length = CseSegmentedDownload_GetLength(ctx, index);
+	uint64_t received = *pReceived;
+	char headers[CSE_HTTP_ETAG_SIZE + 96];
+	uint32_t error = 0;
+	size_t read;
+	bool stop;
+
+	if (!CseDownloadSink_Seek(sink, start + received))
+	{
+		if (request)
+			CseHttpRequest_Free(request);
+
+		return CSE_TRANSFER_FAILED;
+	}
+
+	if (!request)
+	{
+		CseDownload_FormatRange(headers, sizeof(headers), start + received, start + length - 1, state->etag);
+		request = CseHttp_Get(ctx->http, ctx->transfer->url, headers, &error);
+
+		if (!request)
+		{
+			CSE_LOG_WARN("Segment %u request failed (%lu)", (unsigned) index, (unsigned long) error);
+			return CSE_TRANSFER_INTERRUPTED;
+		}
+
+		CseDownload_AddRequest(ctx->transfer, request);
+	}
+
+	response = CseHttpRequest_GetResponse(request);
+
+	if ((response->status != 206) || (response->rangeStart != start + received))
+	{
+		if (response->status == 200)
+		{
+			// If-Range didn't match
+			CSE_LOG_WARN("File has changed on the server, restarting download");
+
+			AcquireSRWLockExclusive(&ctx->lock);
+			ctx->changed = true;
+			ReleaseSRWLockExclusive(&ctx->lock);
+		}
+		else
+		{
+			CSE_LOG_WARN("Unexpected HTTP status %u for segment %u", (unsigned) response->status, (unsigned) index);
+
+			if ((response->status >= 400) && (response->status < 500) && !ctx->transfer->mirror)
+				status = CSE_TRANSFER_FAILED;
+		}
+
+		goto exit;
+	}
+
+	while (received < length)
+	{
+		size_t toRead = ((length - received) > CSE_DOWNLOAD_BUFFER_SIZE)
+			? CSE_DOWNLOAD_BUFFER_SIZE : (size_t) (length - received);
+
+		// Another segment has failed for good, no point in going on
+		AcquireSRWLockExclusive(&ctx->lock);
+		stop = ctx->failed || ctx->changed || CseDownloadThrottle_IsCancelled(ctx->transfer->throttle);
+		ReleaseSRWLockExclusive(&ctx->lock);
+
+		if (stop)
+			goto exit;
+
+		if (!CseDownloadThrottle_Read(ctx->transfer->throttle, request, buffer, toRead, &read, &error))
+		{
+			CSE_LOG_WARN("Segment %u interrupted (%lu)", (unsigned) index, (unsigned long) error);
+			goto exit;
+		}
+
+		if (!read)
+		{
+			CSE_LOG_WARN("Segment %u connection closed at %llu of %llu bytes",
+				(unsigned) index, (unsigned long long) received, (unsigned long long) length);
+			goto exit;
+		}
+
+		if (!CseDownloadSink_Write(sink, buffer, read))
+		{
+			status = CSE_TRANSFER_FAILED;
+			goto exit;
+		}
+
+		CseSegmentedDownload_HashReceived(ctx, start + received, buffer, read);
+		received += read;
+	}
+
+	status = CSE_TRANSFER_COMPLETE;
+
+exit:
+	CseHttpRequest_Free(request);
+
+	// Only data which is in the file counts as received
+	if (!CseDownloadSink_Flush(sink))
+		status = CSE_TRANSFER_FAILED;
+
+	*pReceived = received;
+
+	return status;
+}
+
+static DWORD WINAPI CseSegmentedDownload_Worker(LPVOID param)
+{
+	CseSegmentedDownload* ctx = (CseSegmentedDownload*) param;
+	CseTransferStatus status;
+	CseHttpRequest* request;
+	uint64_t received;
+	uint32_t index;
+	CseDownloadSink sink;
+	bool opened;
+
+	uint8_t* buffer = malloc(CSE_DOWNLOAD_BUFFER_SIZE);
+
+	// Each connection writes through its own sink, moved to every new segment
+	opened = CseDownloadSink_Open(&sink, ctx->transfer->file, 0, NULL,
+		&ctx->transfer->throttle->stats.writeBlockedTime);
+
+	AcquireSRWLockExclusive(&ctx->lock);
+
+	if (!buffer || !opened)
+		ctx->failed = true;
+
+	while (!ctx->failed && !ctx->changed && !CseDownloadThrottle_IsCancelled(ctx->transfer->throttle))
+	{
+		// Segments completed by a previous round are skipped, segments which
+		// fail in this round are left for the next one
+		while ((ctx->nextSegment < ctx->segmentCount) && CseSegmentedDownload_IsComplete(ctx, ctx->nextSegment))
+			ctx->nextSegment++;
+
+		if (ctx->nextSegment >= ctx->segmentCount)
+			break;
+
+		index = ctx->nextSegment++;
+		received = ctx->segmentReceived[index];
+		request = ctx->probe;
+		ctx->probe = NULL;
+
+		ReleaseSRWLockExclusive(&ctx->lock);
+
+		status = CseSegmentedDownload_Fetch(ctx, index, request, &sink, buffer, &received);
+
+		AcquireSRWLockExclusive(&ctx->lock);
+
+		ctx->segmentReceived[index] = received;
+
+		if (status == CSE_TRANSFER_FAILED)
+			ctx->failed = true;
+
+		WakeAllConditionVariable(&ctx->progress);
+	}
+
+	ctx->activeWorkers--;
+	WakeAllConditionVariable(&ctx->progress);
+
+	ReleaseSRWLockExclusive(&ctx->lock);
+
+	if (opened)
+		CseDownloadSink_Close(&sink);
+
+	free(buffer);
+	return 0;
+}
+
+// Hashes the part of a complete segment which arrived ahead of the hash
+// cursor and so couldn't be hashed from the receive buffer
+static bool CseSegmentedDownload_Hash(CseSegmentedDownload* ctx, uint32_t index)
+{
+	CseDownloadTransfer* transfer = ctx->transfer;
+	uint64_t end = CseSegmentedDownload_GetStart(ctx, index) + CseSegmentedDownload_GetLength(ctx, index);
+	bool result;
+
+	if (!transfer->hash)
+		return true;
+
+	// Segment has just been written, it is read back from the system cache.
+	// The lock is taken per buffer, so the next segment's worker isn't held
+	// up for the whole segment
+	while (true)
+	{
+		size_t size;
+
+		AcquireSRWLockExclusive(&ctx->hashLock);
+
+		if (ctx->hashOffset >= end)
+		{
+			ReleaseSRWLockExclusive(&ctx->hashLock);
+			return true;
+		}
+
+		size = ((end - ctx->hashOffset) > CSE_DOWNLOAD_BUFFER_SIZE)
+			? CSE_DOWNLOAD_BUFFER_SIZE : (size_t) (end - ctx->hashOffset);
+
+		result = CseDownload_ReadAt(transfer->file, ctx->hashOffset, transfer->buffer, size) &&
+			CseSha256_Update(transfer->hash, transfer->buffer, size);
+
+		if (result)
+			ctx->hashOffset += size;
+
+		ReleaseSRWLockExclusive(&ctx->hashLock);
+
+		if (!result)
+		{
+			CSE_LOG_ERROR("Failed to hash downloaded data");
+			return false;
+		}
+	}
+}
+
+static CseTransferStatus CseSegmentedDownload_Run(CseSegmentedDownload* ctx)
+{
+	CseDownloadTransfer* transfer = ctx->transfer;
+	CseTransferStatus status;
+	HANDLE threads[CSE_DOWNLOAD_MAX_CONNECTIONS];
+	int threadCount = 0;
+	int workers;
+	uint32_t index;
+	uint64_t received;
+	bool ready;
+
+	if (ctx->unsupported)
+		return CseDownload_Transfer(transfer, ctx->http);
+
+	if (!ctx->segmentCount && !CseSegmentedDownload_Probe(ctx, &status))
+		return status;
+
+	workers = ctx->connections;
+	if ((uint32_t) workers > ctx->segmentCount - ctx->hashedSegments)
+		workers = (int) (ctx->segmentCount - ctx->hashedSegments);
+
+	ctx->nextSegment = ctx->hashedSegments;
+	ctx->activeWorkers = 0;
+
+	// Progress includes segments completed by earlier rounds
+	received = ctx->base;
+	for (index = 0; index < ctx->segmentCount; index++)
+		received += ctx->segmentReceived[index];
+
+	CseDownloadThrottle_SetPosition(transfer->throttle, received, ctx->totalSize);
+
+	for (int i = 0; i < workers; ++i)
+	{
+		AcquireSRWLockExclusive(&ctx->lock);
+		ctx->activeWorkers++;
+		ReleaseSRWLockExclusive(&ctx->lock);
+
+		threads[threadCount] = CreateThread(NULL, 0, CseSegmentedDownload_Worker, ctx, 0, NULL);
+		if (!threads[threadCount])
+		{
+			CSE_LOG_WARN("Failed to start download worker (%lu)", GetLastError());
+
+			AcquireSRWLockExclusive(&ctx->lock);
+			ctx->activeWorkers--;
+			ReleaseSRWLockExclusive(&ctx->lock);
+			break;
+		}
+
+		threadCount++;
+	}
+
+	if (!threadCount)
+	{
+		if (ctx->probe)
+		{
+			CseHttpRequest_Free(ctx->probe);
+			ctx->probe = NULL;
+		}
+
+		return CSE_TRANSFER_FAILED;
+	}
+
+	CSE_LOG_DEBUG("Downloading %u segments over %d connections",
+		(unsigned) (ctx->segmentCount - ctx->hashedSegments), threadCount);
+
+	while (true)
+	{
+		AcquireSRWLockExclusive(&ctx->lock);
+
+		while ((ctx->hashedSegments < ctx->segmentCount) &&
+			!CseSegmentedDownload_IsComplete(ctx, ctx->hashedSegments) &&
+			(ctx->activeWorkers > 0) && !ctx->failed)
+		{
+			SleepConditionVariableSRW(&ctx->progress, &ctx->lock, INFINITE, 0);
+		}
+
+		index = ctx->hashedSegments;
+		ready = (index < ctx->segmentCount) && CseSegmentedDownload_IsComplete(ctx, index) && !ctx->failed;
+
+		ReleaseSRWLockExclusive(&ctx->lock);
+
+		if (!ready)
+			break;
+
+		if (!CseSegmentedDownload_Hash(ctx, index))
+		{
+			AcquireSRWLockExclusive(&ctx->lock);
+			ctx->failed = true;
+			ReleaseSRWLockExclusive(&ctx->lock);
+			break;
+		}
+
+		ctx->hashedSegments++;
+		transfer->state.received = CseSegmentedDownload_GetStart(ctx, index) + CseSegmentedDownload_GetLength(ctx, index);
+		CseDownload_SaveResumeState(transfer);
+	}
+
+	WaitForMultipleObjects((DWORD) threadCount, threads, TRUE, INFINITE);
+
+	for (int i = 0; i < threadCount; ++i)
+		CloseHandle(threads[i]);
+
+	// Workers have flushed their data, so everything hashed is in the file.
+	// Received data then matches the hash for whatever continues the download
+	if (transfer->hash && (ctx->hashOffset > transfer->state.received))
+	{
+		transfer->state.received = ctx->hashOffset;
+		CseDownload_SaveResumeState(transfer);
+	}
+
+	if (ctx->probe)
+	{
+		CseHttpRequest_Free(ctx->probe);
+		ctx->probe = NULL;
+	}
+
+	if (ctx->failed)
+		return CSE_TRANSFER_FAILED;
+
+	if (ctx->changed)
+	{
+		CseSegmentedDownload_Reset(ctx);
+		return CseDownload_Restart(transfer) ? CSE_TRANSFER_INTERRUPTED : CSE_TRANSFER_FAILED;
+	}
+
+	if (ctx->hashedSegments < ctx->segmentCount)
+	{
+		CSE_LOG_WARN("Download interrupted, %llu bytes are complete", (unsigned long long) transfer->state.received);
+		return CSE_TRANSFER_INTERRUPTED;
+	}
+
+	return CSE_TRANSFER_COMPLETE;
+}
+
+// Mirrors serve the file under the same name as url, which is appended to
+// the mirror URL along with suffix. Returns NULL if the result doesn't fit
+// in a URL
+static char* CseDownload_GetMirrorUrl(const char* mirror, const char* url, const char* suffix)
+{
+	char* mirrorUrl;
+	size_t mirrorLength = strlen(mirror);
+	size_t suffixLength = strlen(suffix);
+	size_t nameLength;
+	const char* name = strrchr(url, '/');
+
+	name = name ? name + 1 : url;
+	nameLength = strcspn(name, "?#");
+
+	if (mirrorLength + nameLength + suffixLength + 2 > CSE_DOWNLOAD_URL_SIZE)
+		return NULL;
+
+	mirrorUrl = malloc(mirrorLength + nameLength + suffixLength + 2);
+	if (!mirrorUrl)
+		return NULL;
+
+	memcpy(mirrorUrl, mirror, mirrorLength);
+
+	if (!mirrorLength || (mirror[mirrorLength - 1] != '/'))
+		mirrorUrl[mirrorLength++] = '/';
+
+	memcpy(mirrorUrl + mirrorLength, name, nameLength);
+	memcpy(mirrorUrl + mirrorLength + nameLength, suffix, suffixLength + 1);
+
+	return mirrorUrl;
+}
+
+typedef struct
+{
+	char* url;
+	bool compressed;   // serves a zstd stream of the file, decoded as it is received
+	bool official;     // the URL the download was asked for rather than a mirror
+	uint32_t latency;  // milliseconds until the probe response, UINT32_MAX if there was none
+} CseDownloadSource;
+
+typedef struct
+{
+	CseHttp* http;
+	CseDownloadSource* source;
+	HANDLE thread;
+} CseDownloadProbe;
+
+// Probes go through the download session with short timeouts of their own,
+// so the connection of the source picked is already open for the download
+static DWORD WINAPI CseDownload_ProbeThread(LPVOID param)
+{
+	CseDownloadProbe* probe = (CseDownloadProbe*) param;
+	CseDownloadSource* source = probe->source;
+	CseHttpRequest* request;
+	uint8_t buffer[16];
+	size_t read;
+	uint32_t error = 0;
+	uint32_t status;
+	ULONGLONG start;
+
+	start = GetTickCount64();
+	request = CseHttp_GetWithTimeout(
+		probe->http, source->url, "Range: bytes=0-0\r\n", CSE_DOWNLOAD_PROBE_TIMEOUT, &error);
+
+	if (request)
+	{
+		status = CseHttpRequest_GetResponse(request)->status;
+
+		if ((status == 200) || (status == 206))
+			source->latency = (uint32_t) (GetTickCount64() - start);
+		else if (source->compressed)
+			CSE_LOG_DEBUG("Mirror %s has no compressed file (%u)", source->url, (unsigned) status);
+		else
+			CSE_LOG_WARN("Mirror %s answered with HTTP status %u", source->url, (unsigned) status);
+
+		// Connection only goes back to the session once the byte asked for
+		// is read; a whole file sent instead is not worth waiting for
+		if (status == 206)
+		{
+			while (CseHttpRequest_Read(request, buffer, sizeof(buffer), &read, &error) && read)
+				;
+		}
+
+		CseHttpRequest_Free(request);
+	}
+	else
+	{
+		CSE_LOG_WARN("Mirror %s is not reachable (%lu)", source->url, (unsigned long) error);
+	}
+
+	return 0;
+}
+
+// Places the download may come from, the fastest first
+typedef struct
+{
+	CseDownloadSource* items;
+	int count;
+	int current;
+} CseDownloadSources;
+
+static void CseDownloadSources_Free(CseDownloadSources* ctx)
+{
+	int index;
+
+	for (index = 0; index < ctx->count; index++)
+		free(ctx->items[index].url);
+
+	free(ctx->items);
+	ZeroMemory(ctx, sizeof(CseDownloadSources));
+}
+
+static void CseDownloadSources_AddMirror(CseDownloadSources* ctx, const char* mirror, const char* url, bool compressed)
+{
+	CseDownloadSource* source = &ctx->items[ctx->count];
+
+	source->url = CseDownload_GetMirrorUrl(mirror, url, compressed ? CSE_DOWNLOAD_COMPRESSED_SUFFIX : "");
+	source->compressed = compressed;
+	source->latency = UINT32_MAX;
+
+	if (source->url)
+		ctx->count++;
+	else
+		CSE_LOG_WARN("Ignoring mirror %s", mirror);
+}
+
+// Mirrors, with their compressed file, and url are all asked for the first
+// byte at once. Those which answered are ordered by response time; url is
+// kept last even if it didn't answer, mirrors which didn't are left out
+static bool CseDownloadSources_Init(
+	CseDownloadSources* ctx,
+	CseHttp* http,
+	const char* url,
+	const CseDownloadOptions* options)
+{
+	CseDownloadProbe* probes = NULL;
+	CseDownloadSource* items;
+	int mirrorCount = options ? options->mirrorCount : 0;
+	int probeCount = 0;
+	int index;
+	int next;
+
+	ZeroMemory(ctx, sizeof(CseDownloadSources));
+
+	ctx->items = calloc(mirrorCount * 2 + 1, sizeof(CseDownloadSource));
+	if (!ctx->items)
+		return false;
+
+	items = ctx->items;
+
+	// Compressed file is listed right before the plain one of the same mirror
+	for (index = 0; index < mirrorCount; index++)
+	{
+		CseDownloadSources_AddMirror(ctx, options->mirrors[index], url, true);
+		CseDownloadSources_AddMirror(ctx, options->mirrors[index], url, false);
+	}
+
+	items[ctx->count].url = _strdup(url);
+	items[ctx->count].official = true;
+	items[ctx->count].latency = UINT32_MAX;
+	if (!items[ctx->count].url)
+		goto error;
+
+	ctx->count++;
+
+	if (ctx->count == 1)
+		return true;
+
+	probes = calloc(ctx->count, sizeof(CseDownloadProbe));
+	if (!probes)
+		goto error;
+
+	for (index = 0; index < ctx->count; index++)
+	{
+		probes[index].http = http;
+		probes[index].source = &items[index];
+		probes[index].thread = CreateThread(NULL, 0, CseDownload_ProbeThread, &probes[index], 0, NULL);
+
+		if (!probes[index].thread)
+			break;
+
+		probeCount++;
+	}
+
+	for (index = 0; index < probeCount; index++)
+	{
+		WaitForSingleObject(probes[index].thread, INFINITE);
+		CloseHandle(probes[index].thread);
+	}
+
+	free(probes);
+
+	// A mirror's compressed file is preferred over its plain one, which
+	// stays next to it as a fallback
+	for (index = 0; index + 1 < ctx->count; index++)
+	{
+		if (items[index].compressed && (items[index].latency != UINT32_MAX) &&
+			(items[index + 1].latency != UINT32_MAX))
+		{
+			if (items[index + 1].latency < items[index].latency)
+				items[index].latency = items[index + 1].latency;
+
+			items[index + 1].latency = items[index].latency;
+		}
+	}
+
+	// Official URL is compared with the mirrors, but never dropped
+	if (items[ctx->count - 1].latency == UINT32_MAX)
+		items[ctx->count - 1].latency = UINT32_MAX - 1;
+
+	for (index = 1; index < ctx->count; index++)
+	{
+		CseDownloadSource source = items[index];
+
+		for (next = index; (next > 0) && (items[next - 1].latency > source.latency); next--)
+			items[next] = items[next - 1];
+
+		items[next] = source;
+	}
+
+	while (items[ctx->count - 1].latency == UINT32_MAX)
+	{
+		ctx->count--;
+		free(items[ctx->count].url);
+		items[ctx->count].url = NULL;
+	}
+
+	for (index = 0; index < ctx->count; index++)
+		CSE_LOG_DEBUG("Download source %s (%u ms)", items[index].url, (unsigned) items[index].latency);
+
+	return true;
+
+error:
+	free(probes);
+	CseDownloadSources_Free(ctx);
+	return false;
+}
+
+// Official URL is always kept, but may have been sorted anywhere
+static int CseDownloadSources_GetOfficial(const CseDownloadSources* ctx)
+{
+	int index;
+
+	for (index = 0; index < ctx->count; index++)
+	{
+		if (ctx->items[index].official)
+			break;
+	}
+
+	return index;
+}
+
+// Makes the next requests go to source. The received part is kept when the
+// source can continue it: a compressed stream always starts over, and
+// another server only continues when the digest can tell whether both have
+// served the same file
+static bool CseDownload_SetSource(CseDownloadTransfer* transfer, const CseDownloadSource* source, bool otherServer)
+{
+	transfer->url = source->url;
+	transfer->compressed = source->compressed;
+	transfer->mirror = !source->official;
+
+	if (transfer->state.received && (source->compressed || (otherServer && !transfer->hash)))
+		return CseDownload_Restart(transfer);
+
+	return true;
+}
+
+// Moves on to the next source after an interrupted attempt
+static bool CseDownload_SwitchSource(
+	CseDownloadTransfer* transfer,
+	CseSegmentedDownload* segmented,
+	CseDownloadSources* sources)
+{
+	sources->current = (sources->current + 1) % sources->count;
+
+	CSE_LOG_INFO("Continuing download from %s", sources->items[sources->current].url);
+
+	// Validators belong to the previous server
+	transfer->state.etag[0] = '\0';
+	transfer->state.lastModified[0] = '\0';
+
+	if (segmented)
+	{
+		CseSegmentedDownload_Reset(segmented);
+		segmented->unsupported = false;
+	}
+
+	return CseDownload_SetSource(transfer, &sources->items[sources->current], true);
+}
+
+static const char* CseDownload_ResultName(CseDownloadResult result)
+{
+	switch (result)
+	{
+		case CSE_DOWNLOAD_OK:
+			return "ok";
+		case CSE_DOWNLOAD_PARAM:
+			return "param";
+		case CSE_DOWNLOAD_NOMEM:
+			return "nomem";
+		case CSE_DOWNLOAD_INTEGRITY:
+			return "integrity";
+		case CSE_DOWNLOAD_CANCELLED:
+			return "cancelled";
+		default:
+			return "failure";
+	}
+}
+
+static void CseDownload_SetTiming(JSON_Object* object, const char* name, uint32_t value)
+{
+	if (value != CSE_HTTP_TIME_NONE)
+		lz_json_object_set_number(object, name, value);
+	else
+		lz_json_object_set_null(object, name);
+}
+
+static void CseDownload_WriteSummary(const char* path, const char* summary)
+{
+	FILE* fp;
+	bool result;
+	WCHAR* pathW = LzUnicode_UTF8toUTF16_dup(path);
+
+	if (!pathW)
+		return;
+
+	fp = _wfopen(pathW, L"wb");
+	free(pathW);
+
+	if (!fp)
+	{
+		CSE_LOG_WARN("Failed to write download summary %s", path);
+		return;
+	}
+
+	result = fputs(summary, fp) >= 0;
+
+	if ((fclose(fp) != 0) || !result)
+		CSE_LOG_WARN("Failed to write download summary %s", path);
+}
+
+// Logs what the download went through, and writes it as JSON to summaryPath
+// if it is not NULL
+static void CseDownloadThrottle_Summarize(
+	CseDownloadThrottle* ctx,
+	const char* url,
+	CseDownloadResult result,
+	const char* summaryPath)
+{
+	CseDownloadStats* stats = &ctx->stats;
+	uint64_t duration = ctx->clock.Now(ctx->clock.param) - stats->start;
+	uint64_t rate = duration ? (stats->bytes * 1000 / duration) : stats->bytes;
+	uint64_t writeBlocked = (uint64_t) stats->writeBlockedTime;
+	JSON_Value* root = lz_json_value_init_object();
+	JSON_Value* samples = lz_json_value_init_array();
+	JSON_Object* object = lz_json_value_get_object(root);
+	JSON_Array* array = lz_json_value_get_array(samples);
+	char* summary = NULL;
+	uint32_t index;
+
+	CSE_LOG_INFO("Received %llu bytes in %llu ms (%llu bytes/s): %u requests, %u new connections, "
+		"%u stalls for %llu ms, %llu ms waiting for the disk",
+		(unsigned long long) stats->bytes,
+		(unsigned long long) duration,
+		(unsigned long long) rate,
+		(unsigned) stats->requests,
+		(unsigned) stats->connections,
+		(unsigned) stats->stalls,
+		(unsigned long long) stats->stallTime,
+		(unsigned long long) writeBlocked);
+
+	if (!object || !array)
+		goto exit;
+
+	lz_json_object_set_string(object, "url", url);
+
+	if (stats->source[0])
+		lz_json_object_set_string(object, "source", stats->source);
+	else
+		lz_json_object_set_null(object, "source");
+
+	lz_json_object_set_string(object, "result", CseDownload_ResultName(result));
+	lz_json_object_set_number(object, "bytes", (double) stats->bytes);
+	lz_json_object_set_number(object, "durationMs", (double) duration);
+	lz_json_object_set_number(object, "bytesPerSecond", (double) rate);
+	lz_json_object_set_number(object, "requests", stats->requests);
+	lz_json_object_set_number(object, "newConnections", stats->connections);
+	CseDownload_SetTiming(object, "resolveMs", stats->first.resolve);
+	CseDownload_SetTiming(object, "connectMs", stats->first.connect);
+	CseDownload_SetTiming(object, "tlsMs", stats->first.tls);
+	CseDownload_SetTiming(object, "firstByteMs", stats->first.firstByte);
+
+	if (stats->requests)
+		lz_json_object_set_number(object, "averageFirstByteMs", (double) (stats->firstByteTotal / stats->requests));
+	else
+		lz_json_object_set_null(object, "averageFirstByteMs");
+
+	lz_json_object_set_number(object, "stalls", stats->stalls);
+	lz_json_object_set_number(object, "stallMs", (double) stats->stallTime);
+	lz_json_object_set_number(object, "longestStallMs", (double) stats->longestStall);
+	lz_json_object_set_number(object, "writeBlockedMs", (double) writeBlocked);
+
+	for (index = 0; stats->samples && (index < stats->sampleCount); index++)
+		lz_json_array_append_number(array, (double) stats->samples[index]);
+
+	// Owned by the root from here on
+	lz_json_object_set_value(object, "samples", samples);
+	samples = NULL;
+
+	summary = lz_json_serialize_to_string(root);
+	if (!summary)
+		goto exit;
+
+	CSE_LOG_INFO("Download summary: %s", summary);
+
+	if (summaryPath)
+		CseDownload_WriteSummary(summaryPath, summary);
+
+exit:
+	if (summary)
+		lz_json_free_serialized_string(summary);
+
+	if (samples)
+		lz_json_value_free(samples);
+
+	if (root)
+		lz_json_value_free(root);
+}
+
+// Downloads url to path; state of the completed file is copied to completed
+// if it is not NULL. A response already received for url is taken over as
+// the first attempt, it is freed here in any case
+static CseDownloadResult CseDownload_Fetch(
+	CseHttp* http,
+	const char* url,
+	const char* path,
+	const uint8_t* sha256,
+	const CseDownloadOptions* options,
+	CseDownloadThrottle* throttle,
+	CseHttpRequest* response,
+	CseDownloadResumeState* completed)
+{
+	CseDownloadResult result = CSE_DOWNLOAD_FAILURE;
+	CseTransferStatus status = CSE_TRANSFER_INTERRUPTED;
+	CseDownloadTransfer transfer;
+	CseSegmentedDownload segmented;
+	CseDownloadSources sources;
+	bool useSegments = options && (options->connections > 1);
+	char partialPath[LZ_MAX_PATH];
+	char statePath[LZ_MAX_PATH];
+	WCHAR* pathW = NULL;
+	WCHAR* partialPathW = NULL;
+	WCHAR* statePathW = NULL;
+	uint8_t digest[CSE_SHA256_DIGEST_SIZE];
+	bool discard = false;
+	int maxAttempts;
+	int attempt;
+
+	ZeroMemory(&transfer, sizeof(transfer));
+	ZeroMemory(&segmented, sizeof(segmented));
+	ZeroMemory(&sources, sizeof(sources));
+
+	if (strlen(url) >= CSE_DOWNLOAD_URL_SIZE)
+	{
+		CSE_LOG_ERROR("Download URL is too long");
+		result = CSE_DOWNLOAD_PARAM;
+		goto exit;
+	}
+
+	if ((snprintf(partialPath, sizeof(partialPath), "%s" CSE_DOWNLOAD_PARTIAL_SUFFIX, path) >= sizeof(partialPath)) ||
+		(snprintf(statePath, sizeof(statePath), "%s" CSE_DOWNLOAD_RESUME_SUFFIX, path) >= sizeof(statePath)))
+	{
+		result = CSE_DOWNLOAD_PARAM;
+		goto exit;
+	}
+
+	pathW = LzUnicode_UTF8toUTF16_dup(path);
+	partialPathW = LzUnicode_UTF8toUTF16_dup(partialPath);
+	statePathW = LzUnicode_UTF8toUTF16_dup(statePath);
+
+	if (!pathW || !partialPathW || !statePathW)
+	{
+		result = CSE_DOWNLOAD_PARAM;
+		goto exit;
+	}
+
+	transfer.statePath = statePathW;
+	transfer.throttle = throttle;
+	transfer.buffer = malloc(CSE_DOWNLOAD_BUFFER_SIZE);
+
+	if (!transfer.buffer)
+	{
+		result = CSE_DOWNLOAD_NOMEM;
+		goto exit;
+	}
+
+	if (sha256)
+	{
+		transfer.hash = CseSha256_New();
+		if (!transfer.hash)
+		{
+			result = CSE_DOWNLOAD_NOMEM;
+			goto exit;
+		}
+	}
+
+	if (!CseDownload_OpenPartial(&transfer, partialPathW, url))
+	{
+		CSE_LOG_ERROR("Failed to open partial download file: %s", partialPath);
+		goto exit;
+	}
+
+	if (!CseDownloadSources_Init(&sources, http, url, options))
+	{
+		result = CSE_DOWNLOAD_NOMEM;
+		goto exit;
+	}
+
+	// Partial file may come from another source, the digest checks it then
+	if ((sources.count > 1) && transfer.hash)
+	{
+		transfer.state.etag[0] = '\0';
+		transfer.state.lastModified[0] = '\0';
+	}
+
+	// Response was sent by url, so it is continued from there
+	if (response)
+		sources.current = CseDownloadSources_GetOfficial(&sources);
+
+	transfer.failover = sources.count > 1;
+
+	if (!CseDownload_SetSource(&transfer, &sources.items[sources.current], false))
+		goto exit;
+
+	if (useSegments)
+		CseSegmentedDownload_Init(&segmented, &transfer, http, options);
+
+	// Every source gets a chance before the retries run out
+	maxAttempts = CSE_DOWNLOAD_MAX_ATTEMPTS + sources.count - 1;
+
+	for (attempt = 1; attempt <= maxAttempts; attempt++)
+	{
+		if (response)
+		{
+			CseDownload_AddRequest(&transfer, response);
+			status = CseDownload_Receive(&transfer, response);
+			CseHttpRequest_Free(response);
+			response = NULL;
+		}
+		// Compressed stream can only be decoded in order
+		else if (useSegments && !transfer.compressed)
+			status = CseSegmentedDownload_Run(&segmented);
+		else
+			status = CseDownload_Transfer(&transfer, http);
+
+		if ((status != CSE_TRANSFER_INTERRUPTED) || (attempt == maxAttempts) || CseDownloadThrottle_IsCancelled(throttle))
+			break;
+
+		// Another source is tried right away, the retry delay only gives the
+		// same source time to recover
+		if (sources.count > 1)
+		{
+			if (!CseDownload_SwitchSource(&transfer, useSegments ? &segmented : NULL, &sources))
+			{
+				status = CSE_TRANSFER_FAILED;
+				break;
+			}
+
+			continue;
+		}
+
+		CSE_LOG_INFO("Retrying download (%d/%d)", attempt + 1, maxAttempts);
+		Sleep(CSE_DOWNLOAD_RETRY_DELAY * attempt);
+	}
+
+	if ((status == CSE_TRANSFER_INTERRUPTED) && CseDownloadThrottle_IsCancelled(throttle))
+	{
+		CSE_LOG_INFO("Download cancelled, %llu bytes are kept to resume it later",
+			(unsigned long long) transfer.state.received);
+		result = CSE_DOWNLOAD_CANCELLED;
+		goto exit;
+	}
+
+	if (status == CSE_TRANSFER_INTERRUPTED)
+	{
+		CSE_LOG_ERROR("Download failed, %llu bytes are kept to resume it later",
+			(unsigned long long) transfer.state.received);
+		goto exit;
+	}
+
+	if (status != CSE_TRANSFER_COMPLETE)
+	{
+		discard = true;
+		goto exit;
+	}
+
+	CloseHandle(transfer.file);
+	transfer.file = NULL;
+
+	if (transfer.hash)
+	{
+		if (!CseSha256_Finish(transfer.hash, digest))
+		{
+			discard = true;
+			goto exit;
+		}
+
+		if (memcmp(digest, sha256, CSE_SHA256_DIGEST_SIZE) != 0)
+		{
+			char actualHash[CSE_SHA256_HEX_SIZE];
+			char expectedHash[CSE_SHA256_HEX_SIZE];
+			CseSha256_ToHex(digest, actualHash);
+			CseSha256_ToHex(sha256, expectedHash);
+			CSE_LOG_ERROR("Downloaded file is corrupted: SHA-256 is %s, expected %s", actualHash, expectedHash);
+			result = CSE_DOWNLOAD_INTEGRITY;
+			discard = true;
+			goto exit;
+		}
+	}
+
+	if (!MoveFileExW(partialPathW, pathW, MOVEFILE_REPLACE_EXISTING))
+	{
+		CSE_LOG_ERROR("Failed to move downloaded file to %s (%lu)", path, GetLastError());
+		goto exit;
+	}
+
+	DeleteFileW(statePathW);
+
+	if (completed)
+		memcpy(completed, &transfer.state, sizeof(CseDownloadResumeState));
+
+	// File size is only known for sure now if it came compressed
+	CseDownloadThrottle_SetPosition(throttle, transfer.state.received, transfer.state.received);
+	CseDownloadThrottle_Complete(throttle);
+
+	result = CSE_DOWNLOAD_OK;
+
+exit:
+	if (response)
+		CseHttpRequest_Free(response);
+
+	if (transfer.url)
+		CseDownload_CopyValue(throttle->stats.source, sizeof(throttle->stats.source), transfer.url);
+
+	if (transfer.file)
+		CloseHandle(transfer.file);
+
+	// Interrupted downloads are kept for the next attempt, broken ones are not
+	if (discard)
+	{
+		DeleteFileW(partialPathW);
+		DeleteFileW(statePathW);
+	}
+
+	CseSegmentedDownload_Reset(&segmented);
+	CseDownloadSources_Free(&sources);
+
+	if (transfer.hash)
+		CseSha256_Free(transfer.hash);
+
+	if (transfer.buffer)
+		free(transfer.buffer);
+
+	free(pathW);
+	free(partialPathW);
+	free(statePathW);
 
-int CseDownload_OnWriteFile(void* param, LzHttp* ctx, uint8_t* data, DWORD len)
+	return result;
+}
+
+// Cached files are named after their URL, which changes with every version
+static bool CseDownload_GetCachePath(const char* directory, const char* url, char* path, size_t pathSize)
 {
-	FILE* fp = (FILE*) param;
-	fwrite(data, sizeof(uint8_t), len, fp);
+	uint8_t digest[CSE_SHA256_DIGEST_SIZE];
+	char hash[CSE_SHA256_HEX_SIZE];
+	char fileName[32];
 
-	return 0;
+	if (!CseSha256_Compute((const uint8_t*) url, strlen(url), digest))
+		return false;
+
+	CseSha256_ToHex(digest, hash);
+	snprintf(fileName, sizeof(fileName), "%.16s.msi", hash);
+
+	if (strlen(directory) + sizeof(fileName) + sizeof(CSE_DOWNLOAD_PARTIAL_SUFFIX) >= pathSize)
+		return false;
+
+	path[0] = '\0';
+	LzPathCchAppend(path, pathSize, directory);
+	LzPathCchAppend(path, pathSize, fileName);
+
+	return true;
 }
 
-CseDownloadResult CseDownload_DownloadMsi(WaykBinariesBitness bitness, const char* msiPath)
+// With a known digest the cached file itself is checked and the server isn't
+// asked at all; otherwise it is revalidated with the etag and date received
+// along with it. A new file sent instead is handed over in *response
+static bool CseDownload_IsCacheValid(
+	CseHttp* http,
+	const char* url,
+	const WCHAR* cachePathW,
+	const WCHAR* entryPathW,
+	const uint8_t* sha256,
+	CseHttpRequest** response)
 {
-	CseDownloadResult result = CSE_DOWNLOAD_FAILURE;
-	int status;
-	FILE* fp = NULL;
-	WCHAR* msiPathW = NULL;
-	LzHttp* http = NULL;
-	char* response = NULL;
+	bool valid = false;
+	CseDownloadResumeState entry;
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	uint8_t digest[CSE_SHA256_DIGEST_SIZE];
+	char headers[CSE_HTTP_ETAG_SIZE + CSE_HTTP_DATE_SIZE + 64];
+	CseHttpRequest* request = NULL;
 	uint32_t error = 0;
-	const char* keyLine;
-	const char* keyValue;
-	char key[128];
-	char msiUrl[MAX_PATH];
-	int msiUrlLen = 0;
+	int length = 0;
+
+	if (!CseDownload_LoadResumeState(entryPathW, &entry) || (strcmp(entry.url, url) != 0))
+		return false;
+
+	if (!GetFileAttributesExW(cachePathW, GetFileExInfoStandard, &attributes) ||
+		((((uint64_t) attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow) != entry.received))
+	{
+		return false;
+	}
+
+	if (sha256)
+	{
+		return CseSha256_ComputeFile(cachePathW, entry.received, digest) &&
+			(memcmp(digest, sha256, CSE_SHA256_DIGEST_SIZE) == 0);
+	}
+
+	// Nothing to revalidate with
+	if (!entry.etag[0] && !entry.lastModified[0])
+		return false;
+
+	if (entry.etag[0])
+		length = snprintf(headers, sizeof(headers), "If-None-Match: %s\r\n", entry.etag);
+
+	if (entry.lastModified[0])
+		snprintf(headers + length, sizeof(headers) - length, "If-Modified-Since: %s\r\n", entry.lastModified);
+
+	request = CseHttp_Get(http, url, headers, &error);
+
+	if (!request)
+	{
+		CSE_LOG_WARN("Failed to revalidate cached file (%lu)", (unsigned long) error);
+		return false;
+	}
+
+	valid = CseHttpRequest_GetResponse(request)->status == 304;
+
+	// New file comes with the answer, its body is received into the cache
+	if (!valid && (CseHttpRequest_GetResponse(request)->status == 200))
+		*response = request;
+	else
+		CseHttpRequest_Free(request);
+
+	return valid;
+}
+
+// Cached file is linked to path rather than copied, the MSI is large and
+// both are on the same volume most of the time
+static bool CseDownload_LinkCachedFile(const WCHAR* cachePathW, const WCHAR* pathW)
+{
+	DeleteFileW(pathW);
+
+	if (CreateHardLinkW(pathW, cachePathW, NULL))
+		return true;
+
+	CSE_LOG_DEBUG("Failed to link cached file (%lu), copying it", GetLastError());
 
-	snprintf(key, sizeof(key), "WaykAgentmsi%s.Url", bitness == WAYK_BINARIES_BITNESS_X64 ? "64" : "86");
+	return CopyFileW(cachePathW, pathW, FALSE) ? true : false;
+}
+
+// Downloads into the cache directory unless it already holds the current
+// file, then links the cached file to path
+static CseDownloadResult CseDownload_CachedFile(
+	CseHttp* http,
+	const char* url,
+	const char* path,
+	const uint8_t* sha256,
+	const CseDownloadOptions* options,
+	CseDownloadThrottle* throttle)
+{
+	CseDownloadResult result = CSE_DOWNLOAD_FAILURE;
+	CseDownloadResumeState entry;
+	char cachePath[LZ_MAX_PATH];
+	char entryPath[LZ_MAX_PATH];
+	WCHAR* pathW = NULL;
+	WCHAR* cachePathW = NULL;
+	WCHAR* entryPathW = NULL;
+	CseHttpRequest* response = NULL;
 
-	msiPathW = LzUnicode_UTF8toUTF16_dup(msiPath);
+	if (!LzFile_Exists(options->cacheDirectory) && (LzMkPath(options->cacheDirectory, 0) != LZ_OK))
+	{
+		CSE_LOG_WARN("Failed to create cache directory %s, downloading without cache", options->cacheDirectory);
+		return CseDownload_Fetch(http, url, path, sha256, options, throttle, NULL, NULL);
+	}
 
-	if (!msiPathW)
+	if (!CseDownload_GetCachePath(options->cacheDirectory, url, cachePath, sizeof(cachePath)) ||
+		(snprintf(entryPath, sizeof(entryPath), "%s" CSE_DOWNLOAD_CACHE_SUFFIX, cachePath) >= sizeof(entryPath)))
 	{
 		result = CSE_DOWNLOAD_PARAM;
 		goto exit;
 	}
 
-	http = LzHttp_New(CSE_USER_AGENT);
+	pathW = LzUnicode_UTF8toUTF16_dup(path);
+	cachePathW = LzUnicode_UTF8toUTF16_dup(cachePath);
+	entryPathW = LzUnicode_UTF8toUTF16_dup(entryPath);
 
-	if (!http)
+	if (!pathW || !cachePathW || !entryPathW)
 	{
-		result = CSE_DOWNLOAD_NOMEM;
+		result = CSE_DOWNLOAD_PARAM;
 		goto exit;
 	}
 
-	CSE_LOG_INFO("Requesting MSI URL");
+	if (CseDownload_IsCacheValid(http, url, cachePathW, entryPathW, sha256, &response))
+	{
+		CSE_LOG_INFO("Using cached file %s", cachePath);
+		CseDownload_CopyValue(throttle->stats.source, sizeof(throttle->stats.source), "cache");
+	}
+	else
+	{
+		// Entry describes a complete file only, it is written again after the download
+		DeleteFileW(entryPathW);
 
-	status = LzHttp_Get(http, "https://www.devolutions.net/productinfo.htm", NULL, NULL, &error);
+		result = CseDownload_Fetch(http, url, cachePath, sha256, options, throttle, response, &entry);
+
+		if (result != CSE_DOWNLOAD_OK)
+			goto exit;
 
-	if (status != LZ_OK)
-	{
-		CSE_LOG_ERROR("HTTP request failed %d (%lu)", status, error);
 		result = CSE_DOWNLOAD_FAILURE;
+
+		if (!CseDownload_SaveState(entryPathW, &entry))
+			CSE_LOG_WARN("Failed to save cache entry for %s", cachePath);
+	}
+
+	if (!CseDownload_LinkCachedFile(cachePathW, pathW))
+	{
+		CSE_LOG_ERROR("Failed to copy cached file to %s (%lu)", path, GetLastError());
 		goto exit;
 	}
 
-	response = LzHttp_Response(http);
+	result = CSE_DOWNLOAD_OK;
+
+exit:
+	free(pathW);
+	free(cachePathW);
+	free(entryPathW);
+
+	return result;
+}
+
+// Every request of a download run goes through the same session: WinHTTP
+// keeps connections, TLS sessions and proxy authentication per session, so
+// only the first request to a host pays for them
+static CseHttp* CseDownload_NewSession()
+{
+	CseHttp* http = CseHttp_New(CSE_USER_AGENT);
+
+	if (http)
+		CseHttp_SetRecvTimeout(http, CSE_DOWNLOAD_RECV_TIMEOUT);
+
+	return http;
+}
 
-	if (!response)
+static void CseDownloadSession_Release(CseDownloadSession* ctx)
+{
+	if (InterlockedDecrement(&ctx->refCount) == 0)
 	{
-		CSE_LOG_ERROR("Bad HTTP response");
-		result = CSE_DOWNLOAD_FAILURE;
-		goto exit;
+		CseHttp_Free(ctx->http);
+		free(ctx);
 	}
+}
+
+static void CseDownloadConnect_Free(CseDownloadConnect* ctx)
+{
+	for (int i = 0; i < ctx->urlCount; ++i)
+		free(ctx->urls[i]);
+
+	free(ctx->urls);
+	free(ctx);
+}
 
-	keyLine = strstr(response, key);
+// Requests without a body leave open connections in the session, which the
+// download requests pick up
+static DWORD WINAPI CseDownloadConnect_Thread(LPVOID param)
+{
+	CseDownloadConnect* ctx = (CseDownloadConnect*) param;
+	CseHttpRequest* request;
+	uint32_t error = 0;
+	ULONGLONG start;
 
-	if (!keyLine)
+	for (int i = 0; i < ctx->urlCount; ++i)
 	{
-		CSE_LOG_ERROR("Bad HTTP response. Key %s not found.", key);
-		result = CSE_DOWNLOAD_FAILURE;
-		goto exit;
+		start = GetTickCount64();
+		request = CseHttp_Head(ctx->session->http, ctx->urls[i], NULL, &error);
+
+		if (request)
+		{
+			CSE_LOG_DEBUG("Connected to %s in %u ms", ctx->urls[i], (unsigned) (GetTickCount64() - start));
+			CseHttpRequest_Free(request);
+		}
+		else
+		{
+			CSE_LOG_DEBUG("Failed to connect to %s ahead of the download (%lu)", ctx->urls[i], (unsigned long) error);
+		}
 	}
 
-	keyValue = strstr(keyLine, "=");
+	CseDownloadSession_Release(ctx->session);
+	CseDownloadConnect_Free(ctx);
+	return 0;
+}
+
+void CseDownloadSession_Connect(CseDownloadSession* ctx, const char* const* urls, int urlCount)
+{
+	CseDownloadConnect* connect;
+	HANDLE thread;
+
+	if (urlCount <= 0)
+		return;
+
+	connect = calloc(1, sizeof(CseDownloadConnect));
+	if (!connect)
+		goto error;
+
+	connect->urls = calloc(urlCount, sizeof(char*));
+	if (!connect->urls)
+		goto error;
 
-	if (!keyValue)
+	for (connect->urlCount = 0; connect->urlCount < urlCount; connect->urlCount++)
 	{
-		CSE_LOG_ERROR("Bad HTTP response. Key value not found.");
-		result = CSE_DOWNLOAD_FAILURE;
-		goto exit;
+		connect->urls[connect->urlCount] = _strdup(urls[connect->urlCount]);
+		if (!connect->urls[connect->urlCount])
+			goto error;
 	}
 
-	keyValue++;
+	connect->session = ctx;
+	InterlockedIncrement(&ctx->refCount);
 
-	while ((*keyValue != 0) && (*keyValue != '\r'))
+	thread = CreateThread(NULL, 0, CseDownloadConnect_Thread, connect, 0, NULL);
+	if (!thread)
 	{
-		msiUrl[msiUrlLen++] = *keyValue;
-		keyValue++;
+		CSE_LOG_WARN("Failed to start connect thread (%lu)", GetLastError());
+		CseDownloadSession_Release(ctx);
+		CseDownloadConnect_Free(connect);
+		return;
 	}
 
-	msiUrl[msiUrlLen] = '\0';
+	CloseHandle(thread);
+	return;
+
+error:
+	CSE_LOG_ERROR("Allocation failed");
+	if (connect)
+		CseDownloadConnect_Free(connect);
+}
 
-	LzHttp_Free(http);
-	http = NULL;
+CseDownloadSession* CseDownloadSession_New(const char* const* urls, int urlCount)
+{
+	// Everything the MSI download goes through when options.json sets no mirrors
+	static const char* const defaultUrls[] = { CSE_PRODUCT_INFO_URL, CSE_DOWNLOAD_CDN_URL };
 
-	fp = _wfopen(msiPathW, L"wb");
+	CseDownloadSession* ctx = calloc(1, sizeof(CseDownloadSession));
+	if (!ctx)
+	{
+		CSE_LOG_ERROR("Allocation failed");
+		return NULL;
+	}
 
-	if (!fp)
+	ctx->http = CseDownload_NewSession();
+	if (!ctx->http)
 	{
-		CSE_LOG_ERROR("Failed to open temporary file: %s", msiPath);
-		result = CSE_DOWNLOAD_FAILURE;
+		free(ctx);
+		return NULL;
+	}
+
+	ctx->refCount = 1;
+
+	if (urls)
+		CseDownloadSession_Connect(ctx, urls, urlCount);
+	else
+		CseDownloadSession_Connect(ctx, defaultUrls, (int) (sizeof(defaultUrls) / sizeof(defaultUrls[0])));
+
+	return ctx;
+}
+
+void CseDownloadSession_Free(CseDownloadSession* ctx)
+{
+	CseDownloadSession_Release(ctx);
+}
+
+// Session prepared ahead of time if there is one, a new one otherwise;
+// *owned tells whether it has to be freed by the caller
+static CseHttp* CseDownload_GetSession(const CseDownloadOptions* options, bool* owned)
+{
+	*owned = !(options && options->session);
+
+	return *owned ? CseDownload_NewSession() : options->session->http;
+}
+
+static CseDownloadResult CseDownload_SessionFile(
+	CseHttp* http,
+	const char* url,
+	const char* path,
+	const uint8_t* sha256,
+	const CseDownloadOptions* options,
+	CseDownloadThrottle* throttle)
+{
+	if (options && options->cacheDirectory && options->cacheDirectory[0])
+		return CseDownload_CachedFile(http, url, path, sha256, options, throttle);
+
+	return CseDownload_Fetch(http, url, path, sha256, options, throttle, NULL, NULL);
+}
+
+CseDownloadResult CseDownload_File(
+	const char* url,
+	const char* path,
+	const uint8_t* sha256,
+	const CseDownloadOptions* options)
+{
+	CseDownloadResult result = CSE_DOWNLOAD_NOMEM;
+	CseDownloadThrottle throttle;
+	bool owned;
+	CseHttp* http = CseDownload_GetSession(options, &owned);
+
+	CseDownloadThrottle_Init(&throttle, options);
+
+	if (http)
+		result = CseDownload_SessionFile(http, url, path, sha256, options, &throttle);
+
+	CseDownloadThrottle_Summarize(&throttle, url, result, options ? options->summaryPath : NULL);
+	CseDownloadThrottle_Free(&throttle);
+
+	if (http && owned)
+		CseHttp_Free(http);
+
+	return result;
+}
+
+// productinfo.htm is a long list of "key=value" lines, grouped by product.
+// It is parsed as it is received, a line at a time, and the transfer stops
+// once all the wanted keys have been seen, or once the group of the first
+// (required) key has ended: the other keys are optional, they are never
+// published outside of that group
+typedef struct
+{
+	const char* key;
+	char* value;
+	size_t valueSize;
+	bool found;
+} CseProductInfoField;
+
+typedef struct
+{
+	CseProductInfoField* fields;
+	int fieldCount;
+	int foundCount;
+	const char* group;  // common key prefix of the fields, e.g. "WaykAgentmsi64."
+	char line[CSE_DOWNLOAD_URL_SIZE + 128];
+	size_t lineLength;
+	bool overflow;  // current line doesn't fit in the buffer, it is skipped
+} CseProductInfoParser;
+
+static void CseProductInfoParser_Init(
+	CseProductInfoParser* ctx,
+	const char* group,
+	CseProductInfoField* fields,
+	int fieldCount)
+{
+	ZeroMemory(ctx, sizeof(CseProductInfoParser));
+	ctx->group = group;
+	ctx->fields = fields;
+	ctx->fieldCount = fieldCount;
+}
+
+// Line past the group of the first field, once that field has been found
+static bool CseProductInfoParser_IsGroupEnd(CseProductInfoParser* ctx)
+{
+	ctx->line[ctx->lineLength] = '\0';
+
+	return ctx->fields[0].found && (strncmp(ctx->line, ctx->group, strlen(ctx->group)) != 0);
+}
+
+static void CseProductInfoParser_ParseLine(CseProductInfoParser* ctx)
+{
+	int index;
+
+	ctx->line[ctx->lineLength] = '\0';
+
+	for (index = 0; index < ctx->fieldCount; index++)
+	{
+		CseProductInfoField* field = &ctx->fields[index];
+		size_t keyLength = strlen(field->key);
+
+		if (field->found || (strncmp(ctx->line, field->key, keyLength) != 0) || (ctx->line[keyLength] != '='))
+			continue;
+
+		if (!CseDownload_CopyValue(field->value, field->valueSize, ctx->line + keyLength + 1))
+		{
+			CSE_LOG_ERROR("Value of %s is too long", field->key);
+			continue;
+		}
+
+		field->found = true;
+		ctx->foundCount++;
+	}
+}
+
+// Returns true once every field has been found or the group has ended, the
+// rest of the response is not needed then
+static bool CseProductInfoParser_Feed(CseProductInfoParser* ctx, const char* data, size_t size)
+{
+	size_t index;
+
+	for (index = 0; index < size; index++)
+	{
+		char c = data[index];
+
+		if ((c == '\r') || (c == '\n'))
+		{
+			if (!ctx->overflow && ctx->lineLength)
+			{
+				if (CseProductInfoParser_IsGroupEnd(ctx))
+					return true;
+
+				CseProductInfoParser_ParseLine(ctx);
+			}
+
+			ctx->lineLength = 0;
+			ctx->overflow = false;
+
+			if (ctx->foundCount == ctx->fieldCount)
+				return true;
+
+			continue;
+		}
+
+		if (ctx->lineLength + 1 >= sizeof(ctx->line))
+			ctx->overflow = true;
+		else
+			ctx->line[ctx->lineLength++] = c;
+	}
+
+	return false;
+}
+
+// Last line may have no line break
+static void CseProductInfoParser_Finish(CseProductInfoParser* ctx)
+{
+	if (!ctx->overflow && ctx->lineLength)
+		CseProductInfoParser_ParseLine(ctx);
+
+	ctx->lineLength = 0;
+}
+
+static CseDownloadResult CseDownload_GetProductInfo(
+	CseHttp* http,
+	const char* url,
+	const char* group,
+	CseProductInfoField* fields,
+	int fieldCount)
+{
+	CseDownloadResult result = CSE_DOWNLOAD_FAILURE;
+	CseProductInfoParser parser;
+	CseHttpRequest* request = NULL;
+	uint8_t* buffer = NULL;
+	uint32_t status;
+	uint32_t error = 0;
+	size_t read;
+
+	CseProductInfoParser_Init(&parser, group, fields, fieldCount);
+
+	buffer = malloc(CSE_PRODUCT_INFO_BUFFER_SIZE);
+
+	if (!buffer)
+	{
+		result = CSE_DOWNLOAD_NOMEM;
+		goto exit;
+	}
+
+	request = CseHttp_Get(http, url, NULL, &error);
+
+	if (!request)
+	{
+		CSE_LOG_ERROR("HTTP request failed (%lu)", (unsigned long) error);
+		goto exit;
+	}
+
+	status = CseHttpRequest_GetResponse(request)->status;
+
+	if (status != 200)
+	{
+		CSE_LOG_ERROR("Bad HTTP response status %u", (unsigned) status);
 		goto exit;
 	}
 
-	http = LzHttp_New(CSE_USER_AGENT);
+	while (true)
+	{
+		if (!CseHttpRequest_Read(request, buffer, CSE_PRODUCT_INFO_BUFFER_SIZE, &read, &error))
+		{
+			CSE_LOG_ERROR("Failed to read HTTP response (%lu)", (unsigned long) error);
+			goto exit;
+		}
+
+		if (!read)
+		{
+			CseProductInfoParser_Finish(&parser);
+			break;
+		}
+
+		// Closing the request drops the rest of the response
+		if (CseProductInfoParser_Feed(&parser, (const char*) buffer, read))
+			break;
+	}
+
+	result = CSE_DOWNLOAD_OK;
+
+exit:
+	if (request)
+		CseHttpRequest_Free(request);
+
+	free(buffer);
+
+	return result;
+}
+
+CseDownloadResult CseDownload_DownloadMsi(
+	WaykBinariesBitness bitness,
+	const char* msiPath,
+	const CseDownloadOptions* options)
+{
+	CseDownloadResult result = CSE_DOWNLOAD_FAILURE;
+	char group[64];
+	char key[128];
+	char hashKey[128];
+	char msiUrl[CSE_DOWNLOAD_URL_SIZE];
+	char msiHash[CSE_SHA256_HEX_SIZE];
+	uint8_t expectedDigest[CSE_SHA256_DIGEST_SIZE];
+	bool verifyHash = false;
+	CseProductInfoField fields[2];
+	CseHttp* http = NULL;
+	bool owned = false;
+	CseDownloadThrottle throttle;
+	const char* productInfoUrl = (options && options->productInfoUrl) ? options->productInfoUrl : CSE_PRODUCT_INFO_URL;
 
+	// Summary covers the whole run, from productinfo.htm on
+	CseDownloadThrottle_Init(&throttle, options);
+	msiUrl[0] = '\0';
+
+	snprintf(group, sizeof(group), "WaykAgentmsi%s.", bitness == WAYK_BINARIES_BITNESS_X64 ? "64" : "86");
+	snprintf(key, sizeof(key), "%sUrl", group);
+	snprintf(hashKey, sizeof(hashKey), "%sHash", group);
+
+	ZeroMemory(fields, sizeof(fields));
+	fields[0].key = key;
+	fields[0].value = msiUrl;
+	fields[0].valueSize = sizeof(msiUrl);
+	fields[1].key = hashKey;
+	fields[1].value = msiHash;
+	fields[1].valueSize = sizeof(msiHash);
+
+	// Shared by productinfo.htm and the MSI, so the MSI request can reuse
+	// the connection and proxy authentication
+	http = CseDownload_GetSession(options, &owned);
 	if (!http)
 	{
 		result = CSE_DOWNLOAD_NOMEM;
 		goto exit;
 	}
 
-	CSE_LOG_INFO("Downloading MSI from %s", msiUrl);
+	CSE_LOG_INFO("Requesting MSI URL");
+
+	result = CseDownload_GetProductInfo(http, productInfoUrl, group, fields, 2);
 
-	LzHttp_SetRecvTimeout(http, 600 * 1000);
-	status = LzHttp_Get(http, msiUrl, CseDownload_OnWriteFile, fp, &error);
+	if (result != CSE_DOWNLOAD_OK)
+		goto exit;
 
-	if (status != LZ_OK)
+	if (!fields[0].found)
 	{
-		CSE_LOG_ERROR("HTTP request failed %d (%lu)", status, error);
+		CSE_LOG_ERROR("Bad HTTP response. Key %s not found.", key);
 		result = CSE_DOWNLOAD_FAILURE;
 		goto exit;
 	}
 
-	CSE_LOG_INFO("Downloaded MSI", msiUrl);
+	// Older productinfo responses have no hash; download is not verified then
+	if (fields[1].found)
+	{
+		verifyHash = CseSha256_FromHex(msiHash, expectedDigest);
+		if (!verifyHash)
+			CSE_LOG_WARN("Ignoring invalid MSI hash: %s", msiHash);
+	}
+	else
+	{
+		CSE_LOG_WARN("MSI hash is not published, download will not be verified");
+	}
 
-	result = CSE_DOWNLOAD_OK;
+	if (CseDownloadThrottle_IsCancelled(&throttle))
+	{
+		result = CSE_DOWNLOAD_CANCELLED;
+		goto exit;
+	}
+
+	CSE_LOG_INFO("Downloading MSI from %s", msiUrl);
+
+	result = CseDownload_SessionFile(http, msiUrl, msiPath, verifyHash ? expectedDigest : NULL, options, &throttle);
+
+	if (result != CSE_DOWNLOAD_OK)
+		goto exit;
+
+	CSE_LOG_INFO("Downloaded MSI");
 
 exit:
-	if (fp)
+	// Without an MSI URL, the failure is productinfo.htm's
+	CseDownloadThrottle_Summarize(&throttle, fields[0].found ? msiUrl : productInfoUrl, result,
+		options ? options->summaryPath : NULL);
+	CseDownloadThrottle_Free(&throttle);
+
+	if (http && owned)
+		CseHttp_Free(http);
+
+	return result;
+}
+
+static DWORD WINAPI CseDownload_MsiThread(LPVOID param)
+{
+	CseMsiDownload* ctx = (CseMsiDownload*) param;
+
+	ctx->result = CseDownload_DownloadMsi(ctx->bitness, ctx->msiPath, &ctx->options);
+	return 0;
+}
+
+CseMsiDownload* CseDownload_StartMsi(
+	WaykBinariesBitness bitness,
+	const char* msiPath,
+	const CseDownloadOptions* options)
+{
+	CseMsiDownload* ctx = calloc(1, sizeof(CseMsiDownload));
+	if (!ctx)
 	{
-		fclose(fp);
-		fp = NULL;
+		CSE_LOG_ERROR("Allocation failed");
+		return NULL;
 	}
 
-	if (msiPathW)
+	if (!CseDownload_CopyValue(ctx->msiPath, sizeof(ctx->msiPath), msiPath))
 	{
-		free(msiPathW);
-		msiPathW = NULL;
+		free(ctx);
+		return NULL;
 	}
 
-	if (http)
+	ctx->bitness = bitness;
+	ctx->result = CSE_DOWNLOAD_FAILURE;
+
+	if (options)
+		memcpy(&ctx->options, options, sizeof(CseDownloadOptions));
+
+	ctx->options.cancel = &ctx->cancel;
+
+	ctx->thread = CreateThread(NULL, 0, CseDownload_MsiThread, ctx, 0, NULL);
+	if (!ctx->thread)
 	{
-		LzHttp_Free(http);
-		http = NULL;
+		CSE_LOG_ERROR("Failed to start MSI download thread (%lu)", GetLastError());
+		free(ctx);
+		return NULL;
 	}
 
+	return ctx;
+}
+
+void CseDownload_CancelMsi(CseMsiDownload* ctx)
+{
+	InterlockedExchange(&ctx->cancel, 1);
+}
+
+CseDownloadResult CseDownload_FinishMsi(CseMsiDownload* ctx)
+{
+	CseDownloadResult result;
+
+	WaitForSingleObject(ctx->thread, INFINITE);
+	CloseHandle(ctx->thread);
+
+	result = ctx->result;
+	free(ctx);
+
 	return result;
-}
\ No newline at end of file
+}
@@ -0,0 +1,427 @@
+#include <cse/http.h>
+#include <cse/log.h>
+
+#include <lizard/lizard.h>
+
+#include <windows.h>
+#include <winhttp.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CSE_LOG_TAG "CseHttp"
+
+#define CSE_HTTP_CONNECT_TIMEOUT (60 * 1000)
+#define CSE_HTTP_SEND_TIMEOUT (30 * 1000)
+#define CSE_HTTP_RECV_TIMEOUT (30 * 1000)
+
+struct cse_http
+{
+	HINTERNET session;
+	int resolveTimeout;
+	int connectTimeout;
+	int recvTimeout;
+};
+
+#define CSE_HTTP_STATUS_CALLBACK_FLAGS \
+	(WINHTTP_CALLBACK_FLAG_RESOLVE_NAME | WINHTTP_CALLBACK_FLAG_CONNECT_TO_SERVER | WINHTTP_CALLBACK_FLAG_SEND_REQUEST)
+
+struct cse_http_request
+{
+	HINTERNET connection;
+	HINTERNET request;
+	CseHttpResponse response;
+	CseHttpTimings timings;
+	bool secure;
+	const char* phase;  // what the request was doing, for failure logs
+	ULONGLONG phaseStart;
+};
+
+// Requests are synchronous, so status notifications come on the thread
+// which sends the request, the request is their context
+static void CALLBACK CseHttp_StatusCallback(
+	HINTERNET handle,
+	DWORD_PTR context,
+	DWORD status,
+	LPVOID info,
+	DWORD infoLength)
+{
+	CseHttpRequest* request = (CseHttpRequest*) context;
+	ULONGLONG now = GetTickCount64();
+
+	if (!request)
+		return;
+
+	switch (status)
+	{
+		case WINHTTP_CALLBACK_STATUS_RESOLVING_NAME:
+			request->phase = "resolving name";
+			request->phaseStart = now;
+			break;
+
+		case WINHTTP_CALLBACK_STATUS_NAME_RESOLVED:
+			request->timings.resolve = (uint32_t) (now - request->phaseStart);
+			break;
+
+		case WINHTTP_CALLBACK_STATUS_CONNECTING_TO_SERVER:
+			request->phase = "connecting";
+			request->phaseStart = now;
+			break;
+
+		case WINHTTP_CALLBACK_STATUS_CONNECTED_TO_SERVER:
+			request->timings.connect = (uint32_t) (now - request->phaseStart);
+			request->phase = request->secure ? "negotiating TLS" : "sending request";
+			request->phaseStart = now;
+			break;
+
+		// TLS handshake is done before the request goes out on a new connection
+		case WINHTTP_CALLBACK_STATUS_SENDING_REQUEST:
+			if (request->secure && (request->timings.connect != CSE_HTTP_TIME_NONE))
+				request->timings.tls = (uint32_t) (now - request->phaseStart);
+			request->phase = "sending request";
+			break;
+
+		case WINHTTP_CALLBACK_STATUS_REQUEST_SENT:
+			request->phase = "waiting for response";
+			request->phaseStart = now;
+			break;
+	}
+}
+
+CseHttp* CseHttp_New(const char* userAgent)
+{
+	WCHAR* userAgentW = NULL;
+
+	CseHttp* ctx = calloc(1, sizeof(CseHttp));
+	if (!ctx)
+	{
+		CSE_LOG_ERROR("Allocation failed");
+		return 0;
+	}
+
+	userAgentW = LzUnicode_UTF8toUTF16_dup(userAgent);
+	if (!userAgentW)
+	{
+		CseHttp_Free(ctx);
+		return 0;
+	}
+
+	ctx->session = WinHttpOpen(
+		userAgentW,
+		WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
+		WINHTTP_NO_PROXY_NAME,
+		WINHTTP_NO_PROXY_BYPASS,
+		0);
+
+	free(userAgentW);
+
+	if (!ctx->session)
+	{
+		CSE_LOG_ERROR("Failed to open HTTP session (%lu)", GetLastError());
+		CseHttp_Free(ctx);
+		return 0;
+	}
+
+	ctx->connectTimeout = CSE_HTTP_CONNECT_TIMEOUT;
+	CseHttp_SetRecvTimeout(ctx, CSE_HTTP_RECV_TIMEOUT);
+
+	// Only used for timings, requests work the same without it
+	WinHttpSetStatusCallback(ctx->session, CseHttp_StatusCallback, CSE_HTTP_STATUS_CALLBACK_FLAGS, 0);
+
+	return ctx;
+}
+
+void CseHttp_Free(CseHttp* ctx)
+{
+	if (ctx->session)
+		WinHttpCloseHandle(ctx->session);
+
+	free(ctx);
+}
+
+static void CseHttp_ApplyTimeouts(CseHttp* ctx)
+{
+	// Requests inherit session timeouts when they are opened
+	WinHttpSetTimeouts(ctx->session, ctx->resolveTimeout, ctx->connectTimeout, CSE_HTTP_SEND_TIMEOUT, ctx->recvTimeout);
+}
+
+void CseHttp_SetRecvTimeout(CseHttp* ctx, int timeout)
+{
+	ctx->recvTimeout = timeout;
+	CseHttp_ApplyTimeouts(ctx);
+}
+
+void CseHttp_SetConnectTimeout(CseHttp* ctx, int timeout)
+{
+	ctx->resolveTimeout = timeout;
+	ctx->connectTimeout = timeout;
+	CseHttp_ApplyTimeouts(ctx);
+}
+
+// Copies header value as UTF-8; false if the header is not present
+static bool CseHttp_QueryHeader(HINTERNET request, DWORD query, char* value, size_t valueSize)
+{
+	WCHAR valueW[256];
+	DWORD size = sizeof(valueW);
+
+	if (!WinHttpQueryHeaders(request, query, WINHTTP_HEADER_NAME_BY_INDEX, valueW, &size, WINHTTP_NO_HEADER_INDEX))
+		return false;
+
+	return LzUnicode_UTF16toUTF8(valueW, -1, (uint8_t*) value, (int) valueSize) >= 0;
+}
+
+static void CseHttp_ParseResponse(HINTERNET request, CseHttpResponse* response)
+{
+	DWORD status = 0;
+	DWORD size = sizeof(status);
+	char value[256];
+	unsigned long long first;
+	unsigned long long last;
+	unsigned long long total;
+
+	WinHttpQueryHeaders(
+		request,
+		WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER,
+		WINHTTP_HEADER_NAME_BY_INDEX,
+		&status,
+		&size,
+		WINHTTP_NO_HEADER_INDEX);
+
+	response->status = status;
+	response->contentLength = CSE_HTTP_SIZE_UNKNOWN;
+	response->rangeStart = 0;
+	response->totalSize = CSE_HTTP_SIZE_UNKNOWN;
+	response->etag[0] = '\0';
+	response->lastModified[0] = '\0';
+
+	// Numeric header query is limited to 32 bits
+	if (CseHttp_QueryHeader(request, WINHTTP_QUERY_CONTENT_LENGTH, value, sizeof(value)))
+		response->contentLength = strtoull(value, NULL, 10);
+
+	if (CseHttp_QueryHeader(request, WINHTTP_QUERY_CONTENT_RANGE, value, sizeof(value)))
+	{
+		if (sscanf(value, "bytes %llu-%llu/%llu", &first, &last, &total) == 3)
+		{
+			response->rangeStart = first;
+			response->totalSize = total;
+		}
+		else if (sscanf(value, "bytes %llu-%llu/*", &first, &last) == 2)
+		{
+			response->rangeStart = first;
+		}
+	}
+	else if (response->contentLength != CSE_HTTP_SIZE_UNKNOWN)
+	{
+		response->totalSize = response->contentLength;
+	}
+
+	if (!CseHttp_QueryHeader(request, WINHTTP_QUERY_ETAG, response->etag, sizeof(response->etag)))
+		response->etag[0] = '\0';
+
+	if (!CseHttp_QueryHeader(request, WINHTTP_QUERY_LAST_MODIFIED, response->lastModified, sizeof(response->lastModified)))
+		response->lastModified[0] = '\0';
+}
+
+// timeout replaces every session timeout for this request, 0 keeps them
+static CseHttpRequest* CseHttp_Send(
+	CseHttp* ctx,
+	const WCHAR* verb,
+	const char* url,
+	const char* headers,
+	int timeout,
+	uint32_t* error)
+{
+	WCHAR* urlW = NULL;
+	WCHAR* hostW = NULL;
+	WCHAR* headersW = NULL;
+	URL_COMPONENTS components;
+	CseHttpRequest* request = NULL;
+	DWORD_PTR context;
+	ULONGLONG start = GetTickCount64();
+
+	*error = 0;
+
+	urlW = LzUnicode_UTF8toUTF16_dup(url);
+	if (!urlW)
+	{
+		*error = ERROR_INVALID_PARAMETER;
+		goto error;
+	}
+
+	if (headers)
+	{
+		headersW = LzUnicode_UTF8toUTF16_dup(headers);
+		if (!headersW)
+		{
+			*error = ERROR_INVALID_PARAMETER;
+			goto error;
+		}
+	}
+
+	ZeroMemory(&components, sizeof(components));
+	components.dwStructSize = sizeof(components);
+	components.dwSchemeLength = (DWORD) -1;
+	components.dwHostNameLength = (DWORD) -1;
+	components.dwUrlPathLength = (DWORD) -1;
+	components.dwExtraInfoLength = (DWORD) -1;
+
+	if (!WinHttpCrackUrl(urlW, 0, 0, &components))
+	{
+		*error = GetLastError();
+		CSE_LOG_ERROR("Invalid URL: %s", url);
+		goto error;
+	}
+
+	hostW = calloc(components.dwHostNameLength + 1, sizeof(WCHAR));
+	request = calloc(1, sizeof(CseHttpRequest));
+	if (!hostW || !request)
+	{
+		*error = ERROR_NOT_ENOUGH_MEMORY;
+		goto error;
+	}
+
+	memcpy(hostW, components.lpszHostName, components.dwHostNameLength * sizeof(WCHAR));
+
+	request->timings.resolve = CSE_HTTP_TIME_NONE;
+	request->timings.connect = CSE_HTTP_TIME_NONE;
+	request->timings.tls = CSE_HTTP_TIME_NONE;
+	request->timings.firstByte = CSE_HTTP_TIME_NONE;
+	request->secure = components.nScheme == INTERNET_SCHEME_HTTPS;
+	request->phase = "opening request";
+
+	request->connection = WinHttpConnect(ctx->session, hostW, components.nPort, 0);
+	if (!request->connection)
+	{
+		*error = GetLastError();
+		goto error;
+	}
+
+	// Path is followed by the query string in the URL, both are sent
+	request->request = WinHttpOpenRequest(
+		request->connection,
+		verb,
+		components.dwUrlPathLength ? components.lpszUrlPath : L"/",
+		NULL,
+		WINHTTP_NO_REFERER,
+		WINHTTP_DEFAULT_ACCEPT_TYPES,
+		request->secure ? WINHTTP_FLAG_SECURE : 0);
+
+	if (!request->request)
+	{
+		*error = GetLastError();
+		goto error;
+	}
+
+	context = (DWORD_PTR) request;
+	WinHttpSetOption(request->request, WINHTTP_OPTION_CONTEXT_VALUE, &context, sizeof(context));
+
+	if (timeout)
+		WinHttpSetTimeouts(request->request, timeout, timeout, timeout, timeout);
+
+	if (!WinHttpSendRequest(
+		request->request,
+		headersW ? headersW : WINHTTP_NO_ADDITIONAL_HEADERS,
+		headersW ? (DWORD) -1 : 0,
+		WINHTTP_NO_REQUEST_DATA,
+		0,
+		0,
+		0))
+	{
+		*error = GetLastError();
+		goto error;
+	}
+
+	if (!WinHttpReceiveResponse(request->request, NULL))
+	{
+		*error = GetLastError();
+		goto error;
+	}
+
+	if (request->phaseStart)
+		request->timings.firstByte = (uint32_t) (GetTickCount64() - request->phaseStart);
+
+	CseHttp_ParseResponse(request->request, &request->response);
+
+	free(urlW);
+	free(hostW);
+	free(headersW);
+
+	return request;
+
+error:
+	if (request)
+	{
+		CSE_LOG_WARN("Request to %s failed while %s, after %u ms (%lu)",
+			url, request->phase, (unsigned) (GetTickCount64() - start), (unsigned long) *error);
+		CseHttpRequest_Free(request);
+	}
+
+	free(urlW);
+	free(hostW);
+	free(headersW);
+
+	return NULL;
+}
+
+CseHttpRequest* CseHttp_Get(CseHttp* ctx, const char* url, const char* headers, uint32_t* error)
+{
+	return CseHttp_Send(ctx, L"GET", url, headers, 0, error);
+}
+
+CseHttpRequest* CseHttp_GetWithTimeout(CseHttp* ctx, const char* url, const char* headers, int timeout, uint32_t* error)
+{
+	return CseHttp_Send(ctx, L"GET", url, headers, timeout, error);
+}
+
+CseHttpRequest* CseHttp_Head(CseHttp* ctx, const char* url, const char* headers, uint32_t* error)
+{
+	return CseHttp_Send(ctx, L"HEAD", url, headers, 0, error);
+}
+
+const CseHttpResponse* CseHttpRequest_GetResponse(CseHttpRequest* ctx)
+{
+	return &ctx->response;
+}
+
+const CseHttpTimings* CseHttpRequest_GetTimings(CseHttpRequest* ctx)
+{
+	return &ctx->timings;
+}
+
+void CseHttpRequest_SetRecvTimeout(CseHttpRequest* ctx, int timeout)
+{
+	DWORD value = (DWORD) timeout;
+
+	WinHttpSetOption(ctx->request, WINHTTP_OPTION_RECEIVE_TIMEOUT, &value, sizeof(value));
+}
+
+bool CseHttpRequest_Read(CseHttpRequest* ctx, uint8_t* buffer, size_t size, size_t* read, uint32_t* error)
+{
+	DWORD bytesRead = 0;
+
+	*read = 0;
+	*error = 0;
+
+	if (size > MAXDWORD)
+		size = MAXDWORD;
+
+	if (!WinHttpReadData(ctx->request, buffer, (DWORD) size, &bytesRead))
+	{
+		*error = GetLastError();
+		return false;
+	}
+
+	*read = bytesRead;
+	return true;
+}
+
+void CseHttpRequest_Free(CseHttpRequest* ctx)
+{
+	if (ctx->request)
+		WinHttpCloseHandle(ctx->request);
+	if (ctx->connection)
+		WinHttpCloseHandle(ctx->connection);
+
+	free(ctx);
+}
@@ -8,16 +8,42 @@
 #define MAX_OPTION_NAME_SIZE 256
 #define MSI_OPTION_PREFIX "CONFIG_"
 
-#define MIN_CLI_BUFFER_SIZE 256
+#define MIN_ARGUMENT_CAPACITY 16
+
+#define MSI_COMMAND "msiexec /i "
 
 // CreateProcessW limit (32767) + null terminator
 #define MAX_CLI_BUFFER_SIZE 32768
 
+typedef enum
+{
+	CSE_ARGUMENT_PARAMETER,  // value
+	CSE_ARGUMENT_PROPERTY,   // KEY="value"
+	CSE_ARGUMENT_CONFIG,     // CONFIG_KEY="escaped value", key is the Wayk config option name
+} CseInstallArgumentType;
+
+// Arguments point to the caller's strings, which have to stay valid until
+// the command line is built
+typedef struct
+{
+	CseInstallArgumentType type;
+	const char* key;
+	const char* value;
+	size_t keySize;
+	size_t valueSize;
+} CseInstallArgument;
+
+// Command line is built only once all the arguments are known: its exact
+// size is kept up to date as they are added, so it is allocated once and
+// each argument is written straight to its place
 struct cse_install
 {
-	char* cli;
-	size_t cliBufferCapacity; // stored cli buffer available capacity
-	size_t cliBufferSize;     // stored cli string size (without trailing '\0')
+	const char* msiPath;
+	CseInstallArgument* arguments;
+	int argumentCount;
+	int argumentCapacity;
+	size_t cliSize;  // command line size (without trailing '\0')
+	char* cli;       // NULL until built
 };
 
 static CseInstallResult ToSnakeCase(const char* str, char* buffer, size_t bufferSize)
@@ -65,142 +91,155 @@ CseInstallResult WaykConfigOptionToMsiOption(const char* str, char* buffer, size
 	return ToSnakeCase(str, buffer + currentBufferSize, bufferSize - currentBufferSize);
 }
 
-static CseInstallResult CseInstall_EnsureCliBufferCapacity(CseInstall* ctx, size_t requiredStringSize)
+static size_t GetQuotesCount(const char* str)
 {
-	CSE_LOG_TRACE(
-		"Ensuring buffer capacity (prev %d, size: %d) for string with size %d",
-		(int)ctx->cliBufferCapacity,
-		(int)ctx->cliBufferSize,
-		(int)requiredStringSize);
-	size_t required_capacity = (ctx->cliBufferCapacity)
-		? ctx->cliBufferCapacity
-		: MIN_CLI_BUFFER_SIZE;
-	while (required_capacity < (ctx->cliBufferSize + (requiredStringSize + 1)))
+	size_t quotes = 0;
+	for (; *str; ++str)
 	{
-		required_capacity *= 2;
+		if (*str == '"')
+			++quotes;
+	}
+	return quotes;
+}
 
-		if (required_capacity > MAX_CLI_BUFFER_SIZE)
+// Nested escape " => \\\"
+static size_t GetEscapedSize(const char* str)
+{
+	return strlen(str) + GetQuotesCount(str) * 3;
+}
+
+static char* WriteEscapedArgument(char* dst, const char* str)
+{
+	for (; *str; ++str)
+	{
+		if (*str == '"')
 		{
-			CSE_LOG_ERROR("Command line arguments string for MSI is too long");
-			return CSE_INSTALL_TOO_BIG_CLI;
+			*dst++ = '\\';
+			*dst++ = '\\';
+			*dst++ = '\\';
 		}
-	}
 
-	if (required_capacity <= ctx->cliBufferCapacity)
-	{
-		return CSE_INSTALL_OK;
+		*dst++ = *str;
 	}
 
-	if (ctx->cliBufferCapacity)
+	return dst;
+}
+
+// Accounts for the argument in the command line size; nothing is recorded if
+// the command line would become too long
+static CseInstallResult CseInstall_AddArgument(
+	CseInstall* ctx,
+	CseInstallArgumentType type,
+	const char* key,
+	size_t keySize,
+	const char* value,
+	size_t valueSize)
+{
+	CseInstallArgument* argument;
+	size_t size = 1 + valueSize;  // leading whitespace
+
+	if (type != CSE_ARGUMENT_PARAMETER)
+		size += keySize + 3;      // ="..."
+
+	if (ctx->cliSize + size >= MAX_CLI_BUFFER_SIZE)
 	{
-		char* newBuffer = realloc(ctx->cli, required_capacity);
-		if (!newBuffer)
-		{
-			CSE_LOG_ERROR("Allocation failed");
-			return CSE_INSTALL_NOMEM;
-		}
-		ctx->cli = newBuffer;
+		CSE_LOG_ERROR("Command line arguments string for MSI is too long");
+		return CSE_INSTALL_TOO_BIG_CLI;
 	}
-	else
+
+	if (ctx->argumentCount == ctx->argumentCapacity)
 	{
-		ctx->cli = malloc(required_capacity);
-		if (!ctx->cli)
+		int capacity = ctx->argumentCapacity ? (ctx->argumentCapacity * 2) : MIN_ARGUMENT_CAPACITY;
+		CseInstallArgument* arguments = realloc(ctx->arguments, capacity * sizeof(CseInstallArgument));
+		if (!arguments)
 		{
 			CSE_LOG_ERROR("Allocation failed");
 			return CSE_INSTALL_NOMEM;
 		}
+		ctx->arguments = arguments;
+		ctx->argumentCapacity = capacity;
 	}
 
-	ctx->cliBufferCapacity = required_capacity;
-	return CSE_INSTALL_OK;
-}
+	argument = &ctx->arguments[ctx->argumentCount++];
+	argument->type = type;
+	argument->key = key;
+	argument->value = value;
+	argument->keySize = keySize;
+	argument->valueSize = valueSize;
 
-static CseInstallResult CseInstall_CliAppendString(CseInstall* ctx, const char* str)
-{
-	size_t strSize = strlen(str);
-	CSE_LOG_TRACE("Appending CLI string with size %d", (int)strSize);
-	CseInstallResult result = CseInstall_EnsureCliBufferCapacity(ctx, strSize);
-	if (result != CSE_INSTALL_OK)
-	{
-		CSE_LOG_ERROR("Failed to extend CLI arguments buffer");
-		return result;
-	}
-	strcpy_s(ctx->cli + ctx->cliBufferSize, ctx->cliBufferCapacity - ctx->cliBufferSize, str);
-	ctx->cliBufferSize += strSize;
-	return CSE_INSTALL_OK;
-}
+	ctx->cliSize += size;
 
-static CseInstallResult CseInstall_CliAppendChar(CseInstall* ctx, char ch)
-{
-	CseInstallResult result = CseInstall_EnsureCliBufferCapacity(ctx, 1);
-	if (result != CSE_INSTALL_OK)
+	// Built again with the new argument
+	if (ctx->cli)
 	{
-		CSE_LOG_ERROR("Failed to extend CLI arguments buffer");
-		return result;
+		free(ctx->cli);
+		ctx->cli = 0;
 	}
-	ctx->cli[ctx->cliBufferSize++] = ch;
-	ctx->cli[ctx->cliBufferSize] = '\0';
+
 	return CSE_INSTALL_OK;
 }
 
-static CseInstallResult CseInstall_CliAppendWhitespace(CseInstall* ctx)
+static CseInstallResult CseInstall_BuildCli(CseInstall* ctx)
 {
-	return CseInstall_CliAppendChar(ctx, ' ');
-}
+	if (ctx->cli)
+		return CSE_INSTALL_OK;
 
-static size_t GetQuotesCount(const char* str)
-{
-	size_t strSize = strlen(str);
-	size_t quotes = 0;
-	for (size_t i = 0; i <  strSize; ++i)
+	char* cli = malloc(ctx->cliSize + 1);
+	if (!cli)
 	{
-		if (str[i] == '"')
-			++quotes;
+		CSE_LOG_ERROR("Allocation failed");
+		return CSE_INSTALL_NOMEM;
 	}
-	return quotes;
-}
 
-static char* MakeEscapedArgument(const char* str)
-{
-	if (!str)
-		return 0;
+	char* pos = cli;
 
-	size_t originalSize = strlen(str);
-	// allocate original size + space for escape symbols for escape
-	char* escaped = calloc(originalSize + GetQuotesCount(str) * 3 + 1, sizeof(char));
-	if (!escaped)
-	{
-		CSE_LOG_ERROR("Allocation failed");
-		return 0;
-	}
-	size_t resultStringSize = 0;
-	for (int i = 0; i < originalSize; ++i)
+	memcpy(pos, MSI_COMMAND, sizeof(MSI_COMMAND) - 1);
+	pos += sizeof(MSI_COMMAND) - 1;
+	*pos++ = '"';
+	memcpy(pos, ctx->msiPath, strlen(ctx->msiPath));
+	pos += strlen(ctx->msiPath);
+	*pos++ = '"';
+
+	for (int i = 0; i < ctx->argumentCount; ++i)
 	{
-		if (str[i] == '"')
+		CseInstallArgument* argument = &ctx->arguments[i];
+
+		*pos++ = ' ';
+
+		if (argument->type == CSE_ARGUMENT_PARAMETER)
 		{
-			// Nested escape " => \\\"
-			escaped[resultStringSize++] = '\\';
-			escaped[resultStringSize++] = '\\';
-			escaped[resultStringSize++] = '\\';
+			memcpy(pos, argument->value, argument->valueSize);
+			pos += argument->valueSize;
+			continue;
 		}
 
-		escaped[resultStringSize++] = str[i];
-	}
+		if (argument->type == CSE_ARGUMENT_CONFIG)
+		{
+			// Can't fail, the name has been converted once already; its
+			// terminator is overwritten by the '='
+			WaykConfigOptionToMsiOption(argument->key, pos, argument->keySize + 1);
+			pos += argument->keySize;
+			*pos++ = '=';
+			*pos++ = '"';
+			pos = WriteEscapedArgument(pos, argument->value);
+		}
+		else
+		{
+			memcpy(pos, argument->key, argument->keySize);
+			pos += argument->keySize;
+			*pos++ = '=';
+			*pos++ = '"';
+			memcpy(pos, argument->value, argument->valueSize);
+			pos += argument->valueSize;
+		}
 
-	escaped[resultStringSize] = '\0';
+		*pos++ = '"';
+	}
 
-	return escaped;
-}
+	*pos = '\0';
 
-static CseInstallResult CseInstall_CliAppendQuotedString(CseInstall* ctx, const char* str)
-{
-	CseInstallResult result = CseInstall_CliAppendChar(ctx, '"');
-	if (result != CSE_INSTALL_OK) return result;
-	result = CseInstall_CliAppendString(ctx, str);
-	if (result != CSE_INSTALL_OK) return result;
-	result = CseInstall_CliAppendChar(ctx, '"');
-	if (result != CSE_INSTALL_OK) return result;
-	return result;
+	ctx->cli = cli;
+	return CSE_INSTALL_OK;
 }
 
 static CseInstall* CseInstall_New(const char* msiPath)
@@ -212,17 +251,18 @@ static CseInstall* CseInstall_New(const char* msiPath)
 		goto error;
 	}
 
-	CseInstallResult result = CSE_INSTALL_OK;
-
 	if (!msiPath)
 		goto error;
 
-	result = CseInstall_CliAppendString(ctx, "msiexec /i");
-	if (result != CSE_INSTALL_OK) goto error;
-	result = CseInstall_CliAppendWhitespace(ctx);
-	if (result != CSE_INSTALL_OK) goto error;
-	result = CseInstall_CliAppendQuotedString(ctx, msiPath);
-	if (result != CSE_INSTALL_OK) goto error;
+	// msiexec /i "path"
+	ctx->msiPath = msiPath;
+	ctx->cliSize = sizeof(MSI_COMMAND) - 1 + strlen(msiPath) + 2;
+
+	if (ctx->cliSize >= MAX_CLI_BUFFER_SIZE)
+	{
+		CSE_LOG_ERROR("Command line arguments string for MSI is too long");
+		goto error;
+	}
 
 	return ctx;
 
@@ -239,6 +279,9 @@ void CseInstall_Free(CseInstall* ctx)
 {
 	if (ctx->cli)
 		free(ctx->cli);
+	if (ctx->arguments)
+		free(ctx->arguments);
+	free(ctx);
 }
 
 CseInstall* CseInstall_WithLocalMsi(const char* msiPath)
@@ -255,14 +298,7 @@ static CseInstallResult CseInstall_AddMsiParameter(CseInstall* ctx, const char*
 		return CSE_INSTALL_INVALID_ARGS;
 	}
 
-	CseInstallResult result;
-
-	result = CseInstall_CliAppendWhitespace(ctx);
-	if (result != CSE_INSTALL_OK) return result;
-	result = CseInstall_CliAppendString(ctx, value);
-	if (result != CSE_INSTALL_OK) return result;
-
-	return CSE_INSTALL_OK;
+	return CseInstall_AddArgument(ctx, CSE_ARGUMENT_PARAMETER, 0, 0, value, strlen(value));
 }
 
 static CseInstallResult CseInstall_SetMsiOption(CseInstall* ctx, const char* key, const char* value)
@@ -274,23 +310,8 @@ static CseInstallResult CseInstall_SetMsiOption(CseInstall* ctx, const char* key
 		return CSE_INSTALL_INVALID_ARGS;
 	}
 
-	CseInstallResult result;
-
-	// appends CONFIG_KEY="value"
-	result = CseInstall_CliAppendWhitespace(ctx);
-	if (result != CSE_INSTALL_OK) return result;
-	// result = CseInstall_CliAppendChar(ctx, '"');
-	// if (result != CSE_INSTALL_OK) return result;
-	result = CseInstall_CliAppendString(ctx, key);
-	if (result != CSE_INSTALL_OK) return result;
-	result = CseInstall_CliAppendChar(ctx, '=');
-	if (result != CSE_INSTALL_OK) return result;
-	result = CseInstall_CliAppendQuotedString(ctx, value);
-	if (result != CSE_INSTALL_OK) return result;
-	// result = CseInstall_CliAppendChar(ctx, '"');
-	// if (result != CSE_INSTALL_OK) return result;
-
-	return CSE_INSTALL_OK;
+	// appends KEY="value"
+	return CseInstall_AddArgument(ctx, CSE_ARGUMENT_PROPERTY, key, strlen(key), value, strlen(value));
 }
 
 CseInstallResult CseInstall_SetEnrollmentOptions(CseInstall* ctx, const char* url, const char* token)
@@ -385,15 +406,15 @@ CseInstallResult CseInstall_SetConfigOption(CseInstall* ctx, const char* key, co
 		return CSE_INSTALL_INVALID_ARGS;
 	}
 
-	char* escapedValue = MakeEscapedArgument(msiValue);
-	if (!escapedValue)
-	{
-		return CSE_INSTALL_NOMEM;
-	}
-
-	result = CseInstall_SetMsiOption(ctx, msiOptionName, escapedValue);
-	free(escapedValue);
-	return result;
+	// appends CONFIG_KEY="value", the name is converted again and the value
+	// escaped when the command line is built
+	return CseInstall_AddArgument(
+		ctx,
+		CSE_ARGUMENT_CONFIG,
+		key,
+		strlen(msiOptionName),
+		msiValue,
+		GetEscapedSize(msiValue));
 }
 
 CseInstallResult CseInstall_SetInstallDirectory(CseInstall* ctx, const char* dir)
@@ -436,6 +457,9 @@ CseInstallResult CseInstall_SetBrandingFile(CseInstall* ctx, const char* brandin
 
 char* CseInstall_GetCli(CseInstall* ctx)
 {
+	if (CseInstall_BuildCli(ctx) != CSE_INSTALL_OK)
+		return 0;
+
 	return ctx->cli;
 }
 
@@ -458,6 +482,10 @@ CseInstallResult CseInstall_Run(CseInstall* ctx)
 	startupInfo.cb = sizeof(STARTUPINFOA);
 	ZeroMemory(&processInfo, sizeof(PROCESS_INFORMATION));
 
+	result = CseInstall_BuildCli(ctx);
+	if (result != CSE_INSTALL_OK)
+		return result;
+
 	CSE_LOG_DEBUG("Starting WaykNow executable for MSI installation...");
 	CSE_LOG_DEBUG("CLI: %s", ctx->cli);
 
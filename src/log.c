@@ -27,6 +27,8 @@ static void WriteLogInternal(LogMessageContext* ctx)
 {
 	char buf[64];
 	buf[strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &ctx->time)] = '\0';
+	// Messages may come from bundle extraction workers, keep their lines whole
+	_lock_file(CseLog.outputFile);
 	fprintf(
 		CseLog.outputFile,
 		"%s [%s] %s:%d: ",
@@ -37,6 +39,7 @@ static void WriteLogInternal(LogMessageContext* ctx)
 	vfprintf(CseLog.outputFile, ctx->fmt, ctx->args);
 	fprintf(CseLog.outputFile, "\n");
 	fflush(CseLog.outputFile);
+	_unlock_file(CseLog.outputFile);
 }
 
 void CseLog_Message(CseLogLevel level, const char *file, int line, const char *fmt, ...)
@@ -25,38 +25,148 @@ typedef struct
 	bool hasEmbeddedInstaller;
 } BundleOptionalContentInfo;
 
+static void OnMsiDownloadProgress(void* param, const CseDownloadProgress* progress)
+{
+	if (progress->total != CSE_DOWNLOAD_SIZE_UNKNOWN)
+	{
+		CSE_LOG_DEBUG("Downloaded %llu of %llu KB (%llu KB/s)",
+			(unsigned long long) (progress->received / 1024),
+			(unsigned long long) (progress->total / 1024),
+			(unsigned long long) (progress->bytesPerSecond / 1024));
+	}
+	else
+	{
+		CSE_LOG_DEBUG("Downloaded %llu KB (%llu KB/s)",
+			(unsigned long long) (progress->received / 1024),
+			(unsigned long long) (progress->bytesPerSecond / 1024));
+	}
+}
+
+static CseMsiDownload* StartMsiDownload(
+	WaykBinariesBitness bitness,
+	const char* msiPath,
+	CseOptions* cseOptions,
+	CseDownloadSession* downloadSession)
+{
+	CseDownloadOptions downloadOptions;
+
+	ZeroMemory(&downloadOptions, sizeof(downloadOptions));
+	downloadOptions.connections = CseOptions_GetDownloadConnections(cseOptions);
+	downloadOptions.segmentSize = CseOptions_GetDownloadSegmentSize(cseOptions);
+	downloadOptions.cacheDirectory = CseOptions_GetDownloadCacheDirectory(cseOptions);
+	downloadOptions.mirrors = CseOptions_GetDownloadMirrors(cseOptions, &downloadOptions.mirrorCount);
+	downloadOptions.maxRate = CseOptions_GetDownloadMaxRate(cseOptions);
+	downloadOptions.burstSize = CseOptions_GetDownloadBurstSize(cseOptions);
+	downloadOptions.lowPriority = CseOptions_DownloadLowPriority(cseOptions);
+	downloadOptions.stallThreshold = CseOptions_GetDownloadStallThreshold(cseOptions);
+	downloadOptions.summaryPath = CseOptions_GetDownloadSummaryFile(cseOptions);
+	downloadOptions.progress = OnMsiDownloadProgress;
+	// Without a session the download opens its own
+	downloadOptions.session = downloadSession;
+
+	CSE_LOG_INFO("Downloading latest MSI");
+
+	return CseDownload_StartMsi(bitness, msiPath, &downloadOptions);
+}
 
+// Starts the MSI download as soon as the bundle turns out not to embed the
+// installer, so it goes on while the other entries are extracted
 static int ExtractBundle(
 	const char* extractionPath,
+	const char* msiPath,
 	WaykBinariesBitness bitness,
-	BundleOptionalContentInfo* contentInfo)
+	BundleOptionalContentInfo* contentInfo,
+	CseOptions* cseOptions,
+	CseDownloadSession** pDownloadSession,
+	CseMsiDownload** pMsiDownload)
 {
 	int status = LZ_ERROR_BUNDLE_EXTRACTION;
+	WaykCseBundleExtractItem items[3];
+	char* optionsJson = 0;
 
 	contentInfo->hasBranding = false;
 	contentInfo->hasPowerShellInitScript = false;
 
 	WaykCseBundle* bundle = WaykCseBundle_Open();
+	if (!bundle)
+	{
+		CSE_LOG_ERROR("Failed to open CSE bundle");
+		goto cleanup;
+	}
 
-	if (WaykCseBundle_ExtractOptionsJson(bundle, extractionPath) != WAYK_CSE_BUNDLE_OK)
+	if (WaykCseBundle_ExtractToBuffer(
+		bundle,
+		GetJsonOptionsFileName(),
+		extractionPath,
+		&optionsJson,
+		NULL) != WAYK_CSE_BUNDLE_OK)
 	{
 		CSE_LOG_ERROR("Options json is not found inside CSE bundle");
 		status = LZ_ERROR_NOT_FOUND;
 		goto cleanup;
 	}
 
-	if (WaykCseBundle_ExtractWaykNowInstaller(bundle, bitness, extractionPath) == WAYK_CSE_BUNDLE_OK)
+	// Options are needed before the installer is extracted, they may limit
+	// memory used for decoding
+	CSE_LOG_INFO("Parsing CSE config..");
+
+	if (CseOptions_LoadFromString(cseOptions, optionsJson) != CSE_OPTIONS_OK)
+	{
+		CSE_LOG_ERROR("Failed to load JSON options");
+		status = LZ_ERROR_FAIL;
+		goto cleanup;
+	}
+
+	WaykCseBundle_SetMemoryLimit(bundle, CseOptions_GetExtractionMemoryLimit(cseOptions));
+
+	if (WaykCseBundle_HasEntry(bundle, GetInstallerFileName(bitness)))
+	{
+		// Nothing is downloaded, connections opened ahead of time are closed
+		if (*pDownloadSession)
+			CseDownloadSession_Free(*pDownloadSession);
+		*pDownloadSession = 0;
+	}
+	else
+	{
+		if (*pDownloadSession)
+		{
+			int mirrorCount = 0;
+			const char* const* mirrors = CseOptions_GetDownloadMirrors(cseOptions, &mirrorCount);
+
+			CseDownloadSession_Connect(*pDownloadSession, mirrors, mirrorCount);
+		}
+
+		*pMsiDownload = StartMsiDownload(bitness, msiPath, cseOptions, *pDownloadSession);
+		if (!*pMsiDownload)
+		{
+			status = LZ_ERROR_FAIL;
+			goto cleanup;
+		}
+	}
+
+	ZeroMemory(items, sizeof(items));
+	items[0].fileName = GetInstallerFileName(bitness);
+	items[1].fileName = GetBrandingFileName();
+	items[2].fileName = GetPowerShellInitScriptFileName();
+
+	if (WaykCseBundle_ExtractManyParallel(bundle, extractionPath, items, 3, 0) != WAYK_CSE_BUNDLE_OK)
+	{
+		CSE_LOG_ERROR("Failed to extract CSE bundle");
+		goto cleanup;
+	}
+
+	if (items[0].status == WAYK_CSE_BUNDLE_OK)
 	{
 		CSE_LOG_DEBUG("Extracting installer %s", extractionPath);
 		contentInfo->hasEmbeddedInstaller = true;
 	}
 
-	if (WaykCseBundle_ExtractBrandingZip(bundle, extractionPath) == WAYK_CSE_BUNDLE_OK)
+	if (items[1].status == WAYK_CSE_BUNDLE_OK)
 	{
 		contentInfo->hasBranding = true;
 	}
 
-	if (WaykCseBundle_ExtractPowerShellInitScript(bundle, extractionPath) == WAYK_CSE_BUNDLE_OK)
+	if (items[2].status == WAYK_CSE_BUNDLE_OK)
 	{
 		contentInfo->hasPowerShellInitScript = true;
 	}
@@ -64,6 +174,8 @@ static int ExtractBundle(
 	status = LZ_OK;
 
 cleanup:
+	if (optionsJson)
+		free(optionsJson);
 	if (bundle)
 		WaykCseBundle_Close(bundle);
 
@@ -115,7 +227,6 @@ int WINAPI WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance, _
 	char tempFolderName[LZ_MAX_PATH];
 	char psInitScriptPath[LZ_MAX_PATH];
 	char extractionPath[LZ_MAX_PATH];
-	char optionsPath[LZ_MAX_PATH];
 	char msiPath[LZ_MAX_PATH];
 	char brandingPath[LZ_MAX_PATH];
 	char* productName = 0;
@@ -123,6 +234,8 @@ int WINAPI WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance, _
 	HANDLE cseStartedMutex = 0;
 	CseOptions* cseOptions = 0;
 	CseInstall* cseInstall = 0;
+	CseMsiDownload* msiDownload = 0;
+	CseDownloadSession* downloadSession = 0;
 
 	if (AttachConsole(-1) != 0)
 	{
@@ -148,6 +261,10 @@ int WINAPI WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance, _
 
 	CSE_LOG_INFO("Starting %s CSE deploy...", productName);
 
+	// Connections for a possible MSI download are opened while the bundle is
+	// read; mirrors are added once options.json is loaded
+	downloadSession = CseDownloadSession_New(NULL, 0);
+
 	cseStartedMutex = CreateMutexW(NULL, true, CSE_INSTANCE_MUTEX_NAME_W);
 	if (!cseStartedMutex || GetLastError() == ERROR_ALREADY_EXISTS)
 	{
@@ -182,13 +299,28 @@ int WINAPI WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance, _
 		}
 	}
 
+	cseOptions = CseOptions_New();
+	if (!cseOptions)
+	{
+		status = LZ_ERROR_MEM;
+		goto  cleanup;
+	}
+
+	msiPath[0] = '\0';
+	LzPathCchAppend(msiPath, sizeof(msiPath), extractionPath);
+	LzPathCchAppend(msiPath, sizeof(msiPath), GetInstallerFileName(waykBinariesBitness));
+
 	CSE_LOG_INFO("Extracting compressed CSE artifacts...");
 
 	ZeroMemory(&bundleOptionalContentInfo, sizeof(BundleOptionalContentInfo));
 	status = ExtractBundle(
 		extractionPath,
+		msiPath,
 		waykBinariesBitness,
-		&bundleOptionalContentInfo);
+		&bundleOptionalContentInfo,
+		cseOptions,
+		&downloadSession,
+		&msiDownload);
 
 	if (status != LZ_OK)
 	{
@@ -196,40 +328,24 @@ int WINAPI WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance, _
 		goto cleanup;
 	}
 
-	CSE_LOG_INFO("Parsing CSE config..");
-
-	cseOptions = CseOptions_New();
-	if (!cseOptions)
-	{
-		status = LZ_ERROR_MEM;
-		goto  cleanup;
-	}
-
-	optionsPath[0] = '\0';
-	LzPathCchAppend(optionsPath, sizeof(optionsPath), extractionPath);
-	LzPathCchAppend(optionsPath, sizeof(optionsPath), GetJsonOptionsFileName());
-	if (CseOptions_LoadFromFile(cseOptions, optionsPath) != CSE_OPTIONS_OK)
-	{
-		CSE_LOG_ERROR("Failed to load JSON options");
-		status = LZ_ERROR_FAIL;
-		goto cleanup;
-	}
-
 	CSE_LOG_INFO("Preparing for MSI install...");
 
-	msiPath[0] = '\0';
-	LzPathCchAppend(msiPath, sizeof(msiPath), extractionPath);
-	LzPathCchAppend(msiPath, sizeof(msiPath), GetInstallerFileName(waykBinariesBitness));
-
 	if (!bundleOptionalContentInfo.hasEmbeddedInstaller)
 	{
-		CSE_LOG_INFO("Downloading latest MSI");
+		// Bundle couldn't tell before extraction that the installer is missing
+		if (!msiDownload)
+			msiDownload = StartMsiDownload(waykBinariesBitness, msiPath, cseOptions, downloadSession);
 
-		msiPath[0] = '\0';
-		LzPathCchAppend(msiPath, sizeof(msiPath), extractionPath);
-		LzPathCchAppend(msiPath, sizeof(msiPath), GetInstallerFileName(waykBinariesBitness));
+		if (!msiDownload)
+		{
+			status = LZ_ERROR_FAIL;
+			goto cleanup;
+		}
+
+		CseDownloadResult downloadResult = CseDownload_FinishMsi(msiDownload);
+		msiDownload = 0;
 
-		if (CseDownload_DownloadMsi(waykBinariesBitness, msiPath) != CSE_DOWNLOAD_OK)
+		if (downloadResult != CSE_DOWNLOAD_OK)
 		{
 			CSE_LOG_ERROR("Failed to download MSI");
 			status = LZ_ERROR_FAIL;
@@ -396,6 +512,15 @@ int WINAPI WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance, _
 	CSE_LOG_INFO("Successfully deployed %s CSE!", productName);
 
 cleanup:
+	// Download uses the options, it is waited for before they are freed. It
+	// is only still running here if something else failed, it is of no use then
+	if (msiDownload)
+	{
+		CseDownload_CancelMsi(msiDownload);
+		CseDownload_FinishMsi(msiDownload);
+	}
+	if (downloadSession)
+		CseDownloadSession_Free(downloadSession);
 	if (productName)
 		free(productName);
 	if (cseStartedMutex)
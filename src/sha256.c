@@ -0,0 +1,176 @@
+#include <cse/sha256.h>
+#include <cse/log.h>
+
+#include <windows.h>
+#include <bcrypt.h>
+
+#include <stdlib.h>
+
+#define CSE_LOG_TAG "CseSha256"
+
+#define CSE_SHA256_FILE_BUFFER_SIZE (256 * 1024)
+
+struct cse_sha256
+{
+	BCRYPT_ALG_HANDLE algorithm;
+	BCRYPT_HASH_HANDLE hash;
+};
+
+CseSha256* CseSha256_New()
+{
+	NTSTATUS status;
+
+	CseSha256* ctx = calloc(1, sizeof(CseSha256));
+	if (!ctx)
+	{
+		CSE_LOG_ERROR("Allocation failed");
+		return 0;
+	}
+
+	status = BCryptOpenAlgorithmProvider(&ctx->algorithm, BCRYPT_SHA256_ALGORITHM, NULL, 0);
+	if (!BCRYPT_SUCCESS(status))
+	{
+		CSE_LOG_ERROR("Failed to open SHA-256 provider (0x%08lx)", (unsigned long) status);
+		ctx->algorithm = 0;
+		CseSha256_Free(ctx);
+		return 0;
+	}
+
+	// Hash object memory is allocated by CNG itself (Windows 7 and newer)
+	status = BCryptCreateHash(ctx->algorithm, &ctx->hash, NULL, 0, NULL, 0, 0);
+	if (!BCRYPT_SUCCESS(status))
+	{
+		CSE_LOG_ERROR("Failed to create SHA-256 hash (0x%08lx)", (unsigned long) status);
+		ctx->hash = 0;
+		CseSha256_Free(ctx);
+		return 0;
+	}
+
+	return ctx;
+}
+
+void CseSha256_Free(CseSha256* ctx)
+{
+	if (ctx->hash)
+		BCryptDestroyHash(ctx->hash);
+	if (ctx->algorithm)
+		BCryptCloseAlgorithmProvider(ctx->algorithm, 0);
+
+	free(ctx);
+}
+
+bool CseSha256_Update(CseSha256* ctx, const uint8_t* data, size_t size)
+{
+	while (size > 0)
+	{
+		ULONG chunkSize = (size > 0x40000000) ? 0x40000000 : (ULONG) size;
+
+		if (!BCRYPT_SUCCESS(BCryptHashData(ctx->hash, (PUCHAR) data, chunkSize, 0)))
+			return false;
+
+		data += chunkSize;
+		size -= chunkSize;
+	}
+
+	return true;
+}
+
+bool CseSha256_Finish(CseSha256* ctx, uint8_t* digest)
+{
+	return BCRYPT_SUCCESS(BCryptFinishHash(ctx->hash, digest, CSE_SHA256_DIGEST_SIZE, 0));
+}
+
+bool CseSha256_Compute(const uint8_t* data, size_t size, uint8_t* digest)
+{
+	bool result;
+
+	CseSha256* ctx = CseSha256_New();
+	if (!ctx)
+		return false;
+
+	result = CseSha256_Update(ctx, data, size) && CseSha256_Finish(ctx, digest);
+
+	CseSha256_Free(ctx);
+	return result;
+}
+
+bool CseSha256_ComputeFile(const wchar_t* path, uint64_t size, uint8_t* digest)
+{
+	bool result = false;
+	CseSha256* ctx = NULL;
+	uint8_t* buffer = NULL;
+	DWORD bytesRead;
+
+	HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	ctx = CseSha256_New();
+	buffer = malloc(CSE_SHA256_FILE_BUFFER_SIZE);
+	if (!ctx || !buffer)
+		goto exit;
+
+	while (size > 0)
+	{
+		DWORD toRead = (size > CSE_SHA256_FILE_BUFFER_SIZE) ? CSE_SHA256_FILE_BUFFER_SIZE : (DWORD) size;
+
+		if (!ReadFile(file, buffer, toRead, &bytesRead, NULL) || (bytesRead != toRead))
+			goto exit;
+
+		if (!CseSha256_Update(ctx, buffer, bytesRead))
+			goto exit;
+
+		size -= bytesRead;
+	}
+
+	result = CseSha256_Finish(ctx, digest);
+
+exit:
+	if (ctx)
+		CseSha256_Free(ctx);
+
+	free(buffer);
+	CloseHandle(file);
+
+	return result;
+}
+
+static int HexDigitValue(char c)
+{
+	if ((c >= '0') && (c <= '9'))
+		return c - '0';
+	if ((c >= 'a') && (c <= 'f'))
+		return c - 'a' + 10;
+	if ((c >= 'A') && (c <= 'F'))
+		return c - 'A' + 10;
+	return -1;
+}
+
+bool CseSha256_FromHex(const char* hex, uint8_t* digest)
+{
+	for (int i = 0; i < CSE_SHA256_DIGEST_SIZE; ++i)
+	{
+		int high = HexDigitValue(hex[i * 2]);
+		int low = (high < 0) ? -1 : HexDigitValue(hex[i * 2 + 1]);
+
+		if (low < 0)
+			return false;
+
+		digest[i] = (uint8_t)((high << 4) | low);
+	}
+
+	return hex[CSE_SHA256_DIGEST_SIZE * 2] == '\0';
+}
+
+void CseSha256_ToHex(const uint8_t* digest, char* hex)
+{
+	static const char digits[] = "0123456789abcdef";
+
+	for (int i = 0; i < CSE_SHA256_DIGEST_SIZE; ++i)
+	{
+		hex[i * 2] = digits[digest[i] >> 4];
+		hex[i * 2 + 1] = digits[digest[i] & 0x0F];
+	}
+
+	hex[CSE_SHA256_DIGEST_SIZE * 2] = '\0';
+}
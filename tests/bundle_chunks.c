@@ -0,0 +1,210 @@
+#include <cse/bundle_chunks.h>
+
+#include "test_utils.h"
+
+#include <string.h>
+
+#define TEST_POOL_SIZE 1000
+#define TEST_RECIPE_HEADER_SIZE 4
+#define TEST_RECIPE_RECORD_SIZE 12
+
+static void write_uint32(uint8_t* data, uint32_t value)
+{
+	for (int i = 0; i < 4; ++i)
+		data[i] = (uint8_t) (value >> (8 * i));
+}
+
+// Recipe of the given chunks, returns its size
+static size_t make_recipe(uint8_t* recipe, const uint64_t* offsets, const uint32_t* sizes, uint32_t count)
+{
+	uint8_t* record = recipe + TEST_RECIPE_HEADER_SIZE;
+
+	write_uint32(recipe, count);
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		write_uint32(record, (uint32_t) offsets[i]);
+		write_uint32(record + 4, (uint32_t) (offsets[i] >> 32));
+		write_uint32(record + 8, sizes[i]);
+		record += TEST_RECIPE_RECORD_SIZE;
+	}
+
+	return TEST_RECIPE_HEADER_SIZE + (size_t) count * TEST_RECIPE_RECORD_SIZE;
+}
+
+int validate_recipe()
+{
+	uint8_t recipe[TEST_RECIPE_HEADER_SIZE + 3 * TEST_RECIPE_RECORD_SIZE + 16];
+	uint64_t offsets[3] = { 600, 0, 600 };
+	uint32_t sizes[3] = { 400, 600, 400 };
+	size_t recipeSize;
+
+	// Chunks may repeat and come in any order
+	recipeSize = make_recipe(recipe, offsets, sizes, 3);
+	if (!WaykCseBundleChunks_Validate(recipe, recipeSize, 1400, TEST_POOL_SIZE))
+		return 1;
+
+	// Entry size doesn't match the chunks
+	if (WaykCseBundleChunks_Validate(recipe, recipeSize, 1399, TEST_POOL_SIZE))
+		return 2;
+
+	// Recipe cut in the middle of a record, or shorter than its header
+	if (WaykCseBundleChunks_Validate(recipe, recipeSize - 1, 1400, TEST_POOL_SIZE) ||
+		WaykCseBundleChunks_Validate(recipe, 3, 0, TEST_POOL_SIZE))
+	{
+		return 3;
+	}
+
+	// Trailing bytes after the last record, fewer than another record
+	memset(recipe + recipeSize, 0, 16);
+	for (size_t extra = 1; extra < TEST_RECIPE_RECORD_SIZE; ++extra)
+	{
+		if (WaykCseBundleChunks_Validate(recipe, recipeSize + extra, 1400, TEST_POOL_SIZE))
+			return 4;
+	}
+
+	// Last chunk ends one byte past the pool
+	offsets[2] = 601;
+	recipeSize = make_recipe(recipe, offsets, sizes, 3);
+	if (WaykCseBundleChunks_Validate(recipe, recipeSize, 1400, TEST_POOL_SIZE))
+		return 5;
+
+	// Chunk starts past the pool, also where adding the size would wrap around
+	offsets[2] = UINT64_MAX - 100;
+	recipeSize = make_recipe(recipe, offsets, sizes, 3);
+	if (WaykCseBundleChunks_Validate(recipe, recipeSize, 1400, TEST_POOL_SIZE))
+		return 6;
+
+	offsets[2] = TEST_POOL_SIZE + 1;
+	recipeSize = make_recipe(recipe, offsets, sizes, 3);
+	if (WaykCseBundleChunks_Validate(recipe, recipeSize, 1400, TEST_POOL_SIZE))
+		return 7;
+
+	// Empty chunks are never written by the patcher
+	offsets[2] = 600;
+	sizes[1] = 0;
+	recipeSize = make_recipe(recipe, offsets, sizes, 3);
+	if (WaykCseBundleChunks_Validate(recipe, recipeSize, 800, TEST_POOL_SIZE))
+		return 8;
+
+	// Empty entry has no chunks
+	recipeSize = make_recipe(recipe, offsets, sizes, 0);
+	if (!WaykCseBundleChunks_Validate(recipe, recipeSize, 0, TEST_POOL_SIZE))
+		return 9;
+
+	return 0;
+}
+
+int assemble_chunks()
+{
+	int result = 0;
+	uint8_t* pool = NULL;
+	uint8_t* expected = NULL;
+	uint8_t recipe[TEST_RECIPE_HEADER_SIZE + 3 * TEST_RECIPE_RECORD_SIZE];
+	const uint64_t offsets[3] = { 600, 0, 600 };
+	const uint32_t sizes[3] = { 400, 600, 400 };
+	size_t recipeSize;
+	char poolPath[MAX_PATH];
+	char path[MAX_PATH];
+	WaykCseBundleOutput* output = NULL;
+	bool closed;
+	FILE* fp = NULL;
+
+	poolPath[0] = '\0';
+	path[0] = '\0';
+
+	pool = make_test_file(TEST_POOL_SIZE);
+	expected = malloc(1400);
+	if (!pool || !expected)
+	{
+		result = 1;
+		goto finalize;
+	}
+
+	memcpy(expected, pool + 600, 400);
+	memcpy(expected + 400, pool, 600);
+	memcpy(expected + 1000, pool + 600, 400);
+
+	recipeSize = make_recipe(recipe, offsets, sizes, 3);
+	if (!WaykCseBundleChunks_Validate(recipe, recipeSize, 1400, TEST_POOL_SIZE))
+	{
+		result = 2;
+		goto finalize;
+	}
+
+	if (!make_temp_path("cse_bundle_chunks.bin", poolPath, sizeof(poolPath)) ||
+		!make_temp_path("cse_bundle_chunked.msi", path, sizeof(path)))
+	{
+		result = 3;
+		goto finalize;
+	}
+
+	// Stored pool
+	output = WaykCseBundleOutput_Open(path, 1400, NULL);
+	if (!output || !WaykCseBundleChunks_AssembleFromMemory(recipe, pool, output))
+	{
+		result = 4;
+		goto finalize;
+	}
+
+	closed = WaykCseBundleOutput_Close(output, true);
+	output = NULL;
+
+	if (!closed || (check_file(path, expected, 1400) != 0))
+	{
+		result = 5;
+		goto finalize;
+	}
+
+	// Compressed pool, decoded to a file first
+	DeleteFileA(path);
+
+	fp = fopen(poolPath, "wb");
+	if (!fp || (fwrite(pool, 1, TEST_POOL_SIZE, fp) != TEST_POOL_SIZE))
+	{
+		result = 6;
+		goto finalize;
+	}
+
+	fclose(fp);
+	fp = NULL;
+
+	output = WaykCseBundleOutput_Open(path, 1400, NULL);
+	if (!output || !WaykCseBundleChunks_AssembleFromFile(recipe, poolPath, output))
+	{
+		result = 7;
+		goto finalize;
+	}
+
+	closed = WaykCseBundleOutput_Close(output, true);
+	output = NULL;
+
+	if (!closed || (check_file(path, expected, 1400) != 0))
+	{
+		result = 8;
+		goto finalize;
+	}
+
+finalize:
+	if (output)
+		WaykCseBundleOutput_Close(output, false);
+	if (fp)
+		fclose(fp);
+
+	if (poolPath[0])
+		DeleteFileA(poolPath);
+	if (path[0])
+		DeleteFileA(path);
+
+	free(expected);
+	free(pool);
+
+	return result;
+}
+
+int main()
+{
+	assert_test_succeeded(validate_recipe());
+	assert_test_succeeded(assemble_chunks());
+	return 0;
+}
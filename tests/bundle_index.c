@@ -0,0 +1,350 @@
+#include <cse/bundle_index.h>
+
+#include "test_utils.h"
+
+#include <string.h>
+
+#define TEST_README "Wayk Now bundle test\n"
+#define TEST_README_CRC 0x4A614FF3
+#define TEST_LICENSE_SIZE 300
+
+#define TEST_TOC_HEADER_SIZE 16
+#define TEST_TOC_RECORD_SIZE 128
+
+// Returns the whole file, NULL if it can't be read
+static uint8_t* read_test_file(const char* path, size_t* size)
+{
+	uint8_t* data = NULL;
+	long length;
+	FILE* fp = fopen(path, "rb");
+
+	if (!fp)
+		return NULL;
+
+	if ((fseek(fp, 0, SEEK_END) == 0) && ((length = ftell(fp)) > 0) && (fseek(fp, 0, SEEK_SET) == 0))
+	{
+		data = malloc((size_t) length);
+		if (data && (fread(data, 1, (size_t) length, fp) != (size_t) length))
+		{
+			free(data);
+			data = NULL;
+		}
+
+		*size = (size_t) length;
+	}
+
+	fclose(fp);
+
+	return data;
+}
+
+// Every stored entry of an index has to be within the archive
+static bool check_bounds(WaykCseBundleIndex* index, size_t size)
+{
+	for (int i = 0; i < WaykCseBundleIndex_GetCount(index); ++i)
+	{
+		const WaykCseBundleIndexEntry* entry = WaykCseBundleIndex_GetEntry(index, i);
+
+		if (entry->isStored && ((entry->dataOffset > size) || (entry->size > size - entry->dataOffset)))
+			return false;
+	}
+
+	return true;
+}
+
+int parse_stored()
+{
+	int result = 0;
+	size_t size = 0;
+	uint8_t* data = read_test_file("tests/data/bundle_store.7z", &size);
+	WaykCseBundleIndex* index = NULL;
+	const WaykCseBundleIndexEntry* readme;
+	const WaykCseBundleIndexEntry* license;
+	const WaykCseBundleIndexEntry* empty;
+
+	if (!data)
+	{
+		result = 1;
+		goto finalize;
+	}
+
+	index = WaykCseBundleIndex_Parse(data, size);
+	if (!index || (WaykCseBundleIndex_GetCount(index) != 3))
+	{
+		result = 2;
+		goto finalize;
+	}
+
+	readme = WaykCseBundleIndex_Find(index, "readme.txt");
+	license = WaykCseBundleIndex_Find(index, "bin/license.txt");
+	empty = WaykCseBundleIndex_Find(index, "empty.txt");
+
+	if (!readme || !license || !empty || WaykCseBundleIndex_Find(index, "missing.txt"))
+	{
+		result = 3;
+		goto finalize;
+	}
+
+	// Every file is a stored block of its own, packed one after the other
+	if (!readme->isStored || (readme->size != strlen(TEST_README)) ||
+		(memcmp(data + readme->dataOffset, TEST_README, strlen(TEST_README)) != 0) ||
+		!readme->hasCrc || (readme->crc != TEST_README_CRC))
+	{
+		result = 4;
+		goto finalize;
+	}
+
+	if (!license->isStored || (license->size != TEST_LICENSE_SIZE) ||
+		(license->folderIndex != readme->folderIndex + 1) ||
+		(license->dataOffset != readme->dataOffset + readme->size))
+	{
+		result = 5;
+		goto finalize;
+	}
+
+	if ((empty->folderIndex != -1) || (empty->size != 0))
+	{
+		result = 6;
+		goto finalize;
+	}
+
+finalize:
+	if (index)
+		WaykCseBundleIndex_Free(index);
+	free(data);
+
+	return result;
+}
+
+int parse_encoded_header()
+{
+	int result = 0;
+	size_t size = 0;
+	uint8_t* data = read_test_file("tests/data/bundle_lzma.7z", &size);
+	WaykCseBundleIndex* index = NULL;
+
+	if (!data)
+	{
+		result = 1;
+		goto finalize;
+	}
+
+	// Compressed headers are not read, entries are looked up by the codec
+	index = WaykCseBundleIndex_Parse(data, size);
+	if (index)
+	{
+		result = 2;
+		goto finalize;
+	}
+
+finalize:
+	if (index)
+		WaykCseBundleIndex_Free(index);
+	free(data);
+
+	return result;
+}
+
+int parse_truncated()
+{
+	int result = 0;
+	size_t size = 0;
+	uint8_t* data = read_test_file("tests/data/bundle_store.7z", &size);
+	uint8_t* copy = NULL;
+	WaykCseBundleIndex* index = NULL;
+
+	if (!data)
+	{
+		result = 1;
+		goto finalize;
+	}
+
+	// Header is at the end of the archive, any cut loses part of it. Copies
+	// are exactly as long as the cut, so reading past them is caught
+	for (size_t length = 0; length < size; ++length)
+	{
+		copy = malloc(length ? length : 1);
+		if (!copy)
+		{
+			result = 2;
+			goto finalize;
+		}
+
+		memcpy(copy, data, length);
+		index = WaykCseBundleIndex_Parse(copy, length);
+
+		free(copy);
+		copy = NULL;
+
+		if (index)
+		{
+			result = 3;
+			goto finalize;
+		}
+	}
+
+finalize:
+	if (index)
+		WaykCseBundleIndex_Free(index);
+	free(data);
+
+	return result;
+}
+
+int parse_corrupted()
+{
+	int result = 0;
+	size_t size = 0;
+	uint8_t* data = read_test_file("tests/data/bundle_store.7z", &size);
+	WaykCseBundleIndex* index = NULL;
+	uint64_t headerOffset;
+
+	if (!data)
+	{
+		result = 1;
+		goto finalize;
+	}
+
+	headerOffset = 32 + ((uint64_t) data[12] | ((uint64_t) data[13] << 8) | ((uint64_t) data[14] << 16));
+
+	// Signature is checked first
+	data[0] ^= 0xFF;
+	index = WaykCseBundleIndex_Parse(data, size);
+	data[0] ^= 0xFF;
+
+	if (index)
+	{
+		result = 2;
+		goto finalize;
+	}
+
+	// Header size past the end of the archive
+	data[20] ^= 0x80;
+	index = WaykCseBundleIndex_Parse(data, size);
+	data[20] ^= 0x80;
+
+	if (index)
+	{
+		result = 3;
+		goto finalize;
+	}
+
+	// Any header byte may be wrong: counts, sizes, property ids. Either the
+	// header is rejected or the entries still point into the archive
+	for (size_t i = (size_t) headerOffset; i < size; ++i)
+	{
+		for (int bit = 0; bit < 8; ++bit)
+		{
+			data[i] ^= (uint8_t) (1 << bit);
+			index = WaykCseBundleIndex_Parse(data, size);
+			data[i] ^= (uint8_t) (1 << bit);
+
+			if (index && !check_bounds(index, size))
+			{
+				result = 4;
+				goto finalize;
+			}
+
+			if (index)
+				WaykCseBundleIndex_Free(index);
+			index = NULL;
+		}
+	}
+
+finalize:
+	if (index)
+		WaykCseBundleIndex_Free(index);
+	free(data);
+
+	return result;
+}
+
+static void write_toc_record(uint8_t* record, const char* name, uint64_t offset, uint64_t size)
+{
+	memset(record, 0, TEST_TOC_RECORD_SIZE);
+	strcpy_s((char*) record, 64, name);
+
+	for (int i = 0; i < 8; ++i)
+	{
+		record[64 + i] = (uint8_t) (offset >> (8 * i));
+		record[72 + i] = (uint8_t) (size >> (8 * i));
+		record[80 + i] = (uint8_t) (size >> (8 * i));
+	}
+
+	// Codec 0 is ignored for stored entries
+	record[94] = 0x01;
+}
+
+int parse_toc()
+{
+	int result = 0;
+	uint8_t toc[TEST_TOC_HEADER_SIZE + 2 * TEST_TOC_RECORD_SIZE];
+	WaykCseBundleIndex* index = NULL;
+	const WaykCseBundleIndexEntry* entry;
+
+	memset(toc, 0, sizeof(toc));
+	memcpy(toc, "WCSE_TOC", 8);
+	toc[8] = 1;
+	toc[10] = TEST_TOC_RECORD_SIZE;
+	toc[12] = 2;
+
+	write_toc_record(toc + TEST_TOC_HEADER_SIZE, "WaykNow-x64.msi", 0, 1000);
+	write_toc_record(toc + TEST_TOC_HEADER_SIZE + TEST_TOC_RECORD_SIZE, "cse_options.json", 1000, 24);
+
+	index = WaykCseBundleIndex_ParseToc(toc, sizeof(toc), 1024);
+	if (!index || (WaykCseBundleIndex_GetCount(index) != 2))
+	{
+		result = 1;
+		goto finalize;
+	}
+
+	entry = WaykCseBundleIndex_Find(index, "cse_options.json");
+	if (!entry || !entry->isStored || (entry->dataOffset != 1000) || (entry->size != 24))
+	{
+		result = 2;
+		goto finalize;
+	}
+
+	WaykCseBundleIndex_Free(index);
+
+	// Last entry ends past the payload
+	index = WaykCseBundleIndex_ParseToc(toc, sizeof(toc), 1023);
+	if (index)
+	{
+		result = 3;
+		goto finalize;
+	}
+
+	// Entry count says there are more records than the table holds
+	index = WaykCseBundleIndex_ParseToc(toc, sizeof(toc) - 1, 1024);
+	if (index)
+	{
+		result = 4;
+		goto finalize;
+	}
+
+	// Name fills its whole field, without a terminator
+	memset(toc + TEST_TOC_HEADER_SIZE, 'a', 64);
+	index = WaykCseBundleIndex_ParseToc(toc, sizeof(toc), 1024);
+	if (index)
+	{
+		result = 5;
+		goto finalize;
+	}
+
+finalize:
+	if (index)
+		WaykCseBundleIndex_Free(index);
+
+	return result;
+}
+
+int main()
+{
+	assert_test_succeeded(parse_stored());
+	assert_test_succeeded(parse_encoded_header());
+	assert_test_succeeded(parse_truncated());
+	assert_test_succeeded(parse_corrupted());
+	assert_test_succeeded(parse_toc());
+	return 0;
+}
@@ -1,16 +1,1084 @@
+#include "http_server.h"
+
 #include <cse/download.h>
+#include <cse/sha256.h>
+
+#include <zstd.h>
 
 #include "test_utils.h"
 
 #include <string.h>
 
-int download_msi()
+#define TEST_FILE_SIZE (1024 * 1024 + 123)
+
+// Test file, the local server it is served from and the path it is
+// downloaded to
+typedef struct
+{
+	TestHttpServer server;
+	uint8_t* body;
+	uint8_t digest[CSE_SHA256_DIGEST_SIZE];
+	char url[128];
+	char path[MAX_PATH];
+	char partialPath[MAX_PATH + 16];
+	char statePath[MAX_PATH + 16];
+} TestDownload;
+
+static void test_server_url(const TestHttpServer* server, const char* path, char* url, size_t size)
+{
+	sprintf_s(url, size, "http://127.0.0.1:%u%s", (unsigned) server->port, path);
+}
+
+// Returns 1 if the test file can't be made, 2 if the path can't be
+static int test_download_init(TestDownload* test, const char* name)
 {
+	ZeroMemory(test, sizeof(*test));
+
+	test->body = make_test_file(TEST_FILE_SIZE);
+	if (!test->body || !CseSha256_Compute(test->body, TEST_FILE_SIZE, test->digest))
+		return 1;
+
+	if (!make_temp_path(name, test->path, sizeof(test->path)))
+		return 2;
+
+	sprintf_s(test->partialPath, sizeof(test->partialPath), "%s.partial", test->path);
+	sprintf_s(test->statePath, sizeof(test->statePath), "%s.resume", test->path);
+	DeleteFileA(test->partialPath);
+	DeleteFileA(test->statePath);
+
 	return 0;
 }
 
+// Serves the test file, url is set to path on the server
+static bool test_download_start(TestDownload* test, const char* path)
+{
+	if (!TestHttpServer_Start(&test->server, test->body, TEST_FILE_SIZE))
+		return false;
+
+	test_server_url(&test->server, path, test->url, sizeof(test->url));
+
+	return true;
+}
+
+static void test_download_free(TestDownload* test)
+{
+	if (test->server.thread)
+		TestHttpServer_Stop(&test->server);
+
+	DeleteFileA(test->path);
+	DeleteFileA(test->partialPath);
+	DeleteFileA(test->statePath);
+	free(test->body);
+}
+
+int download_msi()
+{
+	int result = 0;
+	TestDownload test;
+	TestHttpServer infoServer;
+	CseDownloadOptions options;
+	CseMsiDownload* download;
+	char hash[CSE_SHA256_HEX_SIZE];
+	char productInfo[1024];
+	char infoUrl[128];
+	char* key;
+	ULONGLONG start;
+
+	ZeroMemory(&infoServer, sizeof(infoServer));
+	ZeroMemory(&options, sizeof(options));
+
+	result = test_download_init(&test, "cse_download_msi.msi");
+	if (result != 0)
+		goto finalize;
+
+	if (!test_download_start(&test, ""))
+	{
+		result = 3;
+		goto finalize;
+	}
+
+	// Each bitness has its own URL, only the x86 one is published with a hash
+	CseSha256_ToHex(test.digest, hash);
+	sprintf_s(productInfo, sizeof(productInfo),
+		"WaykAgentmsi64.Version=1.0\r\nWaykAgentmsi64.Url=%s/x64/WaykAgent.msi\r\n"
+		"WaykAgentmsi86.Version=1.0\r\nWaykAgentmsi86.Url=%s/x86/WaykAgent.msi\r\nWaykAgentmsi86.Hash=%s\r\n"
+		"WaykNowmsi64.Version=1.0\r\nWaykNowmsi64.Url=%s/WaykNow-x64.msi\r\n",
+		test.url, test.url, hash, test.url);
+
+	// Response to the x64 request stops in the middle of the page, which is
+	// only fine once the line after the x64 group is there
+	infoServer.path = "/productinfo.htm";
+	infoServer.dropRequest = 2;
+	infoServer.dropAfter = (size_t) (strstr(productInfo, "WaykAgentmsi86.Url") - productInfo) + 4;
+	infoServer.stall = true;
+
+	if (!TestHttpServer_Start(&infoServer, (const uint8_t*) productInfo, strlen(productInfo)))
+	{
+		result = 3;
+		goto finalize;
+	}
+
+	test_server_url(&infoServer, "/productinfo.htm", infoUrl, sizeof(infoUrl));
+	options.productInfoUrl = infoUrl;
+
+	download = CseDownload_StartMsi(WAYK_BINARIES_BITNESS_X86, test.path, &options);
+	if (!download)
+	{
+		result = 4;
+		goto finalize;
+	}
+
+	if ((CseDownload_FinishMsi(download) != CSE_DOWNLOAD_OK) ||
+		(check_file(test.path, test.body, TEST_FILE_SIZE) != 0))
+	{
+		result = 5;
+		goto finalize;
+	}
+
+	if ((infoServer.requestCount != 1) || (test.server.requestCount != 1) ||
+		(strcmp(test.server.lastPath, "/x86/WaykAgent.msi") != 0))
+	{
+		result = 6;
+		goto finalize;
+	}
+
+	// Downloaded without a hash to check against; the rest of the page is
+	// not waited for
+	DeleteFileA(test.path);
+	start = GetTickCount64();
+
+	if ((CseDownload_DownloadMsi(WAYK_BINARIES_BITNESS_X64, test.path, &options) != CSE_DOWNLOAD_OK) ||
+		(check_file(test.path, test.body, TEST_FILE_SIZE) != 0) ||
+		(strcmp(test.server.lastPath, "/x64/WaykAgent.msi") != 0))
+	{
+		result = 7;
+		goto finalize;
+	}
+
+	if (GetTickCount64() - start >= 5000)
+	{
+		result = 9;
+		goto finalize;
+	}
+
+	// Without the key of the bitness there is nothing to download
+	DeleteFileA(test.path);
+	key = strstr(productInfo, "WaykAgentmsi64.Url");
+	key[0] = 'X';
+	test.server.requestCount = 0;
+
+	if ((CseDownload_DownloadMsi(WAYK_BINARIES_BITNESS_X64, test.path, &options) != CSE_DOWNLOAD_FAILURE) ||
+		file_exists(test.path) || (test.server.requestCount != 0))
+	{
+		result = 8;
+		goto finalize;
+	}
+
+finalize:
+	if (infoServer.thread)
+		TestHttpServer_Stop(&infoServer);
+
+	test_download_free(&test);
+
+	return result;
+}
+
+int download_resume()
+{
+	int result = 0;
+	TestDownload test;
+
+	result = test_download_init(&test, "cse_download_resume.msi");
+	if (result != 0)
+		goto finalize;
+
+	test.server.dropAfter = 300000;
+	if (!test_download_start(&test, "/WaykAgent.msi"))
+	{
+		result = 3;
+		goto finalize;
+	}
+
+	if (CseDownload_File(test.url, test.path, test.digest, NULL) != CSE_DOWNLOAD_OK)
+	{
+		result = 4;
+		goto finalize;
+	}
+
+	// Second request has to continue where the dropped connection stopped
+	if ((test.server.requestCount != 2) || (test.server.lastRangeStart != test.server.dropAfter))
+	{
+		result = 5;
+		goto finalize;
+	}
+
+	if (check_file(test.path, test.body, TEST_FILE_SIZE) != 0)
+	{
+		result = 6;
+		goto finalize;
+	}
+
+	if (file_exists(test.partialPath) || file_exists(test.statePath))
+	{
+		result = 7;
+		goto finalize;
+	}
+
+finalize:
+	test_download_free(&test);
+
+	return result;
+}
+
+int download_segmented()
+{
+	int result = 0;
+	TestDownload test;
+	CseDownloadOptions options;
+
+	ZeroMemory(&options, sizeof(options));
+
+	result = test_download_init(&test, "cse_download_segmented.msi");
+	if (result != 0)
+		goto finalize;
+
+	// Every response is delayed, so segments only overlap if they are
+	// requested in parallel
+	test.server.latency = 200;
+	if (!test_download_start(&test, "/WaykAgent.msi"))
+	{
+		result = 3;
+		goto finalize;
+	}
+
+	options.connections = 4;
+	options.segmentSize = 256 * 1024;
+
+	if (CseDownload_File(test.url, test.path, test.digest, &options) != CSE_DOWNLOAD_OK)
+	{
+		result = 4;
+		goto finalize;
+	}
+
+	// 5 segments, the last one holds the remaining 123 bytes
+	if ((test.server.requestCount != 5) || (test.server.maxActiveCount < 2))
+	{
+		result = 5;
+		goto finalize;
+	}
+
+	if (check_file(test.path, test.body, TEST_FILE_SIZE) != 0)
+	{
+		result = 6;
+		goto finalize;
+	}
+
+finalize:
+	test_download_free(&test);
+
+	return result;
+}
+
+int download_cache()
+{
+	int result = 0;
+	TestDownload test;
+	CseDownloadOptions options;
+	char cacheDirectory[MAX_PATH];
+
+	ZeroMemory(&options, sizeof(options));
+	cacheDirectory[0] = '\0';
+
+	result = test_download_init(&test, "cse_download_cached.msi");
+	if (result != 0)
+		goto finalize;
+
+	if (!make_temp_path("cse_download_cache", cacheDirectory, sizeof(cacheDirectory)))
+	{
+		result = 2;
+		goto finalize;
+	}
+
+	remove_directory(cacheDirectory);
+
+	if (!test_download_start(&test, "/WaykAgent.msi"))
+	{
+		result = 3;
+		goto finalize;
+	}
+
+	options.cacheDirectory = cacheDirectory;
+
+	if ((CseDownload_File(test.url, test.path, NULL, &options) != CSE_DOWNLOAD_OK) ||
+		(check_file(test.path, test.body, TEST_FILE_SIZE) != 0))
+	{
+		result = 4;
+		goto finalize;
+	}
+
+	// Without a digest the cached file is revalidated, the server answers 304
+	DeleteFileA(test.path);
+
+	if ((CseDownload_File(test.url, test.path, NULL, &options) != CSE_DOWNLOAD_OK) ||
+		(check_file(test.path, test.body, TEST_FILE_SIZE) != 0) ||
+		(test.server.requestCount != 2))
+	{
+		result = 5;
+		goto finalize;
+	}
+
+	// With a digest the cached file is checked locally, without any request
+	DeleteFileA(test.path);
+
+	if ((CseDownload_File(test.url, test.path, test.digest, &options) != CSE_DOWNLOAD_OK) ||
+		(check_file(test.path, test.body, TEST_FILE_SIZE) != 0) ||
+		(test.server.requestCount != 2))
+	{
+		result = 6;
+		goto finalize;
+	}
+
+	// File changed on the server: the answer to the revalidation is the new
+	// file, which is received into the cache without another request
+	DeleteFileA(test.path);
+	test.body[0] ^= 0xFF;
+	test.server.etag = "\"changed\"";
+
+	if ((CseDownload_File(test.url, test.path, NULL, &options) != CSE_DOWNLOAD_OK) ||
+		(check_file(test.path, test.body, TEST_FILE_SIZE) != 0) ||
+		(test.server.requestCount != 3))
+	{
+		result = 7;
+		goto finalize;
+	}
+
+finalize:
+	test_download_free(&test);
+
+	if (cacheDirectory[0])
+		remove_directory(cacheDirectory);
+
+	return result;
+}
+
+int download_mirror()
+{
+	int result = 0;
+	TestDownload test;
+	TestHttpServer mirror;
+	CseDownloadOptions options;
+	char mirrorUrl[128];
+	const char* mirrors[1];
+
+	ZeroMemory(&mirror, sizeof(mirror));
+	ZeroMemory(&options, sizeof(options));
+
+	result = test_download_init(&test, "cse_download_mirror.msi");
+	if (result != 0)
+		goto finalize;
+
+	// Mirror answers first, then drops the download; the slower official
+	// server has to continue it. The probe is the mirror's first request
+	mirror.dropAfter = 300000;
+	mirror.dropRequest = 2;
+	mirror.path = "/mirror/WaykAgent.msi";
+	mirror.keepAlive = true;
+	test.server.latency = 100;
+	test.server.keepAlive = true;
+
+	if (!TestHttpServer_Start(&mirror, test.body, TEST_FILE_SIZE) ||
+		!test_download_start(&test, "/files/WaykAgent.msi?v=1"))
+	{
+		result = 3;
+		goto finalize;
+	}
+
+	test_server_url(&mirror, "/mirror", mirrorUrl, sizeof(mirrorUrl));
+
+	mirrors[0] = mirrorUrl;
+	options.mirrors = mirrors;
+	options.mirrorCount = 1;
+
+	if (CseDownload_File(test.url, test.path, test.digest, &options) != CSE_DOWNLOAD_OK)
+	{
+		result = 4;
+		goto finalize;
+	}
+
+	if ((mirror.requestCount != 2) || (strcmp(mirror.lastPath, "/mirror/WaykAgent.msi") != 0))
+	{
+		result = 5;
+		goto finalize;
+	}
+
+	// Official server got the probe, then the rest of the file
+	if ((test.server.requestCount != 2) || (test.server.lastRangeStart != mirror.dropAfter))
+	{
+		result = 6;
+		goto finalize;
+	}
+
+	// Probes go through the download session, which reuses their
+	// connections; the compressed and plain file probes may run side by side
+	if ((test.server.connectionCount != 1) || (mirror.connectionCount > 2))
+	{
+		result = 7;
+		goto finalize;
+	}
+
+	if (check_file(test.path, test.body, TEST_FILE_SIZE) != 0)
+	{
+		result = 8;
+		goto finalize;
+	}
+
+finalize:
+	if (mirror.thread)
+		TestHttpServer_Stop(&mirror);
+
+	test_download_free(&test);
+
+	return result;
+}
+
+int download_failover()
+{
+	int result = 0;
+	TestDownload test;
+	TestHttpServer mirror;
+	CseDownloadOptions options;
+	char mirrorUrl[128];
+	const char* mirrors[1];
+	ULONGLONG start;
+
+	ZeroMemory(&mirror, sizeof(mirror));
+	ZeroMemory(&options, sizeof(options));
+
+	result = test_download_init(&test, "cse_download_failover.msi");
+	if (result != 0)
+		goto finalize;
+
+	// Mirror answers the probe, then refuses the download
+	mirror.dropRequest = 2;
+	mirror.dropStatus = 403;
+	mirror.path = "/mirror/WaykAgent.msi";
+	test.server.latency = 100;
+
+	if (!TestHttpServer_Start(&mirror, test.body, TEST_FILE_SIZE) ||
+		!test_download_start(&test, "/WaykAgent.msi"))
+	{
+		result = 3;
+		goto finalize;
+	}
+
+	test_server_url(&mirror, "/mirror", mirrorUrl, sizeof(mirrorUrl));
+
+	mirrors[0] = mirrorUrl;
+	options.mirrors = mirrors;
+	options.mirrorCount = 1;
+
+	// Official server takes over at once, without a retry delay
+	start = GetTickCount64();
+
+	if ((CseDownload_File(test.url, test.path, test.digest, &options) != CSE_DOWNLOAD_OK) ||
+		(check_file(test.path, test.body, TEST_FILE_SIZE) != 0))
+	{
+		result = 4;
+		goto finalize;
+	}
+
+	if ((mirror.requestCount != 2) || (test.server.requestCount != 2) || (GetTickCount64() - start >= 1000))
+	{
+		result = 5;
+		goto finalize;
+	}
+
+	// Mirror stops sending in the middle of the file; the official server
+	// continues it long before the receive timeout
+	DeleteFileA(test.path);
+	mirror.dropStatus = 0;
+	mirror.dropAfter = 300000;
+	mirror.stall = true;
+	mirror.requestCount = 0;
+	test.server.requestCount = 0;
+	start = GetTickCount64();
+
+	if ((CseDownload_File(test.url, test.path, test.digest, &options) != CSE_DOWNLOAD_OK) ||
+		(check_file(test.path, test.body, TEST_FILE_SIZE) != 0))
+	{
+		result = 6;
+		goto finalize;
+	}
+
+	if ((test.server.requestCount != 2) || (test.server.lastRangeStart != mirror.dropAfter) ||
+		(GetTickCount64() - start >= 30 * 1000))
+	{
+		result = 7;
+		goto finalize;
+	}
+
+finalize:
+	if (mirror.thread)
+		TestHttpServer_Stop(&mirror);
+
+	test_download_free(&test);
+
+	return result;
+}
+
+typedef struct
+{
+	bool mixed;  // a report had more received than total
+	CseDownloadProgress last;
+} TestProgress;
+
+static void test_compressed_progress(void* param, const CseDownloadProgress* progress)
+{
+	TestProgress* state = (TestProgress*) param;
+
+	if ((progress->total != CSE_DOWNLOAD_SIZE_UNKNOWN) && (progress->received > progress->total))
+		state->mixed = true;
+
+	state->last = *progress;
+}
+
+int download_compressed()
+{
+	int result = 0;
+	TestDownload test;
+	TestHttpServer mirror;
+	CseDownloadOptions options;
+	uint8_t* packed = NULL;
+	size_t packedSize;
+	char mirrorUrl[128];
+	const char* mirrors[1];
+	TestProgress progress;
+
+	ZeroMemory(&mirror, sizeof(mirror));
+	ZeroMemory(&options, sizeof(options));
+	ZeroMemory(&progress, sizeof(progress));
+
+	result = test_download_init(&test, "cse_download_compressed.msi");
+	if (result != 0)
+		goto finalize;
+
+	packed = malloc(ZSTD_compressBound(TEST_FILE_SIZE));
+	if (!packed)
+	{
+		result = 1;
+		goto finalize;
+	}
+
+	packedSize = ZSTD_compress(packed, ZSTD_compressBound(TEST_FILE_SIZE), test.body, TEST_FILE_SIZE, 3);
+	if (ZSTD_isError(packedSize))
+	{
+		result = 1;
+		goto finalize;
+	}
+
+	// Mirror only has the compressed file, the official server is slower
+	mirror.path = "/mirror/WaykAgent.msi.zst";
+	test.server.latency = 100;
+
+	if (!TestHttpServer_Start(&mirror, packed, packedSize) ||
+		!test_download_start(&test, "/WaykAgent.msi"))
+	{
+		result = 3;
+		goto finalize;
+	}
+
+	test_server_url(&mirror, "/mirror/", mirrorUrl, sizeof(mirrorUrl));
+
+	mirrors[0] = mirrorUrl;
+	options.mirrors = mirrors;
+	options.mirrorCount = 1;
+	options.connections = 4;
+	options.progress = test_compressed_progress;
+	options.progressParam = &progress;
+
+	if (CseDownload_File(test.url, test.path, test.digest, &options) != CSE_DOWNLOAD_OK)
+	{
+		result = 4;
+		goto finalize;
+	}
+
+	// Compressed bytes are never compared with the file size, the last
+	// report has the file size
+	if (progress.mixed || (progress.last.received != TEST_FILE_SIZE) || (progress.last.total != TEST_FILE_SIZE))
+	{
+		result = 5;
+		goto finalize;
+	}
+
+	// Compressed file is downloaded in one piece after its probe; the
+	// official server only gets its probe
+	if ((mirror.requestCount != 2) || (strcmp(mirror.lastPath, "/mirror/WaykAgent.msi.zst") != 0) ||
+		(mirror.lastRangeStart != 0) || (test.server.requestCount != 1))
+	{
+		result = 6;
+		goto finalize;
+	}
+
+	if (check_file(test.path, test.body, TEST_FILE_SIZE) != 0)
+	{
+		result = 7;
+		goto finalize;
+	}
+
+finalize:
+	if (mirror.thread)
+		TestHttpServer_Stop(&mirror);
+
+	test_download_free(&test);
+	free(packed);
+
+	return result;
+}
+
+// Simulated clock: time only moves when the download sleeps
+typedef struct
+{
+	uint64_t now;
+	int progressCount;
+	CseDownloadProgress lastProgress;
+} TestClock;
+
+static uint64_t test_clock_now(void* param)
+{
+	return ((TestClock*) param)->now;
+}
+
+static void test_clock_sleep(void* param, uint32_t milliseconds)
+{
+	((TestClock*) param)->now += milliseconds;
+}
+
+static void test_progress(void* param, const CseDownloadProgress* progress)
+{
+	TestClock* clock = (TestClock*) param;
+
+	clock->progressCount++;
+	clock->lastProgress = *progress;
+}
+
+int download_throttled()
+{
+	int result = 0;
+	TestDownload test;
+	CseDownloadOptions options;
+	CseDownloadClock clock;
+	TestClock testClock;
+
+	ZeroMemory(&options, sizeof(options));
+	ZeroMemory(&testClock, sizeof(testClock));
+
+	result = test_download_init(&test, "cse_download_throttled.msi");
+	if (result != 0)
+		goto finalize;
+
+	if (!test_download_start(&test, "/WaykAgent.msi"))
+	{
+		result = 3;
+		goto finalize;
+	}
+
+	clock.Now = test_clock_now;
+	clock.Sleep = test_clock_sleep;
+	clock.param = &testClock;
+
+	options.maxRate = 256 * 1024;
+	options.burstSize = 64 * 1024;
+	options.progress = test_progress;
+	options.progressParam = &testClock;
+	options.clock = &clock;
+
+	if (CseDownload_File(test.url, test.path, NULL, &options) != CSE_DOWNLOAD_OK)
+	{
+		result = 4;
+		goto finalize;
+	}
+
+	// Everything past the initial burst is paced at the rate: 3.75 seconds
+	if ((testClock.now < 3700) || (testClock.now > 3800))
+	{
+		result = 5;
+		goto finalize;
+	}
+
+	if ((testClock.progressCount < 5) ||
+		(testClock.lastProgress.received != TEST_FILE_SIZE) ||
+		(testClock.lastProgress.total != TEST_FILE_SIZE) ||
+		(testClock.lastProgress.bytesPerSecond < 230 * 1024) ||
+		(testClock.lastProgress.bytesPerSecond > 280 * 1024))
+	{
+		result = 6;
+		goto finalize;
+	}
+
+	if (check_file(test.path, test.body, TEST_FILE_SIZE) != 0)
+	{
+		result = 7;
+		goto finalize;
+	}
+
+finalize:
+	test_download_free(&test);
+
+	return result;
+}
+
+// Reads the summary written by the last download, empty if there is none
+static void read_summary(const char* path, char* summary, size_t size)
+{
+	size_t length = 0;
+	FILE* fp = fopen(path, "rb");
+
+	if (fp)
+	{
+		length = fread(summary, 1, size - 1, fp);
+		fclose(fp);
+	}
+
+	summary[length] = '\0';
+	DeleteFileA(path);
+}
+
+int download_summary()
+{
+	int result = 0;
+	TestDownload test;
+	TestHttpServer infoServer;
+	CseDownloadOptions options;
+	char hash[CSE_SHA256_HEX_SIZE];
+	char productInfo[512];
+	char infoUrl[128];
+	char cacheDirectory[MAX_PATH];
+	char summaryPath[MAX_PATH + 8];
+	char summary[2048];
+	char expected[64];
+	char* hashValue;
+
+	ZeroMemory(&infoServer, sizeof(infoServer));
+	ZeroMemory(&options, sizeof(options));
+	cacheDirectory[0] = '\0';
+	summaryPath[0] = '\0';
+
+	result = test_download_init(&test, "cse_download_summary.msi");
+	if (result != 0)
+		goto finalize;
+
+	if (!make_temp_path("cse_download_summary", cacheDirectory, sizeof(cacheDirectory)))
+	{
+		result = 2;
+		goto finalize;
+	}
+
+	sprintf_s(summaryPath, sizeof(summaryPath), "%s.json", test.path);
+	DeleteFileA(summaryPath);
+	remove_directory(cacheDirectory);
+
+	if (!test_download_start(&test, "/WaykAgent.msi"))
+	{
+		result = 3;
+		goto finalize;
+	}
+
+	CseSha256_ToHex(test.digest, hash);
+	sprintf_s(productInfo, sizeof(productInfo),
+		"WaykAgentmsi64.Version=1.0\r\nWaykAgentmsi64.Url=%s\r\nWaykAgentmsi64.Hash=%s\r\n",
+		test.url, hash);
+
+	infoServer.path = "/productinfo.htm";
+	if (!TestHttpServer_Start(&infoServer, (const uint8_t*) productInfo, strlen(productInfo)))
+	{
+		result = 3;
+		goto finalize;
+	}
+
+	options.cacheDirectory = cacheDirectory;
+	options.summaryPath = summaryPath;
+	options.productInfoUrl = infoUrl;
+
+	// productinfo.htm is not found, there is nothing to download
+	test_server_url(&infoServer, "/missing.htm", infoUrl, sizeof(infoUrl));
+
+	if (CseDownload_DownloadMsi(WAYK_BINARIES_BITNESS_X64, test.path, &options) == CSE_DOWNLOAD_OK)
+	{
+		result = 4;
+		goto finalize;
+	}
+
+	read_summary(summaryPath, summary, sizeof(summary));
+
+	if (!strstr(summary, "\"result\":\"failure\"") || !strstr(summary, "\"source\":null") ||
+		!strstr(summary, "missing.htm"))
+	{
+		result = 5;
+		goto finalize;
+	}
+
+	// Downloaded into the cache
+	test_server_url(&infoServer, "/productinfo.htm", infoUrl, sizeof(infoUrl));
+	sprintf_s(expected, sizeof(expected), "\"bytes\":%u,", (unsigned) TEST_FILE_SIZE);
+
+	if ((CseDownload_DownloadMsi(WAYK_BINARIES_BITNESS_X64, test.path, &options) != CSE_DOWNLOAD_OK) ||
+		(check_file(test.path, test.body, TEST_FILE_SIZE) != 0))
+	{
+		result = 6;
+		goto finalize;
+	}
+
+	read_summary(summaryPath, summary, sizeof(summary));
+
+	if (!strstr(summary, "\"result\":\"ok\"") ||
+		!strstr(summary, "WaykAgent.msi\",\"source\":\"http://") ||
+		!strstr(summary, expected) ||
+		!strstr(summary, "\"requests\":1,") ||
+		!strstr(summary, "\"samples\":[") ||
+		strstr(summary, "\"samples\":[]"))
+	{
+		result = 7;
+		goto finalize;
+	}
+
+	// Cache hit, nothing is received
+	if (CseDownload_DownloadMsi(WAYK_BINARIES_BITNESS_X64, test.path, &options) != CSE_DOWNLOAD_OK)
+	{
+		result = 8;
+		goto finalize;
+	}
+
+	read_summary(summaryPath, summary, sizeof(summary));
+
+	if (!strstr(summary, "\"result\":\"ok\"") || !strstr(summary, "\"source\":\"cache\"") ||
+		!strstr(summary, "\"bytes\":0,") || !strstr(summary, "\"requests\":0,"))
+	{
+		result = 9;
+		goto finalize;
+	}
+
+	// Published hash doesn't match the file, neither the cached one nor the
+	// one downloaded again
+	hashValue = strstr(productInfo, "Hash=") + 5;
+	hashValue[0] = (hashValue[0] == '0') ? '1' : '0';
+
+	if (CseDownload_DownloadMsi(WAYK_BINARIES_BITNESS_X64, test.path, &options) != CSE_DOWNLOAD_INTEGRITY)
+	{
+		result = 10;
+		goto finalize;
+	}
+
+	read_summary(summaryPath, summary, sizeof(summary));
+
+	if (!strstr(summary, "\"result\":\"integrity\"") || !strstr(summary, expected))
+	{
+		result = 11;
+		goto finalize;
+	}
+
+finalize:
+	if (infoServer.thread)
+		TestHttpServer_Stop(&infoServer);
+
+	test_download_free(&test);
+
+	if (summaryPath[0])
+		DeleteFileA(summaryPath);
+	if (cacheDirectory[0])
+		remove_directory(cacheDirectory);
+
+	return result;
+}
+
+int download_cancel()
+{
+	int result = 0;
+	TestDownload test;
+	TestHttpServer infoServer;
+	CseDownloadOptions options;
+	CseMsiDownload* download = NULL;
+	char productInfo[256];
+	char infoUrl[128];
+	ULONGLONG start;
+
+	ZeroMemory(&infoServer, sizeof(infoServer));
+	ZeroMemory(&options, sizeof(options));
+
+	result = test_download_init(&test, "cse_download_cancel.msi");
+	if (result != 0)
+		goto finalize;
+
+	if (!test_download_start(&test, "/WaykAgent.msi"))
+	{
+		result = 3;
+		goto finalize;
+	}
+
+	sprintf_s(productInfo, sizeof(productInfo), "WaykAgentmsi64.Url=%s\r\n", test.url);
+
+	infoServer.path = "/productinfo.htm";
+	if (!TestHttpServer_Start(&infoServer, (const uint8_t*) productInfo, strlen(productInfo)))
+	{
+		result = 3;
+		goto finalize;
+	}
+
+	test_server_url(&infoServer, "/productinfo.htm", infoUrl, sizeof(infoUrl));
+
+	// Whole file would take 16 seconds at this rate
+	options.productInfoUrl = infoUrl;
+	options.maxRate = 64 * 1024;
+
+	download = CseDownload_StartMsi(WAYK_BINARIES_BITNESS_X64, test.path, &options);
+	if (!download)
+	{
+		result = 4;
+		goto finalize;
+	}
+
+	Sleep(500);
+
+	start = GetTickCount64();
+	CseDownload_CancelMsi(download);
+
+	if (CseDownload_FinishMsi(download) != CSE_DOWNLOAD_CANCELLED)
+	{
+		result = 5;
+		goto finalize;
+	}
+
+	// Stopped at the next read, the received part is kept
+	if ((GetTickCount64() - start >= 2000) || file_exists(test.path) || !file_exists(test.partialPath))
+	{
+		result = 6;
+		goto finalize;
+	}
+
+finalize:
+	if (infoServer.thread)
+		TestHttpServer_Stop(&infoServer);
+
+	test_download_free(&test);
+
+	return result;
+}
+
+// Waits for the connect requests of a session to be answered
+static bool wait_session_requests(TestHttpServer* server, int count)
+{
+	for (int wait = 0; (wait < 100) && (server->requestCount < count); wait++)
+		Sleep(50);
+
+	// Requests are counted before the latency, the connection goes back to
+	// the session once the response is freed
+	Sleep(server->latency + 100);
+
+	return server->requestCount == count;
+}
+
+int download_session()
+{
+	int result = 0;
+	TestDownload test;
+	CseDownloadOptions options;
+	CseDownloadSession* session = NULL;
+	char infoUrl[128];
+	char mirrorUrl[128];
+	const char* urls[1];
+	const char* mirrors[1];
+	ULONGLONG start;
+
+	ZeroMemory(&options, sizeof(options));
+
+	result = test_download_init(&test, "cse_download_session.msi");
+	if (result != 0)
+		goto finalize;
+
+	test.server.keepAlive = true;
+	test.server.latency = 200;
+	if (!test_download_start(&test, "/mirror/WaykAgent.msi"))
+	{
+		result = 3;
+		goto finalize;
+	}
+
+	// Stands in for the productinfo.htm and CDN hosts
+	test_server_url(&test.server, "/productinfo.htm", infoUrl, sizeof(infoUrl));
+	urls[0] = infoUrl;
+
+	test_server_url(&test.server, "/mirror", mirrorUrl, sizeof(mirrorUrl));
+	mirrors[0] = mirrorUrl;
+
+	// Session is opened before the bundle is read and doesn't wait for the
+	// server to answer
+	start = GetTickCount64();
+	session = CseDownloadSession_New(urls, 1);
+	if (!session || (GetTickCount64() - start >= test.server.latency))
+	{
+		result = 4;
+		goto finalize;
+	}
+
+	if (!wait_session_requests(&test.server, 1) || (test.server.connectionCount != 1))
+	{
+		result = 5;
+		goto finalize;
+	}
+
+	// Mirrors come from the options, loaded while the session connects
+	start = GetTickCount64();
+	CseDownloadSession_Connect(session, mirrors, 1);
+	if (GetTickCount64() - start >= test.server.latency)
+	{
+		result = 6;
+		goto finalize;
+	}
+
+	// Connection setup is over before the download starts
+	if (!wait_session_requests(&test.server, 2) || (test.server.connectionCount != 1))
+	{
+		result = 7;
+		goto finalize;
+	}
+
+	options.session = session;
+
+	if ((CseDownload_File(test.url, test.path, test.digest, &options) != CSE_DOWNLOAD_OK) ||
+		(check_file(test.path, test.body, TEST_FILE_SIZE) != 0))
+	{
+		result = 8;
+		goto finalize;
+	}
+
+	// Download went over the connection opened ahead of it
+	if ((test.server.requestCount != 3) || (test.server.connectionCount != 1))
+	{
+		result = 9;
+		goto finalize;
+	}
+
+finalize:
+	// Idle connections of the session are closed with it
+	if (session)
+		CseDownloadSession_Free(session);
+
+	test_download_free(&test);
+
+	return result;
+}
+
 int main()
 {
 	assert_test_succeeded(download_msi());
+	assert_test_succeeded(download_resume());
+	assert_test_succeeded(download_segmented());
+	assert_test_succeeded(download_cache());
+	assert_test_succeeded(download_mirror());
+	assert_test_succeeded(download_failover());
+	assert_test_succeeded(download_compressed());
+	assert_test_succeeded(download_throttled());
+	assert_test_succeeded(download_summary());
+	assert_test_succeeded(download_cancel());
+	assert_test_succeeded(download_session());
 	return 0;
-}
\ No newline at end of file
+}
@@ -2,6 +2,7 @@
 
 #include "test_utils.h"
 
+#include <stdlib.h>
 #include <string.h>
 
 int all_available_options()
@@ -57,9 +58,57 @@ int quoted_argument_escape()
 	return 0;
 }
 
+int too_big_cli()
+{
+	int result = 0;
+	char* value = 0;
+	CseInstall* install = CseInstall_WithLocalMsi("C:\\installer.msi");
+	if (!install)
+		return 1;
+
+	// Escaped quotes take 4 characters each, too many for the CreateProcess limit
+	value = malloc(10000);
+	if (!value)
+	{
+		result = 2;
+		goto finalize;
+	}
+
+	memset(value, '"', 9999);
+	value[9999] = '\0';
+
+	if (CseInstall_SetConfigOption(install, "personalPassword", "secret") != CSE_INSTALL_OK)
+	{
+		result = 3;
+		goto finalize;
+	}
+
+	if (CseInstall_SetConfigOption(install, "personalPassword", value) != CSE_INSTALL_TOO_BIG_CLI)
+	{
+		result = 4;
+		goto finalize;
+	}
+
+	// Rejected option is left out of the command line
+	const char* expected =
+		"msiexec /i \"C:\\installer.msi\" "
+		"CONFIG_PERSONAL_PASSWORD=\"secret\"";
+
+	const char* actual = CseInstall_GetCli(install);
+
+	if (!actual || (strcmp(actual, expected) != 0))
+		result = 5;
+
+finalize:
+	free(value);
+	CseInstall_Free(install);
+	return result;
+}
+
 int main()
 {
 	assert_test_succeeded(all_available_options());
 	assert_test_succeeded(quoted_argument_escape());
+	assert_test_succeeded(too_big_cli());
 	return 0;
 }
\ No newline at end of file
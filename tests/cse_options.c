@@ -7,6 +7,8 @@
 int connect_json()
 {
 	int result = 0;
+	const char* const* mirrors;
+	int mirrorCount;
 	CseOptions* options = CseOptions_New();
 	if (!options)
 	{
@@ -126,6 +128,51 @@ int connect_json()
 		goto finalize;
 	}
 
+	if (CseOptions_GetExtractionMemoryLimit(options) != 32 * 1024 * 1024)
+	{
+		result = 20;
+		goto finalize;
+	}
+
+	if ((CseOptions_GetDownloadConnections(options) != 4) ||
+		(CseOptions_GetDownloadSegmentSize(options) != 16 * 1024 * 1024))
+	{
+		result = 21;
+		goto finalize;
+	}
+
+	if (!CseOptions_GetDownloadCacheDirectory(options) ||
+		(strcmp(CseOptions_GetDownloadCacheDirectory(options), "C:\\ProgramData\\WaykCse\\Cache") != 0))
+	{
+		result = 22;
+		goto finalize;
+	}
+
+	if ((CseOptions_GetDownloadMaxRate(options) != 512 * 1024) ||
+		(CseOptions_GetDownloadBurstSize(options) != 64 * 1024) ||
+		!CseOptions_DownloadLowPriority(options))
+	{
+		result = 23;
+		goto finalize;
+	}
+
+	mirrors = CseOptions_GetDownloadMirrors(options, &mirrorCount);
+	if ((mirrorCount != 2) ||
+		(strcmp(mirrors[0], "http://mirror1.example.com/wayk") != 0) ||
+		(strcmp(mirrors[1], "http://mirror2.example.com/wayk/") != 0))
+	{
+		result = 24;
+		goto finalize;
+	}
+
+	if ((CseOptions_GetDownloadStallThreshold(options) != 5 * 1000) ||
+		!CseOptions_GetDownloadSummaryFile(options) ||
+		(strcmp(CseOptions_GetDownloadSummaryFile(options), "C:\\ProgramData\\WaykCse\\download.json") != 0))
+	{
+		result = 25;
+		goto finalize;
+	}
+
 	return loadResult;
 
 finalize:
@@ -0,0 +1,335 @@
+#ifndef WAYKCSE_TEST_HTTP_SERVER_H
+#define WAYKCSE_TEST_HTTP_SERVER_H
+
+#include <winsock2.h>
+#include <windows.h>
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Local stand-in for the download servers. Serves one in-memory file on
+// every path, or only on path when it is set. Each connection runs on its own
+// thread and handles a single request, or all the requests sent on it with
+// keepAlive
+
+typedef struct
+{
+	const uint8_t* body;
+	size_t bodySize;
+	const char* etag;  // also answers If-None-Match with 304 when it matches
+	const char* path;  // other paths get 404 and are not counted, NULL to serve every path
+	size_t dropAfter;  // first response is cut after this many body bytes, 0 to send it whole
+	LONG dropRequest;  // number of the request cut by dropAfter instead of the first
+	uint32_t dropStatus;  // status sent to that request instead of the file, 0 for none
+	bool stall;        // cut response is left open instead of closed, until the client gives up
+	DWORD latency;     // milliseconds before every response is sent
+	bool keepAlive;    // connections stay open after the response, except those cut short
+	volatile LONG requestCount;
+	volatile LONG connectionCount;
+	volatile LONG activeCount;
+	volatile LONG maxActiveCount;
+	uint64_t lastRangeStart;
+	char lastPath[256];
+	SOCKET listener;
+	HANDLE thread;
+	uint16_t port;
+} TestHttpServer;
+
+static bool TestHttpServer_Send(SOCKET client, const char* data, size_t size)
+{
+	while (size > 0)
+	{
+		int sent = send(client, data, (size > 0x10000) ? 0x10000 : (int) size, 0);
+		if (sent <= 0)
+			return false;
+
+		data += sent;
+		size -= sent;
+	}
+
+	return true;
+}
+
+// Returns true if the connection can take another request
+static bool TestHttpServer_Respond(TestHttpServer* server, SOCKET client)
+{
+	const char* connection = server->keepAlive ? "keep-alive" : "close";
+	char request[4096];
+	char header[512];
+	char condition[256];
+	char path[256];
+	int size = 0;
+	int received;
+	uint64_t rangeStart = 0;
+	uint64_t rangeEnd;
+	char* rangeLast;
+	size_t length;
+	const char* range;
+	LONG requestIndex;
+	bool head;
+
+	while (size < (int) sizeof(request) - 1)
+	{
+		received = recv(client, request + size, (int) sizeof(request) - 1 - size, 0);
+		if (received <= 0)
+			return false;
+
+		size += received;
+		request[size] = '\0';
+
+		if (strstr(request, "\r\n\r\n"))
+			break;
+	}
+
+	rangeEnd = server->bodySize;
+
+	range = strstr(request, "Range: bytes=");
+	if (range)
+	{
+		rangeStart = strtoull(range + 13, &rangeLast, 10);
+		if ((rangeLast[0] == '-') && isdigit((unsigned char) rangeLast[1]))
+			rangeEnd = strtoull(rangeLast + 1, NULL, 10) + 1;
+		if (rangeEnd > server->bodySize)
+			rangeEnd = server->bodySize;
+	}
+
+	path[0] = '\0';
+	sscanf(request, "%*s %255s", path);
+	head = strncmp(request, "HEAD ", 5) == 0;
+
+	if (server->path && (strcmp(path, server->path) != 0))
+	{
+		snprintf(header, sizeof(header),
+			"HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n", connection);
+		return TestHttpServer_Send(client, header, strlen(header)) && server->keepAlive;
+	}
+
+	requestIndex = InterlockedIncrement(&server->requestCount);
+	server->lastRangeStart = rangeStart;
+	strcpy_s(server->lastPath, sizeof(server->lastPath), path);
+
+	if (server->latency)
+		Sleep(server->latency);
+
+	snprintf(condition, sizeof(condition), "If-None-Match: %s\r\n", server->etag);
+
+	if (strstr(request, condition))
+	{
+		snprintf(header, sizeof(header),
+			"HTTP/1.1 304 Not Modified\r\nETag: %s\r\nConnection: %s\r\n\r\n", server->etag, connection);
+		return TestHttpServer_Send(client, header, strlen(header)) && server->keepAlive;
+	}
+
+	if (server->dropStatus && (requestIndex == (server->dropRequest ? server->dropRequest : 1)))
+	{
+		snprintf(header, sizeof(header),
+			"HTTP/1.1 %u Error\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n", (unsigned) server->dropStatus, connection);
+		return TestHttpServer_Send(client, header, strlen(header)) && server->keepAlive;
+	}
+
+	if (range && (rangeStart >= server->bodySize))
+	{
+		snprintf(header, sizeof(header),
+			"HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n", connection);
+		return TestHttpServer_Send(client, header, strlen(header)) && server->keepAlive;
+	}
+
+	length = (size_t) (rangeEnd - rangeStart);
+
+	if (range)
+	{
+		snprintf(header, sizeof(header),
+			"HTTP/1.1 206 Partial Content\r\n"
+			"Content-Range: bytes %llu-%llu/%llu\r\n"
+			"Content-Length: %llu\r\nETag: %s\r\nConnection: %s\r\n\r\n",
+			(unsigned long long) rangeStart,
+			(unsigned long long) rangeEnd - 1,
+			(unsigned long long) server->bodySize,
+			(unsigned long long) length,
+			server->etag,
+			connection);
+	}
+	else
+	{
+		snprintf(header, sizeof(header),
+			"HTTP/1.1 200 OK\r\nContent-Length: %llu\r\nETag: %s\r\nConnection: %s\r\n\r\n",
+			(unsigned long long) length,
+			server->etag,
+			connection);
+	}
+
+	if (!TestHttpServer_Send(client, header, strlen(header)))
+		return false;
+
+	if (head)
+		return server->keepAlive;
+
+	// Simulates a connection dropped in the middle of the transfer
+	if ((requestIndex == (server->dropRequest ? server->dropRequest : 1)) && server->dropAfter && (server->dropAfter < length))
+	{
+		TestHttpServer_Send(client, (const char*) server->body + rangeStart, server->dropAfter);
+
+		// Nothing more is sent, recv returns once the client closes the connection
+		if (server->stall)
+		{
+			while (recv(client, request, (int) sizeof(request), 0) > 0)
+				;
+		}
+		else
+		{
+			shutdown(client, SD_SEND);
+		}
+
+		return false;
+	}
+
+	if (!TestHttpServer_Send(client, (const char*) server->body + rangeStart, length))
+		return false;
+
+	if (server->keepAlive)
+		return true;
+
+	shutdown(client, SD_SEND);
+	return false;
+}
+
+typedef struct
+{
+	TestHttpServer* server;
+	SOCKET client;
+} TestHttpConnection;
+
+static DWORD WINAPI TestHttpServer_ConnectionThread(LPVOID param)
+{
+	TestHttpConnection* connection = (TestHttpConnection*) param;
+	TestHttpServer* server = connection->server;
+
+	while (TestHttpServer_Respond(server, connection->client))
+		;
+
+	closesocket(connection->client);
+	free(connection);
+
+	InterlockedDecrement(&server->activeCount);
+	return 0;
+}
+
+static DWORD WINAPI TestHttpServer_Thread(LPVOID param)
+{
+	TestHttpServer* server = (TestHttpServer*) param;
+
+	while (true)
+	{
+		HANDLE thread;
+		TestHttpConnection* connection;
+		LONG active;
+		LONG maxActive;
+
+		// Fails once the listener is closed by TestHttpServer_Stop
+		SOCKET client = accept(server->listener, NULL, NULL);
+		if (client == INVALID_SOCKET)
+			break;
+
+		connection = malloc(sizeof(TestHttpConnection));
+		if (!connection)
+		{
+			closesocket(client);
+			continue;
+		}
+
+		connection->server = server;
+		connection->client = client;
+		InterlockedIncrement(&server->connectionCount);
+
+		// Counted here, so TestHttpServer_Stop can't miss a starting thread
+		active = InterlockedIncrement(&server->activeCount);
+		maxActive = server->maxActiveCount;
+
+		while ((active > maxActive) &&
+			(InterlockedCompareExchange(&server->maxActiveCount, active, maxActive) != maxActive))
+		{
+			maxActive = server->maxActiveCount;
+		}
+
+		thread = CreateThread(NULL, 0, TestHttpServer_ConnectionThread, connection, 0, NULL);
+		if (!thread)
+		{
+			InterlockedDecrement(&server->activeCount);
+			closesocket(client);
+			free(connection);
+			continue;
+		}
+
+		CloseHandle(thread);
+	}
+
+	return 0;
+}
+
+static bool TestHttpServer_Start(TestHttpServer* server, const uint8_t* body, size_t bodySize)
+{
+	WSADATA wsaData;
+	struct sockaddr_in address;
+	int addressSize = sizeof(address);
+
+	server->body = body;
+	server->bodySize = bodySize;
+	server->requestCount = 0;
+	server->connectionCount = 0;
+	server->activeCount = 0;
+	server->maxActiveCount = 0;
+	server->lastRangeStart = 0;
+	server->lastPath[0] = '\0';
+	server->thread = NULL;
+
+	if (!server->etag)
+		server->etag = "\"test\"";
+
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+		return false;
+
+	server->listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (server->listener == INVALID_SOCKET)
+		return false;
+
+	ZeroMemory(&address, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0;
+
+	if ((bind(server->listener, (struct sockaddr*) &address, sizeof(address)) != 0) ||
+		(listen(server->listener, SOMAXCONN) != 0) ||
+		(getsockname(server->listener, (struct sockaddr*) &address, &addressSize) != 0))
+	{
+		closesocket(server->listener);
+		return false;
+	}
+
+	server->port = ntohs(address.sin_port);
+	server->thread = CreateThread(NULL, 0, TestHttpServer_Thread, server, 0, NULL);
+
+	return server->thread != NULL;
+}
+
+static void TestHttpServer_Stop(TestHttpServer* server)
+{
+	closesocket(server->listener);
+
+	if (server->thread)
+	{
+		WaitForSingleObject(server->thread, INFINITE);
+		CloseHandle(server->thread);
+	}
+
+	// Connection threads finish on their own once the client is done
+	while (server->activeCount > 0)
+		Sleep(10);
+
+	WSACleanup();
+}
+
+#endif //WAYKCSE_TEST_HTTP_SERVER_H
@@ -0,0 +1,72 @@
+#include <cse/sha256.h>
+
+#include "test_utils.h"
+
+#include <string.h>
+
+static int check_digest(const uint8_t* digest, const char* expectedHex)
+{
+	char hex[CSE_SHA256_HEX_SIZE];
+	CseSha256_ToHex(digest, hex);
+	return (strcmp(hex, expectedHex) == 0) ? 0 : 1;
+}
+
+int test_empty()
+{
+	uint8_t digest[CSE_SHA256_DIGEST_SIZE];
+
+	if (!CseSha256_Compute((const uint8_t*) "", 0, digest))
+		return 1;
+
+	return check_digest(digest, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+}
+
+int test_incremental()
+{
+	uint8_t digest[CSE_SHA256_DIGEST_SIZE];
+	const char* message = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+
+	CseSha256* ctx = CseSha256_New();
+	if (!ctx)
+		return 1;
+
+	// Split at an odd offset so the data doesn't come in whole blocks
+	bool ok = CseSha256_Update(ctx, (const uint8_t*) message, 13)
+		&& CseSha256_Update(ctx, (const uint8_t*) message + 13, strlen(message) - 13)
+		&& CseSha256_Finish(ctx, digest);
+	CseSha256_Free(ctx);
+
+	if (!ok)
+		return 1;
+
+	return check_digest(digest, "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+}
+
+int test_from_hex()
+{
+	uint8_t digest[CSE_SHA256_DIGEST_SIZE];
+
+	if (!CseSha256_FromHex("BA7816BF8F01CFEA414140DE5DAE2223B00361A396177A9CB410FF61F20015AD", digest))
+		return 1;
+
+	if (check_digest(digest, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad") != 0)
+		return 1;
+
+	// Too short, too long and non-hex values are rejected
+	if (CseSha256_FromHex("ba7816bf", digest))
+		return 1;
+	if (CseSha256_FromHex("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad00", digest))
+		return 1;
+	if (CseSha256_FromHex("zz7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", digest))
+		return 1;
+
+	return 0;
+}
+
+int main()
+{
+	assert_test_succeeded(test_empty());
+	assert_test_succeeded(test_incremental());
+	assert_test_succeeded(test_from_hex());
+	return 0;
+}
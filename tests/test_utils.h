@@ -1,7 +1,13 @@
 #ifndef WAYKCSE_TEST_UTILS_H
 #define WAYKCSE_TEST_UTILS_H
 
+#include <windows.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 inline void assert_test_succeeded(int returnCode)
 {
@@ -11,5 +17,92 @@ inline void assert_test_succeeded(int returnCode)
 	}
 }
 
+// Same pseudo-random contents on every call, NULL if out of memory
+static inline uint8_t* make_test_file(size_t size)
+{
+	uint8_t* data = malloc(size);
+	uint32_t state = 0x12345678;
+
+	if (!data)
+		return NULL;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		state = state * 1103515245 + 12345;
+		data[i] = (uint8_t) (state >> 16);
+	}
+
+	return data;
+}
+
+// Builds the path of name in the temporary directory, removing any file
+// left there by a previous run
+static inline bool make_temp_path(const char* name, char* path, size_t size)
+{
+	DWORD length = GetTempPathA((DWORD) size, path);
+
+	if (!length || (length + strlen(name) >= size))
+		return false;
+
+	strcat_s(path, size, name);
+	DeleteFileA(path);
+
+	return true;
+}
+
+// Returns 0 if the file at path has exactly the expected contents
+static inline int check_file(const char* path, const uint8_t* expected, size_t size)
+{
+	int result = 0;
+	uint8_t* data = malloc(size + 1);
+	FILE* fp = fopen(path, "rb");
+
+	if (!data || !fp)
+	{
+		result = 1;
+		goto finalize;
+	}
+
+	if ((fread(data, 1, size + 1, fp) != size) || (memcmp(data, expected, size) != 0))
+		result = 1;
+
+finalize:
+	if (fp)
+		fclose(fp);
+	free(data);
+
+	return result;
+}
+
+static inline bool file_exists(const char* path)
+{
+	return GetFileAttributesA(path) != INVALID_FILE_ATTRIBUTES;
+}
+
+// Removes a directory and the files in it
+static inline void remove_directory(const char* path)
+{
+	WIN32_FIND_DATAA findData;
+	char pattern[MAX_PATH + 8];
+	char filePath[MAX_PATH * 2];
+	HANDLE find;
+
+	sprintf_s(pattern, sizeof(pattern), "%s\\*", path);
+
+	find = FindFirstFileA(pattern, &findData);
+	if (find != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			sprintf_s(filePath, sizeof(filePath), "%s\\%s", path, findData.cFileName);
+			DeleteFileA(filePath);
+		} while (FindNextFileA(find, &findData));
+
+		FindClose(find);
+	}
+
+	RemoveDirectoryA(path);
+}
+
 
 #endif //WAYKCSE_TEST_UTILS_H
@@ -1,11 +1,14 @@
 use std::{
+    collections::HashMap,
     fmt::{Display, Formatter, Result as FmtResult},
     fs::{self, File},
-    io,
+    io::{self, Write},
     path::{Path, PathBuf},
     process::Command,
 };
 
+use log::info;
+use sha2::{Digest, Sha256};
 use tempfile::Builder as TempFileBuilder;
 use thiserror::Error;
 
@@ -28,6 +31,67 @@ impl Display for Bitness {
     }
 }
 
+/// Compression format of the bundle payload; CSE picks the matching decoder by
+/// the codec id stored in the bundle header
+#[derive(Clone, Copy, Eq, PartialEq, Debug)]
+pub enum BundleCodec {
+    SevenZip,
+    Zstd,
+}
+
+impl BundleCodec {
+    fn id(&self) -> u16 {
+        match self {
+            BundleCodec::SevenZip => 0,
+            BundleCodec::Zstd => 1,
+        }
+    }
+}
+
+// CSE hashes zstd entries while they are decoded; 7z entries are read back
+// from disk for their digest, so 7z is only used when asked for
+impl Default for BundleCodec {
+    fn default() -> Self {
+        BundleCodec::Zstd
+    }
+}
+
+const BUNDLE_HEADER_MAGIC: &[u8; 8] = b"WCSEBNDL";
+const BUNDLE_FORMAT_VERSION: u16 = 3;
+const BUNDLE_HEADER_SIZE: usize = 16;
+
+const TOC_MAGIC: &[u8; 8] = b"WCSE_TOC";
+const TOC_VERSION: u16 = 1;
+const TOC_HEADER_SIZE: usize = 16;
+const TOC_RECORD_SIZE: usize = 128;
+const TOC_NAME_SIZE: usize = 64;
+const TOC_FLAG_STORED: u16 = 0x0001;
+
+const DEFAULT_ZSTD_LEVEL: i32 = 19;
+
+// zstd packages larger than a block are split into independent frames which CSE
+// decodes in parallel; the stream starts with a table of frame sizes
+const ZSTD_BLOCKS_CODEC_ID: u16 = 2;
+const ZSTD_BLOCK_SIZE: usize = 4 * 1024 * 1024;
+
+// Installers for both architectures share most of their data; they are split
+// into content-defined chunks and every unique chunk is stored once in the pool
+// entry. Installer streams are recipes listing the pool chunks to concatenate
+const CHUNKED_CODEC_ID: u16 = 3;
+const CHUNK_POOL_NAME: &str = "chunks.bin";
+const CDC_MIN_CHUNK_SIZE: usize = 16 * 1024;
+const CDC_MAX_CHUNK_SIZE: usize = 256 * 1024;
+// 16 bits set gives 64 KB chunks on average
+const CDC_BOUNDARY_MASK: u64 = 0xFFFF_0000_0000_0000;
+// Deduplication is skipped unless it saves at least 1/8 of installers size
+const DEDUP_MIN_SAVING_RATIO: usize = 8;
+
+// Packages with higher sampled entropy (bits per byte) are already compressed,
+// e.g. MSI cabinets or zip, and are stored as-is
+const STORED_ENTROPY_THRESHOLD: f64 = 7.5;
+const ENTROPY_SAMPLE_SIZE: usize = 64 * 1024;
+const ENTROPY_SAMPLE_COUNT: usize = 16;
+
 #[derive(Error, Debug)]
 pub enum Error {
     #[error("Bundle packing failed during io operation ({0})")]
@@ -36,6 +100,8 @@ pub enum Error {
     ArtifactsBundleFailed(#[from] artifacts_bundle::Error),
     #[error("Failed to compress bunlde via 7z ({0})")]
     ArchiverFailure(String),
+    #[error("Bundle entry name '{0}' is too long")]
+    EntryNameTooLong(String),
 }
 
 type BundlePackerResult<T> = Result<T, Error>;
@@ -47,50 +113,161 @@ pub enum BundlePackageType {
     CseOptions,
 }
 
+impl BundlePackageType {
+    fn file_name(&self) -> String {
+        match self {
+            BundlePackageType::InstallationMsi { bitness } => format!("Installer_{}.msi", bitness),
+            BundlePackageType::BrandingZip => "branding.zip".to_string(),
+            BundlePackageType::CustomInitializationScript => "init.ps1".to_string(),
+            BundlePackageType::CseOptions => "options.json".to_string(),
+        }
+    }
+
+    /// CSE reads stored packages straight from the bundle resource, without
+    /// decoding them to a temporary file first
+    fn is_always_stored(&self) -> bool {
+        matches!(self, BundlePackageType::CseOptions)
+    }
+
+    fn is_deduplicated(&self) -> bool {
+        matches!(self, BundlePackageType::InstallationMsi { .. })
+    }
+}
+
+struct BundleEntry {
+    file_name: String,
+    data: Vec<u8>,
+    always_stored: bool,
+    deduplicated: bool,
+    // Set when the entry is rebuilt from the chunk pool
+    recipe: Option<Vec<u8>>,
+}
+
 pub struct BundlePacker {
     packages: Vec<(BundlePackageType, PathBuf)>,
+    codec: BundleCodec,
+    compression_level: Option<i32>,
 }
 
 impl BundlePacker {
     pub fn new() -> Self {
         Self {
             packages: Vec::new(),
+            codec: BundleCodec::default(),
+            compression_level: None,
         }
     }
 
+    pub fn set_codec(&mut self, codec: BundleCodec, compression_level: Option<i32>) {
+        self.codec = codec;
+        self.compression_level = compression_level;
+    }
+
     pub fn add_bundle_package(&mut self, package_type: BundlePackageType, path: &Path) {
         self.packages.push((package_type, path.into()));
     }
 
-    pub fn pack(&self, output_path: &Path) -> BundlePackerResult<()> {
+    /// Writes bundle payload to `output_path` and its table of contents to
+    /// `toc_path`; every package is a separate stream of the payload which CSE
+    /// locates and decodes on its own
+    pub fn pack(&self, output_path: &Path, toc_path: &Path) -> BundlePackerResult<()> {
         let bundle_directory = TempFileBuilder::new().prefix("bundle_").tempdir()?;
 
-        for (package_type, package_path) in &self.packages {
-            match package_type {
-                BundlePackageType::InstallationMsi { bitness } => {
-                    fs::copy(
-                        package_path,
-                        bundle_directory
-                            .path()
-                            .join(format!("Installer_{}.msi", bitness)),
-                    )?;
-                }
-                BundlePackageType::BrandingZip => {
-                    fs::copy(package_path, bundle_directory.path().join("branding.zip"))?;
-                }
-                BundlePackageType::CustomInitializationScript => {
-                    fs::copy(package_path, bundle_directory.path().join("init.ps1"))?;
-                }
-                BundlePackageType::CseOptions => {
-                    fs::copy(package_path, bundle_directory.path().join("options.json"))?;
-                }
-            }
+        let mut bundle = File::create(output_path)?;
+        bundle.write_all(BUNDLE_HEADER_MAGIC)?;
+        bundle.write_all(&BUNDLE_FORMAT_VERSION.to_le_bytes())?;
+        bundle.write_all(&0u16.to_le_bytes())?;
+        bundle.write_all(&(BUNDLE_HEADER_SIZE as u32).to_le_bytes())?;
+
+        let mut entries = self
+            .packages
+            .iter()
+            .map(|(package_type, package_path)| {
+                Ok(BundleEntry {
+                    file_name: package_type.file_name(),
+                    data: fs::read(package_path)?,
+                    always_stored: package_type.is_always_stored(),
+                    deduplicated: package_type.is_deduplicated(),
+                    recipe: None,
+                })
+            })
+            .collect::<BundlePackerResult<Vec<_>>>()?;
+
+        deduplicate_entries(&mut entries);
+
+        let mut toc = Vec::with_capacity(TOC_HEADER_SIZE + TOC_RECORD_SIZE * entries.len());
+        toc.extend_from_slice(TOC_MAGIC);
+        toc.extend_from_slice(&TOC_VERSION.to_le_bytes());
+        toc.extend_from_slice(&(TOC_RECORD_SIZE as u16).to_le_bytes());
+        toc.extend_from_slice(&(entries.len() as u32).to_le_bytes());
+
+        let mut offset = 0u64;
+        for entry in &entries {
+            let file_name = &entry.file_name;
+            let data = &entry.data;
+
+            let encoded;
+            let stored = entry.recipe.is_none()
+                && (entry.always_stored || estimate_entropy(data) > STORED_ENTROPY_THRESHOLD);
+
+            let (stream, codec_id, flags): (&[u8], u16, u16) = if let Some(recipe) = &entry.recipe {
+                (recipe, CHUNKED_CODEC_ID, 0)
+            } else if stored {
+                (data, self.codec.id(), TOC_FLAG_STORED)
+            } else {
+                let (stream, codec_id) =
+                    self.encode_package(bundle_directory.path(), file_name, data)?;
+                encoded = stream;
+                (&encoded, codec_id, 0)
+            };
+
+            append_toc_record(&mut toc, file_name, offset, stream, codec_id, flags, data)?;
+
+            bundle.write_all(stream)?;
+            offset += stream.len() as u64;
         }
 
-        compress_bundle(bundle_directory.path(), output_path)?;
+        fs::write(toc_path, &toc)?;
 
         Ok(())
     }
+
+    fn encode_package(
+        &self,
+        work_directory: &Path,
+        file_name: &str,
+        data: &[u8],
+    ) -> BundlePackerResult<(Vec<u8>, u16)> {
+        match self.codec {
+            BundleCodec::SevenZip => {
+                // Single-file archive, CSE opens it as a separate archive
+                let archive_path = work_directory.join(format!("{}.7z", file_name));
+                let level_arg = self.compression_level.map(|level| format!("-mx={}", level));
+                let level_args: Vec<&str> = level_arg.iter().map(String::as_str).collect();
+
+                fs::write(work_directory.join(file_name), data)?;
+                compress_bundle(
+                    work_directory,
+                    &[file_name.to_string()],
+                    &archive_path,
+                    &level_args,
+                )?;
+
+                Ok((fs::read(&archive_path)?, self.codec.id()))
+            }
+            BundleCodec::Zstd => {
+                let level = self.compression_level.unwrap_or(DEFAULT_ZSTD_LEVEL);
+
+                // Frames record their size, so the decoding window never
+                // exceeds the data size
+                if data.len() <= ZSTD_BLOCK_SIZE {
+                    Ok((zstd::block::compress(data, level)?, self.codec.id()))
+                } else {
+                    Ok((encode_zstd_blocks(data, level)?, ZSTD_BLOCKS_CODEC_ID))
+                }
+            }
+        }
+    }
 }
 
 impl Default for BundlePacker {
@@ -99,16 +276,214 @@ impl Default for BundlePacker {
     }
 }
 
+/// Replaces deduplicated entries (installers) with recipes over a shared
+/// pool of unique chunks, which is added as a separate entry
+fn deduplicate_entries(entries: &mut Vec<BundleEntry>) {
+    let indices: Vec<usize> = (0..entries.len())
+        .filter(|&i| entries[i].deduplicated)
+        .collect();
+
+    if indices.len() < 2 {
+        return;
+    }
+
+    let mut pool = Vec::new();
+    let mut known_chunks: HashMap<Vec<u8>, (u64, u32)> = HashMap::new();
+    let mut recipes = Vec::new();
+    let mut total_size = 0;
+
+    for &i in &indices {
+        let chunks = split_chunks(&entries[i].data);
+        let mut recipe = Vec::with_capacity(4 + chunks.len() * 12);
+        recipe.extend_from_slice(&(chunks.len() as u32).to_le_bytes());
+
+        for chunk in chunks {
+            let digest = Sha256::digest(chunk).to_vec();
+            let (chunk_offset, chunk_size) = *known_chunks.entry(digest).or_insert_with(|| {
+                let chunk_offset = pool.len() as u64;
+                pool.extend_from_slice(chunk);
+                (chunk_offset, chunk.len() as u32)
+            });
+
+            recipe.extend_from_slice(&chunk_offset.to_le_bytes());
+            recipe.extend_from_slice(&chunk_size.to_le_bytes());
+        }
+
+        total_size += entries[i].data.len();
+        recipes.push(recipe);
+    }
+
+    let saved_size = total_size - pool.len();
+    if saved_size * DEDUP_MIN_SAVING_RATIO < total_size {
+        info!("Installers have little data in common, skipping deduplication");
+        return;
+    }
+
+    info!(
+        "Deduplicated installers: {} bytes are shared, {} bytes in chunk pool",
+        saved_size,
+        pool.len()
+    );
+
+    for (&i, recipe) in indices.iter().zip(recipes) {
+        entries[i].recipe = Some(recipe);
+    }
+
+    entries.insert(
+        indices[0],
+        BundleEntry {
+            file_name: CHUNK_POOL_NAME.to_string(),
+            data: pool,
+            always_stored: false,
+            deduplicated: false,
+            recipe: None,
+        },
+    );
+}
+
+/// Gear hash for content-defined chunking
+fn cdc_gear_table() -> [u64; 256] {
+    // splitmix64, the table only has to be fixed and well distributed
+    let mut table = [0u64; 256];
+    let mut state = 0x9E37_79B9_7F4A_7C15u64;
+    for value in table.iter_mut() {
+        state = state.wrapping_add(0x9E37_79B9_7F4A_7C15);
+        let mut z = state;
+        z = (z ^ (z >> 30)).wrapping_mul(0xBF58_476D_1CE4_E5B9);
+        z = (z ^ (z >> 27)).wrapping_mul(0x94D0_49BB_1331_11EB);
+        *value = z ^ (z >> 31);
+    }
+    table
+}
+
+/// Splits data at positions defined by its content, so identical regions of
+/// two files produce identical chunks regardless of their offsets
+fn split_chunks(data: &[u8]) -> Vec<&[u8]> {
+    let gear = cdc_gear_table();
+    let mut chunks = Vec::new();
+    let mut start = 0;
+
+    while start < data.len() {
+        let end = (start + CDC_MAX_CHUNK_SIZE).min(data.len());
+        let mut boundary = end;
+        let mut hash = 0u64;
+
+        let mut pos = start + CDC_MIN_CHUNK_SIZE;
+        while pos < end {
+            hash = (hash << 1).wrapping_add(gear[data[pos] as usize]);
+            if hash & CDC_BOUNDARY_MASK == 0 {
+                boundary = pos + 1;
+                break;
+            }
+            pos += 1;
+        }
+
+        chunks.push(&data[start..boundary]);
+        start = boundary;
+    }
+
+    chunks
+}
+
+/// Block size, block count and compressed size of every block, followed by
+/// the blocks compressed as separate frames
+fn encode_zstd_blocks(data: &[u8], level: i32) -> BundlePackerResult<Vec<u8>> {
+    let frames = data
+        .chunks(ZSTD_BLOCK_SIZE)
+        .map(|block| zstd::block::compress(block, level))
+        .collect::<io::Result<Vec<_>>>()?;
+
+    let mut stream = Vec::new();
+    stream.extend_from_slice(&(ZSTD_BLOCK_SIZE as u32).to_le_bytes());
+    stream.extend_from_slice(&(frames.len() as u32).to_le_bytes());
+    for frame in &frames {
+        stream.extend_from_slice(&(frame.len() as u32).to_le_bytes());
+    }
+    for frame in &frames {
+        stream.extend_from_slice(frame);
+    }
+
+    Ok(stream)
+}
+
+/// Shannon entropy of the byte distribution over evenly spaced samples of data
+fn estimate_entropy(data: &[u8]) -> f64 {
+    if data.is_empty() {
+        return 0.0;
+    }
+
+    let mut histogram = [0u64; 256];
+    let sample_count = ENTROPY_SAMPLE_COUNT
+        .min(data.len() / ENTROPY_SAMPLE_SIZE)
+        .max(1);
+    let sample_size = ENTROPY_SAMPLE_SIZE.min(data.len());
+    let step = (data.len() - sample_size) / sample_count.max(2).saturating_sub(1);
+
+    for i in 0..sample_count {
+        let start = i * step;
+        for &byte in &data[start..start + sample_size] {
+            histogram[byte as usize] += 1;
+        }
+    }
+
+    let total = (sample_count * sample_size) as f64;
+    histogram
+        .iter()
+        .filter(|&&count| count > 0)
+        .map(|&count| {
+            let p = count as f64 / total;
+            -p * p.log2()
+        })
+        .sum()
+}
+
+/// TOC record: null-padded name, stream offset in the payload, stream size,
+/// raw size, CRC32, codec id, flags and SHA-256 of the raw data
+fn append_toc_record(
+    toc: &mut Vec<u8>,
+    file_name: &str,
+    offset: u64,
+    stream: &[u8],
+    codec_id: u16,
+    flags: u16,
+    data: &[u8],
+) -> BundlePackerResult<()> {
+    if file_name.len() >= TOC_NAME_SIZE {
+        return Err(Error::EntryNameTooLong(file_name.to_string()));
+    }
+
+    let mut name = [0u8; TOC_NAME_SIZE];
+    name[..file_name.len()].copy_from_slice(file_name.as_bytes());
+
+    toc.extend_from_slice(&name);
+    toc.extend_from_slice(&offset.to_le_bytes());
+    toc.extend_from_slice(&(stream.len() as u64).to_le_bytes());
+    toc.extend_from_slice(&(data.len() as u64).to_le_bytes());
+    toc.extend_from_slice(&crc32fast::hash(data).to_le_bytes());
+    toc.extend_from_slice(&codec_id.to_le_bytes());
+    toc.extend_from_slice(&flags.to_le_bytes());
+    toc.extend_from_slice(Sha256::digest(data).as_slice());
+
+    Ok(())
+}
+
 fn get_archiver_path() -> BundlePackerResult<PathBuf> {
     which::which("7z")
         .map_err(|e| Error::ArchiverFailure(format!("Failed to find 7z path -> {}", e)))
 }
 
-fn compress_bundle(unpacked_bundle_path: &Path, output_path: &Path) -> BundlePackerResult<()> {
+fn compress_bundle(
+    unpacked_bundle_path: &Path,
+    files: &[String],
+    output_path: &Path,
+    extra_args: &[&str],
+) -> BundlePackerResult<()> {
     let archiver_output = Command::new(get_archiver_path()?)
+        .current_dir(unpacked_bundle_path)
         .arg("a")
+        .args(extra_args)
         .arg(format!("{}", output_path.display()))
-        .arg(format!("{}", unpacked_bundle_path.join("*").display()))
+        .args(files)
         .output()
         .map_err(|e| Error::ArchiverFailure(format!("7z invocation failed -> {}", e)))?;
 
@@ -126,20 +501,7 @@ fn compress_bundle(unpacked_bundle_path: &Path, output_path: &Path) -> BundlePac
 mod tests {
     use super::*;
 
-    #[test]
-    fn test_bundle_packing() {
-        let temp_path = {
-            let tmp = TempFileBuilder::new()
-                .prefix("a")
-                .suffix(".7z")
-                .tempfile()
-                .unwrap()
-                .into_temp_path();
-            tmp.to_path_buf()
-            // Remove actual temp file; just use temp path
-        };
-
-        let mut packer = BundlePacker::new();
+    fn add_test_packages(packer: &mut BundlePacker) {
         packer.add_bundle_package(
             BundlePackageType::BrandingZip,
             Path::new("tests/data/branding.zip"),
@@ -164,20 +526,459 @@ mod tests {
             },
             Path::new("tests/data/fake_installer.msi"),
         );
+    }
 
-        packer.pack(&temp_path).unwrap();
+    fn read_u16(data: &[u8], pos: &mut usize) -> u16 {
+        let mut bytes = [0u8; 2];
+        bytes.copy_from_slice(&data[*pos..*pos + 2]);
+        *pos += 2;
+        u16::from_le_bytes(bytes)
+    }
 
-        let output = Command::new(get_archiver_path().unwrap())
-            .arg("l")
-            .arg(format!("{}", temp_path.display()))
-            .output()
+    fn read_u32(data: &[u8], pos: &mut usize) -> u32 {
+        let mut bytes = [0u8; 4];
+        bytes.copy_from_slice(&data[*pos..*pos + 4]);
+        *pos += 4;
+        u32::from_le_bytes(bytes)
+    }
+
+    fn read_u64(data: &[u8], pos: &mut usize) -> u64 {
+        let mut bytes = [0u8; 8];
+        bytes.copy_from_slice(&data[*pos..*pos + 8]);
+        *pos += 8;
+        u64::from_le_bytes(bytes)
+    }
+
+    struct TocRecord {
+        name: String,
+        offset: usize,
+        packed_size: usize,
+        size: usize,
+        crc: u32,
+        codec: u16,
+        flags: u16,
+        sha256: Vec<u8>,
+    }
+
+    /// Returns bundle payload and parsed table of contents records
+    fn read_bundle(bundle_path: &Path, toc_path: &Path) -> (Vec<u8>, Vec<TocRecord>) {
+        let bundle = fs::read(bundle_path).unwrap();
+        assert_eq!(&bundle[..8], BUNDLE_HEADER_MAGIC);
+        let mut pos = 8;
+        assert_eq!(read_u16(&bundle, &mut pos), BUNDLE_FORMAT_VERSION);
+        pos += 2;
+        let payload_offset = read_u32(&bundle, &mut pos) as usize;
+        assert_eq!(payload_offset, BUNDLE_HEADER_SIZE);
+
+        let toc = fs::read(toc_path).unwrap();
+
+        (bundle[payload_offset..].to_vec(), read_toc(&toc))
+    }
+
+    /// Parses table of contents records, checking its header on the way
+    fn read_toc(toc: &[u8]) -> Vec<TocRecord> {
+        assert_eq!(&toc[..8], TOC_MAGIC);
+        let mut pos = 8;
+        assert_eq!(read_u16(&toc, &mut pos), TOC_VERSION);
+        assert_eq!(read_u16(&toc, &mut pos) as usize, TOC_RECORD_SIZE);
+        let entry_count = read_u32(&toc, &mut pos) as usize;
+        assert_eq!(toc.len(), TOC_HEADER_SIZE + entry_count * TOC_RECORD_SIZE);
+
+        let mut records = Vec::new();
+        for _ in 0..entry_count {
+            let name = &toc[pos..pos + TOC_NAME_SIZE];
+            let name_length = name.iter().position(|&c| c == 0).unwrap();
+            let name = std::str::from_utf8(&name[..name_length])
+                .unwrap()
+                .to_string();
+            pos += TOC_NAME_SIZE;
+
+            let offset = read_u64(&toc, &mut pos) as usize;
+            let packed_size = read_u64(&toc, &mut pos) as usize;
+            let size = read_u64(&toc, &mut pos) as usize;
+            let crc = read_u32(&toc, &mut pos);
+            let codec = read_u16(&toc, &mut pos);
+            let flags = read_u16(&toc, &mut pos);
+            let sha256 = toc[pos..pos + 32].to_vec();
+            pos += 32;
+
+            records.push(TocRecord {
+                name,
+                offset,
+                packed_size,
+                size,
+                crc,
+                codec,
+                flags,
+                sha256,
+            });
+        }
+
+        records
+    }
+
+    /// options.json is always stored, branding.zip is detected as incompressible
+    fn check_stored_record(payload: &[u8], record: &TocRecord) {
+        let source_path = match record.name.as_str() {
+            "options.json" => "tests/data/options.json",
+            "branding.zip" => "tests/data/branding.zip",
+            name => panic!("{} is not expected to be stored", name),
+        };
+
+        assert_eq!(record.flags, TOC_FLAG_STORED);
+        assert_eq!(record.packed_size, record.size);
+
+        let data = &payload[record.offset..record.offset + record.size];
+        assert_eq!(data, &fs::read(source_path).unwrap()[..]);
+        assert_eq!(crc32fast::hash(data), record.crc);
+    }
+
+    #[test]
+    fn entropy_estimation() {
+        assert_eq!(estimate_entropy(&[]), 0.0);
+        assert_eq!(estimate_entropy(&[0u8; 1024 * 1024]), 0.0);
+
+        let text = "Wayk Now CSE bundle ".repeat(100_000);
+        assert!(estimate_entropy(text.as_bytes()) < STORED_ENTROPY_THRESHOLD);
+
+        let uniform: Vec<u8> = (0..4 * 1024 * 1024).map(|i| (i % 256) as u8).collect();
+        assert!(estimate_entropy(&uniform) > STORED_ENTROPY_THRESHOLD);
+
+        let zip = fs::read("tests/data/branding.zip").unwrap();
+        assert!(estimate_entropy(&zip) > STORED_ENTROPY_THRESHOLD);
+    }
+
+    #[test]
+    fn test_bundle_packing() {
+        let temp_dir = TempFileBuilder::new()
+            .prefix("bundle_test_")
+            .tempdir()
             .unwrap();
+        let bundle_path = temp_dir.path().join("bundle.bin");
+        let toc_path = temp_dir.path().join("bundle.toc");
+
+        let mut packer = BundlePacker::new();
+        packer.set_codec(BundleCodec::SevenZip, None);
+        add_test_packages(&mut packer);
+
+        packer.pack(&bundle_path, &toc_path).unwrap();
+
+        let (payload, records) = read_bundle(&bundle_path, &toc_path);
+        assert_eq!(records.len(), 5);
+
+        for record in &records {
+            if record.flags & TOC_FLAG_STORED != 0 {
+                check_stored_record(&payload, record);
+                continue;
+            }
+
+            assert_eq!(record.codec, BundleCodec::SevenZip.id());
+
+            // Every entry is a standalone 7z archive
+            let slice_path = temp_dir.path().join(format!("{}.7z", record.name));
+            fs::write(
+                &slice_path,
+                &payload[record.offset..record.offset + record.packed_size],
+            )
+            .unwrap();
+
+            let output = Command::new(get_archiver_path().unwrap())
+                .arg("l")
+                .arg(format!("{}", slice_path.display()))
+                .output()
+                .unwrap();
+
+            let stdout = std::str::from_utf8(&output.stdout).unwrap().to_string();
+            assert!(stdout.contains(&record.name));
+        }
+
+        let names: Vec<&str> = records.iter().map(|r| r.name.as_str()).collect();
+        assert!(names.contains(&"Installer_x86.msi"));
+        assert!(names.contains(&"Installer_x64.msi"));
+        assert!(names.contains(&"branding.zip"));
+        assert!(names.contains(&"init.ps1"));
+        assert!(names.contains(&"options.json"));
+    }
+
+    #[test]
+    fn test_bundle_packing_zstd() {
+        let temp_dir = TempFileBuilder::new()
+            .prefix("bundle_test_")
+            .tempdir()
+            .unwrap();
+        let bundle_path = temp_dir.path().join("bundle.bin");
+        let toc_path = temp_dir.path().join("bundle.toc");
+
+        let mut packer = BundlePacker::new();
+        packer.set_codec(BundleCodec::Zstd, Some(3));
+        add_test_packages(&mut packer);
+        packer.pack(&bundle_path, &toc_path).unwrap();
+
+        let (payload, records) = read_bundle(&bundle_path, &toc_path);
+        assert_eq!(records.len(), 5);
+        assert_eq!(
+            records
+                .iter()
+                .filter(|r| r.flags & TOC_FLAG_STORED != 0)
+                .count(),
+            2
+        );
+
+        let mut expected_offset = 0;
+        for record in &records {
+            assert_eq!(record.offset, expected_offset);
+            expected_offset += record.packed_size;
+
+            if record.flags & TOC_FLAG_STORED != 0 {
+                check_stored_record(&payload, record);
+                continue;
+            }
+
+            assert_eq!(record.codec, BundleCodec::Zstd.id());
+
+            let stream = &payload[record.offset..record.offset + record.packed_size];
+            let data = zstd::stream::decode_all(stream).unwrap();
+            assert_eq!(data.len(), record.size);
+            assert_eq!(crc32fast::hash(&data), record.crc);
+            assert_eq!(Sha256::digest(&data).as_slice(), &record.sha256[..]);
+        }
+
+        assert_eq!(expected_offset, payload.len());
+    }
+
+    fn pseudo_random_bytes(seed: u64, size: usize) -> Vec<u8> {
+        let mut state = seed;
+        (0..size)
+            .map(|_| {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                state as u8
+            })
+            .collect()
+    }
+
+    #[test]
+    fn cdc_chunks_resync_after_insertion() {
+        let data = pseudo_random_bytes(1, 4 * 1024 * 1024);
+        let mut shifted = pseudo_random_bytes(2, 1000);
+        shifted.extend_from_slice(&data);
+
+        let chunks = split_chunks(&data);
+        assert_eq!(chunks.concat(), data);
+        assert!(chunks.iter().all(|c| c.len() <= CDC_MAX_CHUNK_SIZE));
+
+        let shifted_chunks = split_chunks(&shifted);
+        let common_size: usize = shifted_chunks
+            .iter()
+            .filter(|c| chunks.contains(c))
+            .map(|c| c.len())
+            .sum();
+        assert!(common_size > data.len() * 9 / 10);
+    }
+
+    #[test]
+    fn cdc_chunks_bounds() {
+        assert!(split_chunks(&[]).is_empty());
+
+        let small = pseudo_random_bytes(6, CDC_MIN_CHUNK_SIZE);
+        assert_eq!(split_chunks(&small), vec![&small[..]]);
+
+        // Only the last chunk may be shorter than the minimum
+        let data = pseudo_random_bytes(7, 3 * 1024 * 1024 + 123);
+        let chunks = split_chunks(&data);
+        assert!(chunks.len() > 1);
+        assert_eq!(chunks.concat(), data);
+        assert!(chunks[..chunks.len() - 1]
+            .iter()
+            .all(|c| c.len() > CDC_MIN_CHUNK_SIZE && c.len() <= CDC_MAX_CHUNK_SIZE));
+        assert!(chunks.last().unwrap().len() <= CDC_MAX_CHUNK_SIZE);
+
+        // Boundaries never depend on anything but the data
+        assert_eq!(split_chunks(&data), chunks);
+
+        // Data without any boundary is cut at the maximum size
+        let zeros = vec![0u8; 2 * CDC_MAX_CHUNK_SIZE + 1];
+        let zero_chunks: Vec<usize> = split_chunks(&zeros).iter().map(|c| c.len()).collect();
+        assert_eq!(zero_chunks, vec![CDC_MAX_CHUNK_SIZE, CDC_MAX_CHUNK_SIZE, 1]);
+    }
+
+    #[test]
+    fn toc_records_round_trip() {
+        let data = pseudo_random_bytes(8, 1000);
+        let stream = &data[..600];
+        let long_name = "a".repeat(TOC_NAME_SIZE - 1);
+
+        let mut toc = Vec::new();
+        toc.extend_from_slice(TOC_MAGIC);
+        toc.extend_from_slice(&TOC_VERSION.to_le_bytes());
+        toc.extend_from_slice(&(TOC_RECORD_SIZE as u16).to_le_bytes());
+        toc.extend_from_slice(&2u32.to_le_bytes());
+        assert_eq!(toc.len(), TOC_HEADER_SIZE);
+
+        append_toc_record(
+            &mut toc,
+            "options.json",
+            0,
+            &data,
+            0,
+            TOC_FLAG_STORED,
+            &data,
+        )
+        .unwrap();
+        append_toc_record(
+            &mut toc,
+            &long_name,
+            1000,
+            stream,
+            CHUNKED_CODEC_ID,
+            0,
+            &data,
+        )
+        .unwrap();
+
+        // Name has to leave room for its terminator, nothing is written then
+        let name = "a".repeat(TOC_NAME_SIZE);
+        assert!(matches!(
+            append_toc_record(&mut toc, &name, 0, &data, 0, 0, &data),
+            Err(Error::EntryNameTooLong(_))
+        ));
+        assert_eq!(toc.len(), TOC_HEADER_SIZE + 2 * TOC_RECORD_SIZE);
+
+        let records = read_toc(&toc);
+        assert_eq!(records.len(), 2);
+
+        assert_eq!(records[0].name, "options.json");
+        assert_eq!(records[0].offset, 0);
+        assert_eq!(records[0].packed_size, data.len());
+        assert_eq!(records[0].flags, TOC_FLAG_STORED);
+
+        assert_eq!(records[1].name, long_name);
+        assert_eq!(records[1].offset, 1000);
+        assert_eq!(records[1].packed_size, stream.len());
+        assert_eq!(records[1].codec, CHUNKED_CODEC_ID);
+        assert_eq!(records[1].flags, 0);
+
+        // Size and digests are the ones of the raw data, not of the stream
+        for record in &records {
+            assert_eq!(record.size, data.len());
+            assert_eq!(record.crc, crc32fast::hash(&data));
+            assert_eq!(&record.sha256[..], Sha256::digest(&data).as_slice());
+        }
+    }
+
+    #[test]
+    fn deduplication_skipped_without_shared_data() {
+        let mut entries: Vec<BundleEntry> = [9, 10]
+            .iter()
+            .map(|&seed| BundleEntry {
+                file_name: format!("Installer_{}.msi", seed),
+                data: pseudo_random_bytes(seed, 1024 * 1024),
+                always_stored: false,
+                deduplicated: true,
+                recipe: None,
+            })
+            .collect();
+
+        deduplicate_entries(&mut entries);
+
+        assert_eq!(entries.len(), 2);
+        assert!(entries.iter().all(|e| e.recipe.is_none()));
+    }
+
+    #[test]
+    fn bundle_installers_deduplication() {
+        let temp_dir = TempFileBuilder::new()
+            .prefix("bundle_test_")
+            .tempdir()
+            .unwrap();
+        let bundle_path = temp_dir.path().join("bundle.bin");
+        let toc_path = temp_dir.path().join("bundle.toc");
+
+        // Installers differ in their beginning and share the rest
+        let shared = pseudo_random_bytes(3, 2 * 1024 * 1024);
+        let mut installers = Vec::new();
+        for (seed, bitness) in [(4, Bitness::X86), (5, Bitness::X64)].iter() {
+            let mut data = pseudo_random_bytes(*seed, 300 * 1024);
+            data.extend_from_slice(&shared);
+
+            let path = temp_dir.path().join(format!("{}.msi", bitness));
+            fs::write(&path, &data).unwrap();
+            installers.push((*bitness, path, data));
+        }
+
+        let mut packer = BundlePacker::new();
+        packer.set_codec(BundleCodec::Zstd, Some(3));
+        for (bitness, path, _) in &installers {
+            packer.add_bundle_package(
+                BundlePackageType::InstallationMsi { bitness: *bitness },
+                path,
+            );
+        }
+        packer.pack(&bundle_path, &toc_path).unwrap();
+
+        let (payload, records) = read_bundle(&bundle_path, &toc_path);
+        assert_eq!(records.len(), 3);
+
+        let pool_record = records.iter().find(|r| r.name == CHUNK_POOL_NAME).unwrap();
+        assert_eq!(pool_record.flags, TOC_FLAG_STORED);
+        assert!(pool_record.size < shared.len() + 1024 * 1024);
+        let pool = &payload[pool_record.offset..pool_record.offset + pool_record.size];
+
+        for (bitness, _, data) in &installers {
+            let record = records
+                .iter()
+                .find(|r| r.name == format!("Installer_{}.msi", bitness))
+                .unwrap();
+            assert_eq!(record.codec, CHUNKED_CODEC_ID);
+            assert_eq!(record.size, data.len());
+
+            let recipe = &payload[record.offset..record.offset + record.packed_size];
+            let mut pos = 0;
+            let chunk_count = read_u32(recipe, &mut pos);
+
+            let mut rebuilt = Vec::new();
+            for _ in 0..chunk_count {
+                let chunk_offset = read_u64(recipe, &mut pos) as usize;
+                let chunk_size = read_u32(recipe, &mut pos) as usize;
+                rebuilt.extend_from_slice(&pool[chunk_offset..chunk_offset + chunk_size]);
+            }
+
+            assert_eq!(pos, recipe.len());
+            assert_eq!(&rebuilt, data);
+            assert_eq!(crc32fast::hash(&rebuilt), record.crc);
+            assert_eq!(Sha256::digest(&rebuilt).as_slice(), &record.sha256[..]);
+        }
+    }
+
+    #[test]
+    fn zstd_blocks_encoding() {
+        let data = "Wayk Now CSE bundle block ".repeat(ZSTD_BLOCK_SIZE / 10);
+        let data = data.as_bytes();
+        let stream = encode_zstd_blocks(data, 3).unwrap();
+
+        let mut pos = 0;
+        assert_eq!(read_u32(&stream, &mut pos) as usize, ZSTD_BLOCK_SIZE);
+        let block_count = read_u32(&stream, &mut pos) as usize;
+        assert_eq!(block_count, 3);
+
+        let frame_sizes: Vec<usize> = (0..block_count)
+            .map(|_| read_u32(&stream, &mut pos) as usize)
+            .collect();
+        let frames = &stream[pos..];
+        assert_eq!(frame_sizes.iter().sum::<usize>(), frames.len());
+
+        // Every block decodes on its own...
+        let mut decoded = Vec::new();
+        let mut frame_offset = 0;
+        for frame_size in frame_sizes {
+            let frame = &frames[frame_offset..frame_offset + frame_size];
+            decoded.extend(zstd::block::decompress(frame, ZSTD_BLOCK_SIZE).unwrap());
+            frame_offset += frame_size;
+        }
+        assert_eq!(&decoded[..], data);
 
-        let stdout = std::str::from_utf8(&output.stdout).unwrap().to_string();
-        assert!(stdout.contains("Installer_x86.msi"));
-        assert!(stdout.contains("Installer_x64.msi"));
-        assert!(stdout.contains("branding.zip"));
-        assert!(stdout.contains("init.ps1"));
-        assert!(stdout.contains("options.json"));
+        // ...and all of them together are a regular zstd stream
+        assert_eq!(&zstd::stream::decode_all(frames).unwrap()[..], data);
     }
 }
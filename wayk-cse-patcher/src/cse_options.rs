@@ -7,7 +7,7 @@ use std::{
 use json::JsonValue;
 use thiserror::Error;
 
-use crate::bundle::Bitness;
+use crate::bundle::{Bitness, BundleCodec};
 use std::io::Write;
 
 #[derive(Error, Debug)]
@@ -56,12 +56,19 @@ pub struct InstallOptions {
     pub supported_architectures: Vec<Bitness>,
 }
 
+#[derive(Default)]
+pub struct BundleOptions {
+    pub codec: BundleCodec,
+    pub compression_level: Option<i32>,
+}
+
 pub struct CseOptions {
     json_data: JsonValue,
     branding_options: BrandingOptions,
     signing_options: SigningOptions,
     post_install_script_options: PostInstallScriptOptions,
     install_options: InstallOptions,
+    bundle_options: BundleOptions,
 }
 
 impl CseOptions {
@@ -114,12 +121,30 @@ impl CseOptions {
             install_options.supported_architectures.push(Bitness::X64);
         }
 
+        let mut bundle_options = BundleOptions::default();
+        if let Some(codec) = json_data["bundle"]["codec"].as_str() {
+            bundle_options.codec = match codec {
+                "7z" => BundleCodec::SevenZip,
+                "zstd" => BundleCodec::Zstd,
+                value => {
+                    return Err(CseOptionsError::InvalidValue {
+                        key: "bundle.codec".to_string(),
+                        value: value.to_string(),
+                    });
+                }
+            };
+        }
+        if let Some(level) = json_data["bundle"]["compressionLevel"].as_i32() {
+            bundle_options.compression_level.replace(level);
+        }
+
         Ok(Self {
             json_data,
             branding_options,
             signing_options,
             post_install_script_options,
             install_options,
+            bundle_options,
         })
     }
 
@@ -145,6 +170,9 @@ impl CseOptions {
 
         opts["install"].remove("architecture");
 
+        // Bundle format is detected by CSE from the bundle header itself
+        opts.remove("bundle");
+
         let mut file = File::create(path)?;
 
         // Save without pretty formatting, it will be read only by CSE binary
@@ -166,6 +194,10 @@ impl CseOptions {
     pub fn branding_options(&self) -> &BrandingOptions {
         &self.branding_options
     }
+
+    pub fn bundle_options(&self) -> &BundleOptions {
+        &self.bundle_options
+    }
 }
 
 #[cfg(test)]
@@ -260,6 +292,28 @@ mod tests {
         assert!(options_result.is_err());
     }
 
+    #[test]
+    fn bundle_codec_zstd() {
+        let options = CseOptions::load_from_str(
+            "{\"bundle\":{\"codec\": \"zstd\", \"compressionLevel\": 12}}",
+        )
+        .unwrap();
+        assert_eq!(options.bundle_options().codec, BundleCodec::Zstd);
+        assert_eq!(options.bundle_options().compression_level, Some(12));
+    }
+
+    #[test]
+    fn bundle_codec_7z() {
+        let options = CseOptions::load_from_str("{\"bundle\":{\"codec\": \"7z\"}}").unwrap();
+        assert_eq!(options.bundle_options().codec, BundleCodec::SevenZip);
+    }
+
+    #[test]
+    fn bundle_codec_invalid() {
+        let options_result = CseOptions::load_from_str("{\"bundle\":{\"codec\": \"lzma\"}}");
+        assert!(options_result.is_err());
+    }
+
     #[test]
     fn options_processing_empty() {
         let options = CseOptions::load(Path::new("tests/data/options_empty.json")).unwrap();
@@ -272,6 +326,8 @@ mod tests {
             .import_wayk_now_module
             .is_none());
         assert!(options.install_options().embed_msi.is_none());
+        assert_eq!(options.bundle_options().codec, BundleCodec::Zstd);
+        assert!(options.bundle_options().compression_level.is_none());
         let expected_supported_architectures = vec![Bitness::X86, Bitness::X64];
         assert_eq!(
             options.install_options().supported_architectures,
@@ -54,6 +54,10 @@ impl WaykCsePatcher {
         patcher.set_original_binary_path(output_path);
 
         let mut bundle = BundlePacker::new();
+        bundle.set_codec(
+            options.bundle_options().codec,
+            options.bundle_options().compression_level,
+        );
 
         info!("Generating CSE configuration...");
         let processed_options_path = working_dir.path().join("options.json");
@@ -126,11 +130,13 @@ impl WaykCsePatcher {
         patcher.set_product_name(product_name.as_deref().unwrap_or("Wayk Agent"));
 
         info!("Packing bundle archive...");
-        let bundle_path = working_dir.path().join("bundle.7z");
-        bundle.pack(&bundle_path)?;
+        let bundle_path = working_dir.path().join("bundle.bin");
+        let bundle_toc_path = working_dir.path().join("bundle.toc");
+        bundle.pack(&bundle_path, &bundle_toc_path)?;
 
         info!("Patching executable...");
         patcher.set_wayk_bundle_path(&bundle_path);
+        patcher.set_wayk_bundle_toc_path(&bundle_toc_path);
         patcher.patch().context("Failed to patch CSE executable")?;
 
         if let Some(cert_name) = &options.signing_options().cert_name {
@@ -5,6 +5,7 @@ use thiserror::Error;
 
 const WAYK_BUNDLE_RESOURCE_ID: u32 = 102;
 const PRODUCT_NAME_RESOURCE_ID: u32 = 103;
+const WAYK_BUNDLE_TOC_RESOURCE_ID: u32 = 104;
 
 #[derive(Error, Debug)]
 pub enum Error {
@@ -21,6 +22,7 @@ pub struct ResourcePatcher {
     original_binary_path: Option<PathBuf>,
     icon_path: Option<PathBuf>,
     wayk_bundle_path: Option<PathBuf>,
+    wayk_bundle_toc_path: Option<PathBuf>,
     product_name: Option<String>,
 }
 
@@ -31,6 +33,7 @@ impl ResourcePatcher {
             original_binary_path: None,
             icon_path: None,
             wayk_bundle_path: None,
+            wayk_bundle_toc_path: None,
             product_name: None,
         }
     }
@@ -50,6 +53,11 @@ impl ResourcePatcher {
         self
     }
 
+    pub fn set_wayk_bundle_toc_path(&mut self, path: &Path) -> &mut Self {
+        self.wayk_bundle_toc_path = Some(path.into());
+        self
+    }
+
     pub fn set_product_name(&mut self, name: &str) -> &mut Self {
         self.product_name = Some(name.to_string());
         self
@@ -81,6 +89,14 @@ impl ResourcePatcher {
             )?;
         }
 
+        if let Some(wayk_bundle_toc_path) = self.wayk_bundle_toc_path.as_ref() {
+            check_rcedit(
+                self.resource_updater
+                    .set_rcdata(WAYK_BUNDLE_TOC_RESOURCE_ID, wayk_bundle_toc_path),
+                "Wayk bundle TOC patching failed",
+            )?;
+        }
+
         if let Some(product_name) = self.product_name.as_ref() {
             check_rcedit(
                 self.resource_updater